@@ -2,10 +2,14 @@
 [org 0x8000]
 
 KERNEL_LBA      equ 9
-KERNEL_SECTORS  equ 128
+KERNEL_SECTORS  equ 512
+LOAD_CHUNK      equ 64              ; sectors per INT 13h call (32 KiB)
 KERNEL_SEGMENT  equ 0x1000
 KERNEL_OFFSET   equ 0x0000
 KERNEL_DEST     equ 0x00100000
+INITRD_SECTORS  equ 512             ; loaded right behind the kernel, to 0x50000
+INITRD_BUFFER   equ 0x00050000
+INITRD_DEST     equ 0x00300000      ; between the boot stack and the page pool
 
 CODE32_SEL      equ 0x08
 DATA32_SEL      equ 0x10
@@ -43,12 +47,23 @@ enable_a20:
     out 0x92, al
     ret
 
+; Reads the kernel and then the initrd area in LOAD_CHUNK pieces; many
+; BIOSes cap one extended read at 127 sectors and refuse buffers that
+; cross a 64 KiB boundary.
 load_kernel:
+    mov cx, (KERNEL_SECTORS + INITRD_SECTORS) / LOAD_CHUNK
+.next_chunk:
+    push cx
     mov dl, [boot_drive]
     mov si, dap
     mov ah, 0x42
     int 0x13
+    pop cx
     jc disk_error
+    mov word [dap + 2], LOAD_CHUNK
+    add word [dap + 6], (LOAD_CHUNK * 512) >> 4
+    add dword [dap + 8], LOAD_CHUNK
+    loop .next_chunk
     ret
 
 serial_init:
@@ -134,6 +149,12 @@ protected_mode:
     mov ecx, (KERNEL_SECTORS * 512) / 4
     rep movsd
 
+    ; Copy the initrd area (archive or zeros) above 1 MiB for the kernel.
+    mov esi, INITRD_BUFFER
+    mov edi, INITRD_DEST
+    mov ecx, (INITRD_SECTORS * 512) / 4
+    rep movsd
+
     ; Build minimal 4-level page tables for identity map of first 2 MiB.
     mov dword [PML4_BASE + 0], PDPT_BASE | 0x003
     mov dword [PML4_BASE + 4], 0x00000000
@@ -203,7 +224,7 @@ long_mode:
     mov gs, ax
 
     mov rsp, 0x0009E000
-    xor rdi, rdi
+    mov rdi, boot_info
     mov rax, KERNEL_DEST
     jmp rax
 
@@ -235,11 +256,22 @@ align 8
 boot_drive db 0
 err_msg db "Kernel load failed", 0
 
+; barecore_boot_info_t (include/boot_info.h): no framebuffer, memory
+; size from CMOS, initrd as copied above.
+align 8
+boot_info:
+    dq 0x42415245434F5245           ; BARECORE_BOOTINFO_MAGIC
+    dq 0                            ; framebuffer_base
+    dd 0, 0, 0, 0, 0, 0             ; width, height, pitch, bpp, format, reserved
+    dq 0, 0                         ; mem_base, mem_size
+    dq INITRD_DEST
+    dq INITRD_SECTORS * 512
+
 align 8
 dap:
     db 0x10
     db 0x00
-    dw KERNEL_SECTORS
+    dw LOAD_CHUNK
     dw KERNEL_OFFSET
     dw KERNEL_SEGMENT
     dq KERNEL_LBA
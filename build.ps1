@@ -1,6 +1,7 @@
 param(
     [string]$CrossPrefix = "x86_64-elf-",
-    [int]$Stage2Sectors = 8
+    [int]$Stage2Sectors = 8,
+    [int]$KernelSectors = 512
 )
 
 $ErrorActionPreference = "Stop"
@@ -19,7 +20,7 @@ $objcopy = "${CrossPrefix}objcopy"
 & $nasm -f bin (Join-Path $root "boot\stage2.asm") -o (Join-Path $build "stage2.bin")
 & $nasm -f elf64 (Join-Path $root "kernel\kernel_entry.asm") -o (Join-Path $build "kernel_entry.o")
 
-& $gcc -ffreestanding -fno-pic -fno-stack-protector -m64 -mcmodel=kernel -mno-red-zone -O2 -Wall -Wextra -I (Join-Path $root "include") `
+& $gcc -ffreestanding -fno-pic -fno-stack-protector -m64 -mcmodel=kernel -mno-red-zone -mgeneral-regs-only -O2 -Wall -Wextra -I (Join-Path $root "include") `
     -c (Join-Path $root "kernel\kernel.c") -o (Join-Path $build "kernel.o")
 
 & $ld -nostdlib -z max-page-size=0x1000 -T (Join-Path $root "linker.ld") `
@@ -28,6 +29,9 @@ $objcopy = "${CrossPrefix}objcopy"
 
 & $objcopy -O binary (Join-Path $build "kernel.elf") (Join-Path $build "kernel.bin")
 
+# The kernel reads ustar as well as newc cpio, and tar ships with Windows.
+& tar --format=ustar -cf (Join-Path $build "initrd.tar") -C (Join-Path $root "initrd") .
+
 $imgPath = Join-Path $build "os.img"
 $imgSize = 2880 * 512
 $stream = [System.IO.File]::Open($imgPath, [System.IO.FileMode]::Create, [System.IO.FileAccess]::ReadWrite, [System.IO.FileShare]::None)
@@ -50,5 +54,6 @@ function Write-Blob {
 Write-Blob -ImagePath $imgPath -BlobPath (Join-Path $build "boot.bin") -OffsetBytes 0
 Write-Blob -ImagePath $imgPath -BlobPath (Join-Path $build "stage2.bin") -OffsetBytes 512
 Write-Blob -ImagePath $imgPath -BlobPath (Join-Path $build "kernel.bin") -OffsetBytes ((1 + $Stage2Sectors) * 512)
+Write-Blob -ImagePath $imgPath -BlobPath (Join-Path $build "initrd.tar") -OffsetBytes ((1 + $Stage2Sectors + $KernelSectors) * 512)
 
 Write-Host "Built $imgPath"
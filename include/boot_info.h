@@ -14,6 +14,10 @@ typedef struct {
     uint32_t framebuffer_bpp;
     uint32_t framebuffer_format; /* GOP pixel format value */
     uint32_t reserved;
+    uint64_t mem_base; /* largest free RAM range above 1 MiB, 0 if unknown */
+    uint64_t mem_size;
+    uint64_t initrd_base; /* newc cpio or ustar archive, 0 if none was loaded */
+    uint64_t initrd_size;
 } barecore_boot_info_t;
 
 #endif
@@ -1,3 +1,5 @@
+#include <immintrin.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -8,6 +10,9 @@
 #define MAX_USER_TASKS 4
 #define USER_STACK_SIZE 4096
 #define STACK_SIZE 4096
+#define SIMD_SAVE_SIZE 1024 /* FXSAVE image, or XSAVE of x87/SSE/AVX state */
+#define SIMD_FXSAVE 1
+#define SIMD_XSAVE  2
 
 #define PIT_HZ 100
 
@@ -22,16 +27,61 @@
 
 #define KBD_DATA     0x60
 
+#define INPUT_RING      1024
+#define INPUT_RELEASE   0x01 /* key up */
+#define INPUT_EXTENDED  0x02 /* 0xE0-prefixed scancode */
+#define INPUT_MOD_SHIFT 0x01
+#define INPUT_MOD_CTRL  0x02
+#define INPUT_MOD_ALT   0x04
+#define INPUT_MOD_CAPS  0x08
+#define KEY_EXT(sc)     (0x100 | (sc)) /* input_event_t.code of an extended key, e.g. KEY_EXT(0x48) is Up */
+
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+#define PCI_MAX_DEVICES    32
+#define PCI_CMD_IO         0x0001
+#define PCI_CMD_MEMORY     0x0002
+#define PCI_CMD_BUS_MASTER 0x0004
+
 #define COM1_PORT    0x3F8
+#define UART_IRQ     4
+#define UART_FIFO    16
+#define UART_TX_RING 4096
+#define UART_RX_RING 256
+#define UART_IER_RDI  0x01
+#define UART_IER_THRI 0x02
+#define UART_LSR_DR   0x01
+#define UART_LSR_THRE 0x20
 #define QEMU_EXIT_PORT 0xF4
 
+#define FB_FONT_W     8
+#define FB_FONT_H     16
+#define FB_FONT_FIRST 0x20
+#define FB_FONT_LAST  0x7E
+#define FB_FLUSH_HZ   50
+#define FB_FLUSH_TICKS (PIT_HZ / FB_FLUSH_HZ)
+
+#define LOG_SLOTS     256
+#define LOG_TEXT      104
+#define LOG_STALE_US  20000 /* producers drain themselves past this if the drain task is starved */
+
 #define VECTOR_DIVIDE      0
 #define VECTOR_PAGE_FAULT  14
 #define IRQ_BASE           32
 #define VECTOR_TIMER       (IRQ_BASE + 0)
 #define VECTOR_KEYBOARD    (IRQ_BASE + 1)
+#define VECTOR_MSI_BASE    0x30
 #define VECTOR_SYSCALL     0x80
 
+#define MSI_SLOTS      8
+#define IRQ_MAX_SHARED 4
+
+#define SOFTIRQ_TIMER   0
+#define SOFTIRQ_TASKLET 1
+#define SOFTIRQ_COUNT   2
+#define SOFTIRQ_ROUNDS  4  /* restarts per IRQ exit before leftovers wait for the next one */
+#define KBD_RAW_RING    64
+
 #define SYS_WRITE   1
 #define SYS_EXIT    2
 #define SYS_GETPID  3
@@ -39,6 +89,33 @@
 #define SYS_YIELD   5
 #define SYS_FORK    6
 #define SYS_EXEC    7
+#define SYS_OPEN    8
+#define SYS_READ    9
+#define SYS_CLOSE   10
+#define SYS_LSEEK   11
+#define SYS_MMAP    12
+#define SYS_MUNMAP  13
+#define SYS_FBMAP   14
+#define SYS_FBFLUSH 15
+
+#define USER_SPRITE_SIZE 64
+
+#define O_RDONLY 0x000
+#define O_WRONLY 0x001
+#define O_RDWR   0x002
+#define O_ACCMODE 0x003
+#define O_CREAT  0x040
+#define O_TRUNC  0x200
+#define O_APPEND 0x400
+
+#define SEEK_SET 0
+#define SEEK_CUR 1
+#define SEEK_END 2
+
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define MAP_SHARED  0x01
+#define MAP_PRIVATE 0x02
 
 #define GDT_KERNEL_CODE 0x08
 #define GDT_KERNEL_DATA 0x10
@@ -47,6 +124,223 @@
 #define GDT_TSS         0x28
 #define USER_STACK_TOP  0x00080000u
 
+#define UIO_BUF_SIZE 256
+#define UIO_LINEBUF  0
+#define UIO_FULLBUF  1
+
+#define ATA_PRIMARY_IO   0x1F0
+#define ATA_PRIMARY_CTRL 0x3F6
+#define ATA_REG_DATA     0
+#define ATA_REG_SECCOUNT 2
+#define ATA_REG_LBA0     3
+#define ATA_REG_LBA1     4
+#define ATA_REG_LBA2     5
+#define ATA_REG_DRIVE    6
+#define ATA_REG_STATUS   7
+#define ATA_REG_COMMAND  7
+#define ATA_SR_BSY  0x80
+#define ATA_SR_DF   0x20
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_ERR  0x01
+#define ATA_CMD_READ_SECTORS       0x20
+#define ATA_CMD_READ_SECTORS_EXT   0x24
+#define ATA_CMD_READ_MULTIPLE_EXT  0x29
+#define ATA_CMD_READ_MULTIPLE      0xC4
+#define ATA_CMD_SET_MULTIPLE       0xC6
+#define ATA_CMD_IDENTIFY           0xEC
+#define ATA_CMD_WRITE_SECTORS      0x30
+#define ATA_CMD_WRITE_SECTORS_EXT  0x34
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_WRITE_MULTIPLE     0xC5
+#define ATA_TIMEOUT_SPINS 1000000u
+#define ATA_MAX_SECTORS(d) ((d).lba48 ? 65536u : 256u)
+
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_READ_DMA           0xC8
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_WRITE_DMA          0xCA
+#define ATA_DMA_MAX_SECTORS 256u
+#define ATA_PRD_MAX 4
+#define ATA_IRQ 14
+
+#define BMIDE_REG_COMMAND 0
+#define BMIDE_REG_STATUS  2
+#define BMIDE_REG_PRDT    4
+#define BMIDE_CMD_START   0x01
+#define BMIDE_CMD_READ    0x08
+#define BMIDE_SR_ACTIVE   0x01
+#define BMIDE_SR_ERR      0x02
+#define BMIDE_SR_IRQ      0x04
+
+#define BLOCK_MAX_DEVICES 4
+#define BLK_OK       0
+#define BLK_PENDING  1
+#define BLK_ERROR    (-1)
+#define BLK_TIMEOUT_TICKS (2 * PIT_HZ)
+#define DISKBENCH_OPS 512
+#define FBBENCH_FRAMES 16
+#define DISKLAT_OPS 1024
+#define BLKQ_CARRIERS 8
+#define BLKQ_MERGE_MAX_SECTORS 256u
+#define BLKQ_READ_EXPIRE_TICKS (PIT_HZ / 2)
+#define BLKQ_WRITE_EXPIRE_TICKS (PIT_HZ * 5)
+
+#define AHCI_CAP   0x00
+#define AHCI_GHC   0x04
+#define AHCI_IS    0x08
+#define AHCI_PI    0x0C
+#define AHCI_PORT_BASE 0x100
+#define AHCI_PORT_SIZE 0x80
+#define AHCI_PxCLB  0x00
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB   0x08
+#define AHCI_PxFBU  0x0C
+#define AHCI_PxIS   0x10
+#define AHCI_PxIE   0x14
+#define AHCI_PxCMD  0x18
+#define AHCI_PxTFD  0x20
+#define AHCI_PxSIG  0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34
+#define AHCI_PxCI   0x38
+#define AHCI_GHC_IE (1u << 1)
+#define AHCI_GHC_AE (1u << 31)
+#define AHCI_CMD_ST  (1u << 0)
+#define AHCI_CMD_FRE (1u << 4)
+#define AHCI_CMD_FR  (1u << 14)
+#define AHCI_CMD_CR  (1u << 15)
+#define AHCI_IS_TFES (1u << 30)
+#define AHCI_IE_DEFAULT 0x7DC0007Fu
+#define AHCI_SIG_ATA 0x00000101u
+#define AHCI_PRDT_MAX 8
+#define AHCI_PRD_MAX_BYTES (4u << 20)
+#define AHCI_CMD_TABLE_SIZE (0x80 + AHCI_PRDT_MAX * 16)
+#define AHCI_MAX_SECTORS 8192u
+#define AHCI_TIMEOUT_SPINS 10000000u
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+
+#define VIRTIO_VENDOR 0x1AF4
+#define VIRTIO_DEV_BLK_MODERN 0x1042
+#define VIRTIO_DEV_BLK_TRANSITIONAL 0x1001
+#define VIRTIO_CAP_COMMON 1
+#define VIRTIO_CAP_NOTIFY 2
+#define VIRTIO_CAP_ISR    3
+#define VIRTIO_CAP_DEVICE 4
+#define VIRTIO_STATUS_ACK       1
+#define VIRTIO_STATUS_DRIVER    2
+#define VIRTIO_STATUS_DRIVER_OK 4
+#define VIRTIO_STATUS_FEATURES_OK 8
+#define VIRTIO_F_EVENT_IDX 29
+#define VIRTIO_F_VERSION_1 32
+#define VIRTQ_SIZE 128
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_MAX_SECTORS 8192u
+
+#define NVME_REG_CAP   0x00
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_INTMC 0x10
+#define NVME_REG_CC    0x14
+#define NVME_REG_CSTS  0x1C
+#define NVME_REG_AQA   0x24
+#define NVME_REG_ASQ   0x28
+#define NVME_REG_ACQ   0x30
+#define NVME_CC_EN     (1u << 0)
+#define NVME_CC_IOSQES (6u << 16)
+#define NVME_CC_IOCQES (4u << 20)
+#define NVME_CSTS_RDY  (1u << 0)
+#define NVME_CSTS_CFS  (1u << 1)
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY  0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+#define NVME_FEAT_NUM_QUEUES 0x07
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ  0x02
+#define NVME_ADMIN_DEPTH 16
+#define NVME_IO_DEPTH    64
+#define NVME_MAX_CPUS    1 /* one I/O queue pair per CPU; only the BSP runs today */
+#define NVME_PRP_ENTRIES 32
+#define NVME_MAX_SECTORS (NVME_PRP_ENTRIES * 8u)
+#define NVME_TIMEOUT_US  2000000u
+
+#define PT_POOL_PAGES 16
+#define PTE_PRESENT (1ull << 0)
+#define PTE_WRITE   (1ull << 1)
+#define PTE_USER    (1ull << 2)
+#define PTE_PWT     (1ull << 3)
+#define PTE_PCD     (1ull << 4)
+#define PTE_PS      (1ull << 7)
+#define PTE_PAT     (1ull << 7)  /* 4 KiB pages */
+#define PTE_PAT_PS  (1ull << 12) /* 2 MiB / 1 GiB pages */
+#define PTE_ANON    (1ull << 9) /* software bit: a private copy, not a page cache page */
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ull
+
+/* Memory types are PAT indices: PWT is bit 0, PCD bit 1, PAT bit 2. */
+#define CACHE_WB       0
+#define CACHE_WC       1
+#define CACHE_UC_MINUS 2
+#define CACHE_UC       3
+#define CACHE_WT       5
+#define PAT_MSR        0x277
+#define PAT_VALUE      0x0007040600070106ull /* WB WC UC- UC WB WT UC- UC */
+
+#define FAT_INLINE_EXTENTS 64
+#define FAT_MAX_EXTENTS 16384 /* fat_file_t extent arrays double up to this */
+#define FAT_LFN_MAX     255
+#define FAT_DIR_SLOTS   8
+#define FAT_DIR_ENTRIES 4096
+#define FAT_DIR_HASH    4096 /* most hash heads one index gets */
+#define FAT_DIR_NAMES   (64 * 1024)
+#define FAT_DIR_NONE    0xFFFF
+#define FAT_NODES       16
+#define FAT_DIRTY_PAGES 256 /* write-back data held before the writer has to flush itself */
+#define FAT_FLUSH_TICKS PIT_HZ
+#define FAT_FLUSH_RUN   32  /* FAT sectors encoded per batched write */
+#define FAT_TABLE_SPAN  (PAGE_SIZE / 4) /* table entries per page */
+
+#define EXT2_MAGIC     0xEF53
+#define EXT2_ROOT_INO  2
+#define EXT2_ICACHE    16
+#define EXT2_BMAP_ERROR 0xFFFFFFFFu
+#define EXT2_S_IFMT    0xF000
+#define EXT2_S_IFDIR   0x4000
+#define EXT2_S_IFREG   0x8000
+#define EXT2_INCOMPAT_FILETYPE 0x0002
+
+#define INITRD_FILES  1024
+#define INITRD_HASH   1024
+
+#define TASK_FDS      16 /* 0..2 are the console */
+#define VFS_MOUNTS    4
+#define VFS_INODES    32
+#define VFS_FILES     32
+#define VFS_DCACHE    64 /* direct-mapped by path hash */
+#define VFS_NAME_MAX  64
+#define VFS_PATH_MAX  256
+
+#define MMAP_BASE     0x4000000000ull /* 256 GiB, far above any identity-mapped RAM */
+#define MMAP_SIZE     (1ull << 30)
+#define MM_VMAS       16
+#define PCACHE_PAGES  1024
+#define PCACHE_HASH   256
+
+#define MEM_POOL_BASE 0x400000ull /* page_alloc never hands out the low 4 MiB */
+#define PAGE_SIZE 4096u
+
+#define BCACHE_BLOCK_SECTORS 8u
+#define BCACHE_BLOCK_SIZE (BCACHE_BLOCK_SECTORS * 512u)
+#define BCACHE_MAX_BYTES (32u << 20)
+#define BCACHE_STATIC_BLOCKS 8 /* used when no pool memory is available */
+#define BCACHE_STREAMS 4
+#define BCACHE_RA_MIN 4u
+#define BCACHE_RA_MAX 32u
+#define BCACHE_WRITE_REQS 32
+
 #define LAPIC_DEFAULT_BASE 0xFEE00000u
 #define HPET_DEFAULT_BASE  0xFED00000u
 #define IOAPIC_DEFAULT_BASE 0xFEC00000u
@@ -133,9 +427,48 @@ typedef struct __attribute__((packed)) {
 typedef enum {
     TASK_RUNNABLE = 0,
     TASK_SLEEPING = 1,
-    TASK_EXITED = 2
+    TASK_EXITED = 2,
+    TASK_BLOCKED = 3
 } task_state_t;
 
+/* Bitmask of task indices blocked on an event; MAX_TASKS must stay <= 32. */
+typedef struct {
+    volatile uint32_t waiters;
+} wait_queue_t;
+
+/* Run count and TSC cycles of one hard IRQ vector, softirq, tasklet or work item. */
+typedef struct {
+    const char *name;
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t max_cycles;
+} irq_time_t;
+
+/* Deferred call run from softirq context; scheduling one already queued is a no-op. */
+typedef struct tasklet tasklet_t;
+struct tasklet {
+    tasklet_t *next;
+    void (*func)(void);
+    volatile uint8_t scheduled;
+    irq_time_t time;
+};
+
+/* Deferred call run by a workqueue's worker task, so it may sleep and take locks. */
+typedef struct work work_t;
+struct work {
+    work_t *next;
+    void (*func)(void);
+    volatile uint8_t pending;
+    irq_time_t time;
+};
+
+typedef struct {
+    work_t *head;
+    work_t *tail;
+    wait_queue_t wait;
+    uint64_t queued;
+} workqueue_t;
+
 typedef struct {
     int pid;
     uint64_t rsp;
@@ -143,6 +476,7 @@ typedef struct {
     uint64_t wake_tick;
     const char *name;
     void (*entry)(void);
+    uint8_t fds[TASK_FDS]; /* open-file index + 1, 0 when free */
 } task_t;
 
 typedef struct {
@@ -151,8 +485,16 @@ typedef struct {
     uint64_t rflags;
     uint8_t active;
     uint8_t pid;
+    uint8_t fds[TASK_FDS];
+    uint8_t simd[SIMD_SAVE_SIZE] __attribute__((aligned(64))); /* vector state while switched out */
 } user_task_t;
 
+typedef struct {
+    char buf[UIO_BUF_SIZE];
+    uint32_t len;
+    uint8_t mode;
+} uio_t;
+
 typedef struct {
     uint64_t addr;
     uint32_t width;
@@ -162,16 +504,368 @@ typedef struct {
     uint32_t format;
     uint32_t cursor_x;
     uint32_t cursor_y;
+    uint32_t cols;
+    uint32_t rows;
     uint32_t fg;
     uint32_t bg;
+    uint32_t fg_pixel;
+    uint32_t bg_pixel;
+    uint32_t *draw; /* shadow buffer once fb_shadow_init ran, else fb.addr */
+    uint64_t last_flush;
+    uint64_t flushes;
+    uint8_t shadowed;
     uint8_t enabled;
 } fb_console_t;
 
+typedef struct {
+    uint32_t x0;
+    uint32_t y0;
+    uint32_t x1; /* exclusive; 0 when nothing is dirty */
+    uint32_t y1;
+} fb_rect_t;
+
+typedef struct {
+    uint32_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch; /* in pixels */
+} gfx_surface_t;
+
+/* Span kernels; blend is src-over with straight alpha in bits 24..31 of src. */
+typedef struct {
+    const char *name;
+    void (*fill)(uint32_t *dst, uint32_t color, uint32_t n);
+    void (*copy)(uint32_t *dst, const uint32_t *src, uint32_t n);
+    void (*blend)(uint32_t *dst, const uint32_t *src, uint32_t n);
+    void (*swap_rb)(uint32_t *dst, const uint32_t *src, uint32_t n);
+} gfx_ops_t;
+
+/*
+ * One log ring slot. seq follows the bounded MPMC queue scheme: equal to
+ * the position when free for that producer, position + 1 once written.
+ */
+typedef struct {
+    uint64_t seq;
+    uint64_t tsc;
+    uint32_t len;
+    char text[LOG_TEXT];
+} log_record_t;
+
+typedef struct {
+    uint8_t present;
+    uint8_t irq_mode;   /* 16550A FIFO and IRQ4 in use; otherwise output is polled */
+    uint8_t tx_busy;    /* THRE interrupt armed: the ISR refills the FIFO */
+    uint8_t ier;
+    uint32_t tx_head;
+    uint32_t tx_tail;
+    uint32_t rx_head;
+    uint32_t rx_tail;
+    uint64_t irqs;
+    uint64_t tx_bytes;
+    uint64_t tx_bursts;
+    uint64_t tx_stalls; /* ring full, producer waited for the THRE interrupt */
+    uint64_t rx_bytes;
+    uint64_t rx_drops;
+    wait_queue_t tx_wait; /* writers blocked on a full TX ring */
+    uint8_t tx[UART_TX_RING];
+    char rx[UART_RX_RING];
+} uart_t;
+
+typedef struct {
+    uint16_t code;  /* set-1 make code; KEY_EXT() for extended keys */
+    uint8_t flags;  /* INPUT_RELEASE, INPUT_EXTENDED */
+    uint8_t mods;   /* INPUT_MOD_* in effect after this event */
+    char ascii;     /* 0 for keys without a character */
+    uint64_t tsc;   /* IRQ time */
+} input_event_t;
+
+/* Filled in by SYS_FBMAP. */
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch; /* in pixels */
+    uint32_t format; /* boot_info framebuffer_format: 0 = xRGB, else xBGR */
+} fb_info_t;
+
 typedef struct {
     const char *name;
     const char *data;
 } initrd_file_t;
 
+/* A regular file in the initrd archive; name and data point into the archive itself. */
+typedef struct {
+    const char *name; /* not NUL-terminated in ustar headers */
+    const uint8_t *data;
+    uint32_t name_len;
+    uint32_t size;
+    uint16_t next;    /* hash chain: entry index + 1, 0 ends it */
+} initrd_entry_t;
+
+typedef struct {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t fn;
+    uint8_t class_code;
+    uint8_t subclass;
+    uint8_t prog_if;
+    uint8_t irq_line;
+    uint16_t vendor;
+    uint16_t device;
+} pci_dev_t;
+
+typedef void (*irq_handler_t)(void);
+
+typedef struct blk_req blk_req_t;
+typedef struct block_dev block_dev_t;
+
+/*
+ * One transfer handed to a block driver (a read unless write is set). status stays BLK_PENDING until the
+ * driver completes it through block_complete (possibly from IRQ context),
+ * which then calls done if set.
+ */
+struct blk_req {
+    uint64_t lba;
+    uint32_t count;
+    void *buf;
+    volatile int status;
+    void (*done)(blk_req_t *req);
+    void *ctx;
+    uint8_t write; /* buf -> device */
+    /* request-queue bookkeeping */
+    blk_req_t *next;   /* elevator list */
+    blk_req_t *chain;  /* requests merged behind this one */
+    uint32_t span;     /* sectors covered with the chain */
+    uint64_t deadline; /* tick by which the deadline elevator dispatches it */
+};
+
+typedef struct blk_queue blk_queue_t;
+
+typedef struct {
+    const char *name;
+    void (*add)(blk_queue_t *q, blk_req_t *req); /* link into q->head */
+    blk_req_t *(*pick)(blk_queue_t *q);          /* next to dispatch, still linked */
+} blk_elevator_t;
+
+/* A merged transfer as the driver sees it; completion fans out to head's chain. */
+typedef struct {
+    blk_req_t req;
+    blk_req_t *head;
+    uint8_t *bounce; /* NULL when the merged buffers are contiguous */
+    block_dev_t *dev;
+} blk_carrier_t;
+
+/*
+ * Requests wait here until the driver has room. While the queue is plugged
+ * they only accumulate, and one that starts where a queued request ends is
+ * chained to it so both reach the device as a single transfer. The lists,
+ * plug count and running flag only change with interrupts off.
+ */
+struct blk_queue {
+    const blk_elevator_t *elv;
+    blk_req_t *head;
+    uint32_t plugged;
+    uint8_t running;
+    uint64_t head_pos; /* LBA just past the last dispatch */
+    volatile uint32_t carrier_busy;
+    blk_carrier_t carriers[BLKQ_CARRIERS];
+    uint8_t *bounce; /* BLKQ_CARRIERS merge buffers, or NULL */
+    uint64_t merges;
+    uint64_t dispatched;
+};
+
+struct block_dev {
+    const char *name;
+    uint64_t sectors;
+    uint32_t max_sectors; /* per request */
+    uint32_t max_queue;   /* requests the driver accepts in flight */
+    uint8_t irq_driven;   /* completions arrive by interrupt, else call poll */
+    int (*submit)(block_dev_t *dev, blk_req_t *req);
+    void (*kick)(block_dev_t *dev); /* optional: doorbell for submissions batched since the last kick */
+    void (*poll)(block_dev_t *dev);
+    void (*set_polled)(block_dev_t *dev, int on); /* optional: mask device interrupts while busy-polling */
+    volatile uint32_t completed; /* bumped by block_complete */
+    wait_queue_t wait;
+    blk_queue_t queue;
+    void *priv;
+};
+
+/*
+ * One 4 KiB cache block. req doubles as the fill state: BLK_PENDING while
+ * the read is in flight, BLK_OK once data is valid, BLK_ERROR if it failed.
+ */
+typedef struct bcache_buf bcache_buf_t;
+struct bcache_buf {
+    block_dev_t *dev; /* NULL while unhashed */
+    uint64_t block;
+    uint8_t *data;
+    bcache_buf_t *hnext;
+    bcache_buf_t *lru_prev;
+    bcache_buf_t *lru_next;
+    blk_req_t req;
+};
+
+/* A sequential reader; window doubles while accesses keep landing on last + 1. */
+typedef struct {
+    block_dev_t *dev;
+    uint64_t last;
+    uint64_t next; /* first block readahead has not requested yet */
+    uint32_t window;
+} bcache_stream_t;
+
+typedef struct {
+    bcache_buf_t *bufs;
+    bcache_buf_t **hash;
+    uint32_t nbufs;
+    uint32_t hash_mask;
+    bcache_buf_t *lru_head; /* most recently used */
+    bcache_buf_t *lru_tail;
+    bcache_stream_t streams[BCACHE_STREAMS];
+    uint32_t stream_clock;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;
+    uint64_t evictions;
+    uint32_t wnext;       /* write request ring cursor */
+    uint8_t write_failed; /* since the last bcache_sync */
+    uint64_t writes;
+} bcache_t;
+
+typedef struct {
+    volatile uint8_t *abar;
+    volatile uint8_t *port;
+    uint32_t slots;   /* command slots in the HBA */
+    uint32_t depth;   /* usable in flight: NCQ depth, or 1 */
+    uint8_t ncq;
+    uint8_t port_no;
+    volatile uint32_t busy;
+    blk_req_t *reqs[32];
+    block_dev_t dev;
+} ahci_port_t;
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} vring_desc_t;
+
+/* Split virtqueue rings; used_event/avail_event are the VIRTIO_F_EVENT_IDX words. */
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[VIRTQ_SIZE];
+    uint16_t used_event;
+} vring_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} vring_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    vring_used_elem_t ring[VIRTQ_SIZE];
+    uint16_t avail_event;
+} vring_used_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} virtio_blk_hdr_t;
+
+typedef struct {
+    volatile uint8_t *common;
+    volatile uint8_t *isr;
+    volatile uint8_t *device;
+    volatile uint16_t *notify;
+    volatile uint16_t *used_event;  /* avail.ring[qsize] */
+    volatile uint16_t *avail_event; /* used.ring[qsize] */
+    uint16_t qsize;
+    uint16_t free_head;
+    uint16_t num_free;
+    uint16_t last_used;
+    uint16_t kicked_idx; /* avail.idx at the last doorbell */
+    uint8_t event_idx;
+    blk_req_t *reqs[VIRTQ_SIZE];
+    block_dev_t dev;
+} virtio_blk_t;
+
+typedef struct {
+    uint32_t cdw0;
+    uint32_t nsid;
+    uint64_t rsvd;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} nvme_sqe_t;
+
+typedef struct {
+    uint32_t result;
+    uint32_t rsvd;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status; /* bit 0 is the phase tag */
+} nvme_cqe_t;
+
+/*
+ * An SQ/CQ pair. sq_tail runs ahead of the doorbell until nvme_kick, so a
+ * burst of submissions costs one MMIO write; the CQ head doorbell is
+ * likewise written once per reaped batch.
+ */
+typedef struct {
+    volatile nvme_sqe_t *sq;
+    volatile nvme_cqe_t *cq;
+    volatile uint32_t *sq_db;
+    volatile uint32_t *cq_db;
+    uint16_t qid;
+    uint16_t depth;
+    uint16_t sq_tail;
+    uint16_t sq_tail_db; /* value last written to the doorbell */
+    uint16_t cq_head;
+    uint8_t phase;
+    uint8_t msix_entry;
+    uint64_t free_cids;
+    blk_req_t *reqs[NVME_IO_DEPTH];
+} nvme_queue_t;
+
+typedef struct {
+    volatile uint8_t *regs;
+    volatile uint32_t *msix;
+    uint32_t db_stride;
+    uint32_t nqueues;
+    uint8_t polled;
+    nvme_queue_t admin;
+    nvme_queue_t io[NVME_MAX_CPUS];
+    block_dev_t dev;
+} nvme_ctrl_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t addr;
+    uint16_t bytes; /* 0 = 64 KiB */
+    uint16_t flags; /* bit 15: end of table */
+} ata_prd_t;
+
+typedef struct {
+    uint8_t present;
+    uint8_t lba48;
+    uint16_t multiple; /* sectors per DRQ block, 0 = READ MULTIPLE unsupported */
+    uint64_t sectors;
+    uint16_t bmide;    /* bus-master register base for the primary channel, 0 = PIO only */
+    blk_req_t *active; /* DMA request in flight */
+    uint64_t deadline;
+    uint32_t spins;    /* polls of the active request, for when ticks stand still */
+    uint8_t dma_status;
+} ata_dev_t;
+
 typedef struct __attribute__((packed)) {
     uint8_t jmp[3];
     uint8_t oem[8];
@@ -196,6 +890,7 @@ typedef struct __attribute__((packed)) {
 } fat_bpb_t;
 
 typedef struct {
+    block_dev_t *dev;
     fat_bpb_t bpb;
     uint32_t fat_start_lba;
     uint32_t root_start_lba;
@@ -203,10 +898,211 @@ typedef struct {
     uint32_t root_dir_sectors;
     uint32_t total_sectors;
     uint32_t total_clusters;
-    uint8_t fat_type; /* 12 or 16 */
+    uint32_t sectors_per_fat;
+    uint32_t root_cluster; /* FAT32: the root directory is a cluster chain */
+    uint32_t fsinfo_lba;   /* FAT32 FSInfo sector, 0 if absent or invalid */
+    uint8_t fat_type; /* 12, 16 or 32 */
+    uint8_t fat_copies; /* FATs kept in sync on write */
     uint8_t valid;
+    uint32_t **table; /* first FAT decoded per cluster, one page per FAT_TABLE_SPAN clusters
+                         allocated when a sector in it loads; NULL when out of memory */
+    uint8_t *table_loaded; /* FAT32: FAT sectors already decoded into table */
+    uint8_t *fat_dirty; /* FAT sectors whose table entries changed since the last flush */
+    uint8_t table_dirty;
+    uint8_t read_only; /* a FAT sector failed to load; writes are refused from then on */
+    uint32_t free_clusters;
+    uint32_t reserved_clusters; /* promised to dirty files, not allocated yet */
+    uint32_t next_free;         /* allocation scan hint */
 } fat_fs_t;
 
+typedef struct {
+    uint32_t hash;
+    uint32_t name_off; /* into the index's name arena */
+    uint32_t cluster;
+    uint32_t size;
+    uint32_t slot;     /* 8.3 entry's index in its directory */
+    uint32_t parent;   /* directory cluster, filled in by fat_resolve */
+    uint16_t name_len;
+    uint16_t next;     /* hash chain, FAT_DIR_NONE ends it */
+    uint8_t attr;
+    uint8_t alias;     /* 8.3 name of an entry also indexed by its long name */
+} fat_dirent_t;
+
+/* Name -> entry hash index of one directory (cluster 0 is the root). */
+typedef struct {
+    uint32_t cluster;
+    uint8_t used;
+    uint8_t complete; /* every entry fit; a miss is authoritative */
+    uint32_t count;
+    uint32_t names_used;
+    uint32_t cap;       /* entries and name bytes the buffer was sized for */
+    uint32_t names_cap;
+    uint32_t hash_mask;
+    uint32_t pages;   /* allocation behind ents, heads and names */
+    uint64_t stamp;
+    uint16_t *heads;
+    fat_dirent_t *ents; /* NULL while sizing */
+    char *names;
+} fat_dir_index_t;
+
+/* A run of count on-disk clusters starting at cluster, holding file clusters file_cluster.. */
+typedef struct {
+    uint32_t file_cluster;
+    uint32_t cluster;
+    uint32_t count;
+} fat_extent_t;
+
+/*
+ * An open file's cluster chain as sorted extents. The array starts inline
+ * and moves to pages as the chain needs more; chains more fragmented than
+ * FAT_MAX_EXTENTS keep the tail unmapped and walk it on demand.
+ */
+typedef struct {
+    uint32_t size;
+    uint32_t nextents;
+    uint32_t mapped_clusters;
+    uint32_t cap;
+    fat_extent_t *extents; /* inline_extents until it grows; NULL before the first map */
+    fat_extent_t inline_extents[FAT_INLINE_EXTENTS];
+} fat_file_t;
+
+typedef struct {
+    block_dev_t *dev;
+    uint32_t block_size;
+    uint32_t block_sectors;
+    uint32_t blocks_per_group;
+    uint32_t inodes_per_group;
+    uint32_t inode_size;
+    uint32_t groups;
+    uint32_t *inode_tables; /* per block group, from the descriptor table */
+    uint64_t clock;
+    uint64_t map_reads;     /* indirect blocks read from the cache/disk */
+    uint8_t valid;
+} ext2_fs_t;
+
+/*
+ * A cached inode with its block-map cache: the last pointer block it used
+ * at each level of the single, double and triple indirect trees.
+ */
+typedef struct {
+    uint32_t ino;
+    uint16_t mode;
+    uint32_t size;
+    uint32_t block[15];
+    uint64_t stamp;
+    uint32_t ind_no;
+    uint32_t dind_no;
+    uint32_t dind2_no;
+    uint32_t tind_no;
+    uint32_t tind2_no;
+    uint32_t tind3_no;
+    uint32_t *ind;
+    uint32_t *dind;
+    uint32_t *dind2;
+    uint32_t *tind;
+    uint32_t *tind2;
+    uint32_t *tind3;
+} ext2_inode_t;
+
+typedef struct fat_page fat_page_t;
+struct fat_page {
+    uint32_t index; /* file offset / PAGE_SIZE */
+    uint8_t *data;
+    fat_page_t *next;
+};
+
+/*
+ * A file with unwritten changes. Data lives only in pages until the next
+ * flush allocates clusters for it; bytes in [disk_valid, size) that no
+ * page holds read as zero.
+ */
+typedef struct {
+    uint8_t used;
+    uint32_t parent;     /* directory cluster */
+    uint32_t slot;       /* 8.3 entry in parent */
+    uint32_t cluster;    /* first cluster, 0 when none is allocated */
+    uint32_t clusters;   /* chain length on disk */
+    uint32_t reserved;   /* clusters promised to size beyond the chain */
+    uint32_t reserve_to; /* size the reservation covers; above size while a write is in flight */
+    uint32_t size;
+    uint32_t disk_valid; /* prefix whose on-disk bytes are still current */
+    fat_page_t *pages;   /* sorted by index */
+} fat_node_t;
+
+/* Read position in a FAT file; see fat_cursor_next. */
+typedef struct {
+    const fat_node_t *node; /* dirty overlay, or NULL to read the extents directly */
+    fat_file_t file;
+    uint32_t pos;
+} fat_cursor_t;
+
+/*
+ * A file as the VFS sees it: its mount plus a key the filesystem
+ * understands (initrd index, FAT parent/slot, ext2 inode number).
+ */
+typedef struct {
+    uint8_t used;
+    uint8_t mount;
+    uint16_t refs; /* open files and mappings */
+    uint64_t key;
+    uint64_t stamp;
+} vfs_inode_t;
+
+typedef struct {
+    const char *name;
+    int (*lookup)(const char *path, int create, uint64_t *key);
+    int (*read)(const vfs_inode_t *ip, uint32_t offset, uint8_t *out, uint32_t len, uint32_t *got);
+    int (*write)(const vfs_inode_t *ip, uint32_t offset, const uint8_t *src, uint32_t len);
+    int (*truncate)(const vfs_inode_t *ip, uint32_t size);
+    uint32_t (*size)(const vfs_inode_t *ip);
+} vfs_ops_t;
+
+typedef struct {
+    const char *path; /* "/" or a prefix without a trailing '/' */
+    uint32_t len;
+    const vfs_ops_t *ops;
+} vfs_mount_t;
+
+/* Path (relative to its mount) to key; misses fall through to the filesystem's lookup. */
+typedef struct {
+    uint32_t hash;
+    uint8_t mount;
+    uint8_t len; /* 0 marks an empty slot */
+    char name[VFS_NAME_MAX];
+    uint64_t key;
+} vfs_dentry_t;
+
+/* One file page shared by every mapping of it; data is identity-mapped RAM. */
+typedef struct pcache_page pcache_page_t;
+struct pcache_page {
+    const vfs_inode_t *ip; /* NULL when the header is free */
+    uint32_t index;
+    uint32_t maps;         /* PTEs pointing at data */
+    uint64_t stamp;
+    uint8_t *data;
+    pcache_page_t *next;   /* hash chain */
+};
+
+typedef struct {
+    uint8_t used;
+    uint8_t prot;
+    uint8_t flags;
+    uint32_t owner;  /* mm_owner() of the mapping task */
+    uint64_t start;
+    uint32_t pages;
+    uint32_t pgoff;
+    vfs_inode_t *ip;    /* NULL for a device mapping of phys */
+    uint64_t phys;
+    uint32_t cache;
+} mm_vma_t;
+
+typedef struct {
+    uint16_t refs; /* fd slots pointing here, 0 when free */
+    uint16_t flags;
+    uint32_t offset;
+    vfs_inode_t *ip;
+} vfs_file_t;
+
 extern void idt_load(idtr_t *idtr);
 extern void gdt_load(void *gdtr);
 extern void tss_load(uint16_t selector);
@@ -217,6 +1113,8 @@ extern void isr_keyboard_stub(void);
 extern void isr_syscall_stub(void);
 extern void isr_divide_stub(void);
 extern void isr_page_fault_stub(void);
+extern void (*const isr_irq_stubs[16])(void);
+extern void (*const isr_msi_stubs[MSI_SLOTS])(void);
 
 static idt_gate_t idt[IDT_ENTRIES];
 static idtr_t idtr;
@@ -230,6 +1128,123 @@ static tss_t tss;
 static volatile uint16_t *const vga = (volatile uint16_t *)0xB8000;
 static uint16_t vga_pos = 0;
 static fb_console_t fb;
+static uart_t uart;
+static fb_rect_t fb_dirty;
+
+static log_record_t log_ring[LOG_SLOTS];
+static uint64_t log_head;      /* next position a producer claims */
+static uint64_t log_tail;      /* next position the drain emits; drain side only */
+static uint32_t log_draining;  /* consumer ownership */
+static uint8_t log_task_running;
+static uint64_t log_dropped;
+static uint64_t log_reported_drops;
+static uint64_t log_batches;
+static uint64_t log_records;
+static uint64_t log_max_lag_us;
+static wait_queue_t log_wait;
+
+/* IBM VGA ROM 8x16 font (code page 437, printable ASCII only). Bit 7 is the
+   leftmost pixel. Covers 0x20..0x7E. */
+static const uint8_t fb_font[FB_FONT_LAST - FB_FONT_FIRST + 1][FB_FONT_H] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* ' ' */
+    {0x00, 0x00, 0x18, 0x3C, 0x3C, 0x3C, 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00}, /* '!' */
+    {0x00, 0x66, 0x66, 0x66, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '"' */
+    {0x00, 0x00, 0x00, 0x6C, 0x6C, 0xFE, 0x6C, 0x6C, 0x6C, 0xFE, 0x6C, 0x6C, 0x00, 0x00, 0x00, 0x00}, /* '#' */
+    {0x18, 0x18, 0x7C, 0xC6, 0xC2, 0xC0, 0x7C, 0x06, 0x06, 0x86, 0xC6, 0x7C, 0x18, 0x18, 0x00, 0x00}, /* '$' */
+    {0x00, 0x00, 0x00, 0x00, 0xC2, 0xC6, 0x0C, 0x18, 0x30, 0x60, 0xC6, 0x86, 0x00, 0x00, 0x00, 0x00}, /* '%' */
+    {0x00, 0x00, 0x38, 0x6C, 0x6C, 0x38, 0x76, 0xDC, 0xCC, 0xCC, 0xCC, 0x76, 0x00, 0x00, 0x00, 0x00}, /* '&' */
+    {0x00, 0x30, 0x30, 0x30, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* ''' */
+    {0x00, 0x00, 0x0C, 0x18, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x18, 0x0C, 0x00, 0x00, 0x00, 0x00}, /* '(' */
+    {0x00, 0x00, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x18, 0x30, 0x00, 0x00, 0x00, 0x00}, /* ')' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '*' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x7E, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '+' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x18, 0x30, 0x00, 0x00, 0x00}, /* ',' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFE, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '-' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00}, /* '.' */
+    {0x00, 0x00, 0x00, 0x00, 0x02, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0x80, 0x00, 0x00, 0x00, 0x00}, /* '/' */
+    {0x00, 0x00, 0x38, 0x6C, 0xC6, 0xC6, 0xD6, 0xD6, 0xC6, 0xC6, 0x6C, 0x38, 0x00, 0x00, 0x00, 0x00}, /* '0' */
+    {0x00, 0x00, 0x18, 0x38, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x7E, 0x00, 0x00, 0x00, 0x00}, /* '1' */
+    {0x00, 0x00, 0x7C, 0xC6, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xC0, 0xC6, 0xFE, 0x00, 0x00, 0x00, 0x00}, /* '2' */
+    {0x00, 0x00, 0x7C, 0xC6, 0x06, 0x06, 0x3C, 0x06, 0x06, 0x06, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* '3' */
+    {0x00, 0x00, 0x0C, 0x1C, 0x3C, 0x6C, 0xCC, 0xFE, 0x0C, 0x0C, 0x0C, 0x1E, 0x00, 0x00, 0x00, 0x00}, /* '4' */
+    {0x00, 0x00, 0xFE, 0xC0, 0xC0, 0xC0, 0xFC, 0x06, 0x06, 0x06, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* '5' */
+    {0x00, 0x00, 0x38, 0x60, 0xC0, 0xC0, 0xFC, 0xC6, 0xC6, 0xC6, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* '6' */
+    {0x00, 0x00, 0xFE, 0xC6, 0x06, 0x06, 0x0C, 0x18, 0x30, 0x30, 0x30, 0x30, 0x00, 0x00, 0x00, 0x00}, /* '7' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xC6, 0xC6, 0x7C, 0xC6, 0xC6, 0xC6, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* '8' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xC6, 0xC6, 0x7E, 0x06, 0x06, 0x06, 0x0C, 0x78, 0x00, 0x00, 0x00, 0x00}, /* '9' */
+    {0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00}, /* ':' */
+    {0x00, 0x00, 0x00, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x18, 0x18, 0x30, 0x00, 0x00, 0x00, 0x00}, /* ';' */
+    {0x00, 0x00, 0x00, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x30, 0x18, 0x0C, 0x06, 0x00, 0x00, 0x00, 0x00}, /* '<' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x7E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '=' */
+    {0x00, 0x00, 0x00, 0x60, 0x30, 0x18, 0x0C, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x00, 0x00, 0x00, 0x00}, /* '>' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xC6, 0x0C, 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00}, /* '?' */
+    {0x00, 0x00, 0x00, 0x7C, 0xC6, 0xC6, 0xDE, 0xDE, 0xDE, 0xDC, 0xC0, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* '@' */
+    {0x00, 0x00, 0x10, 0x38, 0x6C, 0xC6, 0xC6, 0xFE, 0xC6, 0xC6, 0xC6, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* 'A' */
+    {0x00, 0x00, 0xFC, 0x66, 0x66, 0x66, 0x7C, 0x66, 0x66, 0x66, 0x66, 0xFC, 0x00, 0x00, 0x00, 0x00}, /* 'B' */
+    {0x00, 0x00, 0x3C, 0x66, 0xC2, 0xC0, 0xC0, 0xC0, 0xC0, 0xC2, 0x66, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* 'C' */
+    {0x00, 0x00, 0xF8, 0x6C, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x6C, 0xF8, 0x00, 0x00, 0x00, 0x00}, /* 'D' */
+    {0x00, 0x00, 0xFE, 0x66, 0x62, 0x68, 0x78, 0x68, 0x60, 0x62, 0x66, 0xFE, 0x00, 0x00, 0x00, 0x00}, /* 'E' */
+    {0x00, 0x00, 0xFE, 0x66, 0x62, 0x68, 0x78, 0x68, 0x60, 0x60, 0x60, 0xF0, 0x00, 0x00, 0x00, 0x00}, /* 'F' */
+    {0x00, 0x00, 0x3C, 0x66, 0xC2, 0xC0, 0xC0, 0xDE, 0xC6, 0xC6, 0x66, 0x3A, 0x00, 0x00, 0x00, 0x00}, /* 'G' */
+    {0x00, 0x00, 0xC6, 0xC6, 0xC6, 0xC6, 0xFE, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* 'H' */
+    {0x00, 0x00, 0x3C, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* 'I' */
+    {0x00, 0x00, 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0xCC, 0xCC, 0xCC, 0x78, 0x00, 0x00, 0x00, 0x00}, /* 'J' */
+    {0x00, 0x00, 0xE6, 0x66, 0x66, 0x6C, 0x78, 0x78, 0x6C, 0x66, 0x66, 0xE6, 0x00, 0x00, 0x00, 0x00}, /* 'K' */
+    {0x00, 0x00, 0xF0, 0x60, 0x60, 0x60, 0x60, 0x60, 0x60, 0x62, 0x66, 0xFE, 0x00, 0x00, 0x00, 0x00}, /* 'L' */
+    {0x00, 0x00, 0xC6, 0xEE, 0xFE, 0xFE, 0xD6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* 'M' */
+    {0x00, 0x00, 0xC6, 0xE6, 0xF6, 0xFE, 0xDE, 0xCE, 0xC6, 0xC6, 0xC6, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* 'N' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 'O' */
+    {0x00, 0x00, 0xFC, 0x66, 0x66, 0x66, 0x7C, 0x60, 0x60, 0x60, 0x60, 0xF0, 0x00, 0x00, 0x00, 0x00}, /* 'P' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xD6, 0xDE, 0x7C, 0x0C, 0x0E, 0x00, 0x00}, /* 'Q' */
+    {0x00, 0x00, 0xFC, 0x66, 0x66, 0x66, 0x7C, 0x6C, 0x66, 0x66, 0x66, 0xE6, 0x00, 0x00, 0x00, 0x00}, /* 'R' */
+    {0x00, 0x00, 0x7C, 0xC6, 0xC6, 0x60, 0x38, 0x0C, 0x06, 0xC6, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 'S' */
+    {0x00, 0x00, 0x7E, 0x7E, 0x5A, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* 'T' */
+    {0x00, 0x00, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 'U' */
+    {0x00, 0x00, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x6C, 0x38, 0x10, 0x00, 0x00, 0x00, 0x00}, /* 'V' */
+    {0x00, 0x00, 0xC6, 0xC6, 0xC6, 0xC6, 0xD6, 0xD6, 0xD6, 0xFE, 0xEE, 0x6C, 0x00, 0x00, 0x00, 0x00}, /* 'W' */
+    {0x00, 0x00, 0xC6, 0xC6, 0x6C, 0x7C, 0x38, 0x38, 0x7C, 0x6C, 0xC6, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* 'X' */
+    {0x00, 0x00, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* 'Y' */
+    {0x00, 0x00, 0xFE, 0xC6, 0x86, 0x0C, 0x18, 0x30, 0x60, 0xC2, 0xC6, 0xFE, 0x00, 0x00, 0x00, 0x00}, /* 'Z' */
+    {0x00, 0x00, 0x3C, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x30, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* '[' */
+    {0x00, 0x00, 0x00, 0x80, 0xC0, 0xE0, 0x70, 0x38, 0x1C, 0x0E, 0x06, 0x02, 0x00, 0x00, 0x00, 0x00}, /* backslash */
+    {0x00, 0x00, 0x3C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* ']' */
+    {0x10, 0x38, 0x6C, 0xC6, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '^' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x00, 0x00}, /* '_' */
+    {0x30, 0x30, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '`' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x78, 0x0C, 0x7C, 0xCC, 0xCC, 0xCC, 0x76, 0x00, 0x00, 0x00, 0x00}, /* 'a' */
+    {0x00, 0x00, 0xE0, 0x60, 0x60, 0x78, 0x6C, 0x66, 0x66, 0x66, 0x66, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 'b' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x7C, 0xC6, 0xC0, 0xC0, 0xC0, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 'c' */
+    {0x00, 0x00, 0x1C, 0x0C, 0x0C, 0x3C, 0x6C, 0xCC, 0xCC, 0xCC, 0xCC, 0x76, 0x00, 0x00, 0x00, 0x00}, /* 'd' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x7C, 0xC6, 0xFE, 0xC0, 0xC0, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 'e' */
+    {0x00, 0x00, 0x1C, 0x36, 0x32, 0x30, 0x78, 0x30, 0x30, 0x30, 0x30, 0x78, 0x00, 0x00, 0x00, 0x00}, /* 'f' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x76, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0x7C, 0x0C, 0xCC, 0x78, 0x00}, /* 'g' */
+    {0x00, 0x00, 0xE0, 0x60, 0x60, 0x6C, 0x76, 0x66, 0x66, 0x66, 0x66, 0xE6, 0x00, 0x00, 0x00, 0x00}, /* 'h' */
+    {0x00, 0x00, 0x18, 0x18, 0x00, 0x38, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* 'i' */
+    {0x00, 0x00, 0x06, 0x06, 0x00, 0x0E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x66, 0x66, 0x3C, 0x00}, /* 'j' */
+    {0x00, 0x00, 0xE0, 0x60, 0x60, 0x66, 0x6C, 0x78, 0x78, 0x6C, 0x66, 0xE6, 0x00, 0x00, 0x00, 0x00}, /* 'k' */
+    {0x00, 0x00, 0x38, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, 0x00, 0x00, 0x00, 0x00}, /* 'l' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xEC, 0xFE, 0xD6, 0xD6, 0xD6, 0xD6, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* 'm' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xDC, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x00, 0x00, 0x00, 0x00}, /* 'n' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x7C, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 'o' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xDC, 0x66, 0x66, 0x66, 0x66, 0x66, 0x7C, 0x60, 0x60, 0xF0, 0x00}, /* 'p' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x76, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0x7C, 0x0C, 0x0C, 0x1E, 0x00}, /* 'q' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xDC, 0x76, 0x66, 0x60, 0x60, 0x60, 0xF0, 0x00, 0x00, 0x00, 0x00}, /* 'r' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x7C, 0xC6, 0x60, 0x38, 0x0C, 0xC6, 0x7C, 0x00, 0x00, 0x00, 0x00}, /* 's' */
+    {0x00, 0x00, 0x10, 0x30, 0x30, 0xFC, 0x30, 0x30, 0x30, 0x30, 0x36, 0x1C, 0x00, 0x00, 0x00, 0x00}, /* 't' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0xCC, 0x76, 0x00, 0x00, 0x00, 0x00}, /* 'u' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x66, 0x66, 0x66, 0x66, 0x66, 0x3C, 0x18, 0x00, 0x00, 0x00, 0x00}, /* 'v' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xC6, 0xC6, 0xD6, 0xD6, 0xD6, 0xFE, 0x6C, 0x00, 0x00, 0x00, 0x00}, /* 'w' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xC6, 0x6C, 0x38, 0x38, 0x38, 0x6C, 0xC6, 0x00, 0x00, 0x00, 0x00}, /* 'x' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0xC6, 0x7E, 0x06, 0x0C, 0xF8, 0x00}, /* 'y' */
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0xFE, 0xCC, 0x18, 0x30, 0x60, 0xC6, 0xFE, 0x00, 0x00, 0x00, 0x00}, /* 'z' */
+    {0x00, 0x00, 0x0E, 0x18, 0x18, 0x18, 0x70, 0x18, 0x18, 0x18, 0x18, 0x0E, 0x00, 0x00, 0x00, 0x00}, /* '{' */
+    {0x00, 0x00, 0x18, 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x18, 0x18, 0x00, 0x00, 0x00, 0x00}, /* '|' */
+    {0x00, 0x00, 0x70, 0x18, 0x18, 0x18, 0x0E, 0x18, 0x18, 0x18, 0x18, 0x70, 0x00, 0x00, 0x00, 0x00}, /* '}' */
+    {0x00, 0x00, 0x76, 0xDC, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}, /* '~' */
+};
+
+/* Every possible glyph row expanded to 8 pixels in the current colours. */
+static uint32_t fb_spans[256][FB_FONT_W];
 
 static volatile uint64_t ticks = 0;
 
@@ -247,10 +1262,18 @@ static uint64_t last_preempt_tick = 0;
 static uint8_t user_need_resched = 0;
 static uint8_t user_task_stacks[MAX_USER_TASKS][USER_STACK_SIZE];
 
-static char kbd_ring[256];
-static volatile uint32_t kbd_head = 0;
-static volatile uint32_t kbd_tail = 0;
-static uint8_t kbd_shift = 0;
+static input_event_t input_ring[INPUT_RING];
+static uint32_t input_head;  /* written by the keyboard tasklet only */
+static uint32_t input_tail;  /* written by the reader only */
+static uint8_t input_mods;
+static uint8_t input_prefix; /* saw 0xE0 */
+static uint8_t input_skip;   /* bytes left of a Pause sequence */
+static wait_queue_t input_wait;
+static uint64_t input_events;
+static uint64_t input_drops;
+static uint64_t input_wakeups;
+static uint64_t input_lat_last_us;
+static uint64_t input_lat_max_us;
 
 static uint8_t apic_enabled = 0;
 static uint32_t lapic_base = LAPIC_DEFAULT_BASE;
@@ -259,10 +1282,108 @@ static uint64_t hpet_period_fs = 0;
 static uint8_t hpet_irq = 2;
 static uint8_t ioapic_enabled = 0;
 
+static pci_dev_t pci_devs[PCI_MAX_DEVICES];
+static int pci_dev_count = 0;
+
+static irq_handler_t irq_handlers[16][IRQ_MAX_SHARED];
+static uint8_t irq_ioapic_routing = 0;
+static irq_handler_t msi_handlers[MSI_SLOTS];
+static int msi_used = 0;
+
+static irq_time_t hardirq_time[IDT_ENTRIES];
+static irq_time_t softirq_time[SOFTIRQ_COUNT] = {{"timer", 0, 0, 0}, {"tasklet", 0, 0, 0}};
+static volatile uint32_t softirq_pending;
+static uint8_t softirq_active;
+static volatile uint32_t irq_depth; /* hard IRQ handlers running, nested ones included */
+static uint64_t softirq_deferred; /* exits that left work for the next IRQ */
+static tasklet_t *tasklet_head;
+static tasklet_t *tasklet_tail;
+static workqueue_t system_wq;
+static uint8_t kbd_raw[KBD_RAW_RING];
+static uint32_t kbd_raw_head; /* written by the keyboard IRQ only */
+static uint32_t kbd_raw_tail; /* written by the keyboard tasklet only */
+static uint64_t kbd_raw_drops;
+
+static uint64_t tsc_per_us = 0;
+static uint64_t pt_pool[PT_POOL_PAGES][512] __attribute__((aligned(4096)));
+static int pt_pool_used = 0;
+static uint8_t pat_enabled = 0;
+static uint64_t mem_pool_next = 0;
+static uint64_t mem_pool_end = 0;
+
+static block_dev_t *block_devs[BLOCK_MAX_DEVICES];
+static int block_dev_count = 0;
+static block_dev_t ata_blk;
+static ahci_port_t ahci;
+static uint8_t ahci_clb[1024] __attribute__((aligned(1024)));
+static uint8_t ahci_fis[256] __attribute__((aligned(256)));
+static uint8_t ahci_ctbl[32][AHCI_CMD_TABLE_SIZE] __attribute__((aligned(128)));
+static uint16_t ahci_identify[256] __attribute__((aligned(2)));
+static virtio_blk_t vblk;
+static volatile vring_desc_t vq_desc[VIRTQ_SIZE] __attribute__((aligned(4096)));
+static volatile vring_avail_t vq_avail __attribute__((aligned(4096)));
+static volatile vring_used_t vq_used __attribute__((aligned(4096)));
+static virtio_blk_hdr_t vblk_hdr[VIRTQ_SIZE];
+static volatile uint8_t vblk_status[VIRTQ_SIZE];
+static nvme_ctrl_t nvme;
+static volatile nvme_sqe_t nvme_admin_sq[NVME_ADMIN_DEPTH] __attribute__((aligned(4096)));
+static volatile nvme_cqe_t nvme_admin_cq[NVME_ADMIN_DEPTH] __attribute__((aligned(4096)));
+static volatile nvme_sqe_t nvme_io_sq[NVME_MAX_CPUS][NVME_IO_DEPTH] __attribute__((aligned(4096)));
+static volatile nvme_cqe_t nvme_io_cq[NVME_MAX_CPUS][NVME_IO_DEPTH] __attribute__((aligned(4096)));
+static uint64_t nvme_prp[NVME_MAX_CPUS][NVME_IO_DEPTH][NVME_PRP_ENTRIES] __attribute__((aligned(256)));
+static uint8_t nvme_identify[4096] __attribute__((aligned(4096)));
+static blk_req_t diskbench_reqs[32];
+static volatile uint32_t diskbench_done;
+static uint8_t diskbench_buf[32][4096] __attribute__((aligned(4096)));
+static uint32_t disklat_ns[DISKLAT_OPS];
+
+static bcache_t bcache;
+static bcache_buf_t bcache_static_bufs[BCACHE_STATIC_BLOCKS];
+static bcache_buf_t *bcache_static_hash[BCACHE_STATIC_BLOCKS];
+static uint8_t bcache_static_data[BCACHE_STATIC_BLOCKS][BCACHE_BLOCK_SIZE] __attribute__((aligned(4096)));
+static blk_req_t bcache_wreqs[BCACHE_WRITE_REQS];
+
+static ata_dev_t ata;
+static ata_prd_t ata_prdt[ATA_PRD_MAX] __attribute__((aligned(64)));
 static fat_fs_t fat_fs;
-static uint8_t fat_sector[512];
+static fat_dir_index_t fat_dirs[FAT_DIR_SLOTS];
+static uint64_t fat_dir_clock = 0;
+static fat_node_t fat_nodes[FAT_NODES];
+static fat_node_t *fat_pinned; /* node the write path is using; a flush keeps it */
+static fat_page_t fat_pages[FAT_DIRTY_PAGES];
+static fat_page_t *fat_page_free;
+static uint32_t fat_pages_made;
+static fat_file_t fat_node_file;
+static ext2_fs_t ext2_fs;
+static ext2_inode_t ext2_icache[EXT2_ICACHE];
+static uint8_t ext2_dir_buf[4096];
+static vfs_mount_t vfs_mounts[VFS_MOUNTS];
+static uint32_t vfs_mount_count;
+static vfs_inode_t vfs_inodes[VFS_INODES];
+static uint64_t vfs_clock;
+static vfs_dentry_t vfs_dcache[VFS_DCACHE];
+static uint64_t vfs_dcache_hits;
+static uint64_t vfs_dcache_misses;
+static vfs_file_t vfs_files[VFS_FILES];
+static pcache_page_t pcache_pages[PCACHE_PAGES];
+static pcache_page_t *pcache_hash[PCACHE_HASH];
+static uint8_t *mm_free_pages; /* recycled data pages, linked through their first word */
+static uint64_t pcache_hits;
+static uint64_t pcache_misses;
+static uint64_t mm_faults;
+static uint64_t mm_cow_copies;
+static mm_vma_t mm_vmas[MM_VMAS];
+static volatile uint8_t fat_busy;
+static uint8_t fat_sec_buf[512];
+static uint8_t fat_io_buf[FAT_FLUSH_RUN * 512] __attribute__((aligned(4096)));
 static uint8_t file_buffer[4096];
 
+static initrd_entry_t initrd_entries[INITRD_FILES];
+static uint16_t initrd_hash[INITRD_HASH]; /* entry index + 1 */
+static uint32_t initrd_count;
+static const char *initrd_format = "built-in";
+
+/* Served when the loader passes no archive. */
 static const initrd_file_t initrd_files[] = {
     {"README.TXT", "barecore initrd\n"},
     {"MOTD.TXT", "Welcome to barecore shell\n"},
@@ -285,6 +1406,16 @@ static inline uint16_t inw(uint16_t port) {
     return value;
 }
 
+static inline void outl(uint16_t port, uint32_t value) {
+    __asm__ volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t value;
+    __asm__ volatile("inl %1, %0" : "=a"(value) : "Nd"(port));
+    return value;
+}
+
 static inline void io_wait(void) {
     __asm__ volatile("outb %%al, $0x80" : : "a"(0));
 }
@@ -301,6 +1432,31 @@ static inline void cpu_cli(void) {
     __asm__ volatile("cli");
 }
 
+static inline void cpu_pause(void) {
+    __asm__ volatile("pause");
+}
+
+static inline void cpu_mfence(void) {
+    __asm__ volatile("mfence" : : : "memory");
+}
+
+/* Index of the executing CPU; the kernel only brings up the BSP. */
+static inline uint32_t this_cpu(void) {
+    return 0;
+}
+
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & 0x200) {
+        cpu_sti();
+    }
+}
+
 static inline void rdmsr(uint32_t msr, uint32_t *lo, uint32_t *hi) {
     __asm__ volatile("rdmsr" : "=a"(*lo), "=d"(*hi) : "c"(msr));
 }
@@ -310,7 +1466,23 @@ static inline void wrmsr(uint32_t msr, uint32_t lo, uint32_t hi) {
 }
 
 static inline void cpuid(uint32_t leaf, uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d) {
-    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf));
+    __asm__ volatile("cpuid" : "=a"(*a), "=b"(*b), "=c"(*c), "=d"(*d) : "a"(leaf), "c"(0));
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void *kmemcpy(void *dst, const void *src, size_t n) {
+    void *ret = dst;
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+    return ret;
+}
+
+static inline void kmemzero(void *dst, size_t n) {
+    __asm__ volatile("rep stosb" : "+D"(dst), "+c"(n) : "a"(0) : "memory");
 }
 
 static inline uint32_t rgb_to_pixel(uint32_t rgb, uint32_t format) {
@@ -325,164 +1497,800 @@ static inline uint32_t rgb_to_pixel(uint32_t rgb, uint32_t format) {
 
 static void serial_put_char(char c) {
     uint32_t spin = 10000;
-    while ((inb(COM1_PORT + 5) & 0x20) == 0 && spin > 0) {
+    while ((inb(COM1_PORT + 5) & UART_LSR_THRE) == 0 && spin > 0) {
         spin--;
     }
     outb(COM1_PORT, (uint8_t)c);
 }
 
-static void fb_put_pixel(uint32_t x, uint32_t y, uint32_t color) {
-    if (!fb.enabled || x >= fb.width || y >= fb.height) {
+static void wait_queue_sleep(wait_queue_t *wq, uint64_t timeout_ticks);
+static void wait_queue_wake_all(wait_queue_t *wq);
+
+/*
+ * COM1 transmit path once uart_init switched to interrupts: bytes queue in
+ * a software ring and go out UART_FIFO at a time, from the THRE interrupt
+ * or from whoever arms it. All of these run with interrupts off.
+ */
+static void uart_set_ier(uint8_t ier) {
+    uart.ier = ier;
+    outb(COM1_PORT + 1, ier);
+}
+
+/* Only valid while the transmit FIFO is empty (LSR.THRE). */
+static void uart_fill_fifo(void) {
+    uint32_t n = 0;
+    while (n < UART_FIFO && uart.tx_tail != uart.tx_head) {
+        outb(COM1_PORT, uart.tx[uart.tx_tail]);
+        uart.tx_tail = (uart.tx_tail + 1) % UART_TX_RING;
+        n++;
+    }
+    if (n != 0) {
+        uart.tx_bytes += n;
+        uart.tx_bursts++;
+    }
+}
+
+static void uart_start_tx(void) {
+    if (uart.tx_busy || uart.tx_tail == uart.tx_head) {
         return;
     }
-    ((uint32_t *)(uintptr_t)fb.addr)[y * fb.pitch_pixels + x] = color;
+    uart.tx_busy = 1;
+    if (inb(COM1_PORT + 5) & UART_LSR_THRE) {
+        uart_fill_fifo();
+    }
+    uart_set_ier(uart.ier | UART_IER_THRI);
 }
 
-static void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color) {
-    for (uint32_t yy = 0; yy < h; ++yy) {
-        for (uint32_t xx = 0; xx < w; ++xx) {
-            fb_put_pixel(x + xx, y + yy, color);
-        }
+/* Waits for the FIFO to empty and refills it; only for callers whose interrupts are off for good. */
+static void uart_tx_poll(void) {
+    uint32_t spin = 100000;
+    while ((inb(COM1_PORT + 5) & UART_LSR_THRE) == 0 && spin > 0) {
+        spin--;
     }
+    uart_fill_fifo();
 }
 
-static void fb_draw_char(char c) {
-    const uint32_t cw = 8;
-    const uint32_t ch = 16;
-    uint32_t px = fb.cursor_x * cw;
-    uint32_t py = fb.cursor_y * ch;
-    uint32_t fg = rgb_to_pixel(fb.fg, fb.format);
-    uint32_t bg = rgb_to_pixel(fb.bg, fb.format);
+static void uart_write(const char *s, size_t len) {
+    if (!uart.irq_mode) {
+        for (size_t i = 0; i < len; ++i) {
+            serial_put_char(s[i]);
+        }
+        return;
+    }
+    uint64_t flags = irq_save();
+    while (len > 0) {
+        uint32_t next = (uart.tx_head + 1) % UART_TX_RING;
+        if (next == uart.tx_tail) {
+            /*
+             * Ring full: with interrupts on, let the THRE interrupt drain it,
+             * sleeping if we are a task; poll only when nothing else can.
+             */
+            uart.tx_stalls++;
+            uart_start_tx();
+            if ((flags & 0x200) == 0) {
+                uart_tx_poll();
+            } else if (current_task >= 0) {
+                wait_queue_sleep(&uart.tx_wait, 1);
+                flags = irq_save();
+            } else {
+                irq_restore(flags);
+                cpu_pause();
+                flags = irq_save();
+            }
+            continue;
+        }
+        uart.tx[uart.tx_head] = (uint8_t)*s++;
+        uart.tx_head = next;
+        len--;
+    }
+    uart_start_tx();
+    irq_restore(flags);
+}
 
-    if (c == '\n') {
-        fb.cursor_x = 0;
-        fb.cursor_y++;
+/* Panic path: interrupts stay off from here on, so push the whole ring out by polling. */
+static void uart_flush_poll(void) {
+    if (!uart.irq_mode) {
         return;
     }
+    uint64_t flags = irq_save();
+    while (uart.tx_tail != uart.tx_head) {
+        uart_tx_poll();
+    }
+    irq_restore(flags);
+}
+
+static inline void kmemset32(uint32_t *dst, uint32_t value, size_t n) {
+    __asm__ volatile("rep stosl" : "+D"(dst), "+c"(n) : "a"(value) : "memory");
+}
 
-    fb_fill_rect(px, py, cw, ch, bg);
-    fb_fill_rect(px + 1, py + 1, 6, 1, fg);
-    fb_fill_rect(px + 1, py + 10, 6, 1, fg);
-    fb_fill_rect(px + 1, py + 1, 1, 10, fg);
-    fb_fill_rect(px + 6, py + 1, 1, 10, fg);
-    for (uint32_t bit = 0; bit < 6; ++bit) {
-        if (((uint8_t)c >> bit) & 1U) {
-            fb_fill_rect(px + 1 + bit, py + 12, 1, 3, fg);
+static void gfx_scalar_fill(uint32_t *dst, uint32_t color, uint32_t n) {
+    kmemset32(dst, color, n);
+}
+
+static void gfx_scalar_copy(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    kmemcpy(dst, src, (size_t)n * sizeof(uint32_t));
+}
+
+/* (s*a + d*(255-a)) / 255, rounded; the vector kernels compute exactly this in 16-bit lanes. */
+static inline uint32_t gfx_mix8(uint32_t s, uint32_t d, uint32_t a) {
+    uint32_t t = s * a + d * (255 - a) + 128;
+    return (t + (t >> 8)) >> 8;
+}
+
+static void gfx_scalar_blend(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t s = src[i];
+        uint32_t d = dst[i];
+        uint32_t a = s >> 24;
+        uint32_t out = 0;
+        for (uint32_t shift = 0; shift < 32; shift += 8) {
+            out |= gfx_mix8((s >> shift) & 0xFF, (d >> shift) & 0xFF, a) << shift;
         }
+        dst[i] = out;
     }
+}
 
-    fb.cursor_x++;
-    if ((fb.cursor_x + 1) * cw >= fb.width) {
-        fb.cursor_x = 0;
-        fb.cursor_y++;
-    }
-    if ((fb.cursor_y + 1) * ch >= fb.height) {
-        fb.cursor_x = 0;
-        fb.cursor_y = 0;
-        fb_fill_rect(0, 0, fb.width, fb.height, bg);
+static void gfx_scalar_swap_rb(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    for (uint32_t i = 0; i < n; ++i) {
+        uint32_t p = src[i];
+        dst[i] = (p & 0xFF00FF00u) | ((p >> 16) & 0xFF) | ((p & 0xFF) << 16);
     }
 }
 
-static void vga_put_char(char c) {
-    if (c == '\n') {
-        vga_pos = (uint16_t)((vga_pos / 80 + 1) * 80);
-        return;
+__attribute__((target("sse2"))) static void gfx_sse2_fill(uint32_t *dst, uint32_t color, uint32_t n) {
+    __m128i v = _mm_set1_epi32((int)color);
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)(dst + i), v);
     }
-    vga[vga_pos++] = (uint16_t)(0x0F00 | (uint8_t)c);
-    if (vga_pos >= 80 * 25) {
-        vga_pos = 0;
+    for (; i < n; ++i) {
+        dst[i] = color;
     }
 }
 
-static void put_char(char c) {
-    serial_put_char(c);
-    if (fb.enabled) {
-        fb_draw_char(c);
-    } else {
-        vga_put_char(c);
+__attribute__((target("sse2"))) static void gfx_sse2_copy(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_loadu_si128((const __m128i *)(src + i)));
     }
+    gfx_scalar_copy(dst + i, src + i, n - i);
 }
 
-static void write_text(const char *s, size_t len) {
-    for (size_t i = 0; i < len; ++i) {
-        put_char(s[i]);
+/* Two pixels widened to 16-bit channels; alpha is word 3 of each pixel. */
+__attribute__((target("sse2"))) static inline __m128i gfx_sse2_mix(__m128i s, __m128i d) {
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+    t = _mm_add_epi16(t, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("sse2"))) static void gfx_sse2_blend(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i lo = gfx_sse2_mix(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero));
+        __m128i hi = gfx_sse2_mix(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
     }
+    gfx_scalar_blend(dst + i, src + i, n - i);
 }
 
-static void write_cstr(const char *s) {
-    while (*s) {
-        put_char(*s++);
+__attribute__((target("sse2"))) static void gfx_sse2_swap_rb(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    const __m128i ga = _mm_set1_epi32((int)0xFF00FF00u);
+    const __m128i low = _mm_set1_epi32(0xFF);
+    uint32_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), low);
+        __m128i b = _mm_slli_epi32(_mm_and_si128(p, low), 16);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_and_si128(p, ga), _mm_or_si128(r, b)));
     }
+    gfx_scalar_swap_rb(dst + i, src + i, n - i);
 }
 
-static void write_u64_hex(uint64_t value) {
-    static const char *hex = "0123456789ABCDEF";
-    write_cstr("0x");
-    for (int i = 60; i >= 0; i -= 4) {
-        put_char(hex[(value >> i) & 0xF]);
+__attribute__((target("avx2"))) static void gfx_avx2_fill(uint32_t *dst, uint32_t color, uint32_t n) {
+    __m256i v = _mm256_set1_epi32((int)color);
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    for (; i < n; ++i) {
+        dst[i] = color;
     }
 }
 
-static void dump_regs(const regs_t *r) {
-    write_cstr("RAX="); write_u64_hex(r->rax); write_cstr(" RBX="); write_u64_hex(r->rbx); write_cstr("\n");
-    write_cstr("RCX="); write_u64_hex(r->rcx); write_cstr(" RDX="); write_u64_hex(r->rdx); write_cstr("\n");
-    write_cstr("RSI="); write_u64_hex(r->rsi); write_cstr(" RDI="); write_u64_hex(r->rdi); write_cstr("\n");
-    write_cstr("RBP="); write_u64_hex(r->rbp); write_cstr(" RSP=?\n");
-    write_cstr("R8 ="); write_u64_hex(r->r8);  write_cstr(" R9 ="); write_u64_hex(r->r9);  write_cstr("\n");
-    write_cstr("R10="); write_u64_hex(r->r10); write_cstr(" R11="); write_u64_hex(r->r11); write_cstr("\n");
-    write_cstr("R12="); write_u64_hex(r->r12); write_cstr(" R13="); write_u64_hex(r->r13); write_cstr("\n");
-    write_cstr("R14="); write_u64_hex(r->r14); write_cstr(" R15="); write_u64_hex(r->r15); write_cstr("\n");
+__attribute__((target("avx2"))) static void gfx_avx2_copy(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_loadu_si256((const __m256i *)(src + i)));
+    }
+    gfx_scalar_copy(dst + i, src + i, n - i);
 }
 
-static void dump_backtrace(uint64_t rbp) {
-    write_cstr("Backtrace:\n");
-    for (int i = 0; i < 8 && rbp; ++i) {
-        uint64_t *frame = (uint64_t *)rbp;
-        uint64_t ret = frame[1];
-        write_cstr("  "); write_u64_hex(ret); write_cstr("\n");
-        rbp = frame[0];
+__attribute__((target("avx2"))) static inline __m256i gfx_avx2_mix(__m256i s, __m256i d) {
+    __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s, 0xFF), 0xFF);
+    __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(s, a),
+                                 _mm256_mullo_epi16(d, _mm256_sub_epi16(_mm256_set1_epi16(255), a)));
+    t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+    return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+/* Unpack and pack both work within 128-bit lanes, so pixel order survives the round trip. */
+__attribute__((target("avx2"))) static void gfx_avx2_blend(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i lo = gfx_avx2_mix(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero));
+        __m256i hi = gfx_avx2_mix(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(lo, hi));
     }
+    gfx_scalar_blend(dst + i, src + i, n - i);
 }
 
-static void clear_console(void) {
-    if (fb.enabled) {
-        fb_fill_rect(0, 0, fb.width, fb.height, rgb_to_pixel(fb.bg, fb.format));
-        fb.cursor_x = 0;
-        fb.cursor_y = 0;
+__attribute__((target("avx2"))) static void gfx_avx2_swap_rb(uint32_t *dst, const uint32_t *src, uint32_t n) {
+    const __m256i order = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(p, order));
+    }
+    gfx_scalar_swap_rb(dst + i, src + i, n - i);
+}
+
+static const gfx_ops_t gfx_scalar_ops = {
+    "scalar", gfx_scalar_fill, gfx_scalar_copy, gfx_scalar_blend, gfx_scalar_swap_rb,
+};
+static const gfx_ops_t gfx_sse2_ops = {
+    "sse2", gfx_sse2_fill, gfx_sse2_copy, gfx_sse2_blend, gfx_sse2_swap_rb,
+};
+static const gfx_ops_t gfx_avx2_ops = {
+    "avx2", gfx_avx2_fill, gfx_avx2_copy, gfx_avx2_blend, gfx_avx2_swap_rb,
+};
+static const gfx_ops_t *gfx = &gfx_scalar_ops;
+static uint8_t simd_switch; /* how ring3_preempt saves vector state: 0 (none), SIMD_FXSAVE or SIMD_XSAVE */
+
+/*
+ * Turns on SSE (stage2 leaves CR4.OSFXSR clear) and, when CPUID and XCR0
+ * allow it, AVX; then picks the widest gfx kernels. The kernel is built
+ * with -mgeneral-regs-only and only the gfx_sse2_* and gfx_avx2_* kernels
+ * touch vector registers, so interrupt entry has no vector state to save.
+ * Ring3 tasks call those kernels too and can be preempted inside one, so
+ * ring3_preempt switches vector state per user task.
+ */
+static void simd_init(void) {
+    uint32_t a, b, c, d;
+    uint64_t cr0, cr4;
+    cpuid(1, &a, &b, &c, &d);
+    if ((d & (1u << 26)) == 0) {
         return;
     }
-    for (int i = 0; i < 80 * 25; ++i) {
-        vga[i] = 0x0F20;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" : : "r"((cr0 & ~(1ull << 2)) | (1ull << 1))); /* EM off, MP on */
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= (1ull << 9) | (1ull << 10); /* OSFXSR, OSXMMEXCPT */
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4));
+    gfx = &gfx_sse2_ops;
+    simd_switch = SIMD_FXSAVE;
+
+    if ((c & (1u << 26)) == 0 || (c & (1u << 28)) == 0) {
+        return; /* no XSAVE or no AVX */
+    }
+    __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | (1ull << 18))); /* OSXSAVE */
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    __asm__ volatile("xsetbv" : : "a"(lo | 7u), "d"(hi), "c"(0)); /* x87, SSE, AVX state */
+    cpuid(0xD, &a, &b, &c, &d);
+    if (b > SIMD_SAVE_SIZE) {
+        return; /* state too big for user_task_t: stay on SSE2, which FXSAVE covers */
+    }
+    simd_switch = SIMD_XSAVE;
+    cpuid(7, &a, &b, &c, &d);
+    if (b & (1u << 5)) {
+        gfx = &gfx_avx2_ops;
     }
-    vga_pos = 0;
 }
 
-static void init_console(const barecore_boot_info_t *bi) {
-    fb.enabled = 0;
-    fb.cursor_x = 0;
-    fb.cursor_y = 0;
-    fb.fg = 0xF0F0F0;
-    fb.bg = 0x101418;
+static void simd_save(uint8_t *area) {
+    if (simd_switch == SIMD_XSAVE) {
+        __asm__ volatile("xsave64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+    } else if (simd_switch == SIMD_FXSAVE) {
+        __asm__ volatile("fxsave64 (%0)" : : "r"(area) : "memory");
+    }
+}
 
-    if (bi != NULL && bi->magic == BARECORE_BOOTINFO_MAGIC && bi->framebuffer_base != 0 && bi->framebuffer_bpp >= 24) {
-        fb.addr = bi->framebuffer_base;
-        fb.width = bi->framebuffer_width;
-        fb.height = bi->framebuffer_height;
-        fb.pitch_pixels = bi->framebuffer_pitch_pixels;
-        fb.bpp = bi->framebuffer_bpp;
-        fb.format = bi->framebuffer_format;
-        fb.enabled = 1;
-        clear_console();
+static void simd_restore(const uint8_t *area) {
+    if (simd_switch == SIMD_XSAVE) {
+        __asm__ volatile("xrstor64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+    } else if (simd_switch == SIMD_FXSAVE) {
+        __asm__ volatile("fxrstor64 (%0)" : : "r"(area) : "memory");
     }
 }
 
-static void gdt_set_entry(gdt_entry_t *e, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
-    e->limit = (uint16_t)(limit & 0xFFFF);
-    e->base_low = (uint16_t)(base & 0xFFFF);
-    e->base_mid = (uint8_t)((base >> 16) & 0xFF);
-    e->access = access;
-    e->gran = (uint8_t)(((limit >> 16) & 0x0F) | (gran & 0xF0));
-    e->base_high = (uint8_t)((base >> 24) & 0xFF);
+/* Power-on vector state: an empty XSAVE header, default x87 control word and MXCSR. */
+static void simd_reset(uint8_t *area) {
+    kmemzero(area, SIMD_SAVE_SIZE);
+    area[0] = 0x7F;
+    area[1] = 0x03;
+    area[24] = 0x80;
+    area[25] = 0x1F;
+}
+
+/* Clips [x, x + *w) x [y, y + *h) to s; returns 0 when nothing is left. */
+static int gfx_clip(const gfx_surface_t *s, uint32_t x, uint32_t y, uint32_t *w, uint32_t *h) {
+    if (x >= s->width || y >= s->height) {
+        return 0;
+    }
+    if (*w > s->width - x) {
+        *w = s->width - x;
+    }
+    if (*h > s->height - y) {
+        *h = s->height - y;
+    }
+    return *w != 0 && *h != 0;
+}
+
+static void gfx_fill(const gfx_surface_t *s, uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color) {
+    if (!gfx_clip(s, x, y, &w, &h)) {
+        return;
+    }
+    uint32_t *row = s->pixels + (size_t)y * s->pitch + x;
+    for (uint32_t i = 0; i < h; ++i, row += s->pitch) {
+        gfx->fill(row, color, w);
+    }
+}
+
+/* Copies src to (x, y) in dst; blend composites it with src's per-pixel alpha instead. */
+static void gfx_draw(const gfx_surface_t *dst, uint32_t x, uint32_t y, const gfx_surface_t *src, int blend) {
+    uint32_t w = src->width;
+    uint32_t h = src->height;
+    if (!gfx_clip(dst, x, y, &w, &h)) {
+        return;
+    }
+    uint32_t *d = dst->pixels + (size_t)y * dst->pitch + x;
+    const uint32_t *sp = src->pixels;
+    for (uint32_t i = 0; i < h; ++i, d += dst->pitch, sp += src->pitch) {
+        if (blend) {
+            gfx->blend(d, sp, w);
+        } else {
+            gfx->copy(d, sp, w);
+        }
+    }
+}
+
+static void gfx_blit(const gfx_surface_t *dst, uint32_t x, uint32_t y, const gfx_surface_t *src) {
+    gfx_draw(dst, x, y, src, 0);
+}
+
+static void gfx_composite(const gfx_surface_t *dst, uint32_t x, uint32_t y, const gfx_surface_t *src) {
+    gfx_draw(dst, x, y, src, 1);
+}
+
+/* Bulk xRGB to framebuffer order (and back: the swap is its own inverse); dst may equal src. */
+static void gfx_convert(uint32_t *dst, const uint32_t *src, uint32_t n, uint32_t format) {
+    if (format == 0) {
+        if (dst != src) {
+            gfx->copy(dst, src, n);
+        }
+        return;
+    }
+    gfx->swap_rb(dst, src, n);
+}
+
+static inline uint32_t *fb_row(uint32_t y) {
+    return fb.draw + (size_t)y * fb.pitch_pixels;
+}
+
+static void fb_mark_dirty(uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    if (!fb.shadowed) {
+        return;
+    }
+    uint64_t flags = irq_save();
+    if (fb_dirty.x1 == 0) {
+        fb_dirty.x0 = x;
+        fb_dirty.y0 = y;
+        fb_dirty.x1 = x + w;
+        fb_dirty.y1 = y + h;
+    } else {
+        if (x < fb_dirty.x0) fb_dirty.x0 = x;
+        if (y < fb_dirty.y0) fb_dirty.y0 = y;
+        if (x + w > fb_dirty.x1) fb_dirty.x1 = x + w;
+        if (y + h > fb_dirty.y1) fb_dirty.y1 = y + h;
+    }
+    irq_restore(flags);
+}
+
+/* Streams pixels to video memory 8 bytes at a time with movnti, bypassing the cache. */
+static void fb_copy_nt(uint32_t *dst, const uint32_t *src, uint32_t pixels) {
+    if (((uintptr_t)dst & 4) && pixels > 0) {
+        __asm__ volatile("movnti %1, %0" : "=m"(*dst) : "r"(*src));
+        dst++;
+        src++;
+        pixels--;
+    }
+    uint64_t qwords = pixels / 2;
+    if (qwords > 0) {
+        __asm__ volatile(
+            "1: mov (%1), %%rax\n\t"
+            "movnti %%rax, (%0)\n\t"
+            "add $8, %0\n\t"
+            "add $8, %1\n\t"
+            "dec %2\n\t"
+            "jnz 1b"
+            : "+r"(dst), "+r"(src), "+r"(qwords) : : "rax", "memory");
+    }
+    if (pixels & 1) {
+        __asm__ volatile("movnti %1, %0" : "=m"(*dst) : "r"(*src));
+    }
+}
+
+/* Copies the dirty rectangle of the shadow buffer out to the framebuffer. */
+static void fb_flush(void) {
+    if (!fb.shadowed) {
+        return;
+    }
+    uint64_t flags = irq_save();
+    fb_rect_t r = fb_dirty;
+    fb_dirty.x1 = 0;
+    fb.last_flush = ticks;
+    irq_restore(flags);
+    if (r.x1 == 0) {
+        return;
+    }
+
+    size_t offset = (size_t)r.y0 * fb.pitch_pixels + r.x0;
+    uint32_t *dst = (uint32_t *)(uintptr_t)fb.addr + offset;
+    const uint32_t *src = fb.draw + offset;
+    for (uint32_t y = r.y0; y < r.y1; ++y) {
+        fb_copy_nt(dst, src, r.x1 - r.x0);
+        dst += fb.pitch_pixels;
+        src += fb.pitch_pixels;
+    }
+    __asm__ volatile("sfence" : : : "memory");
+    fb.flushes++;
+}
+
+/* Output paths call this after drawing; at most FB_FLUSH_HZ flushes reach the screen. */
+static void fb_flush_throttled(void) {
+    if (fb_dirty.x1 != 0 && ticks - fb.last_flush >= FB_FLUSH_TICKS) {
+        fb_flush();
+    }
+}
+
+static void fb_fill_rect(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color) {
+    if (!fb.enabled || x >= fb.width || y >= fb.height) {
+        return;
+    }
+    if (w > fb.width - x) {
+        w = fb.width - x;
+    }
+    if (h > fb.height - y) {
+        h = fb.height - y;
+    }
+    for (uint32_t yy = 0; yy < h; ++yy) {
+        gfx->fill(fb_row(y + yy) + x, color, w);
+    }
+    fb_mark_dirty(x, y, w, h);
+}
+
+static void fb_set_colors(uint32_t fg, uint32_t bg) {
+    fb.fg = fg;
+    fb.bg = bg;
+    fb.fg_pixel = rgb_to_pixel(fg, fb.format);
+    fb.bg_pixel = rgb_to_pixel(bg, fb.format);
+    for (uint32_t bits = 0; bits < 256; ++bits) {
+        for (uint32_t x = 0; x < FB_FONT_W; ++x) {
+            fb_spans[bits][x] = (bits & (0x80U >> x)) ? fb.fg_pixel : fb.bg_pixel;
+        }
+    }
+}
+
+static void fb_draw_glyph(uint32_t col, uint32_t row, uint8_t c) {
+    if (c < FB_FONT_FIRST || c > FB_FONT_LAST) {
+        c = '?';
+    }
+    const uint8_t *glyph = fb_font[c - FB_FONT_FIRST];
+    uint32_t *dst = fb_row(row * FB_FONT_H) + col * FB_FONT_W;
+    for (uint32_t y = 0; y < FB_FONT_H; ++y) {
+        kmemcpy(dst, fb_spans[glyph[y]], sizeof(fb_spans[0]));
+        dst += fb.pitch_pixels;
+    }
+    fb_mark_dirty(col * FB_FONT_W, row * FB_FONT_H, FB_FONT_W, FB_FONT_H);
+}
+
+/* Move every text line up by one and blank the bottom line. rep movsb copies
+ * forwards, so the overlapping move towards lower addresses is safe. */
+static void fb_scroll(void) {
+    size_t line = (size_t)fb.pitch_pixels * FB_FONT_H;
+    uint32_t *base = fb_row(0);
+    kmemcpy(base, base + line, (fb.rows - 1) * line * sizeof(uint32_t));
+    fb_fill_rect(0, (fb.rows - 1) * FB_FONT_H, fb.width, FB_FONT_H, fb.bg_pixel);
+    fb_mark_dirty(0, 0, fb.width, (fb.rows - 1) * FB_FONT_H);
+}
+
+static void fb_newline(void) {
+    fb.cursor_x = 0;
+    if (fb.cursor_y + 1 < fb.rows) {
+        fb.cursor_y++;
+    } else {
+        fb_scroll();
+    }
+}
+
+static void fb_draw_char(char c) {
+    if (c == '\n') {
+        fb_newline();
+        return;
+    }
+    if (c == '\r') {
+        fb.cursor_x = 0;
+        return;
+    }
+    if (c == '\b') {
+        if (fb.cursor_x > 0) {
+            fb.cursor_x--;
+        }
+        return;
+    }
+
+    fb_draw_glyph(fb.cursor_x, fb.cursor_y, (uint8_t)c);
+    if (++fb.cursor_x >= fb.cols) {
+        fb_newline();
+    }
+}
+
+static void vga_put_char(char c) {
+    if (c == '\n') {
+        vga_pos = (uint16_t)((vga_pos / 80 + 1) * 80);
+        return;
+    }
+    vga[vga_pos++] = (uint16_t)(0x0F00 | (uint8_t)c);
+    if (vga_pos >= 80 * 25) {
+        vga_pos = 0;
+    }
+}
+
+/* Console sinks, fed only by log_drain. */
+static void console_write(const char *s, size_t len) {
+    uart_write(s, len);
+    for (size_t i = 0; i < len; ++i) {
+        if (fb.enabled) {
+            fb_draw_char(s[i]);
+        } else {
+            vga_put_char(s[i]);
+        }
+    }
+    if (fb.enabled) {
+        fb_flush_throttled();
+    }
+}
+
+/*
+ * Kernel log. Every console write becomes a record (sequence number is its
+ * ring position, plus a TSC stamp) in a lock-free ring that task and IRQ
+ * producers fill with one CAS; the log-drain task empties it to the console
+ * sinks in batches. Before that task runs, when the ring is full, or when
+ * the oldest record is stale, task-context producers drain inline instead.
+ * IRQ-context producers never do: when the ring is full their record is
+ * dropped and counted in log_dropped.
+ */
+static void log_init(void) {
+    for (uint32_t i = 0; i < LOG_SLOTS; ++i) {
+        log_ring[i].seq = i;
+    }
+}
+
+static int log_push(const char *s, uint32_t len) {
+    uint64_t pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    for (;;) {
+        log_record_t *r = &log_ring[pos % LOG_SLOTS];
+        int64_t diff = (int64_t)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff < 0) {
+            return 0;
+        }
+        if (diff > 0) {
+            pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            r->tsc = rdtsc();
+            r->len = len;
+            kmemcpy(r->text, s, len);
+            __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+            return 1;
+        }
+    }
+}
+
+/* Oldest record is complete; returns it or NULL. */
+static log_record_t *log_peek(void) {
+    log_record_t *r = &log_ring[log_tail % LOG_SLOTS];
+    return (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == log_tail + 1) ? r : NULL;
+}
+
+/* Whoever wins log_draining is the single consumer; everyone else returns at once. */
+static void log_drain(void) {
+    if (__atomic_exchange_n(&log_draining, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    uint32_t n = 0;
+    log_record_t *r;
+    while ((r = log_peek()) != NULL) {
+        console_write(r->text, r->len);
+        if (tsc_per_us != 0) {
+            uint64_t lag = (rdtsc() - r->tsc) / tsc_per_us;
+            if (lag > log_max_lag_us) {
+                log_max_lag_us = lag;
+            }
+        }
+        __atomic_store_n(&r->seq, log_tail + LOG_SLOTS, __ATOMIC_RELEASE);
+        log_tail++;
+        n++;
+    }
+    uint64_t dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+    if (dropped != log_reported_drops) {
+        console_write("\n[log: records dropped]\n", 24);
+        log_reported_drops = dropped;
+    }
+    if (n != 0) {
+        log_batches++;
+        log_records += n;
+    }
+    __atomic_store_n(&log_draining, 0, __ATOMIC_RELEASE);
+}
+
+static int log_stale(void) {
+    log_record_t *r = log_peek();
+    return r != NULL && rdtsc() - r->tsc > LOG_STALE_US * tsc_per_us;
+}
+
+/* Hard IRQ handlers and the softirqs that run on their way out. */
+static int in_interrupt(void) {
+    return irq_depth != 0 || softirq_active;
+}
+
+/*
+ * Only task context ever drains inline (ring full, no drain task yet, or
+ * the drain task starved past LOG_STALE_US). Interrupt context pushes and
+ * wakes: the sinks are slow, and framebuffer users outside log_draining
+ * (clear_console, ksys_fbflush, the fb-flush work) assume no IRQ-time
+ * drain runs under them.
+ */
+static void log_write(const char *s, size_t len) {
+    int irq = in_interrupt();
+    while (len > 0) {
+        uint32_t n = (len > LOG_TEXT) ? LOG_TEXT : (uint32_t)len;
+        if (!log_push(s, n)) {
+            if (!irq) {
+                log_drain();
+            }
+            if (irq || !log_push(s, n)) {
+                __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            }
+        }
+        s += n;
+        len -= n;
+    }
+    if (!irq && (!log_task_running || log_stale())) {
+        log_drain();
+    } else if (log_wait.waiters != 0) {
+        wait_queue_wake_all(&log_wait);
+    }
+}
+
+/* Fatal paths may have interrupted a drain that will never resume: take the consumer side over. */
+static void log_panic_flush(void) {
+    __atomic_store_n(&log_draining, 0, __ATOMIC_RELEASE);
+    log_drain();
+    uart_flush_poll();
+    fb_flush();
+}
+
+static void put_char(char c) {
+    log_write(&c, 1);
+}
+
+static void write_text(const char *s, size_t len) {
+    log_write(s, len);
+}
+
+static void write_cstr(const char *s) {
+    size_t len = 0;
+    while (s[len]) {
+        len++;
+    }
+    log_write(s, len);
+}
+
+static void write_u64_dec(uint64_t value) {
+    char tmp[20];
+    int n = 20;
+    do {
+        tmp[--n] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    log_write(tmp + n, (size_t)(20 - n));
+}
+
+static void write_u64_hex(uint64_t value) {
+    static const char *hex = "0123456789ABCDEF";
+    char tmp[18];
+    tmp[0] = '0';
+    tmp[1] = 'x';
+    for (int i = 0; i < 16; ++i) {
+        tmp[2 + i] = hex[(value >> (60 - 4 * i)) & 0xF];
+    }
+    log_write(tmp, sizeof(tmp));
+}
+
+static void dump_regs(const regs_t *r) {
+    write_cstr("RAX="); write_u64_hex(r->rax); write_cstr(" RBX="); write_u64_hex(r->rbx); write_cstr("\n");
+    write_cstr("RCX="); write_u64_hex(r->rcx); write_cstr(" RDX="); write_u64_hex(r->rdx); write_cstr("\n");
+    write_cstr("RSI="); write_u64_hex(r->rsi); write_cstr(" RDI="); write_u64_hex(r->rdi); write_cstr("\n");
+    write_cstr("RBP="); write_u64_hex(r->rbp); write_cstr(" RSP=?\n");
+    write_cstr("R8 ="); write_u64_hex(r->r8);  write_cstr(" R9 ="); write_u64_hex(r->r9);  write_cstr("\n");
+    write_cstr("R10="); write_u64_hex(r->r10); write_cstr(" R11="); write_u64_hex(r->r11); write_cstr("\n");
+    write_cstr("R12="); write_u64_hex(r->r12); write_cstr(" R13="); write_u64_hex(r->r13); write_cstr("\n");
+    write_cstr("R14="); write_u64_hex(r->r14); write_cstr(" R15="); write_u64_hex(r->r15); write_cstr("\n");
+}
+
+static void dump_backtrace(uint64_t rbp) {
+    write_cstr("Backtrace:\n");
+    for (int i = 0; i < 8 && rbp; ++i) {
+        uint64_t *frame = (uint64_t *)rbp;
+        uint64_t ret = frame[1];
+        write_cstr("  "); write_u64_hex(ret); write_cstr("\n");
+        rbp = frame[0];
+    }
+}
+
+static void clear_console(void) {
+    log_drain();
+    if (fb.enabled) {
+        fb_fill_rect(0, 0, fb.width, fb.height, fb.bg_pixel);
+        fb.cursor_x = 0;
+        fb.cursor_y = 0;
+        return;
+    }
+    for (int i = 0; i < 80 * 25; ++i) {
+        vga[i] = 0x0F20;
+    }
+    vga_pos = 0;
+}
+
+static void init_console(const barecore_boot_info_t *bi) {
+    fb.enabled = 0;
+    fb.cursor_x = 0;
+    fb.cursor_y = 0;
+
+    if (bi != NULL && bi->magic == BARECORE_BOOTINFO_MAGIC && bi->framebuffer_base != 0 && bi->framebuffer_bpp >= 24) {
+        fb.addr = bi->framebuffer_base;
+        fb.width = bi->framebuffer_width;
+        fb.height = bi->framebuffer_height;
+        fb.pitch_pixels = bi->framebuffer_pitch_pixels;
+        fb.bpp = bi->framebuffer_bpp;
+        fb.format = bi->framebuffer_format;
+        fb.draw = (uint32_t *)(uintptr_t)fb.addr;
+        fb.shadowed = 0;
+        fb.cols = fb.width / FB_FONT_W;
+        fb.rows = fb.height / FB_FONT_H;
+        fb_set_colors(0xF0F0F0, 0x101418);
+        fb.enabled = fb.cols > 0 && fb.rows > 0;
+        clear_console();
+    }
+}
+
+static void gdt_set_entry(gdt_entry_t *e, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+    e->limit = (uint16_t)(limit & 0xFFFF);
+    e->base_low = (uint16_t)(base & 0xFFFF);
+    e->base_mid = (uint8_t)((base >> 16) & 0xFF);
+    e->access = access;
+    e->gran = (uint8_t)(((limit >> 16) & 0x0F) | (gran & 0xF0));
+    e->base_high = (uint8_t)((base >> 24) & 0xFF);
 }
 
 static void gdt_set_tss(gdt_tss_entry_t *e, uint64_t base, uint32_t limit) {
@@ -587,38 +2395,285 @@ static void init_pit(uint32_t hz) {
     outb(PIT_CHANNEL0, (uint8_t)((divisor >> 8) & 0xFF));
 }
 
-static volatile uint32_t *lapic_reg(uint32_t offset) {
-    return (volatile uint32_t *)(uintptr_t)(lapic_base + offset);
+/* Calibrates the TSC against a 10 ms one-shot on PIT channel 2 (gate via port 0x61). */
+static void tsc_calibrate(void) {
+    const uint32_t pit_10ms = 1193182U / 100;
+    uint8_t gate = inb(0x61);
+    outb(0x61, (uint8_t)((gate & ~0x02) & ~0x01));
+    outb(PIT_COMMAND, 0xB0);
+    outb(0x42, (uint8_t)(pit_10ms & 0xFF));
+    outb(0x42, (uint8_t)(pit_10ms >> 8));
+    outb(0x61, (uint8_t)((gate & ~0x02) | 0x01));
+    uint64_t t0 = rdtsc();
+    for (uint32_t spin = 0; (inb(0x61) & 0x20) == 0 && spin < 100000000u; ++spin) {
+    }
+    uint64_t t1 = rdtsc();
+    outb(0x61, gate);
+    tsc_per_us = (t1 - t0) / 10000;
+    if (tsc_per_us == 0) {
+        tsc_per_us = 1;
+    }
 }
 
-static void lapic_write(uint32_t offset, uint32_t value) {
-    *lapic_reg(offset) = value;
-    (void)*lapic_reg(0x20);
+static uint64_t clock_us(void) {
+    return rdtsc() / tsc_per_us;
 }
 
-static void lapic_init(void) {
-    uint32_t a, b, c, d;
-    cpuid(1, &a, &b, &c, &d);
-    if ((d & (1u << 9)) == 0) {
-        apic_enabled = 0;
-        return;
+static uint64_t *pt_alloc(void) {
+    if (pt_pool_used >= PT_POOL_PAGES) {
+        return NULL;
     }
-
-    uint32_t lo, hi;
-    rdmsr(0x1B, &lo, &hi);
-    lo |= (1u << 11);
-    wrmsr(0x1B, lo, hi);
-
-    lapic_base = (lo & 0xFFFFF000u);
-    if (lapic_base == 0) {
-        lapic_base = LAPIC_DEFAULT_BASE;
+    uint64_t *t = pt_pool[pt_pool_used++];
+    for (int i = 0; i < 512; ++i) {
+        t[i] = 0;
     }
+    return t;
+}
 
-    lapic_write(0xF0, 0x1FF);
-    lapic_write(0x3E0, 0x3);
-    lapic_write(0x320, VECTOR_TIMER | (1u << 17));
-    lapic_write(0x380, 0x100000);
-    apic_enabled = 1;
+static uint64_t *pt_next(uint64_t *table, uint32_t idx) {
+    if ((table[idx] & PTE_PRESENT) == 0) {
+        uint64_t *t = pt_alloc();
+        if (t == NULL) {
+            return NULL;
+        }
+        table[idx] = (uint64_t)(uintptr_t)t | PTE_PRESENT | PTE_WRITE;
+    }
+    return (uint64_t *)(uintptr_t)(table[idx] & PTE_ADDR_MASK);
+}
+
+/*
+ * Identity-maps [phys, phys + size) with 2 MiB pages using the live page
+ * tables (stage2's or the firmware's). Ranges that are already mapped are
+ * left untouched; new mappings get flags (PCD/PWT for device memory).
+ */
+static void *paging_identity_map(uint64_t phys, uint64_t size, uint64_t flags) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(cr3 & PTE_ADDR_MASK);
+
+    for (uint64_t va = phys & ~0x1FFFFFull; va < phys + size; va += 0x200000ull) {
+        uint64_t *pdpt = pt_next(pml4, (uint32_t)((va >> 39) & 0x1FF));
+        if (pdpt == NULL) {
+            return NULL;
+        }
+        uint32_t pdpt_idx = (uint32_t)((va >> 30) & 0x1FF);
+        if ((pdpt[pdpt_idx] & (PTE_PRESENT | PTE_PS)) == (PTE_PRESENT | PTE_PS)) {
+            continue;
+        }
+        uint64_t *pd = pt_next(pdpt, pdpt_idx);
+        if (pd == NULL) {
+            return NULL;
+        }
+        uint32_t pd_idx = (uint32_t)((va >> 21) & 0x1FF);
+        if (pd[pd_idx] & PTE_PRESENT) {
+            continue;
+        }
+        pd[pd_idx] = va | PTE_PRESENT | PTE_WRITE | PTE_PS | flags;
+        __asm__ volatile("invlpg (%0)" : : "r"(va) : "memory");
+    }
+    return (void *)(uintptr_t)phys;
+}
+
+static uint64_t cache_bits(uint32_t type, int large) {
+    if (!pat_enabled && type == CACHE_WC) {
+        type = CACHE_UC; /* power-on PAT has no WC entry */
+    }
+    uint64_t bits = 0;
+    if (type & 1) {
+        bits |= PTE_PWT;
+    }
+    if (type & 2) {
+        bits |= PTE_PCD;
+    }
+    if (type & 4) {
+        bits |= large ? PTE_PAT_PS : PTE_PAT;
+    }
+    return bits;
+}
+
+static inline void tlb_flush_all(void) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3) : : "memory");
+}
+
+/*
+ * Reprograms PAT so index 1 (PWT alone) is write-combining. Follows the SDM
+ * sequence: caches off and flushed around the MSR write.
+ */
+static void pat_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if ((d & (1u << 16)) == 0) {
+        return;
+    }
+    uint64_t flags = irq_save();
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0; wbinvd" : : "r"((cr0 | (1ull << 30)) & ~(1ull << 29)) : "memory");
+    wrmsr(PAT_MSR, (uint32_t)PAT_VALUE, (uint32_t)(PAT_VALUE >> 32));
+    __asm__ volatile("wbinvd" : : : "memory");
+    tlb_flush_all();
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0) : "memory");
+    irq_restore(flags);
+    pat_enabled = 1;
+}
+
+/*
+ * Identity-maps [phys, phys + size) with an explicit memory type. Unlike
+ * paging_identity_map it also retypes mappings that already exist (stage2
+ * maps LAPIC/HPET write-back, firmware maps everything WB), splitting
+ * 1 GiB pages so the change stays within the 2 MiB pages that cover the range.
+ */
+static void *ioremap(uint64_t phys, uint64_t size, uint32_t type) {
+    if (paging_identity_map(phys, size, cache_bits(type, 1)) == NULL) {
+        return NULL;
+    }
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    uint64_t *pml4 = (uint64_t *)(uintptr_t)(cr3 & PTE_ADDR_MASK);
+    uint64_t end = phys + size;
+
+    for (uint64_t va = phys & ~0x1FFFFFull; va < end; va += 0x200000ull) {
+        uint64_t *pdpt = (uint64_t *)(uintptr_t)(pml4[(va >> 39) & 0x1FF] & PTE_ADDR_MASK);
+        uint64_t *pdpte = &pdpt[(va >> 30) & 0x1FF];
+        if (*pdpte & PTE_PS) {
+            uint64_t *pd = pt_alloc();
+            if (pd == NULL) {
+                return NULL;
+            }
+            uint64_t base = *pdpte & PTE_ADDR_MASK & ~0x3FFFFFFFull;
+            uint64_t attrs = *pdpte & (0x1FFFull | (1ull << 63));
+            for (uint64_t i = 0; i < 512; ++i) {
+                pd[i] = (base + (i << 21)) | attrs;
+            }
+            *pdpte = (uint64_t)(uintptr_t)pd | PTE_PRESENT | PTE_WRITE | (*pdpte & PTE_USER);
+        }
+        uint64_t *pd = (uint64_t *)(uintptr_t)(*pdpte & PTE_ADDR_MASK);
+        uint64_t *pde = &pd[(va >> 21) & 0x1FF];
+        if (*pde & PTE_PS) {
+            *pde = (*pde & ~(PTE_PWT | PTE_PCD | PTE_PAT_PS)) | cache_bits(type, 1);
+            continue;
+        }
+        uint64_t *pt = (uint64_t *)(uintptr_t)(*pde & PTE_ADDR_MASK);
+        for (uint32_t i = 0; i < 512; ++i) {
+            uint64_t page = va + ((uint64_t)i << 12);
+            if (page + PAGE_SIZE > phys && page < end && (pt[i] & PTE_PRESENT)) {
+                pt[i] = (pt[i] & ~(PTE_PWT | PTE_PCD | PTE_PAT)) | cache_bits(type, 0);
+            }
+        }
+    }
+    tlb_flush_all();
+    __asm__ volatile("wbinvd" : : : "memory"); /* drop lines cached under the old type */
+    return (void *)(uintptr_t)phys;
+}
+
+static void *mmio_map(uint64_t phys, uint64_t size) {
+    return ioremap(phys, size, CACHE_UC);
+}
+
+static void *fb_map(uint32_t type) {
+    return ioremap(fb.addr, (uint64_t)fb.pitch_pixels * fb.height * sizeof(uint32_t), type);
+}
+
+static uint8_t cmos_read(uint8_t reg) {
+    outb(0x70, reg);
+    return inb(0x71);
+}
+
+/*
+ * Picks the RAM range handed out by page_alloc: the loader's report on the
+ * UEFI path, otherwise the CMOS extended-memory counters from the BIOS.
+ */
+static void mem_init(const barecore_boot_info_t *bi) {
+    if (bi != NULL && bi->magic == BARECORE_BOOTINFO_MAGIC && bi->mem_size != 0) {
+        mem_pool_next = bi->mem_base;
+        mem_pool_end = bi->mem_base + bi->mem_size;
+    } else {
+        uint64_t above16 = ((uint64_t)cmos_read(0x34) | ((uint64_t)cmos_read(0x35) << 8)) << 16;
+        uint64_t above1 = ((uint64_t)cmos_read(0x30) | ((uint64_t)cmos_read(0x31) << 8)) << 10;
+        mem_pool_end = above16 ? 0x1000000ull + above16 : 0x100000ull + above1;
+        mem_pool_next = MEM_POOL_BASE;
+    }
+    if (mem_pool_next < MEM_POOL_BASE) {
+        mem_pool_next = MEM_POOL_BASE; /* kernel image, BSS and boot stack live below */
+    }
+    mem_pool_next = (mem_pool_next + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (mem_pool_end < mem_pool_next) {
+        mem_pool_end = mem_pool_next;
+    }
+}
+
+static uint64_t mem_available(void) {
+    return mem_pool_end - mem_pool_next;
+}
+
+/* Bump allocator over the mem_init range; pages are never returned. */
+static void *page_alloc(uint64_t pages) {
+    uint64_t bytes = pages * PAGE_SIZE;
+    if (bytes > mem_available()) {
+        return NULL;
+    }
+    void *p = paging_identity_map(mem_pool_next, bytes, 0);
+    if (p != NULL) {
+        mem_pool_next += bytes;
+    }
+    return p;
+}
+
+/*
+ * Moves console drawing into a RAM copy of the screen so glyphs, fills and
+ * scrolls never touch video memory; fb_flush pushes out what changed.
+ */
+static void fb_shadow_init(void) {
+    if (!fb.enabled) {
+        return;
+    }
+    uint64_t bytes = (uint64_t)fb.pitch_pixels * fb.height * sizeof(uint32_t);
+    uint32_t *shadow = (uint32_t *)page_alloc((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (shadow == NULL) {
+        return;
+    }
+    uint64_t flags = irq_save();
+    kmemcpy(shadow, fb.draw, bytes);
+    fb.draw = shadow;
+    fb.last_flush = ticks;
+    fb.shadowed = 1;
+    irq_restore(flags);
+}
+
+static volatile uint32_t *lapic_reg(uint32_t offset) {
+    return (volatile uint32_t *)(uintptr_t)(lapic_base + offset);
+}
+
+static void lapic_write(uint32_t offset, uint32_t value) {
+    *lapic_reg(offset) = value;
+    (void)*lapic_reg(0x20);
+}
+
+static void lapic_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, &a, &b, &c, &d);
+    if ((d & (1u << 9)) == 0) {
+        apic_enabled = 0;
+        return;
+    }
+
+    uint32_t lo, hi;
+    rdmsr(0x1B, &lo, &hi);
+    lo |= (1u << 11);
+    wrmsr(0x1B, lo, hi);
+
+    lapic_base = (lo & 0xFFFFF000u);
+    if (lapic_base == 0) {
+        lapic_base = LAPIC_DEFAULT_BASE;
+    }
+    mmio_map(lapic_base, 0x1000);
+
+    lapic_write(0xF0, 0x1FF);
+    lapic_write(0x3E0, 0x3);
+    lapic_write(0x320, VECTOR_TIMER | (1u << 17));
+    lapic_write(0x380, 0x100000);
+    apic_enabled = 1;
 }
 
 static void lapic_eoi(void) {
@@ -644,6 +2699,7 @@ static uint8_t hpet_pick_irq(void) {
 }
 
 static void hpet_init(void) {
+    mmio_map(HPET_DEFAULT_BASE, 0x400);
     uint64_t cap = *hpet_reg(0x0);
     if (cap == 0 || cap == 0xFFFFFFFFFFFFFFFFULL) {
         hpet_enabled = 0;
@@ -674,6 +2730,7 @@ static uint32_t ioapic_read(uint8_t reg) {
 }
 
 static void ioapic_init(void) {
+    mmio_map(IOAPIC_DEFAULT_BASE, 0x20);
     uint32_t ver = ioapic_read(0x01);
     uint32_t max_redir = (ver >> 16) & 0xFF;
     for (uint32_t i = 0; i <= max_redir; ++i) {
@@ -727,24 +2784,339 @@ static void hpet_set_periodic_ms(uint32_t ms) {
     *hpet_reg(0x108) = hpet_ticks;
 }
 
-static void kbd_ring_push(char c) {
-    uint32_t next = (kbd_head + 1) & 0xFF;
-    if (next == kbd_tail) {
+static uint32_t pci_read32(const pci_dev_t *d, uint8_t off) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000u | ((uint32_t)d->bus << 16) | ((uint32_t)d->dev << 11) |
+                             ((uint32_t)d->fn << 8) | (off & 0xFC));
+    return inl(PCI_CONFIG_DATA);
+}
+
+static void pci_write32(const pci_dev_t *d, uint8_t off, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000u | ((uint32_t)d->bus << 16) | ((uint32_t)d->dev << 11) |
+                             ((uint32_t)d->fn << 8) | (off & 0xFC));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+static uint16_t pci_read16(const pci_dev_t *d, uint8_t off) {
+    return (uint16_t)(pci_read32(d, off) >> ((off & 2) * 8));
+}
+
+static void pci_write16(const pci_dev_t *d, uint8_t off, uint16_t value) {
+    uint32_t v = pci_read32(d, off);
+    uint32_t shift = (off & 2) * 8;
+    v = (v & ~(0xFFFFu << shift)) | ((uint32_t)value << shift);
+    pci_write32(d, off, v);
+}
+
+static void pci_enable(const pci_dev_t *d, uint16_t bits) {
+    pci_write16(d, 0x04, (uint16_t)(pci_read16(d, 0x04) | bits));
+}
+
+static void pci_scan(void) {
+    pci_dev_count = 0;
+    for (uint32_t bus = 0; bus < 256; ++bus) {
+        for (uint8_t dev = 0; dev < 32; ++dev) {
+            for (uint8_t fn = 0; fn < 8; ++fn) {
+                pci_dev_t d = {(uint8_t)bus, dev, fn, 0, 0, 0, 0, 0, 0};
+                uint32_t id = pci_read32(&d, 0x00);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    if (fn == 0) {
+                        break;
+                    }
+                    continue;
+                }
+                uint32_t cls = pci_read32(&d, 0x08);
+                d.vendor = (uint16_t)(id & 0xFFFF);
+                d.device = (uint16_t)(id >> 16);
+                d.class_code = (uint8_t)(cls >> 24);
+                d.subclass = (uint8_t)(cls >> 16);
+                d.prog_if = (uint8_t)(cls >> 8);
+                d.irq_line = (uint8_t)(pci_read32(&d, 0x3C) & 0xFF);
+                if (pci_dev_count < PCI_MAX_DEVICES) {
+                    pci_devs[pci_dev_count++] = d;
+                }
+                if (fn == 0 && (pci_read32(&d, 0x0C) & 0x00800000u) == 0) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static const pci_dev_t *pci_find_class(uint8_t class_code, uint8_t subclass) {
+    for (int i = 0; i < pci_dev_count; ++i) {
+        if (pci_devs[i].class_code == class_code && pci_devs[i].subclass == subclass) {
+            return &pci_devs[i];
+        }
+    }
+    return NULL;
+}
+
+static uint8_t pci_find_cap(const pci_dev_t *d, uint8_t cap_id) {
+    if ((pci_read16(d, 0x06) & (1u << 4)) == 0) {
+        return 0;
+    }
+    uint8_t off = (uint8_t)(pci_read32(d, 0x34) & 0xFC);
+    for (int guard = 0; off != 0 && guard < 48; ++guard) {
+        uint32_t hdr = pci_read32(d, off);
+        if ((hdr & 0xFF) == cap_id) {
+            return off;
+        }
+        off = (uint8_t)((hdr >> 8) & 0xFC);
+    }
+    return 0;
+}
+
+static uint64_t pci_bar_addr(const pci_dev_t *d, uint8_t bar) {
+    uint8_t off = (uint8_t)(0x10 + bar * 4);
+    uint32_t lo = pci_read32(d, off);
+    uint64_t addr = lo & 0xFFFFFFF0u;
+    if ((lo & 0x6) == 0x4) {
+        addr |= (uint64_t)pci_read32(d, (uint8_t)(off + 4)) << 32;
+    }
+    return addr;
+}
+
+/* Reserves one of the MSI vectors (VECTOR_MSI_BASE + slot); returns 0 when exhausted. */
+static uint8_t msi_alloc(irq_handler_t handler) {
+    if (!apic_enabled || msi_used >= MSI_SLOTS) {
+        return 0;
+    }
+    int slot = msi_used++;
+    msi_handlers[slot] = handler;
+    idt_set_gate((uint8_t)(VECTOR_MSI_BASE + slot), isr_msi_stubs[slot], 0x8E);
+    return (uint8_t)(VECTOR_MSI_BASE + slot);
+}
+
+static uint32_t msi_address(void) {
+    return LAPIC_DEFAULT_BASE | ((*lapic_reg(0x20) >> 24) << 12);
+}
+
+/* Switches d from INTx to a single MSI vector; returns 0 if unsupported. */
+static int pci_enable_msi(const pci_dev_t *d, irq_handler_t handler) {
+    uint8_t cap = pci_find_cap(d, 0x05);
+    if (cap == 0) {
+        return 0;
+    }
+    uint8_t vector = msi_alloc(handler);
+    if (vector == 0) {
+        return 0;
+    }
+    uint16_t ctrl = (uint16_t)(pci_read32(d, cap) >> 16);
+    pci_write32(d, (uint8_t)(cap + 4), msi_address());
+    if (ctrl & (1u << 7)) {
+        pci_write32(d, (uint8_t)(cap + 8), 0);
+        pci_write16(d, (uint8_t)(cap + 0x0C), vector);
+    } else {
+        pci_write16(d, (uint8_t)(cap + 8), vector);
+    }
+    ctrl = (uint16_t)((ctrl & ~(0x7u << 4)) | 1u);
+    pci_write16(d, (uint8_t)(cap + 2), ctrl);
+    pci_enable(d, 1u << 10); /* INTx disable */
+    return 1;
+}
+
+/*
+ * Switches d to MSI-X with table entry i delivering to a fresh vector for
+ * handlers[i]; NULL handlers leave their entry masked. Returns the mapped
+ * vector table, or NULL when MSI-X or enough vectors are unavailable.
+ */
+static volatile uint32_t *pci_enable_msix(const pci_dev_t *d, const irq_handler_t *handlers, uint32_t count) {
+    uint8_t cap = pci_find_cap(d, 0x11);
+    if (cap == 0 || !apic_enabled || msi_used + (int)count > MSI_SLOTS) {
+        return NULL;
+    }
+    uint16_t ctrl = pci_read16(d, (uint8_t)(cap + 2));
+    uint32_t size = (uint32_t)(ctrl & 0x7FF) + 1;
+    uint32_t tbl = pci_read32(d, (uint8_t)(cap + 4));
+    uint64_t base = pci_bar_addr(d, (uint8_t)(tbl & 7));
+    if (count > size || (tbl & 7) > 5 || base == 0) {
+        return NULL;
+    }
+    volatile uint32_t *table = (volatile uint32_t *)mmio_map(base + (tbl & ~7u), size * 16);
+    if (table == NULL) {
+        return NULL;
+    }
+    pci_write16(d, (uint8_t)(cap + 2), (uint16_t)(ctrl | (1u << 14))); /* function mask */
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t vector = (handlers[i] != NULL) ? msi_alloc(handlers[i]) : 0;
+        table[i * 4 + 0] = msi_address();
+        table[i * 4 + 1] = 0;
+        table[i * 4 + 2] = vector;
+        table[i * 4 + 3] = (vector != 0) ? 0 : 1;
+    }
+    pci_write16(d, (uint8_t)(cap + 2), (uint16_t)((ctrl | (1u << 15)) & ~(1u << 14)));
+    pci_enable(d, 1u << 10); /* INTx disable */
+    return table;
+}
+
+static void pic_unmask(uint8_t line) {
+    if (line >= 8) {
+        outb(PIC2_DATA, (uint8_t)(inb(PIC2_DATA) & ~(1u << (line - 8))));
+        line = 2;
+    }
+    outb(PIC1_DATA, (uint8_t)(inb(PIC1_DATA) & ~(1u << line)));
+}
+
+/*
+ * Routes a legacy IRQ line to vector IRQ_BASE + line through the same
+ * controller the timer uses: the IOAPIC on the HPET path, the 8259 PIC
+ * otherwise. PCI INTx lines are level-triggered and may be shared, so up to
+ * IRQ_MAX_SHARED handlers run per line.
+ */
+static void irq_install(uint8_t line, irq_handler_t handler, uint8_t level) {
+    if (line < 2 || line >= 16 || isr_irq_stubs[line] == NULL) {
+        return;
+    }
+    int slot = 0;
+    while (slot < IRQ_MAX_SHARED && irq_handlers[line][slot] != NULL) {
+        slot++;
+    }
+    if (slot == IRQ_MAX_SHARED) {
+        return;
+    }
+    irq_handlers[line][slot] = handler;
+    idt_set_gate((uint8_t)(IRQ_BASE + line), isr_irq_stubs[line], 0x8E);
+    if (irq_ioapic_routing) {
+        ioapic_write((uint8_t)(0x10 + line * 2), (uint32_t)(IRQ_BASE + line) | (level ? (1u << 15) : 0));
+        ioapic_write((uint8_t)(0x10 + line * 2 + 1), 0x0);
+    } else {
+        pic_unmask(line);
+    }
+}
+
+static void irq_eoi(uint8_t line) {
+    if (irq_ioapic_routing) {
+        lapic_eoi();
+        return;
+    }
+    if (line >= 8) {
+        outb(PIC2_COMMAND, PIC_EOI);
+    }
+    outb(PIC1_COMMAND, PIC_EOI);
+}
+
+/*
+ * Input events. The ring is single-producer/single-consumer: only the
+ * keyboard tasklet decodes into it, and only the shell reads. Readers
+ * sleep on input_wait and producers wake them, so an idle shell costs
+ * nothing and a key reaches it as soon as it is scheduled.
+ */
+static void input_push(const input_event_t *ev) {
+    uint32_t head = __atomic_load_n(&input_head, __ATOMIC_RELAXED);
+    if (head - __atomic_load_n(&input_tail, __ATOMIC_ACQUIRE) == INPUT_RING) {
+        input_drops++;
+        return;
+    }
+    input_ring[head % INPUT_RING] = *ev;
+    __atomic_store_n(&input_head, head + 1, __ATOMIC_RELEASE);
+    input_events++;
+}
+
+static int input_pop(input_event_t *ev) {
+    uint32_t tail = __atomic_load_n(&input_tail, __ATOMIC_RELAXED);
+    if (tail == __atomic_load_n(&input_head, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *ev = input_ring[tail % INPUT_RING];
+    __atomic_store_n(&input_tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void input_wake(void) {
+    if (input_wait.waiters != 0) {
+        input_wakeups++;
+        wait_queue_wake_all(&input_wait);
+    }
+}
+
+static void uart_rx_push(char c) {
+    uint32_t next = (uart.rx_head + 1) % UART_RX_RING;
+    if (next == uart.rx_tail) {
+        uart.rx_drops++;
         return;
     }
-    kbd_ring[kbd_head] = c;
-    kbd_head = next;
+    uart.rx[uart.rx_head] = c;
+    uart.rx_head = next;
+    uart.rx_bytes++;
 }
 
-static char kbd_ring_pop(void) {
-    if (kbd_head == kbd_tail) {
+static char uart_rx_pop(void) {
+    if (uart.rx_head == uart.rx_tail) {
         return 0;
     }
-    char c = kbd_ring[kbd_tail];
-    kbd_tail = (kbd_tail + 1) & 0xFF;
+    char c = uart.rx[uart.rx_tail];
+    uart.rx_tail = (uart.rx_tail + 1) % UART_RX_RING;
     return c;
 }
 
+/* Drains every pending cause: RX bytes into the ring, THRE refills the FIFO or disarms itself. */
+static void uart_irq_handler(void) {
+    uint8_t iir;
+    uart.irqs++;
+    while (((iir = inb(COM1_PORT + 2)) & 1) == 0) {
+        switch (iir & 0x0E) {
+        case 0x04: /* RX data available */
+        case 0x0C: /* RX timeout */
+            while (inb(COM1_PORT + 5) & UART_LSR_DR) {
+                char c = (char)inb(COM1_PORT);
+                if (c == '\r') {
+                    c = '\n';
+                } else if (c == 0x7F) {
+                    c = '\b';
+                }
+                uart_rx_push(c);
+            }
+            input_wake();
+            break;
+        case 0x02: /* THR empty */
+            if (uart.tx_tail == uart.tx_head) {
+                uart.tx_busy = 0;
+                uart_set_ier(uart.ier & ~UART_IER_THRI);
+            } else {
+                uart_fill_fifo();
+            }
+            if (uart.tx_wait.waiters != 0) {
+                wait_queue_wake_all(&uart.tx_wait);
+            }
+            break;
+        case 0x06:
+            (void)inb(COM1_PORT + 5);
+            break;
+        default:
+            (void)inb(COM1_PORT + 6);
+            break;
+        }
+    }
+}
+
+/*
+ * 115200 8N1 with the 16-byte FIFOs on and IRQ4 for RX data and THR empty.
+ * A chip without a working FIFO (8250/16450) keeps the polled path.
+ */
+static void uart_init(void) {
+    outb(COM1_PORT + 7, 0xA5);
+    if (inb(COM1_PORT + 7) != 0xA5) {
+        return;
+    }
+    outb(COM1_PORT + 1, 0x00);
+    outb(COM1_PORT + 3, 0x80); /* DLAB */
+    outb(COM1_PORT + 0, 0x01);
+    outb(COM1_PORT + 1, 0x00);
+    outb(COM1_PORT + 3, 0x03);
+    outb(COM1_PORT + 2, 0xC7); /* FIFO on, both cleared, RX trigger at 14 */
+    outb(COM1_PORT + 4, 0x0B); /* DTR, RTS, OUT2 gates the IRQ line */
+    uart.present = 1;
+    if ((inb(COM1_PORT + 2) & 0xC0) != 0xC0) {
+        return;
+    }
+    while (inb(COM1_PORT + 5) & UART_LSR_DR) {
+        (void)inb(COM1_PORT);
+    }
+    irq_install(UART_IRQ, uart_irq_handler, 0);
+    uart_set_ier(UART_IER_RDI);
+    uart.irq_mode = 1;
+}
+
 static char scancode_to_ascii(uint8_t sc, uint8_t shift) {
     static const char base[128] = {
         0, 27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
@@ -764,6 +3136,75 @@ static char scancode_to_ascii(uint8_t sc, uint8_t shift) {
     return shift ? shft[sc] : base[sc];
 }
 
+/* Scancode set 1 to key up/down events, tracking Shift, Ctrl, Alt and Caps Lock. */
+static void input_scancode(uint8_t sc) {
+    if (sc == 0xE0) {
+        input_prefix = 1;
+        return;
+    }
+    if (sc == 0xE1) {
+        input_skip = 5; /* Pause: E1 1D 45 E1 9D C5, no break code */
+        return;
+    }
+    if (input_skip != 0) {
+        input_skip--;
+        return;
+    }
+    input_event_t ev;
+    uint8_t make = sc & 0x7F;
+    ev.flags = (sc & 0x80) ? INPUT_RELEASE : 0;
+    if (input_prefix) {
+        input_prefix = 0;
+        ev.flags |= INPUT_EXTENDED;
+        if (make == 0x2A || make == 0x36) {
+            return; /* fake shifts around PrtSc and the navigation block */
+        }
+    }
+    ev.code = (ev.flags & INPUT_EXTENDED) ? (uint16_t)KEY_EXT(make) : make;
+
+    uint8_t mod = 0;
+    switch (ev.code) {
+    case 0x2A:
+    case 0x36:
+        mod = INPUT_MOD_SHIFT;
+        break;
+    case 0x1D:
+    case KEY_EXT(0x1D):
+        mod = INPUT_MOD_CTRL;
+        break;
+    case 0x38:
+    case KEY_EXT(0x38):
+        mod = INPUT_MOD_ALT;
+        break;
+    case 0x3A:
+        if ((ev.flags & INPUT_RELEASE) == 0) {
+            input_mods ^= INPUT_MOD_CAPS;
+        }
+        break;
+    default:
+        break;
+    }
+    if (mod != 0) {
+        input_mods = (ev.flags & INPUT_RELEASE) ? (uint8_t)(input_mods & ~mod) : (uint8_t)(input_mods | mod);
+    }
+
+    ev.ascii = 0;
+    if (ev.code == KEY_EXT(0x1C)) {
+        ev.ascii = '\n'; /* keypad Enter */
+    } else if (ev.code == KEY_EXT(0x35)) {
+        ev.ascii = '/';
+    } else if ((ev.flags & INPUT_EXTENDED) == 0) {
+        ev.ascii = scancode_to_ascii(make, input_mods & INPUT_MOD_SHIFT);
+        if ((input_mods & INPUT_MOD_CAPS) && ((ev.ascii >= 'a' && ev.ascii <= 'z') || (ev.ascii >= 'A' && ev.ascii <= 'Z'))) {
+            ev.ascii ^= 0x20;
+        }
+    }
+    ev.mods = input_mods;
+    ev.tsc = rdtsc();
+    input_push(&ev);
+    input_wake();
+}
+
 static int pick_next_task(void) {
     if (task_count == 0) {
         return -1;
@@ -778,12 +3219,21 @@ static int pick_next_task(void) {
     return -1;
 }
 
+/*
+ * Runs from schedule() and from the timer softirq, both with interrupts on,
+ * so the scan is done with them off: no IRQ-time waker or state change can
+ * land between a task's state check and the store.
+ */
 static void scheduler_wake_sleepers(void) {
+    uint64_t flags = irq_save();
     for (int i = 0; i < task_count; ++i) {
         if (tasks[i].state == TASK_SLEEPING && ticks >= tasks[i].wake_tick) {
             tasks[i].state = TASK_RUNNABLE;
+        } else if (tasks[i].state == TASK_BLOCKED && tasks[i].wake_tick != 0 && ticks >= tasks[i].wake_tick) {
+            tasks[i].state = TASK_RUNNABLE;
         }
     }
+    irq_restore(flags);
 }
 
 static void schedule(void) {
@@ -838,6 +3288,7 @@ static int create_task(void (*entry)(void), const char *name) {
     tasks[idx].wake_tick = 0;
     tasks[idx].name = name;
     tasks[idx].entry = entry;
+    kmemzero(tasks[idx].fds, sizeof(tasks[idx].fds));
     return idx;
 }
 
@@ -864,13 +3315,19 @@ static void task_exec_current(void (*entry)(void), const char *name) {
     __asm__ volatile("mov %0, %%rsp; ret" : : "r"(t->rsp));
 }
 
+static void vfs_dup_all(const uint8_t *from, uint8_t *to);
+
 static int task_fork_simple(void) {
     if (current_task < 0 || current_task >= task_count) {
         return -1;
     }
     task_t *parent = &tasks[current_task];
     int child = create_task(parent->entry, parent->name);
-    return (child < 0) ? -1 : tasks[child].pid;
+    if (child < 0) {
+        return -1;
+    }
+    vfs_dup_all(parent->fds, tasks[child].fds);
+    return tasks[child].pid;
 }
 
 static int current_pid(void) {
@@ -898,291 +3355,1342 @@ static void task_sleep_ticks(uint64_t sleep_ticks) {
     schedule();
 }
 
-static long ksys_write(const char *buf, size_t len) {
-    write_text(buf, len);
-    return (long)len;
+/*
+ * Blocks the current task on wq. The caller re-checks its condition with
+ * interrupts disabled before calling, so a wakeup from IRQ context between
+ * the check and the switch is never lost. Returns with interrupts enabled;
+ * timeout_ticks == 0 waits forever.
+ */
+static void wait_queue_sleep(wait_queue_t *wq, uint64_t timeout_ticks) {
+    if (current_task < 0 || current_task >= task_count) {
+        cpu_sti();
+        return;
+    }
+    wq->waiters |= 1u << current_task;
+    tasks[current_task].wake_tick = timeout_ticks ? ticks + timeout_ticks : 0;
+    tasks[current_task].state = TASK_BLOCKED;
+    cpu_sti();
+    schedule();
+    cpu_cli();
+    wq->waiters &= ~(1u << current_task);
+    cpu_sti();
 }
 
-static long ksys_getpid(void) {
-    return (long)current_pid();
+/* Safe from any context; softirqs call it with interrupts on. */
+static void wait_queue_wake_all(wait_queue_t *wq) {
+    uint64_t flags = irq_save();
+    uint32_t w = wq->waiters;
+    wq->waiters = 0;
+    for (int i = 0; w != 0 && i < task_count; ++i, w >>= 1) {
+        if ((w & 1) && tasks[i].state == TASK_BLOCKED) {
+            tasks[i].state = TASK_RUNNABLE;
+        }
+    }
+    irq_restore(flags);
 }
 
-static long ksys_sleep(uint64_t ms) {
-    uint64_t sleep_ticks = (ms * PIT_HZ + 999) / 1000;
-    if (sleep_ticks == 0) {
-        sleep_ticks = 1;
+/*
+ * VFS core. Paths pick the mount with the longest matching prefix; the
+ * rest goes through the dentry cache and, on a miss, the filesystem's
+ * lookup. Tasks switch cooperatively, so the tables need no lock beyond
+ * what each filesystem takes inside its own ops.
+ */
+static uint32_t vfs_hash(uint32_t mount, const char *name, uint32_t len) {
+    uint32_t h = 2166136261u ^ mount;
+    for (uint32_t i = 0; i < len; ++i) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
     }
-    task_sleep_ticks(sleep_ticks);
-    return 0;
+    return h;
 }
 
-static long ksys_exit(void) {
-    task_exit_now();
-    return 0;
+static int vfs_find_mount(const char *path, const char **rest) {
+    int best = -1;
+    uint32_t best_len = 0;
+    for (uint32_t i = 0; i < vfs_mount_count; ++i) {
+        const vfs_mount_t *m = &vfs_mounts[i];
+        uint32_t n = 0;
+        while (n < m->len && path[n] == m->path[n]) {
+            n++;
+        }
+        if (n == m->len && (m->len == 1 || path[n] == '\0' || path[n] == '/') && (best < 0 || m->len > best_len)) {
+            best = (int)i;
+            best_len = m->len;
+        }
+    }
+    if (best >= 0) {
+        *rest = path + best_len;
+        while (**rest == '/') {
+            (*rest)++;
+        }
+    }
+    return best;
 }
 
-static long userspace_write(const char *s) {
-    size_t len = 0;
-    while (s[len]) {
+/* Relative paths are taken from "/"; there is no working directory. */
+static int vfs_lookup(const char *path, int create, uint32_t *mount, uint64_t *key) {
+    const char *rest = path;
+    int m = vfs_find_mount(path, &rest);
+    if (m < 0) {
+        return 0;
+    }
+    uint32_t len = 0;
+    while (rest[len] != '\0') {
         len++;
     }
-    return ksys_write(s, len);
+    uint32_t h = vfs_hash((uint32_t)m, rest, len);
+    vfs_dentry_t *de = &vfs_dcache[h % VFS_DCACHE];
+    if (de->len == len && de->hash == h && de->mount == m) {
+        uint32_t i = 0;
+        while (i < len && de->name[i] == rest[i]) {
+            i++;
+        }
+        if (i == len) {
+            vfs_dcache_hits++;
+            *mount = (uint32_t)m;
+            *key = de->key;
+            return 1;
+        }
+    }
+    vfs_dcache_misses++;
+    if (len == 0 || !vfs_mounts[m].ops->lookup(rest, create, key)) {
+        return 0;
+    }
+    *mount = (uint32_t)m;
+    if (len < VFS_NAME_MAX) {
+        de = &vfs_dcache[h % VFS_DCACHE];
+        de->hash = h;
+        de->mount = (uint8_t)m;
+        de->len = (uint8_t)len;
+        kmemcpy(de->name, rest, len);
+        de->key = *key;
+    }
+    return 1;
 }
 
-static long userspace_getpid(void) {
-    return ksys_getpid();
+
+static uint8_t *mm_page_alloc(void) {
+    uint8_t *p = mm_free_pages;
+    if (p != NULL) {
+        mm_free_pages = *(uint8_t **)p;
+        return p;
+    }
+    return (uint8_t *)page_alloc(1);
 }
 
-static void userspace_sleep(uint64_t ms) {
-    (void)ksys_sleep(ms);
+static void mm_page_free(uint8_t *p) {
+    *(uint8_t **)p = mm_free_pages;
+    mm_free_pages = p;
 }
 
-static void userspace_exit(void) {
-    (void)ksys_exit();
+static pcache_page_t **pcache_bucket(const vfs_inode_t *ip, uint32_t index) {
+    return &pcache_hash[(uint32_t)(((uintptr_t)ip >> 4) * 31u + index) % PCACHE_HASH];
 }
 
-static void shell_print_prompt(void) {
-    userspace_write("\n$ ");
+static pcache_page_t *pcache_find(const vfs_inode_t *ip, uint32_t index) {
+    pcache_page_t *pg = *pcache_bucket(ip, index);
+    while (pg != NULL && (pg->ip != ip || pg->index != index)) {
+        pg = pg->next;
+    }
+    return pg;
 }
 
-static int str_equal(const char *a, const char *b) {
-    while (*a && *b) {
-        if (*a != *b) {
-            return 0;
-        }
-        a++;
-        b++;
+static void pcache_unhash(pcache_page_t *pg) {
+    pcache_page_t **pp = pcache_bucket(pg->ip, pg->index);
+    while (*pp != pg) {
+        pp = &(*pp)->next;
     }
-    return *a == 0 && *b == 0;
+    *pp = pg->next;
+    pg->ip = NULL;
 }
 
-static int str_starts_with(const char *s, const char *prefix) {
-    while (*prefix) {
-        if (*s++ != *prefix++) {
-            return 0;
+/*
+ * Page index of ip, read through the filesystem on a miss into the least
+ * recently used unmapped page. The header is pinned while the read
+ * sleeps; if another task cached the page meanwhile, its copy wins.
+ */
+static pcache_page_t *pcache_get(const vfs_inode_t *ip, uint32_t index) {
+    pcache_page_t *pg = pcache_find(ip, index);
+    if (pg != NULL) {
+        pcache_hits++;
+        pg->stamp = ++vfs_clock;
+        return pg;
+    }
+    pcache_misses++;
+    for (uint32_t i = 0; i < PCACHE_PAGES; ++i) {
+        pcache_page_t *c = &pcache_pages[i];
+        if (c->ip == NULL && c->maps == 0) {
+            pg = c;
+            break;
+        }
+        if (c->maps == 0 && (pg == NULL || c->stamp < pg->stamp)) {
+            pg = c;
         }
     }
-    return 1;
+    if (pg == NULL) {
+        return NULL;
+    }
+    if (pg->ip != NULL) {
+        pcache_unhash(pg);
+    }
+    if (pg->data == NULL && (pg->data = mm_page_alloc()) == NULL) {
+        return NULL;
+    }
+    uint32_t got = 0;
+    pg->maps = 1;
+    int ok = vfs_mounts[ip->mount].ops->read(ip, index * PAGE_SIZE, pg->data, PAGE_SIZE, &got);
+    pg->maps = 0;
+    pcache_page_t *raced = pcache_find(ip, index);
+    if (!ok || raced != NULL) {
+        return raced;
+    }
+    kmemzero(pg->data + got, PAGE_SIZE - got);
+    pg->ip = ip;
+    pg->index = index;
+    pg->stamp = ++vfs_clock;
+    pcache_page_t **head = pcache_bucket(ip, index);
+    pg->next = *head;
+    *head = pg;
+    return pg;
 }
 
-static void shell_cmd_help(void) {
-    userspace_write("commands: help ls cat echo clear pid sleep lsdisk catdisk fork exec userdemo userpreempt\n");
+/* Keeps cached pages (and so every mapping of them) in step with a write through an fd. */
+static void pcache_write(const vfs_inode_t *ip, uint32_t offset, const uint8_t *src, uint32_t len) {
+    while (len > 0) {
+        uint32_t in_page = offset % PAGE_SIZE;
+        uint32_t chunk = (len < PAGE_SIZE - in_page) ? len : PAGE_SIZE - in_page;
+        pcache_page_t *pg = pcache_find(ip, offset / PAGE_SIZE);
+        if (pg != NULL) {
+            kmemcpy(pg->data + in_page, src, chunk);
+        }
+        offset += chunk;
+        src += chunk;
+        len -= chunk;
+    }
 }
 
-static void shell_cmd_ls(void) {
-    for (size_t i = 0; i < sizeof(initrd_files) / sizeof(initrd_files[0]); ++i) {
-        userspace_write(initrd_files[i].name);
-        userspace_write("\n");
+/* Drops ip's pages at or past size; mapped ones stay, zero-filled like a hole. */
+static void pcache_truncate(const vfs_inode_t *ip, uint32_t size) {
+    for (uint32_t i = 0; i < PCACHE_PAGES; ++i) {
+        pcache_page_t *pg = &pcache_pages[i];
+        uint64_t start = (uint64_t)pg->index * PAGE_SIZE;
+        if (pg->ip != ip || start + PAGE_SIZE <= size) {
+            continue;
+        }
+        if (start >= size && pg->maps == 0) {
+            pcache_unhash(pg);
+        } else {
+            uint32_t keep = (start < size) ? (uint32_t)(size - start) : 0;
+            kmemzero(pg->data + keep, PAGE_SIZE - keep);
+        }
     }
 }
 
-static void shell_cmd_cat(const char *name) {
-    for (size_t i = 0; i < sizeof(initrd_files) / sizeof(initrd_files[0]); ++i) {
-        if (str_equal(name, initrd_files[i].name)) {
-            userspace_write(initrd_files[i].data);
-            return;
+/* ip == NULL drops every unmapped page, for changes made behind the VFS's back. */
+static void pcache_drop(const vfs_inode_t *ip) {
+    for (uint32_t i = 0; i < PCACHE_PAGES; ++i) {
+        pcache_page_t *pg = &pcache_pages[i];
+        if (pg->ip != NULL && pg->maps == 0 && (ip == NULL || pg->ip == ip)) {
+            pcache_unhash(pg);
         }
     }
-    userspace_write("cat: not found\n");
 }
 
-static void shell_exec(char *line);
-static void user_demo(void);
-static void user_task_a(void);
-static void user_task_b(void);
-static void user_task_c(void);
-static void user_task_d(void);
+/* Called after a file changes outside the VFS, so no dentry or cached page keeps old contents. */
+static void vfs_invalidate(void) {
+    kmemzero(vfs_dcache, sizeof(vfs_dcache));
+    pcache_drop(NULL);
+}
 
-static char keyboard_read_blocking(void) {
-    for (;;) {
-        cpu_cli();
-        char c = kbd_ring_pop();
-        cpu_sti();
-        if (c != 0) {
-            return c;
+/* Cached inode for (mount, key); only inodes with no open files or mappings are recycled (LRU). */
+static vfs_inode_t *vfs_iget(uint32_t mount, uint64_t key) {
+    vfs_inode_t *victim = NULL;
+    for (uint32_t i = 0; i < VFS_INODES; ++i) {
+        vfs_inode_t *ip = &vfs_inodes[i];
+        if (ip->used && ip->mount == mount && ip->key == key) {
+            ip->stamp = ++vfs_clock;
+            return ip;
         }
-        userspace_sleep(10);
+        if (ip->refs == 0 && (victim == NULL || !ip->used || (victim->used && ip->stamp < victim->stamp))) {
+            victim = ip;
+        }
+    }
+    if (victim != NULL) {
+        if (victim->used) {
+            pcache_drop(victim);
+        }
+        victim->used = 1;
+        victim->mount = (uint8_t)mount;
+        victim->key = key;
+        victim->stamp = ++vfs_clock;
     }
+    return victim;
 }
 
-static void task_shell(void) {
-    char line[128];
-    userspace_write("\n[bcore shell] type 'help'\n");
-    shell_print_prompt();
+static const vfs_ops_t *vfs_ops(const vfs_inode_t *ip) {
+    return vfs_mounts[ip->mount].ops;
+}
 
-    for (;;) {
-        size_t n = 0;
-        for (;;) {
-            char c = keyboard_read_blocking();
-            if (c == '\r') {
-                c = '\n';
-            }
-            if (c == '\n') {
-                userspace_write("\n");
-                break;
-            }
-            if (c == '\b') {
-                if (n > 0) {
-                    n--;
-                    userspace_write("\b \b");
-                }
-                continue;
-            }
-            if (n + 1 < sizeof(line)) {
-                line[n++] = c;
-                put_char(c);
-            }
-        }
-        line[n] = 0;
-        shell_exec(line);
-        shell_print_prompt();
+/* The caller's fd table: the running ring3 task's, else the kernel task's. */
+static uint8_t *fd_table(void) {
+    if (ring3_enabled && current_user >= 0) {
+        return user_tasks[current_user].fds;
+    }
+    if (current_task >= 0 && current_task < task_count) {
+        return tasks[current_task].fds;
     }
+    return NULL;
 }
 
-static void task_a(void) {
-    for (int i = 0; i < 20; ++i) {
-        userspace_write("A");
-        userspace_sleep(50);
+static vfs_file_t *fd_file(int fd) {
+    const uint8_t *fds = fd_table();
+    if (fds == NULL || fd < 3 || fd >= TASK_FDS || fds[fd] == 0) {
+        return NULL;
     }
-    userspace_write(" [A exit]\n");
-    userspace_exit();
+    return &vfs_files[fds[fd] - 1];
 }
 
-static void task_b(void) {
-    for (int i = 0; i < 20; ++i) {
-        userspace_write("B");
-        userspace_sleep(70);
+static void vfs_file_put(uint8_t slot) {
+    vfs_file_t *f = &vfs_files[slot - 1];
+    if (--f->refs == 0) {
+        f->ip->refs--;
+        f->ip = NULL;
     }
-    userspace_write(" [B exit]\n");
-    userspace_exit();
 }
 
-static int create_user_task(int slot, void (*entry)(void)) {
-    if (slot < 0 || slot >= MAX_USER_TASKS) {
-        return -1;
+static void vfs_close_all(uint8_t *fds) {
+    for (int fd = 3; fds != NULL && fd < TASK_FDS; ++fd) {
+        if (fds[fd] != 0) {
+            vfs_file_put(fds[fd]);
+            fds[fd] = 0;
+        }
     }
-    user_tasks[slot].rip = (uint64_t)(uintptr_t)entry;
-    user_tasks[slot].rsp = (uint64_t)(uintptr_t)&user_task_stacks[slot][USER_STACK_SIZE];
-    user_tasks[slot].rflags = 0x202;
-    user_tasks[slot].active = 1;
-    user_tasks[slot].pid = (uint8_t)(slot + 1);
-    return user_tasks[slot].pid;
 }
 
-static int pick_next_user(int current) {
-    int next = current;
-    for (int i = 0; i < MAX_USER_TASKS; ++i) {
-        next = (next + 1) % MAX_USER_TASKS;
-        if (user_tasks[next].active) {
-            return next;
+/* fork: the child shares each open file, offset included. */
+static void vfs_dup_all(const uint8_t *from, uint8_t *to) {
+    for (int fd = 3; from != NULL && fd < TASK_FDS; ++fd) {
+        to[fd] = from[fd];
+        if (to[fd] != 0) {
+            vfs_files[to[fd] - 1].refs++;
         }
     }
-    return -1;
 }
 
-static void ring3_preempt(irq_frame_t *frame) {
-    if (!ring3_enabled || current_user < 0) {
-        return;
+static int mm_user_ok(uint64_t va, uint64_t len, int write);
+static int mm_user_pin(uint64_t va, uint64_t len, int write);
+
+/* Copies a NUL-terminated user string; fails if it does not fit in size bytes. */
+static int user_copy_str(char *dst, const char *src, uint32_t size) {
+    for (uint32_t i = 0; i < size; ++i) {
+        uint64_t va = (uint64_t)(uintptr_t)&src[i];
+        if ((i == 0 || (va & (PAGE_SIZE - 1)) == 0) && !mm_user_ok(va, 1, 0)) {
+            return 0;
+        }
+        dst[i] = src[i];
+        if (dst[i] == '\0') {
+            return 1;
+        }
     }
-    if ((frame->cs & 3) != 3) {
-        return;
+    return 0;
+}
+
+/*
+ * Lookup and truncate may sleep on the disk. The fd and file slots are
+ * claimed before truncating, so running out of either cannot leave a
+ * file emptied behind a failed open.
+ */
+static long ksys_open(const char *user_path, int flags) {
+    uint8_t *fds = fd_table();
+    char path[VFS_PATH_MAX];
+    uint32_t mount = 0;
+    uint64_t key = 0;
+    if (fds == NULL || !user_copy_str(path, user_path, sizeof(path)) ||
+        !vfs_lookup(path, (flags & O_CREAT) != 0, &mount, &key)) {
+        return -1;
     }
-    if (!user_need_resched && (ticks - last_preempt_tick < 1)) {
-        return;
+    vfs_inode_t *ip = vfs_iget(mount, key);
+    const vfs_ops_t *ops = vfs_mounts[mount].ops;
+    if (ip == NULL || ((flags & O_ACCMODE) != O_RDONLY && ops->write == NULL)) {
+        return -1;
     }
-    last_preempt_tick = ticks;
-    user_need_resched = 0;
+    int fd = 3;
+    int slot = 0;
+    while (fd < TASK_FDS && fds[fd] != 0) {
+        fd++;
+    }
+    while (slot < VFS_FILES && vfs_files[slot].refs != 0) {
+        slot++;
+    }
+    if (fd == TASK_FDS || slot == VFS_FILES) {
+        return -1;
+    }
+    ip->refs++;
+    vfs_files[slot].refs = 1;
+    vfs_files[slot].flags = (uint16_t)flags;
+    vfs_files[slot].offset = 0;
+    vfs_files[slot].ip = ip;
+    fds[fd] = (uint8_t)(slot + 1);
+    if ((flags & O_TRUNC) && (flags & O_ACCMODE) != O_RDONLY) {
+        if (!ops->truncate(ip, 0)) {
+            fds[fd] = 0;
+            vfs_file_put((uint8_t)(slot + 1));
+            return -1;
+        }
+        pcache_truncate(ip, 0);
+    }
+    return fd;
+}
 
-    user_task_t *cur = &user_tasks[current_user];
-    cur->rip = frame->rip;
-    cur->rsp = frame->rsp;
-    cur->rflags = frame->rflags;
+static long ksys_read(int fd, uint8_t *buf, size_t len) {
+    vfs_file_t *f = fd_file(fd);
+    uint32_t got = 0;
+    if (f == NULL || (f->flags & O_ACCMODE) == O_WRONLY) {
+        return -1;
+    }
+    if (len > 0x7FFFFFFFu) {
+        len = 0x7FFFFFFFu;
+    }
+    if (!mm_user_pin((uint64_t)(uintptr_t)buf, len, 1)) {
+        return -1;
+    }
+    if (!vfs_ops(f->ip)->read(f->ip, f->offset, buf, (uint32_t)len, &got)) {
+        return -1;
+    }
+    f->offset += got;
+    return (long)got;
+}
 
-    int next = pick_next_user(current_user);
-    if (next < 0 || next == current_user) {
-        return;
+/* fds 1 and 2 are the console; anything else must be open for writing. */
+static long ksys_fd_write(int fd, const uint8_t *buf, size_t len) {
+    if (fd == 1 || fd == 2) {
+        if (!mm_user_ok((uint64_t)(uintptr_t)buf, len, 0)) {
+            return -1;
+        }
+        write_text((const char *)buf, len);
+        return (long)len;
     }
-    current_user = next;
-    frame->rip = user_tasks[next].rip;
-    frame->rsp = user_tasks[next].rsp;
-    frame->rflags = user_tasks[next].rflags;
-    frame->cs = 0x23;
-    frame->ss = 0x1B;
+    vfs_file_t *f = fd_file(fd);
+    if (f == NULL || (f->flags & O_ACCMODE) == O_RDONLY || len > 0x7FFFFFFFu || !mm_user_pin((uint64_t)(uintptr_t)buf, len, 0)) {
+        return -1;
+    }
+    const vfs_ops_t *ops = vfs_ops(f->ip);
+    if (f->flags & O_APPEND) {
+        f->offset = ops->size(f->ip);
+    }
+    if (!ops->write(f->ip, f->offset, buf, (uint32_t)len)) {
+        return -1;
+    }
+    pcache_write(f->ip, f->offset, buf, (uint32_t)len);
+    f->offset += (uint32_t)len;
+    return (long)len;
 }
 
-void irq_timer_handler(regs_t *regs, irq_frame_t *frame) {
-    (void)regs;
-    ticks++;
-    scheduler_wake_sleepers();
-    ring3_preempt(frame);
-    if (apic_enabled) {
-        lapic_eoi();
-    } else {
-        outb(PIC1_COMMAND, PIC_EOI);
+static long ksys_lseek(int fd, int64_t offset, int whence) {
+    vfs_file_t *f = fd_file(fd);
+    int64_t base = 0;
+    if (f == NULL) {
+        return -1;
+    }
+    if (whence == SEEK_CUR) {
+        base = f->offset;
+    } else if (whence == SEEK_END) {
+        base = vfs_ops(f->ip)->size(f->ip);
+    } else if (whence != SEEK_SET) {
+        return -1;
+    }
+    if (base + offset < 0 || base + offset > 0xFFFFFFFFll) {
+        return -1;
     }
+    f->offset = (uint32_t)(base + offset);
+    return (long)f->offset;
 }
 
-void irq_keyboard_handler(regs_t *regs) {
-    (void)regs;
-    uint8_t sc = inb(KBD_DATA);
+static long ksys_close(int fd) {
+    uint8_t *fds = fd_table();
+    if (fd_file(fd) == NULL) {
+        return -1;
+    }
+    vfs_file_put(fds[fd]);
+    fds[fd] = 0;
+    return 0;
+}
 
-    if (sc == 0x2A || sc == 0x36) {
-        kbd_shift = 1;
-    } else if (sc == 0xAA || sc == 0xB6) {
-        kbd_shift = 0;
-    } else if ((sc & 0x80U) == 0) {
-        char c = scancode_to_ascii(sc, kbd_shift);
-        if (c) {
-            kbd_ring_push(c);
-        }
+/*
+ * File mappings. Every task shares one page table, so each mapping gets
+ * its own range of the MMAP_BASE window and owners only matter for
+ * munmap and exit. PTEs start empty and faults fill them: page cache
+ * pages read-only, or private copies (PTE_ANON) on a write to a
+ * MAP_PRIVATE mapping.
+ */
+static uint32_t mm_owner(void) {
+    if (ring3_enabled && current_user >= 0) {
+        return 0x100u + (uint32_t)current_user;
     }
+    return (uint32_t)(current_task + 1);
+}
 
-    outb(PIC1_COMMAND, PIC_EOI);
+static inline void mm_invlpg(uint64_t va) {
+    __asm__ volatile("invlpg (%0)" : : "r"(va) : "memory");
 }
 
-void exception_divide_handler(regs_t *regs) {
-    (void)regs;
-    write_cstr("\n\n=== EXCEPTION: DIVIDE BY ZERO (#DE) ===\n");
-    dump_regs(regs);
-    dump_backtrace(regs->rbp);
-    write_cstr("Kernel halted for safety.\n");
-    cpu_cli();
-    for (;;) {
-        cpu_halt();
+/* 4 KiB PTE for va; create builds missing user-accessible tables on the way down. */
+static uint64_t *mm_pte(uint64_t va, int create) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    uint64_t *table = (uint64_t *)(uintptr_t)(cr3 & PTE_ADDR_MASK);
+    for (int shift = 39; shift > 12; shift -= 9) {
+        uint64_t *e = &table[(va >> shift) & 0x1FF];
+        if ((*e & PTE_PRESENT) == 0) {
+            uint64_t *t = create ? (uint64_t *)mm_page_alloc() : NULL;
+            if (t == NULL) {
+                return NULL;
+            }
+            kmemzero(t, PAGE_SIZE);
+            *e = (uint64_t)(uintptr_t)t | PTE_PRESENT | PTE_WRITE;
+        }
+        if (create) {
+            *e |= PTE_USER;
+        }
+        table = (uint64_t *)(uintptr_t)(*e & PTE_ADDR_MASK);
     }
+    return &table[(va >> 12) & 0x1FF];
 }
 
-void exception_page_fault_handler(regs_t *regs, uint64_t error_code) {
-    uint64_t cr2;
-    (void)regs;
-    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+static mm_vma_t *mm_find(uint64_t va) {
+    for (uint32_t i = 0; i < MM_VMAS; ++i) {
+        mm_vma_t *v = &mm_vmas[i];
+        if (v->used && va >= v->start && va < v->start + (uint64_t)v->pages * PAGE_SIZE) {
+            return v;
+        }
+    }
+    return NULL;
+}
 
-    write_cstr("\n\n=== EXCEPTION: PAGE FAULT (#PF) ===\n");
-    write_cstr("fault_addr=");
-    write_u64_hex(cr2);
-    write_cstr(" error_code=");
-    write_u64_hex(error_code);
-    write_cstr("\nKernel halted for safety.\n");
-    dump_regs(regs);
-    dump_backtrace(regs->rbp);
-    cpu_cli();
-    for (;;) {
-        cpu_halt();
+/*
+ * Checks a syscall buffer against the mappings before the kernel touches
+ * it: with CR0.WP a kernel store to a read-only user page faults like a
+ * user one would, and a hole in the mmap window cannot be filled at all.
+ * Buffers outside the window are the identity-mapped demo memory.
+ */
+static int mm_user_ok(uint64_t va, uint64_t len, int write) {
+    uint64_t end = va + len;
+    if (end < va) {
+        return 0;
+    }
+    if (va < MMAP_BASE) {
+        va = MMAP_BASE;
+    }
+    if (end > MMAP_BASE + MMAP_SIZE) {
+        end = MMAP_BASE + MMAP_SIZE;
+    }
+    while (va < end) {
+        const mm_vma_t *v = mm_find(va);
+        if (v == NULL || (write && (v->prot & PROT_WRITE) == 0)) {
+            return 0;
+        }
+        va = v->start + (uint64_t)v->pages * PAGE_SIZE;
     }
+    return 1;
 }
 
-void syscall_dispatch(regs_t *regs) {
-    switch (regs->rax) {
-    case SYS_WRITE:
-        regs->rax = (uint64_t)ksys_write((const char *)(uintptr_t)regs->rdi, (size_t)regs->rsi);
-        break;
-    case SYS_EXIT:
-        if (current_task >= 0 && current_task < task_count) {
-            tasks[current_task].state = TASK_EXITED;
+static uint64_t mm_find_gap(uint32_t pages) {
+    uint64_t start = MMAP_BASE;
+    uint64_t len = (uint64_t)pages * PAGE_SIZE;
+    for (uint32_t i = 0; i < MM_VMAS; ++i) {
+        const mm_vma_t *v = &mm_vmas[i];
+        uint64_t end = v->start + (uint64_t)v->pages * PAGE_SIZE;
+        if (v->used && start < end && v->start < start + len) {
+            start = end;
+            i = (uint32_t)-1; /* rescan from the first mapping */
         }
-        regs->rax = 0;
-        break;
-    case SYS_GETPID:
+    }
+    return (start + len <= MMAP_BASE + MMAP_SIZE) ? start : 0;
+}
+
+/* Page-fault hook; returns 0 when va is not in a mapping or the access is not allowed. */
+static int mm_fault(uint64_t va, uint64_t error_code) {
+    mm_vma_t *v = mm_find(va);
+    int write = (error_code & 2) != 0;
+    if (v == NULL || (write && (v->prot & PROT_WRITE) == 0)) {
+        return 0;
+    }
+    va &= ~(uint64_t)(PAGE_SIZE - 1);
+    uint32_t index = v->pgoff + (uint32_t)((va - v->start) / PAGE_SIZE);
+    uint64_t *pte = mm_pte(va, 1);
+    if (v->ip == NULL) {
+        if (pte == NULL) {
+            return 0;
+        }
+        mm_faults++;
+        *pte = (v->phys + (uint64_t)index * PAGE_SIZE) | PTE_PRESENT | PTE_WRITE | PTE_USER | cache_bits(v->cache, 0);
+        mm_invlpg(va);
+        return 1;
+    }
+    pcache_page_t *pg = (pte != NULL) ? pcache_get(v->ip, index) : NULL;
+    if (pg == NULL) {
+        return 0;
+    }
+    mm_faults++;
+    if ((*pte & PTE_PRESENT) && (!write || (*pte & PTE_WRITE))) {
+        return 1; /* filled by another task while pcache_get slept */
+    }
+    if (write) {
+        uint8_t *copy = mm_page_alloc();
+        if (copy == NULL) {
+            return 0;
+        }
+        kmemcpy(copy, pg->data, PAGE_SIZE);
+        if (*pte & PTE_PRESENT) {
+            pg->maps--;
+        }
+        *pte = (uint64_t)(uintptr_t)copy | PTE_PRESENT | PTE_WRITE | PTE_USER | PTE_ANON;
+        mm_cow_copies++;
+    } else {
+        pg->maps++;
+        *pte = (uint64_t)(uintptr_t)pg->data | PTE_PRESENT | PTE_USER;
+    }
+    mm_invlpg(va);
+    return 1;
+}
+
+/*
+ * Faults a syscall buffer in before a filesystem op runs with fat_lock or
+ * a block request held: a fault in there would re-enter the fs through
+ * pcache_get. Mapped cache pages are never evicted and private copies stay
+ * put, so the buffer cannot fault again until the caller unmaps it.
+ */
+static int mm_user_pin(uint64_t va, uint64_t len, int write) {
+    if (!mm_user_ok(va, len, write)) {
+        return 0;
+    }
+    uint64_t end = va + len;
+    if (end > MMAP_BASE + MMAP_SIZE) {
+        end = MMAP_BASE + MMAP_SIZE;
+    }
+    va = (va < MMAP_BASE) ? MMAP_BASE : (va & ~(uint64_t)(PAGE_SIZE - 1));
+    for (; va < end; va += PAGE_SIZE) {
+        const uint64_t *pte = mm_pte(va, 0);
+        int present = pte != NULL && (*pte & PTE_PRESENT) && (!write || (*pte & PTE_WRITE));
+        if (!present && !mm_fault(va, write ? 2 : 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void mm_unmap(mm_vma_t *v) {
+    for (uint32_t i = 0; i < v->pages; ++i) {
+        uint64_t va = v->start + (uint64_t)i * PAGE_SIZE;
+        uint64_t *pte = mm_pte(va, 0);
+        if (pte == NULL || (*pte & PTE_PRESENT) == 0) {
+            continue;
+        }
+        if (*pte & PTE_ANON) {
+            mm_page_free((uint8_t *)(uintptr_t)(*pte & PTE_ADDR_MASK));
+        } else if (v->ip != NULL) {
+            pcache_page_t *pg = pcache_find(v->ip, v->pgoff + i);
+            if (pg != NULL) {
+                pg->maps--;
+            }
+        }
+        *pte = 0;
+        mm_invlpg(va);
+    }
+    if (v->ip != NULL) {
+        v->ip->refs--;
+    }
+    v->used = 0;
+}
+
+static void mm_unmap_all(uint32_t owner) {
+    for (uint32_t i = 0; i < MM_VMAS; ++i) {
+        if (mm_vmas[i].used && mm_vmas[i].owner == owner) {
+            mm_unmap(&mm_vmas[i]);
+        }
+    }
+}
+
+static mm_vma_t *mm_vma_alloc(uint64_t len, int prot, int flags) {
+    uint32_t pages = (uint32_t)((len + PAGE_SIZE - 1) / PAGE_SIZE);
+    uint64_t start = mm_find_gap(pages);
+    mm_vma_t *v = NULL;
+    for (uint32_t i = 0; i < MM_VMAS && v == NULL; ++i) {
+        if (!mm_vmas[i].used) {
+            v = &mm_vmas[i];
+        }
+    }
+    if (start == 0 || v == NULL) {
+        return NULL;
+    }
+    v->used = 1;
+    v->prot = (uint8_t)prot;
+    v->flags = (uint8_t)flags;
+    v->owner = mm_owner();
+    v->start = start;
+    v->pages = pages;
+    v->pgoff = 0;
+    v->ip = NULL;
+    v->phys = 0;
+    v->cache = CACHE_WB;
+    return v;
+}
+
+/* MAP_SHARED mappings are read-only; MAP_PRIVATE ones may add PROT_WRITE and copy on write. */
+static long ksys_mmap(int fd, uint64_t len, int prot, int flags, uint64_t offset) {
+    vfs_file_t *f = fd_file(fd);
+    int share = flags & (MAP_SHARED | MAP_PRIVATE);
+    if (f == NULL || (f->flags & O_ACCMODE) == O_WRONLY || len == 0 || len > MMAP_SIZE || offset % PAGE_SIZE != 0 ||
+        offset > 0xFFFFFFFFull || (share != MAP_SHARED && share != MAP_PRIVATE) ||
+        (share == MAP_SHARED && (prot & PROT_WRITE))) {
+        return -1;
+    }
+    mm_vma_t *v = mm_vma_alloc(len, prot, share);
+    if (v == NULL) {
+        return -1;
+    }
+    v->pgoff = (uint32_t)(offset / PAGE_SIZE);
+    v->ip = f->ip;
+    f->ip->refs++;
+    return (long)v->start;
+}
+
+/*
+ * Maps the console surface read-write into the caller's window: the shadow
+ * buffer when there is one (cached, SYS_FBFLUSH pushes it out), else the
+ * write-combining framebuffer itself.
+ */
+static long ksys_fbmap(fb_info_t *info) {
+    if (!fb.enabled || info == NULL || !mm_user_ok((uint64_t)(uintptr_t)info, sizeof(*info), 1)) {
+        return -1;
+    }
+    uint64_t row = (uint64_t)fb.pitch_pixels * sizeof(uint32_t);
+    uint32_t height = fb.height;
+    if (!fb.shadowed) {
+        /* Only whole pages of video memory: rows reaching into a partial last page are left out. */
+        uint64_t whole = (row * fb.height) & ~(uint64_t)(PAGE_SIZE - 1);
+        height = (uint32_t)(whole / row);
+    }
+    mm_vma_t *v = (height != 0) ? mm_vma_alloc(row * height, PROT_READ | PROT_WRITE, MAP_SHARED) : NULL;
+    if (v == NULL) {
+        return -1;
+    }
+    v->phys = (uint64_t)(uintptr_t)fb.draw;
+    v->cache = fb.shadowed ? CACHE_WB : CACHE_WC;
+    info->width = fb.width;
+    info->height = height;
+    info->pitch = fb.pitch_pixels;
+    info->format = fb.format;
+    return (long)v->start;
+}
+
+static long ksys_fbflush(uint32_t x, uint32_t y, uint32_t w, uint32_t h) {
+    gfx_surface_t screen = {fb.draw, fb.width, fb.height, fb.pitch_pixels};
+    if (!fb.enabled || !gfx_clip(&screen, x, y, &w, &h)) {
+        return -1;
+    }
+    fb_mark_dirty(x, y, w, h);
+    fb_flush();
+    return 0;
+}
+
+/* Whole mappings only: addr must be what mmap returned. */
+static long ksys_munmap(uint64_t addr) {
+    uint32_t owner = mm_owner();
+    for (uint32_t i = 0; i < MM_VMAS; ++i) {
+        if (mm_vmas[i].used && mm_vmas[i].owner == owner && mm_vmas[i].start == addr) {
+            mm_unmap(&mm_vmas[i]);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Kernel writes must fault on read-only user PTEs too, or they would scribble on cached pages. */
+static void mm_init(void) {
+    uint64_t cr0;
+    __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ volatile("mov %0, %%cr0" : : "r"(cr0 | (1ull << 16)) : "memory");
+}
+
+static long ksys_write(const char *buf, size_t len) {
+    write_text(buf, len);
+    return (long)len;
+}
+
+static long ksys_getpid(void) {
+    return (long)current_pid();
+}
+
+static long ksys_sleep(uint64_t ms) {
+    uint64_t sleep_ticks = (ms * PIT_HZ + 999) / 1000;
+    if (sleep_ticks == 0) {
+        sleep_ticks = 1;
+    }
+    task_sleep_ticks(sleep_ticks);
+    return 0;
+}
+
+static long ksys_exit(void) {
+    mm_unmap_all(mm_owner());
+    vfs_close_all(fd_table());
+    task_exit_now();
+    return 0;
+}
+
+static long userspace_write(const char *s) {
+    size_t len = 0;
+    while (s[len]) {
+        len++;
+    }
+    return ksys_write(s, len);
+}
+
+static long userspace_getpid(void) {
+    return ksys_getpid();
+}
+
+static void userspace_sleep(uint64_t ms) {
+    (void)ksys_sleep(ms);
+}
+
+static void userspace_exit(void) {
+    (void)ksys_exit();
+}
+
+static int userspace_open(const char *path, int flags) {
+    return (int)ksys_open(path, flags);
+}
+
+static long userspace_read(int fd, void *buf, size_t len) {
+    return ksys_read(fd, (uint8_t *)buf, len);
+}
+
+static long userspace_write_fd(int fd, const void *buf, size_t len) {
+    return ksys_fd_write(fd, (const uint8_t *)buf, len);
+}
+
+static void userspace_close(int fd) {
+    (void)ksys_close(fd);
+}
+
+static void shell_print_prompt(void) {
+    userspace_write("\n$ ");
+}
+
+static int str_equal(const char *a, const char *b) {
+    while (*a && *b) {
+        if (*a != *b) {
+            return 0;
+        }
+        a++;
+        b++;
+    }
+    return *a == 0 && *b == 0;
+}
+
+static int str_starts_with(const char *s, const char *prefix) {
+    while (*prefix) {
+        if (*s++ != *prefix++) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void shell_cmd_help(void) {
+    userspace_write("commands: help ls cat echo clear pid sleep lsdisk catdisk writedisk truncdisk rmdisk sync mounts logstat uartstat inputstat irqstat diskbench fbbench disklat bcache elevator fork exec userdemo usercat usermap userfb userpreempt\n");
+}
+
+static void shell_cmd_ls(void) {
+    for (uint32_t i = 0; i < initrd_count; ++i) {
+        write_text(initrd_entries[i].name, initrd_entries[i].name_len);
+        userspace_write(" ");
+        write_u64_dec(initrd_entries[i].size);
+        userspace_write("\n");
+    }
+}
+
+/* Streams any mounted file through one reusable buffer. */
+static void shell_cmd_cat(const char *path) {
+    static uint8_t buf[512];
+    int fd = userspace_open(path, O_RDONLY);
+    long n;
+    if (fd < 0) {
+        userspace_write("cat: not found\n");
+        return;
+    }
+    while ((n = userspace_read(fd, buf, sizeof(buf))) > 0) {
+        (void)userspace_write_fd(1, buf, (size_t)n);
+    }
+    userspace_close(fd);
+    if (n < 0) {
+        userspace_write("\ncat: read error\n");
+    }
+}
+
+static void shell_exec(char *line);
+static void user_demo(void);
+static void user_cat(void);
+static void user_map(void);
+static void user_fb(void);
+static char user_path[128]; /* usercat's argument, read from ring3 */
+static uint32_t user_sprite[USER_SPRITE_SIZE * USER_SPRITE_SIZE]; /* userfb's image, drawn in ring3 */
+static void user_task_a(void);
+static void user_task_b(void);
+static void user_task_c(void);
+static void user_task_d(void);
+
+/* Next typed character from the keyboard or COM1; sleeps on input_wait while there is none. */
+static char keyboard_read_blocking(void) {
+    for (;;) {
+        input_event_t ev;
+        while (input_pop(&ev)) {
+            if ((ev.flags & INPUT_RELEASE) == 0 && ev.ascii != 0) {
+                if (tsc_per_us != 0) {
+                    input_lat_last_us = (rdtsc() - ev.tsc) / tsc_per_us;
+                    if (input_lat_last_us > input_lat_max_us) {
+                        input_lat_max_us = input_lat_last_us;
+                    }
+                }
+                return ev.ascii;
+            }
+        }
+        cpu_cli();
+        char c = uart_rx_pop();
+        if (c != 0) {
+            cpu_sti();
+            return c;
+        }
+        if (__atomic_load_n(&input_head, __ATOMIC_ACQUIRE) == input_tail) {
+            wait_queue_sleep(&input_wait, 0);
+        } else {
+            cpu_sti();
+        }
+    }
+}
+
+static void task_shell(void) {
+    char line[128];
+    userspace_write("\n[bcore shell] type 'help'\n");
+    shell_print_prompt();
+
+    for (;;) {
+        size_t n = 0;
+        for (;;) {
+            char c = keyboard_read_blocking();
+            if (c == '\r') {
+                c = '\n';
+            }
+            if (c == '\n') {
+                userspace_write("\n");
+                break;
+            }
+            if (c == '\b') {
+                if (n > 0) {
+                    n--;
+                    userspace_write("\b \b");
+                }
+                continue;
+            }
+            if (n + 1 < sizeof(line)) {
+                line[n++] = c;
+                put_char(c);
+            }
+        }
+        line[n] = 0;
+        shell_exec(line);
+        shell_print_prompt();
+    }
+}
+
+static void task_a(void) {
+    for (int i = 0; i < 20; ++i) {
+        userspace_write("A");
+        userspace_sleep(50);
+    }
+    userspace_write(" [A exit]\n");
+    userspace_exit();
+}
+
+static void task_b(void) {
+    for (int i = 0; i < 20; ++i) {
+        userspace_write("B");
+        userspace_sleep(70);
+    }
+    userspace_write(" [B exit]\n");
+    userspace_exit();
+}
+
+static int create_user_task(int slot, void (*entry)(void)) {
+    if (slot < 0 || slot >= MAX_USER_TASKS) {
+        return -1;
+    }
+    mm_unmap_all(0x100u + (uint32_t)slot);
+    vfs_close_all(user_tasks[slot].fds);
+    user_tasks[slot].rip = (uint64_t)(uintptr_t)entry;
+    user_tasks[slot].rsp = (uint64_t)(uintptr_t)&user_task_stacks[slot][USER_STACK_SIZE];
+    user_tasks[slot].rflags = 0x202;
+    simd_reset(user_tasks[slot].simd);
+    user_tasks[slot].active = 1;
+    user_tasks[slot].pid = (uint8_t)(slot + 1);
+    return user_tasks[slot].pid;
+}
+
+static int pick_next_user(int current) {
+    int next = current;
+    for (int i = 0; i < MAX_USER_TASKS; ++i) {
+        next = (next + 1) % MAX_USER_TASKS;
+        if (user_tasks[next].active) {
+            return next;
+        }
+    }
+    return -1;
+}
+
+static void ring3_preempt(irq_frame_t *frame) {
+    if (!ring3_enabled || current_user < 0) {
+        return;
+    }
+    if ((frame->cs & 3) != 3) {
+        return;
+    }
+    if (!user_need_resched && (ticks - last_preempt_tick < 1)) {
+        return;
+    }
+    last_preempt_tick = ticks;
+    user_need_resched = 0;
+
+    user_task_t *cur = &user_tasks[current_user];
+    cur->rip = frame->rip;
+    cur->rsp = frame->rsp;
+    cur->rflags = frame->rflags;
+
+    int next = pick_next_user(current_user);
+    if (next < 0 || next == current_user) {
+        return;
+    }
+    simd_save(cur->simd);
+    simd_restore(user_tasks[next].simd);
+    current_user = next;
+    frame->rip = user_tasks[next].rip;
+    frame->rsp = user_tasks[next].rsp;
+    frame->rflags = user_tasks[next].rflags;
+    frame->cs = 0x23;
+    frame->ss = 0x1B;
+}
+
+/*
+ * Deferred work. A hard IRQ handler only acknowledges its device, grabs
+ * what it must before the device forgets it, raises a softirq or schedules
+ * a tasklet, and sends EOI. Softirqs then run on the way out of the
+ * outermost IRQ with interrupts enabled; anything that may sleep or runs
+ * long goes to a workqueue and its worker task instead.
+ */
+static void irq_time_add(irq_time_t *t, uint64_t cycles) {
+    t->count++;
+    t->cycles += cycles;
+    if (cycles > t->max_cycles) {
+        t->max_cycles = cycles;
+    }
+}
+
+static void raise_softirq(uint32_t nr) {
+    __atomic_or_fetch(&softirq_pending, 1u << nr, __ATOMIC_RELAXED);
+}
+
+/* Safe from any context; the tasklet runs once however often it was scheduled. */
+static void tasklet_schedule(tasklet_t *t) {
+    uint64_t flags = irq_save();
+    if (!t->scheduled) {
+        t->scheduled = 1;
+        t->next = NULL;
+        if (tasklet_tail != NULL) {
+            tasklet_tail->next = t;
+        } else {
+            tasklet_head = t;
+        }
+        tasklet_tail = t;
+        raise_softirq(SOFTIRQ_TASKLET);
+    }
+    irq_restore(flags);
+}
+
+static void tasklet_action(void) {
+    uint64_t flags = irq_save();
+    tasklet_t *list = tasklet_head;
+    tasklet_head = NULL;
+    tasklet_tail = NULL;
+    irq_restore(flags);
+    while (list != NULL) {
+        tasklet_t *t = list;
+        list = t->next;
+        t->scheduled = 0; /* rescheduling from func queues it again */
+        uint64_t t0 = rdtsc();
+        t->func();
+        irq_time_add(&t->time, rdtsc() - t0);
+    }
+}
+
+/* Safe from any context; returns 0 if w was still pending. */
+static int queue_work(workqueue_t *wq, work_t *w) {
+    uint64_t flags = irq_save();
+    if (w->pending) {
+        irq_restore(flags);
+        return 0;
+    }
+    w->pending = 1;
+    w->next = NULL;
+    if (wq->tail != NULL) {
+        wq->tail->next = w;
+    } else {
+        wq->head = w;
+    }
+    wq->tail = w;
+    wq->queued++;
+    wait_queue_wake_all(&wq->wait);
+    irq_restore(flags);
+    return 1;
+}
+
+static void worker_loop(workqueue_t *wq) {
+    for (;;) {
+        cpu_cli();
+        work_t *w = wq->head;
+        if (w == NULL) {
+            wait_queue_sleep(&wq->wait, 0);
+            continue;
+        }
+        wq->head = w->next;
+        if (wq->head == NULL) {
+            wq->tail = NULL;
+        }
+        w->pending = 0;
+        cpu_sti();
+        uint64_t t0 = rdtsc();
+        w->func();
+        irq_time_add(&w->time, rdtsc() - t0);
+    }
+}
+
+static void system_worker_task(void) {
+    worker_loop(&system_wq);
+}
+
+static void kbd_tasklet_func(void) {
+    uint32_t tail = kbd_raw_tail;
+    while (tail != __atomic_load_n(&kbd_raw_head, __ATOMIC_ACQUIRE)) {
+        input_scancode(kbd_raw[tail % KBD_RAW_RING]);
+        __atomic_store_n(&kbd_raw_tail, ++tail, __ATOMIC_RELEASE);
+    }
+}
+
+static tasklet_t kbd_tasklet = {NULL, kbd_tasklet_func, 0, {"kbd-decode", 0, 0, 0}};
+
+/* Pushes console output that no later put_char flushed, e.g. the prompt before a key wait. */
+static work_t fb_flush_work = {NULL, fb_flush, 0, {"fb-flush", 0, 0, 0}};
+
+static irq_time_t *const defer_times[] = {&kbd_tasklet.time, &fb_flush_work.time};
+
+static void timer_softirq(void) {
+    scheduler_wake_sleepers();
+    if (fb.shadowed && fb_dirty.x1 != 0 && ticks - fb.last_flush >= FB_FLUSH_TICKS) {
+        queue_work(&system_wq, &fb_flush_work);
+    }
+}
+
+static void (*const softirq_vec[SOFTIRQ_COUNT])(void) = {timer_softirq, tasklet_action};
+
+/*
+ * Called with interrupts off after EOI. Only the outermost IRQ exit runs
+ * softirqs, so an IRQ that lands while they run just raises more bits and
+ * returns; work that keeps arriving past SOFTIRQ_ROUNDS waits for the next
+ * interrupt (the timer bounds that to one tick).
+ */
+static void do_softirq(void) {
+    if (softirq_active) {
+        return;
+    }
+    softirq_active = 1;
+    for (int round = 0; round < SOFTIRQ_ROUNDS; ++round) {
+        uint32_t pending = __atomic_exchange_n(&softirq_pending, 0, __ATOMIC_RELAXED);
+        if (pending == 0) {
+            break;
+        }
+        cpu_sti();
+        for (uint32_t nr = 0; nr < SOFTIRQ_COUNT; ++nr) {
+            if (pending & (1u << nr)) {
+                uint64_t t0 = rdtsc();
+                softirq_vec[nr]();
+                irq_time_add(&softirq_time[nr], rdtsc() - t0);
+            }
+        }
+        cpu_cli();
+    }
+    if (softirq_pending != 0) {
+        softirq_deferred++;
+    }
+    softirq_active = 0;
+}
+
+static uint64_t irq_enter(void) {
+    irq_depth++;
+    return rdtsc();
+}
+
+/* Charges the hard handler's time to its vector before softirqs run. */
+static void irq_exit(uint8_t vector, uint64_t t0) {
+    irq_time_add(&hardirq_time[vector], rdtsc() - t0);
+    irq_depth--;
+    do_softirq();
+}
+
+/* ring3_preempt stays in hard IRQ context: it rewrites the frame iretq returns through. */
+void irq_timer_handler(regs_t *regs, irq_frame_t *frame) {
+    (void)regs;
+    uint64_t t0 = irq_enter();
+    ticks++;
+    ring3_preempt(frame);
+    raise_softirq(SOFTIRQ_TIMER);
+    if (apic_enabled) {
+        lapic_eoi();
+    } else {
+        outb(PIC1_COMMAND, PIC_EOI);
+    }
+    irq_exit(VECTOR_TIMER, t0);
+}
+
+void irq_keyboard_handler(regs_t *regs) {
+    (void)regs;
+    uint64_t t0 = irq_enter();
+    uint8_t sc = inb(KBD_DATA);
+    if (kbd_raw_head - __atomic_load_n(&kbd_raw_tail, __ATOMIC_ACQUIRE) < KBD_RAW_RING) {
+        kbd_raw[kbd_raw_head % KBD_RAW_RING] = sc;
+        __atomic_store_n(&kbd_raw_head, kbd_raw_head + 1, __ATOMIC_RELEASE);
+    } else {
+        kbd_raw_drops++;
+    }
+    tasklet_schedule(&kbd_tasklet);
+    outb(PIC1_COMMAND, PIC_EOI);
+    irq_exit(VECTOR_KEYBOARD, t0);
+}
+
+void irq_dispatch(regs_t *regs, uint64_t line) {
+    (void)regs;
+    uint64_t t0 = irq_enter();
+    for (int i = 0; line < 16 && i < IRQ_MAX_SHARED && irq_handlers[line][i] != NULL; ++i) {
+        irq_handlers[line][i]();
+    }
+    irq_eoi((uint8_t)line);
+    irq_exit((uint8_t)(IRQ_BASE + line), t0);
+}
+
+void msi_dispatch(regs_t *regs, uint64_t slot) {
+    (void)regs;
+    uint64_t t0 = irq_enter();
+    if (slot < MSI_SLOTS && msi_handlers[slot] != NULL) {
+        msi_handlers[slot]();
+    }
+    lapic_eoi();
+    irq_exit((uint8_t)(VECTOR_MSI_BASE + slot), t0);
+}
+
+void exception_divide_handler(regs_t *regs) {
+    (void)regs;
+    write_cstr("\n\n=== EXCEPTION: DIVIDE BY ZERO (#DE) ===\n");
+    dump_regs(regs);
+    dump_backtrace(regs->rbp);
+    write_cstr("Kernel halted for safety.\n");
+    log_panic_flush();
+    cpu_cli();
+    for (;;) {
+        cpu_halt();
+    }
+}
+
+/* SYS_EXIT and fatal ring3 faults: drops the caller's mappings and files and takes it off the run list. */
+static void user_task_retire(void) {
+    mm_unmap_all(mm_owner());
+    vfs_close_all(fd_table());
+    if (ring3_enabled && current_user >= 0) {
+        user_tasks[current_user].active = 0;
+        user_need_resched = 1;
+    } else if (current_task >= 0 && current_task < task_count) {
+        tasks[current_task].state = TASK_EXITED;
+    }
+}
+
+static void user_exit_loop(void);
+
+void exception_page_fault_handler(regs_t *regs, uint64_t error_code, irq_frame_t *frame) {
+    uint64_t cr2;
+    __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+    if (mm_fault(cr2, error_code)) {
+        return;
+    }
+    if ((frame->cs & 3) == 3) {
+        /* A bad user access kills the task, not the kernel; it resumes in a yield loop until switched out. */
+        write_cstr("\n[ring3] segfault at ");
+        write_u64_hex(cr2);
+        write_cstr(" rip=");
+        write_u64_hex(frame->rip);
+        write_cstr(", task killed\n");
+        user_task_retire();
+        frame->rip = (uint64_t)(uintptr_t)user_exit_loop;
+        frame->rsp = (ring3_enabled && current_user >= 0)
+            ? (uint64_t)(uintptr_t)&user_task_stacks[current_user][USER_STACK_SIZE]
+            : USER_STACK_TOP;
+        return;
+    }
+
+    write_cstr("\n\n=== EXCEPTION: PAGE FAULT (#PF) ===\n");
+    write_cstr("fault_addr=");
+    write_u64_hex(cr2);
+    write_cstr(" error_code=");
+    write_u64_hex(error_code);
+    write_cstr("\nKernel halted for safety.\n");
+    dump_regs(regs);
+    dump_backtrace(regs->rbp);
+    log_panic_flush();
+    cpu_cli();
+    for (;;) {
+        cpu_halt();
+    }
+}
+
+void syscall_dispatch(regs_t *regs) {
+    switch (regs->rax) {
+    case SYS_WRITE:
+        regs->rax = (uint64_t)ksys_fd_write((int)regs->rdi, (const uint8_t *)(uintptr_t)regs->rsi, (size_t)regs->rdx);
+        break;
+    case SYS_OPEN:
+        regs->rax = (uint64_t)ksys_open((const char *)(uintptr_t)regs->rdi, (int)regs->rsi);
+        break;
+    case SYS_READ:
+        regs->rax = (uint64_t)ksys_read((int)regs->rdi, (uint8_t *)(uintptr_t)regs->rsi, (size_t)regs->rdx);
+        break;
+    case SYS_LSEEK:
+        regs->rax = (uint64_t)ksys_lseek((int)regs->rdi, (int64_t)regs->rsi, (int)regs->rdx);
+        break;
+    case SYS_CLOSE:
+        regs->rax = (uint64_t)ksys_close((int)regs->rdi);
+        break;
+    case SYS_MMAP:
+        regs->rax = (uint64_t)ksys_mmap((int)regs->rdi, regs->rsi, (int)regs->rdx, (int)regs->r10, regs->r8);
+        break;
+    case SYS_MUNMAP:
+        regs->rax = (uint64_t)ksys_munmap(regs->rdi);
+        break;
+    case SYS_FBMAP:
+        regs->rax = (uint64_t)ksys_fbmap((fb_info_t *)(uintptr_t)regs->rdi);
+        break;
+    case SYS_FBFLUSH:
+        regs->rax = (uint64_t)ksys_fbflush((uint32_t)regs->rdi, (uint32_t)regs->rsi, (uint32_t)regs->rdx, (uint32_t)regs->r10);
+        break;
+    case SYS_EXIT:
+        user_task_retire();
+        regs->rax = 0;
+        break;
+    case SYS_GETPID:
         regs->rax = (uint64_t)ksys_getpid();
         break;
     case SYS_SLEEP:
@@ -1191,214 +4699,4786 @@ void syscall_dispatch(regs_t *regs) {
             if (sleep_ticks == 0) {
                 sleep_ticks = 1;
             }
-            tasks[current_task].wake_tick = ticks + sleep_ticks;
-            tasks[current_task].state = TASK_SLEEPING;
+            tasks[current_task].wake_tick = ticks + sleep_ticks;
+            tasks[current_task].state = TASK_SLEEPING;
+        }
+        regs->rax = 0;
+        break;
+    case SYS_YIELD:
+        if (ring3_enabled && current_user >= 0) {
+            user_need_resched = 1;
+        }
+        regs->rax = 0;
+        break;
+    default:
+        regs->rax = (uint64_t)-1;
+        break;
+    }
+}
+
+static uint8_t ata_status(void) {
+    return inb(ATA_PRIMARY_IO + ATA_REG_STATUS);
+}
+
+static void ata_delay_400ns(void) {
+    for (int i = 0; i < 4; ++i) {
+        (void)inb(ATA_PRIMARY_CTRL);
+    }
+}
+
+static int ata_wait_bsy(void) {
+    for (uint32_t i = 0; i < ATA_TIMEOUT_SPINS; ++i) {
+        if ((ata_status() & ATA_SR_BSY) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int ata_wait_drq(void) {
+    for (uint32_t i = 0; i < ATA_TIMEOUT_SPINS; ++i) {
+        uint8_t s = ata_status();
+        if (s & ATA_SR_BSY) {
+            continue;
+        }
+        if (s & (ATA_SR_ERR | ATA_SR_DF)) {
+            return 0;
+        }
+        if (s & ATA_SR_DRQ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline void ata_insw(void *buf, uint32_t words) {
+    __asm__ volatile("rep insw" : "+D"(buf), "+c"(words) : "d"((uint16_t)(ATA_PRIMARY_IO + ATA_REG_DATA)) : "memory");
+}
+
+static void ata_issue(uint64_t lba, uint32_t count, uint8_t cmd28, uint8_t cmd48) {
+    if (ata.lba48) {
+        outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, 0x40);
+        outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, (uint8_t)((count >> 8) & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA0, (uint8_t)((lba >> 24) & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA1, (uint8_t)((lba >> 32) & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA2, (uint8_t)((lba >> 40) & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, (uint8_t)(count & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA0, (uint8_t)(lba & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA1, (uint8_t)((lba >> 8) & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_LBA2, (uint8_t)((lba >> 16) & 0xFF));
+        outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, cmd48);
+        return;
+    }
+    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, (uint8_t)(0xE0 | ((lba >> 24) & 0x0F)));
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, (uint8_t)(count & 0xFF));
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA0, (uint8_t)(lba & 0xFF));
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA1, (uint8_t)((lba >> 8) & 0xFF));
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA2, (uint8_t)((lba >> 16) & 0xFF));
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, cmd28);
+}
+
+static void ata_init(void) {
+    uint16_t id[256];
+
+    ata.present = 0;
+    ata.lba48 = 0;
+    ata.multiple = 0;
+    ata.sectors = 0;
+
+    outb(ATA_PRIMARY_CTRL, 0x02); /* nIEN: this driver polls */
+    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, 0xA0);
+    ata_delay_400ns();
+    /* A floating bus reads 0xFF; otherwise the selected drive must be idle before it takes a command. */
+    if (ata_status() == 0xFF || !ata_wait_bsy()) {
+        return;
+    }
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA0, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA1, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_LBA2, 0);
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_IDENTIFY);
+    ata_delay_400ns();
+    if (ata_status() == 0 || ata_status() == 0xFF) {
+        return;
+    }
+    if (!ata_wait_bsy()) {
+        return;
+    }
+    if (inb(ATA_PRIMARY_IO + ATA_REG_LBA1) != 0 || inb(ATA_PRIMARY_IO + ATA_REG_LBA2) != 0) {
+        return; /* ATAPI / SATA signature, not a PATA disk */
+    }
+    if (!ata_wait_drq()) {
+        return;
+    }
+    ata_insw(id, 256);
+
+    ata.present = 1;
+    ata.lba48 = (id[83] & (1u << 10)) ? 1 : 0;
+    if (ata.lba48) {
+        ata.sectors = (uint64_t)id[100] | ((uint64_t)id[101] << 16) | ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+    } else {
+        ata.sectors = (uint64_t)id[60] | ((uint64_t)id[61] << 16);
+    }
+
+    uint16_t max_multiple = id[47] & 0xFF;
+    if (max_multiple == 0) {
+        return;
+    }
+    outb(ATA_PRIMARY_IO + ATA_REG_DRIVE, ata.lba48 ? 0x40 : 0xE0);
+    ata_delay_400ns();
+    if (!ata_wait_bsy()) {
+        return;
+    }
+    outb(ATA_PRIMARY_IO + ATA_REG_SECCOUNT, (uint8_t)max_multiple);
+    outb(ATA_PRIMARY_IO + ATA_REG_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_delay_400ns();
+    if (ata_wait_bsy() && (ata_status() & ATA_SR_ERR) == 0) {
+        ata.multiple = max_multiple;
+    }
+}
+
+/*
+ * Reads count sectors starting at lba straight into buf. Each command moves
+ * up to ATA_MAX_SECTORS(ata) sectors; with READ MULTIPLE the device raises
+ * DRQ once per ata.multiple sectors instead of once per sector.
+ */
+static int ata_pio_read_sectors(uint64_t lba, uint32_t count, void *buf) {
+    uint8_t *dst = (uint8_t *)buf;
+    while (count > 0) {
+        uint32_t n = (count < ATA_MAX_SECTORS(ata)) ? count : ATA_MAX_SECTORS(ata);
+        uint32_t per_drq = ata.multiple ? ata.multiple : 1;
+
+        if (!ata_wait_bsy()) {
+            return 0;
+        }
+        if (ata.multiple) {
+            ata_issue(lba, n, ATA_CMD_READ_MULTIPLE, ATA_CMD_READ_MULTIPLE_EXT);
+        } else {
+            ata_issue(lba, n, ATA_CMD_READ_SECTORS, ATA_CMD_READ_SECTORS_EXT);
+        }
+        ata_delay_400ns();
+
+        for (uint32_t done = 0; done < n; done += per_drq) {
+            uint32_t block = (n - done < per_drq) ? (n - done) : per_drq;
+            if (!ata_wait_drq()) {
+                return 0;
+            }
+            ata_insw(dst, block * 256);
+            dst += block * 512;
+        }
+        lba += n;
+        count -= n;
+    }
+    return 1;
+}
+
+static inline void ata_outsw(const void *buf, uint32_t words) {
+    __asm__ volatile("rep outsw" : "+S"(buf), "+c"(words) : "d"((uint16_t)(ATA_PRIMARY_IO + ATA_REG_DATA)) : "memory");
+}
+
+/* PIO counterpart of ata_pio_read_sectors; WRITE MULTIPLE when the drive supports it. */
+static int ata_pio_write_sectors(uint64_t lba, uint32_t count, const void *buf) {
+    const uint8_t *src = (const uint8_t *)buf;
+    while (count > 0) {
+        uint32_t n = (count < ATA_MAX_SECTORS(ata)) ? count : ATA_MAX_SECTORS(ata);
+        uint32_t per_drq = ata.multiple ? ata.multiple : 1;
+
+        if (!ata_wait_bsy()) {
+            return 0;
+        }
+        if (ata.multiple) {
+            ata_issue(lba, n, ATA_CMD_WRITE_MULTIPLE, ATA_CMD_WRITE_MULTIPLE_EXT);
+        } else {
+            ata_issue(lba, n, ATA_CMD_WRITE_SECTORS, ATA_CMD_WRITE_SECTORS_EXT);
+        }
+        ata_delay_400ns();
+
+        for (uint32_t done = 0; done < n; done += per_drq) {
+            uint32_t block = (n - done < per_drq) ? (n - done) : per_drq;
+            if (!ata_wait_drq()) {
+                return 0;
+            }
+            ata_outsw(src, block * 256);
+            src += block * 512;
+        }
+        if (!ata_wait_bsy() || (ata_status() & (ATA_SR_ERR | ATA_SR_DF))) {
+            return 0;
+        }
+        lba += n;
+        count -= n;
+    }
+    return 1;
+}
+
+static void block_complete(block_dev_t *dev, blk_req_t *req, int status);
+
+/* Stops the engine and completes the active request; interrupts must be off. */
+static void ata_dma_finish(uint8_t bm, int timed_out) {
+    blk_req_t *req = ata.active;
+    if (req == NULL) {
+        return;
+    }
+    outb((uint16_t)(ata.bmide + BMIDE_REG_COMMAND), 0);
+    outb(ATA_PRIMARY_CTRL, 0x02);
+    uint8_t st = ata_status();
+    ata.active = NULL;
+    ata.dma_status = bm;
+    int ok = !timed_out && (bm & BMIDE_SR_ERR) == 0 && (st & (ATA_SR_ERR | ATA_SR_DF | ATA_SR_BSY)) == 0;
+    block_complete(&ata_blk, req, ok ? BLK_OK : BLK_ERROR);
+}
+
+static void ata_irq_handler(void) {
+    uint8_t bm = inb((uint16_t)(ata.bmide + BMIDE_REG_STATUS));
+    (void)ata_status(); /* acknowledges INTRQ on the device */
+    if ((bm & BMIDE_SR_IRQ) == 0) {
+        return;
+    }
+    outb((uint16_t)(ata.bmide + BMIDE_REG_STATUS), BMIDE_SR_IRQ | BMIDE_SR_ERR);
+    ata_dma_finish(bm, 0);
+}
+
+/* Completion without IRQ14: early boot, disklat's polled pass, or a lost interrupt. */
+static void ata_blk_poll(block_dev_t *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    if (ata.active != NULL) {
+        uint8_t bm = inb((uint16_t)(ata.bmide + BMIDE_REG_STATUS));
+        if (bm & (BMIDE_SR_IRQ | BMIDE_SR_ERR)) {
+            outb((uint16_t)(ata.bmide + BMIDE_REG_STATUS), BMIDE_SR_IRQ | BMIDE_SR_ERR);
+            ata_dma_finish(bm, 0);
+        } else if (ticks >= ata.deadline || ++ata.spins >= ATA_TIMEOUT_SPINS) {
+            ata_dma_finish(bm, 1);
+        }
+    }
+    irq_restore(flags);
+}
+
+static void ata_dma_init(void) {
+    const pci_dev_t *ide = pci_find_class(0x01, 0x01);
+    ata.bmide = 0;
+    if (!ata.present || ide == NULL || (ide->prog_if & 0x80) == 0) {
+        return;
+    }
+    uint32_t bar4 = pci_read32(ide, 0x20);
+    if ((bar4 & 1) == 0 || (bar4 & 0xFFFC) == 0) {
+        return;
+    }
+    pci_enable(ide, PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+    ata.bmide = (uint16_t)(bar4 & 0xFFFC);
+    outb((uint16_t)(ata.bmide + BMIDE_REG_COMMAND), 0);
+    outb((uint16_t)(ata.bmide + BMIDE_REG_STATUS), BMIDE_SR_IRQ | BMIDE_SR_ERR);
+    irq_install(ATA_IRQ, ata_irq_handler, 0);
+}
+
+/* Fills ata_prdt for one transfer, splitting at 64 KiB physical boundaries. */
+static int ata_build_prdt(uint64_t phys, uint32_t bytes) {
+    int n = 0;
+    while (bytes > 0) {
+        if (n == ATA_PRD_MAX || phys + bytes > 0x100000000ULL) {
+            return 0;
+        }
+        uint32_t room = 0x10000u - (uint32_t)(phys & 0xFFFF);
+        uint32_t chunk = (bytes < room) ? bytes : room;
+        ata_prdt[n].addr = (uint32_t)phys;
+        ata_prdt[n].bytes = (uint16_t)(chunk & 0xFFFF);
+        ata_prdt[n].flags = 0;
+        phys += chunk;
+        bytes -= chunk;
+        n++;
+    }
+    ata_prdt[n - 1].flags = 0x8000;
+    return 1;
+}
+
+static void block_complete(block_dev_t *dev, blk_req_t *req, int status) {
+    req->status = status;
+    dev->completed++;
+    if (req->done != NULL) {
+        req->done(req);
+    }
+    wait_queue_wake_all(&dev->wait);
+}
+
+static void block_kick(block_dev_t *dev) {
+    if (dev->kick != NULL) {
+        dev->kick(dev);
+    }
+}
+
+/*
+ * Starts one bus-master READ/WRITE DMA command and returns; ata_dma_finish
+ * completes it from IRQ14 or ata_blk_poll, so nothing sleeps in here while
+ * the queue is dispatching. Buffers DMA cannot reach go through PIO, which
+ * completes before returning.
+ */
+static int ata_blk_submit(block_dev_t *dev, blk_req_t *req) {
+    if (ata.active != NULL) {
+        return 0;
+    }
+    if (ata.bmide == 0 || ((uintptr_t)req->buf & 1) != 0 || !ata_build_prdt((uint64_t)(uintptr_t)req->buf, req->count * 512)) {
+        int ok = req->write ? ata_pio_write_sectors(req->lba, req->count, req->buf) : ata_pio_read_sectors(req->lba, req->count, req->buf);
+        block_complete(dev, req, ok ? BLK_OK : BLK_ERROR);
+        return 1;
+    }
+    if (!ata_wait_bsy()) {
+        block_complete(dev, req, BLK_ERROR);
+        return 1;
+    }
+    uint16_t bm = ata.bmide;
+    uint8_t dir = req->write ? 0 : BMIDE_CMD_READ;
+    outb((uint16_t)(bm + BMIDE_REG_COMMAND), 0);
+    outl((uint16_t)(bm + BMIDE_REG_PRDT), (uint32_t)(uintptr_t)ata_prdt);
+    outb((uint16_t)(bm + BMIDE_REG_STATUS), BMIDE_SR_IRQ | BMIDE_SR_ERR);
+    outb((uint16_t)(bm + BMIDE_REG_COMMAND), dir);
+
+    uint64_t flags = irq_save();
+    ata.active = req;
+    ata.deadline = ticks + PIT_HZ;
+    ata.spins = 0;
+    outb(ATA_PRIMARY_CTRL, 0x00);
+    if (req->write) {
+        ata_issue(req->lba, req->count, ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT);
+    } else {
+        ata_issue(req->lba, req->count, ATA_CMD_READ_DMA, ATA_CMD_READ_DMA_EXT);
+    }
+    outb((uint16_t)(bm + BMIDE_REG_COMMAND), (uint8_t)(dir | BMIDE_CMD_START));
+    irq_restore(flags);
+    return 1;
+}
+
+static void elv_noop_add(blk_queue_t *q, blk_req_t *req) {
+    blk_req_t **pp = &q->head;
+    while (*pp != NULL) {
+        pp = &(*pp)->next;
+    }
+    req->next = NULL;
+    *pp = req;
+}
+
+static blk_req_t *elv_noop_pick(blk_queue_t *q) {
+    return q->head;
+}
+
+/* Keeps the list in LBA order for a one-way sweep. */
+static void elv_deadline_add(blk_queue_t *q, blk_req_t *req) {
+    blk_req_t **pp = &q->head;
+    while (*pp != NULL && (*pp)->lba <= req->lba) {
+        pp = &(*pp)->next;
+    }
+    req->next = *pp;
+    *pp = req;
+}
+
+/* Oldest expired request first, otherwise the next LBA at or past the head. */
+static blk_req_t *elv_deadline_pick(blk_queue_t *q) {
+    blk_req_t *expired = NULL;
+    blk_req_t *ahead = NULL;
+    for (blk_req_t *r = q->head; r != NULL; r = r->next) {
+        if (r->deadline <= ticks && (expired == NULL || r->deadline < expired->deadline)) {
+            expired = r;
+        }
+        if (ahead == NULL && r->lba >= q->head_pos) {
+            ahead = r;
+        }
+    }
+    if (expired != NULL) {
+        return expired;
+    }
+    return (ahead != NULL) ? ahead : q->head;
+}
+
+static const blk_elevator_t elv_noop = {"noop", elv_noop_add, elv_noop_pick};
+static const blk_elevator_t elv_deadline = {"deadline", elv_deadline_add, elv_deadline_pick};
+
+static void block_register(block_dev_t *dev) {
+    if (block_dev_count >= BLOCK_MAX_DEVICES) {
+        return;
+    }
+    blk_queue_t *q = &dev->queue;
+    q->elv = &elv_noop;
+    q->head = NULL;
+    q->plugged = 0;
+    q->running = 0;
+    q->head_pos = 0;
+    q->carrier_busy = 0;
+    q->bounce = (uint8_t *)page_alloc((uint64_t)BLKQ_CARRIERS * BLKQ_MERGE_MAX_SECTORS * 512 / PAGE_SIZE);
+    block_devs[block_dev_count++] = dev;
+}
+
+static void ata_blk_register(void) {
+    if (!ata.present) {
+        return;
+    }
+    ata_blk.name = "ata0";
+    ata_blk.sectors = ata.sectors;
+    ata_blk.max_sectors = ATA_DMA_MAX_SECTORS;
+    ata_blk.max_queue = 1;
+    ata_blk.irq_driven = (ata.bmide != 0);
+    ata_blk.submit = ata_blk_submit;
+    ata_blk.kick = NULL;
+    ata_blk.poll = ata_blk_poll;
+    ata_blk.set_polled = NULL;
+    ata_blk.priv = &ata;
+    block_register(&ata_blk);
+    ata_blk.queue.elv = &elv_deadline;
+}
+
+static volatile uint32_t *ahci_hba_reg(uint32_t off) {
+    return (volatile uint32_t *)(ahci.abar + off);
+}
+
+static volatile uint32_t *ahci_port_reg(uint32_t off) {
+    return (volatile uint32_t *)(ahci.port + off);
+}
+
+static void ahci_port_stop(void) {
+    *ahci_port_reg(AHCI_PxCMD) &= ~AHCI_CMD_ST;
+    for (uint32_t i = 0; i < AHCI_TIMEOUT_SPINS && (*ahci_port_reg(AHCI_PxCMD) & AHCI_CMD_CR); ++i) {
+    }
+    *ahci_port_reg(AHCI_PxCMD) &= ~AHCI_CMD_FRE;
+    for (uint32_t i = 0; i < AHCI_TIMEOUT_SPINS && (*ahci_port_reg(AHCI_PxCMD) & AHCI_CMD_FR); ++i) {
+    }
+}
+
+static void ahci_port_start(void) {
+    for (uint32_t i = 0; i < AHCI_TIMEOUT_SPINS && (*ahci_port_reg(AHCI_PxCMD) & AHCI_CMD_CR); ++i) {
+    }
+    *ahci_port_reg(AHCI_PxCMD) |= AHCI_CMD_FRE;
+    *ahci_port_reg(AHCI_PxCMD) |= AHCI_CMD_ST;
+}
+
+/* Builds the command header, H2D register FIS and PRDT for one slot. */
+static int ahci_prepare(uint32_t slot, uint8_t cmd, uint64_t lba, uint32_t count, void *buf, uint32_t bytes) {
+    uint8_t *tbl = ahci_ctbl[slot];
+    uint32_t *prdt = (uint32_t *)(tbl + 0x80);
+    uint64_t addr = (uint64_t)(uintptr_t)buf;
+    uint32_t prdtl = 0;
+
+    if (addr & 1) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < 0x80; ++i) {
+        tbl[i] = 0;
+    }
+    while (bytes > 0) {
+        uint32_t chunk = (bytes < AHCI_PRD_MAX_BYTES) ? bytes : AHCI_PRD_MAX_BYTES;
+        if (prdtl == AHCI_PRDT_MAX) {
+            return 0;
+        }
+        prdt[prdtl * 4 + 0] = (uint32_t)addr;
+        prdt[prdtl * 4 + 1] = (uint32_t)(addr >> 32);
+        prdt[prdtl * 4 + 2] = 0;
+        prdt[prdtl * 4 + 3] = chunk - 1;
+        addr += chunk;
+        bytes -= chunk;
+        prdtl++;
+    }
+
+    tbl[0] = 0x27; /* H2D register FIS */
+    tbl[1] = 0x80; /* command, not control */
+    tbl[2] = cmd;
+    tbl[4] = (uint8_t)lba;
+    tbl[5] = (uint8_t)(lba >> 8);
+    tbl[6] = (uint8_t)(lba >> 16);
+    tbl[7] = (cmd == ATA_CMD_IDENTIFY) ? 0 : 0x40;
+    tbl[8] = (uint8_t)(lba >> 24);
+    tbl[9] = (uint8_t)(lba >> 32);
+    tbl[10] = (uint8_t)(lba >> 40);
+    if (cmd == ATA_CMD_READ_FPDMA_QUEUED || cmd == ATA_CMD_WRITE_FPDMA_QUEUED) {
+        /* FPDMA carries the sector count in FEATURES and the tag in COUNT[7:3]. */
+        tbl[3] = (uint8_t)count;
+        tbl[11] = (uint8_t)(count >> 8);
+        tbl[12] = (uint8_t)(slot << 3);
+    } else {
+        tbl[12] = (uint8_t)count;
+        tbl[13] = (uint8_t)(count >> 8);
+    }
+
+    uint32_t *hdr = (uint32_t *)(ahci_clb + slot * 32);
+    hdr[0] = 5u | (prdtl << 16); /* CFL = 5 dwords */
+    if (cmd == ATA_CMD_WRITE_FPDMA_QUEUED || cmd == ATA_CMD_WRITE_DMA_EXT) {
+        hdr[0] |= 1u << 6; /* W: host-to-device data */
+    }
+    hdr[1] = 0;
+    hdr[2] = (uint32_t)(uintptr_t)tbl;
+    hdr[3] = (uint32_t)((uint64_t)(uintptr_t)tbl >> 32);
+    return 1;
+}
+
+static void ahci_complete(uint32_t slot, int status) {
+    blk_req_t *req = ahci.reqs[slot];
+    ahci.reqs[slot] = NULL;
+    ahci.busy &= ~(1u << slot);
+    if (req != NULL) {
+        block_complete(&ahci.dev, req, status);
+    }
+}
+
+/* Retires finished slots; called with interrupts disabled. */
+static void ahci_reap(void) {
+    uint32_t is = *ahci_port_reg(AHCI_PxIS);
+    *ahci_port_reg(AHCI_PxIS) = is;
+    if (is & AHCI_IS_TFES) {
+        /* A task-file error aborts the whole NCQ queue; fail it and restart the port. */
+        ahci_port_stop();
+        for (uint32_t slot = 0; slot < 32; ++slot) {
+            if (ahci.busy & (1u << slot)) {
+                ahci_complete(slot, BLK_ERROR);
+            }
+        }
+        *ahci_port_reg(AHCI_PxSERR) = 0xFFFFFFFFu;
+        *ahci_port_reg(AHCI_PxIS) = 0xFFFFFFFFu;
+        ahci_port_start();
+        return;
+    }
+    uint32_t active = *ahci_port_reg(AHCI_PxSACT) | *ahci_port_reg(AHCI_PxCI);
+    uint32_t done = ahci.busy & ~active;
+    for (uint32_t slot = 0; done != 0; ++slot, done >>= 1) {
+        if (done & 1) {
+            ahci_complete(slot, BLK_OK);
+        }
+    }
+}
+
+static void ahci_irq_handler(void) {
+    uint32_t his = *ahci_hba_reg(AHCI_IS);
+    if ((his & (1u << ahci.port_no)) == 0) {
+        return;
+    }
+    ahci_reap();
+    *ahci_hba_reg(AHCI_IS) = his;
+}
+
+static void ahci_poll(block_dev_t *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    ahci_reap();
+    irq_restore(flags);
+}
+
+/*
+ * Queues req on a free command slot. With NCQ every read is READ FPDMA
+ * QUEUED, so up to ahci.depth commands are outstanding at once; returns 0
+ * when all usable slots are busy.
+ */
+static int ahci_submit(block_dev_t *dev, blk_req_t *req) {
+    uint64_t flags = irq_save();
+    uint32_t inflight = 0;
+    for (uint32_t b = ahci.busy; b != 0; b &= b - 1) {
+        inflight++;
+    }
+    if (inflight >= ahci.depth) {
+        irq_restore(flags);
+        return 0;
+    }
+    uint32_t slot = 0;
+    while (ahci.busy & (1u << slot)) {
+        slot++;
+    }
+    uint8_t cmd = ahci.ncq ? ATA_CMD_READ_FPDMA_QUEUED : ATA_CMD_READ_DMA_EXT;
+    if (req->write) {
+        cmd = ahci.ncq ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_WRITE_DMA_EXT;
+    }
+    if (req->count == 0 || req->count > AHCI_MAX_SECTORS ||
+        !ahci_prepare(slot, cmd, req->lba, req->count, req->buf, req->count * 512)) {
+        block_complete(dev, req, BLK_ERROR);
+        irq_restore(flags);
+        return 1;
+    }
+    ahci.reqs[slot] = req;
+    ahci.busy |= 1u << slot;
+    if (ahci.ncq) {
+        *ahci_port_reg(AHCI_PxSACT) = 1u << slot;
+    }
+    *ahci_port_reg(AHCI_PxCI) = 1u << slot;
+    irq_restore(flags);
+    return 1;
+}
+
+static int ahci_identify_device(void) {
+    if (!ahci_prepare(0, ATA_CMD_IDENTIFY, 0, 0, ahci_identify, sizeof(ahci_identify))) {
+        return 0;
+    }
+    *ahci_port_reg(AHCI_PxCI) = 1u;
+    for (uint32_t i = 0; i < AHCI_TIMEOUT_SPINS; ++i) {
+        if (*ahci_port_reg(AHCI_PxIS) & AHCI_IS_TFES) {
+            return 0;
+        }
+        if ((*ahci_port_reg(AHCI_PxCI) & 1u) == 0) {
+            *ahci_port_reg(AHCI_PxIS) = 0xFFFFFFFFu;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void ahci_init(void) {
+    const pci_dev_t *d = pci_find_class(0x01, 0x06);
+    ahci.abar = NULL;
+    if (d == NULL || d->prog_if != 0x01) {
+        return;
+    }
+    uint64_t abar = pci_bar_addr(d, 5);
+    if (abar == 0) {
+        return;
+    }
+    pci_enable(d, PCI_CMD_MEMORY | PCI_CMD_BUS_MASTER);
+    ahci.abar = (volatile uint8_t *)mmio_map(abar, 0x1100);
+    if (ahci.abar == NULL) {
+        return;
+    }
+    *ahci_hba_reg(AHCI_GHC) |= AHCI_GHC_AE;
+
+    uint32_t cap = *ahci_hba_reg(AHCI_CAP);
+    uint32_t pi = *ahci_hba_reg(AHCI_PI);
+    ahci.slots = ((cap >> 8) & 0x1F) + 1;
+    ahci.port = NULL;
+    for (uint8_t p = 0; p < 32; ++p) {
+        if ((pi & (1u << p)) == 0) {
+            continue;
+        }
+        volatile uint8_t *port = ahci.abar + AHCI_PORT_BASE + p * AHCI_PORT_SIZE;
+        uint32_t ssts = *(volatile uint32_t *)(port + AHCI_PxSSTS);
+        uint32_t sig = *(volatile uint32_t *)(port + AHCI_PxSIG);
+        if ((ssts & 0xF) == 3 && sig == AHCI_SIG_ATA) {
+            ahci.port = port;
+            ahci.port_no = p;
+            break;
+        }
+    }
+    if (ahci.port == NULL) {
+        return;
+    }
+
+    ahci_port_stop();
+    for (uint32_t i = 0; i < sizeof(ahci_clb); ++i) {
+        ahci_clb[i] = 0;
+    }
+    for (uint32_t i = 0; i < sizeof(ahci_fis); ++i) {
+        ahci_fis[i] = 0;
+    }
+    *ahci_port_reg(AHCI_PxCLB) = (uint32_t)(uintptr_t)ahci_clb;
+    *ahci_port_reg(AHCI_PxCLBU) = 0;
+    *ahci_port_reg(AHCI_PxFB) = (uint32_t)(uintptr_t)ahci_fis;
+    *ahci_port_reg(AHCI_PxFBU) = 0;
+    *ahci_port_reg(AHCI_PxSERR) = 0xFFFFFFFFu;
+    *ahci_port_reg(AHCI_PxIS) = 0xFFFFFFFFu;
+    *ahci_port_reg(AHCI_PxIE) = 0;
+    ahci_port_start();
+
+    if (!ahci_identify_device()) {
+        return;
+    }
+    ahci.busy = 0;
+    ahci.ncq = ((cap & (1u << 30)) && (ahci_identify[76] & (1u << 8))) ? 1 : 0;
+    ahci.depth = 1;
+    if (ahci.ncq) {
+        ahci.depth = (uint32_t)(ahci_identify[75] & 0x1F) + 1;
+        if (ahci.depth > ahci.slots) {
+            ahci.depth = ahci.slots;
+        }
+    }
+
+    ahci.dev.name = "ahci0";
+    ahci.dev.sectors = (uint64_t)ahci_identify[100] | ((uint64_t)ahci_identify[101] << 16) |
+                       ((uint64_t)ahci_identify[102] << 32) | ((uint64_t)ahci_identify[103] << 48);
+    ahci.dev.max_sectors = AHCI_MAX_SECTORS;
+    ahci.dev.max_queue = ahci.depth;
+    ahci.dev.submit = ahci_submit;
+    ahci.dev.kick = NULL;
+    ahci.dev.poll = ahci_poll;
+    ahci.dev.set_polled = NULL;
+    ahci.dev.priv = &ahci;
+    ahci.dev.irq_driven = 0;
+    if (pci_enable_msi(d, ahci_irq_handler)) {
+        ahci.dev.irq_driven = 1;
+    } else if (d->irq_line >= 2 && d->irq_line < 16) {
+        irq_install(d->irq_line, ahci_irq_handler, 1);
+        ahci.dev.irq_driven = 1;
+    }
+    if (ahci.dev.irq_driven) {
+        *ahci_port_reg(AHCI_PxIE) = AHCI_IE_DEFAULT;
+        *ahci_hba_reg(AHCI_GHC) |= AHCI_GHC_IE;
+    }
+    block_register(&ahci.dev);
+    ahci.dev.queue.elv = &elv_deadline;
+}
+
+static volatile uint32_t *vblk_common32(uint32_t off) {
+    return (volatile uint32_t *)(vblk.common + off);
+}
+
+static volatile uint16_t *vblk_common16(uint32_t off) {
+    return (volatile uint16_t *)(vblk.common + off);
+}
+
+static void vblk_set_status(uint8_t bits) {
+    vblk.common[0x14] = (uint8_t)(vblk.common[0x14] | bits);
+}
+
+/* Event-index test from the virtio spec: did new_idx step past event since old_idx? */
+static int vring_need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static void vblk_reap(void) {
+    while (vblk.last_used != vq_used.idx) {
+        __asm__ volatile("" : : : "memory");
+        vring_used_elem_t e = vq_used.ring[vblk.last_used % vblk.qsize];
+        uint16_t head = (uint16_t)e.id;
+        blk_req_t *req = vblk.reqs[head];
+        uint8_t st = vblk_status[head];
+
+        /* Return the three-descriptor chain to the free list. */
+        uint16_t tail = vq_desc[head].next;
+        tail = vq_desc[tail].next;
+        vq_desc[tail].next = vblk.free_head;
+        vblk.free_head = head;
+        vblk.num_free = (uint16_t)(vblk.num_free + 3);
+        vblk.reqs[head] = NULL;
+        vblk.last_used++;
+        if (req != NULL) {
+            block_complete(&vblk.dev, req, (st == 0) ? BLK_OK : BLK_ERROR);
+        }
+    }
+    /* Ask for the next interrupt only once everything seen so far is retired. */
+    *vblk.used_event = vblk.last_used;
+    cpu_mfence();
+}
+
+static void vblk_irq_handler(void) {
+    if ((*vblk.isr & 1) == 0) {
+        return;
+    }
+    vblk_reap();
+}
+
+static void vblk_poll(block_dev_t *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    vblk_reap();
+    irq_restore(flags);
+}
+
+/*
+ * Publishes everything added since the last kick with a single doorbell
+ * write, and skips even that when the device's avail_event shows it is
+ * still walking the ring and will pick the new entries up by itself.
+ */
+static void vblk_kick(block_dev_t *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    uint16_t new_idx = vq_avail.idx;
+    uint16_t old_idx = vblk.kicked_idx;
+    if (new_idx != old_idx) {
+        cpu_mfence();
+        vblk.kicked_idx = new_idx;
+        if (!vblk.event_idx || vring_need_event(*vblk.avail_event, new_idx, old_idx)) {
+            *vblk.notify = 0;
+        }
+    }
+    irq_restore(flags);
+}
+
+/* Builds header -> data -> status descriptor chain; the doorbell waits for vblk_kick. */
+static int vblk_submit(block_dev_t *dev, blk_req_t *req) {
+    uint64_t flags = irq_save();
+    if (vblk.num_free < 3) {
+        irq_restore(flags);
+        return 0;
+    }
+    if (req->count == 0 || req->count > VIRTIO_BLK_MAX_SECTORS) {
+        block_complete(dev, req, BLK_ERROR);
+        irq_restore(flags);
+        return 1;
+    }
+    uint16_t head = vblk.free_head;
+    uint16_t data = vq_desc[head].next;
+    uint16_t stat = vq_desc[data].next;
+    vblk.free_head = vq_desc[stat].next;
+    vblk.num_free = (uint16_t)(vblk.num_free - 3);
+
+    vblk_hdr[head].type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    vblk_hdr[head].reserved = 0;
+    vblk_hdr[head].sector = req->lba;
+    vblk_status[head] = 0xFF;
+    vblk.reqs[head] = req;
+
+    vq_desc[head].addr = (uint64_t)(uintptr_t)&vblk_hdr[head];
+    vq_desc[head].len = sizeof(virtio_blk_hdr_t);
+    vq_desc[head].flags = VIRTQ_DESC_F_NEXT;
+    vq_desc[data].addr = (uint64_t)(uintptr_t)req->buf;
+    vq_desc[data].len = req->count * 512;
+    vq_desc[data].flags = req->write ? VIRTQ_DESC_F_NEXT : (VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE);
+    vq_desc[stat].addr = (uint64_t)(uintptr_t)&vblk_status[head];
+    vq_desc[stat].len = 1;
+    vq_desc[stat].flags = VIRTQ_DESC_F_WRITE;
+
+    vq_avail.ring[vq_avail.idx % vblk.qsize] = head;
+    __asm__ volatile("" : : : "memory");
+    vq_avail.idx = (uint16_t)(vq_avail.idx + 1);
+    irq_restore(flags);
+    return 1;
+}
+
+static volatile uint8_t *virtio_cap_ptr(const pci_dev_t *d, uint8_t cap, uint32_t *len) {
+    uint8_t bar = (uint8_t)(pci_read32(d, (uint8_t)(cap + 4)) & 0xFF);
+    uint32_t off = pci_read32(d, (uint8_t)(cap + 8));
+    *len = pci_read32(d, (uint8_t)(cap + 12));
+    uint64_t base = pci_bar_addr(d, bar);
+    if (bar > 5 || base == 0) {
+        return NULL;
+    }
+    return (volatile uint8_t *)mmio_map(base + off, *len);
+}
+
+static void virtio_blk_init(void) {
+    const pci_dev_t *d = NULL;
+    for (int i = 0; i < pci_dev_count; ++i) {
+        if (pci_devs[i].vendor == VIRTIO_VENDOR &&
+            (pci_devs[i].device == VIRTIO_DEV_BLK_MODERN || pci_devs[i].device == VIRTIO_DEV_BLK_TRANSITIONAL)) {
+            d = &pci_devs[i];
+            break;
+        }
+    }
+    vblk.common = NULL;
+    if (d == NULL) {
+        return;
+    }
+    pci_enable(d, PCI_CMD_MEMORY | PCI_CMD_BUS_MASTER);
+
+    volatile uint8_t *notify_base = NULL;
+    uint32_t notify_mult = 0;
+    uint8_t cap = pci_find_cap(d, 0x09);
+    for (int guard = 0; cap != 0 && guard < 16; ++guard) {
+        uint32_t hdr = pci_read32(d, cap);
+        if ((hdr & 0xFF) == 0x09) {
+            uint32_t len = 0;
+            switch ((hdr >> 24) & 0xFF) {
+            case VIRTIO_CAP_COMMON:
+                vblk.common = virtio_cap_ptr(d, cap, &len);
+                break;
+            case VIRTIO_CAP_NOTIFY:
+                notify_base = virtio_cap_ptr(d, cap, &len);
+                notify_mult = pci_read32(d, (uint8_t)(cap + 16));
+                break;
+            case VIRTIO_CAP_ISR:
+                vblk.isr = virtio_cap_ptr(d, cap, &len);
+                break;
+            case VIRTIO_CAP_DEVICE:
+                vblk.device = virtio_cap_ptr(d, cap, &len);
+                break;
+            default:
+                break;
+            }
+        }
+        cap = (uint8_t)((hdr >> 8) & 0xFC);
+    }
+    if (vblk.common == NULL || notify_base == NULL || vblk.isr == NULL || vblk.device == NULL) {
+        vblk.common = NULL;
+        return;
+    }
+
+    vblk.common[0x14] = 0;
+    for (uint32_t i = 0; i < AHCI_TIMEOUT_SPINS && vblk.common[0x14] != 0; ++i) {
+    }
+    vblk_set_status(VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+    *vblk_common32(0x00) = 0;
+    uint32_t feat_lo = *vblk_common32(0x04);
+    *vblk_common32(0x00) = 1;
+    uint32_t feat_hi = *vblk_common32(0x04);
+    if ((feat_hi & (1u << (VIRTIO_F_VERSION_1 - 32))) == 0) {
+        return;
+    }
+    vblk.event_idx = (feat_lo & (1u << VIRTIO_F_EVENT_IDX)) ? 1 : 0;
+    *vblk_common32(0x08) = 0;
+    *vblk_common32(0x0C) = vblk.event_idx ? (1u << VIRTIO_F_EVENT_IDX) : 0;
+    *vblk_common32(0x08) = 1;
+    *vblk_common32(0x0C) = 1u << (VIRTIO_F_VERSION_1 - 32);
+    vblk_set_status(VIRTIO_STATUS_FEATURES_OK);
+    if ((vblk.common[0x14] & VIRTIO_STATUS_FEATURES_OK) == 0) {
+        return;
+    }
+
+    *vblk_common16(0x16) = 0;
+    uint16_t qsize = *vblk_common16(0x18);
+    if (qsize == 0) {
+        return;
+    }
+    vblk.qsize = (qsize < VIRTQ_SIZE) ? qsize : VIRTQ_SIZE;
+    *vblk_common16(0x18) = vblk.qsize;
+    for (uint16_t i = 0; i < vblk.qsize; ++i) {
+        vq_desc[i].next = (uint16_t)(i + 1);
+        vblk.reqs[i] = NULL;
+    }
+    vblk.free_head = 0;
+    vblk.num_free = (uint16_t)(vblk.qsize - vblk.qsize % 3);
+    vblk.last_used = 0;
+    vblk.kicked_idx = 0;
+    vblk.used_event = (vblk.qsize == VIRTQ_SIZE) ? &vq_avail.used_event : &vq_avail.ring[vblk.qsize];
+    vblk.avail_event = (vblk.qsize == VIRTQ_SIZE) ? &vq_used.avail_event : (volatile uint16_t *)&vq_used.ring[vblk.qsize];
+    vq_avail.flags = 0;
+    vq_avail.idx = 0;
+    *vblk.used_event = 0;
+    vq_used.flags = 0;
+    vq_used.idx = 0;
+    *vblk.avail_event = 0;
+
+    uint64_t desc = (uint64_t)(uintptr_t)vq_desc;
+    uint64_t avail = (uint64_t)(uintptr_t)&vq_avail;
+    uint64_t used = (uint64_t)(uintptr_t)&vq_used;
+    *vblk_common16(0x1A) = 0xFFFF; /* no MSI-X vector: INTx + ISR status */
+    *vblk_common32(0x20) = (uint32_t)desc;
+    *vblk_common32(0x24) = (uint32_t)(desc >> 32);
+    *vblk_common32(0x28) = (uint32_t)avail;
+    *vblk_common32(0x2C) = (uint32_t)(avail >> 32);
+    *vblk_common32(0x30) = (uint32_t)used;
+    *vblk_common32(0x34) = (uint32_t)(used >> 32);
+    vblk.notify = (volatile uint16_t *)(notify_base + (uint32_t)*vblk_common16(0x1E) * notify_mult);
+    *vblk_common16(0x1C) = 1;
+    vblk_set_status(VIRTIO_STATUS_DRIVER_OK);
+
+    vblk.dev.name = "vblk0";
+    vblk.dev.sectors = (uint64_t)*(volatile uint32_t *)vblk.device |
+                       ((uint64_t)*(volatile uint32_t *)(vblk.device + 4) << 32);
+    vblk.dev.max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    vblk.dev.max_queue = (uint32_t)(vblk.qsize / 3);
+    vblk.dev.submit = vblk_submit;
+    vblk.dev.kick = vblk_kick;
+    vblk.dev.poll = vblk_poll;
+    vblk.dev.set_polled = NULL;
+    vblk.dev.priv = &vblk;
+    vblk.dev.irq_driven = 0;
+    if (d->irq_line >= 2 && d->irq_line < 16) {
+        irq_install(d->irq_line, vblk_irq_handler, 1);
+        vblk.dev.irq_driven = 1;
+    }
+    block_register(&vblk.dev);
+}
+
+static volatile uint32_t *nvme_reg32(uint32_t off) {
+    return (volatile uint32_t *)(nvme.regs + off);
+}
+
+static void nvme_queue_init(nvme_queue_t *q, uint16_t qid, uint16_t depth,
+                            volatile nvme_sqe_t *sq, volatile nvme_cqe_t *cq) {
+    q->sq = sq;
+    q->cq = cq;
+    q->qid = qid;
+    q->depth = depth;
+    q->sq_db = nvme_reg32(0x1000 + (2u * qid) * nvme.db_stride);
+    q->cq_db = nvme_reg32(0x1000 + (2u * qid + 1) * nvme.db_stride);
+    q->sq_tail = 0;
+    q->sq_tail_db = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    q->msix_entry = (uint8_t)qid;
+    /* One slot stays empty so the SQ tail never catches the head. */
+    q->free_cids = (1ull << (depth - 1)) - 1;
+    for (uint16_t i = 0; i < depth; ++i) {
+        cq[i].status = 0;
+    }
+    for (uint32_t i = 0; i < NVME_IO_DEPTH; ++i) {
+        q->reqs[i] = NULL;
+    }
+}
+
+/* Claims and clears the next SQ slot; it reaches the device on the next doorbell. */
+static volatile nvme_sqe_t *nvme_sqe_next(nvme_queue_t *q, uint8_t opcode, uint16_t cid) {
+    volatile nvme_sqe_t *e = &q->sq[q->sq_tail];
+    volatile uint32_t *w = (volatile uint32_t *)e;
+    for (uint32_t i = 0; i < sizeof(nvme_sqe_t) / 4; ++i) {
+        w[i] = 0;
+    }
+    e->cdw0 = opcode | ((uint32_t)cid << 16);
+    q->sq_tail = (uint16_t)((q->sq_tail + 1) % q->depth);
+    return e;
+}
+
+static void nvme_sq_doorbell(nvme_queue_t *q) {
+    if (q->sq_tail != q->sq_tail_db) {
+        __asm__ volatile("" : : : "memory");
+        *q->sq_db = q->sq_tail;
+        q->sq_tail_db = q->sq_tail;
+    }
+}
+
+/* Rings the admin doorbell and polls for the single outstanding completion. */
+static int nvme_admin_wait(void) {
+    nvme_queue_t *q = &nvme.admin;
+    nvme_sq_doorbell(q);
+    uint64_t t0 = clock_us();
+    for (;;) {
+        uint16_t st = q->cq[q->cq_head].status;
+        if ((st & 1) == q->phase) {
+            if (++q->cq_head == q->depth) {
+                q->cq_head = 0;
+                q->phase ^= 1;
+            }
+            *q->cq_db = q->cq_head;
+            return (st >> 1) == 0;
+        }
+        if (clock_us() - t0 > NVME_TIMEOUT_US) {
+            return 0;
+        }
+        cpu_pause();
+    }
+}
+
+static int nvme_identify_cmd(uint32_t cns, uint32_t nsid) {
+    volatile nvme_sqe_t *e = nvme_sqe_next(&nvme.admin, NVME_ADMIN_IDENTIFY, nvme.admin.sq_tail);
+    e->nsid = nsid;
+    e->prp1 = (uint64_t)(uintptr_t)nvme_identify;
+    e->cdw10 = cns;
+    return nvme_admin_wait();
+}
+
+static int nvme_create_io_queue(nvme_queue_t *q, int irq) {
+    uint32_t size = (uint32_t)(q->depth - 1) << 16;
+    volatile nvme_sqe_t *e = nvme_sqe_next(&nvme.admin, NVME_ADMIN_CREATE_CQ, nvme.admin.sq_tail);
+    e->prp1 = (uint64_t)(uintptr_t)q->cq;
+    e->cdw10 = q->qid | size;
+    e->cdw11 = 1u | (irq ? 2u : 0u) | ((uint32_t)(nvme.msix != NULL ? q->msix_entry : 0) << 16);
+    if (!nvme_admin_wait()) {
+        return 0;
+    }
+    e = nvme_sqe_next(&nvme.admin, NVME_ADMIN_CREATE_SQ, nvme.admin.sq_tail);
+    e->prp1 = (uint64_t)(uintptr_t)q->sq;
+    e->cdw10 = q->qid | size;
+    e->cdw11 = 1u | ((uint32_t)q->qid << 16);
+    return nvme_admin_wait();
+}
+
+/*
+ * Fills PRP1/PRP2 for a buffer of bytes: PRP2 is the second page itself
+ * when the transfer touches two pages, otherwise a per-command PRP list.
+ */
+static void nvme_set_prps(volatile nvme_sqe_t *e, uint64_t *list, uint64_t addr, uint32_t bytes) {
+    uint32_t first = 4096u - (uint32_t)(addr & 0xFFF);
+    e->prp1 = addr;
+    if (bytes <= first) {
+        return;
+    }
+    uint64_t page = addr + first;
+    uint32_t rest = bytes - first;
+    if (rest <= 4096u) {
+        e->prp2 = page;
+        return;
+    }
+    for (uint32_t i = 0; i * 4096u < rest; ++i) {
+        list[i] = page + (uint64_t)i * 4096u;
+    }
+    e->prp2 = (uint64_t)(uintptr_t)list;
+}
+
+static void nvme_reap(nvme_queue_t *q) {
+    uint16_t reaped = 0;
+    for (;;) {
+        volatile nvme_cqe_t *c = &q->cq[q->cq_head];
+        uint16_t st = c->status;
+        if ((st & 1) != q->phase) {
+            break;
+        }
+        __asm__ volatile("" : : : "memory");
+        uint16_t cid = c->cid;
+        if (++q->cq_head == q->depth) {
+            q->cq_head = 0;
+            q->phase ^= 1;
+        }
+        reaped++;
+        if (cid < NVME_IO_DEPTH && q->reqs[cid] != NULL) {
+            blk_req_t *req = q->reqs[cid];
+            q->reqs[cid] = NULL;
+            q->free_cids |= 1ull << cid;
+            block_complete(&nvme.dev, req, ((st >> 1) == 0) ? BLK_OK : BLK_ERROR);
+        }
+    }
+    if (reaped != 0) {
+        *q->cq_db = q->cq_head;
+    }
+}
+
+static void nvme_irq_handler(void) {
+    for (uint32_t i = 0; i < nvme.nqueues; ++i) {
+        nvme_reap(&nvme.io[i]);
+    }
+}
+
+static void nvme_poll(block_dev_t *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    nvme_irq_handler();
+    irq_restore(flags);
+}
+
+/* One SQ tail doorbell write covers every command queued since the last kick. */
+static void nvme_kick(block_dev_t *dev) {
+    (void)dev;
+    uint64_t flags = irq_save();
+    nvme_sq_doorbell(&nvme.io[this_cpu()]);
+    irq_restore(flags);
+}
+
+static void nvme_set_polled(block_dev_t *dev, int on) {
+    (void)dev;
+    if (nvme.msix != NULL) {
+        for (uint32_t i = 0; i < nvme.nqueues; ++i) {
+            nvme.msix[nvme.io[i].msix_entry * 4u + 3] = on ? 1u : 0u;
+        }
+    } else {
+        *nvme_reg32(on ? NVME_REG_INTMS : NVME_REG_INTMC) = 1;
+    }
+}
+
+static int nvme_submit(block_dev_t *dev, blk_req_t *req) {
+    uint64_t flags = irq_save();
+    uint32_t cpu = this_cpu();
+    nvme_queue_t *q = &nvme.io[cpu];
+    if (q->free_cids == 0) {
+        irq_restore(flags);
+        return 0;
+    }
+    if (req->count == 0 || req->count > NVME_MAX_SECTORS || ((uintptr_t)req->buf & 3) != 0) {
+        block_complete(dev, req, BLK_ERROR);
+        irq_restore(flags);
+        return 1;
+    }
+    uint16_t cid = (uint16_t)__builtin_ctzll(q->free_cids);
+    q->free_cids &= ~(1ull << cid);
+    q->reqs[cid] = req;
+    volatile nvme_sqe_t *e = nvme_sqe_next(q, req->write ? NVME_CMD_WRITE : NVME_CMD_READ, cid);
+    e->nsid = 1;
+    nvme_set_prps(e, nvme_prp[cpu][cid], (uint64_t)(uintptr_t)req->buf, req->count * 512);
+    e->cdw10 = (uint32_t)req->lba;
+    e->cdw11 = (uint32_t)(req->lba >> 32);
+    e->cdw12 = req->count - 1;
+    irq_restore(flags);
+    return 1;
+}
+
+static int nvme_wait_ready(uint32_t want, uint64_t timeout_us) {
+    uint64_t t0 = clock_us();
+    while ((*nvme_reg32(NVME_REG_CSTS) & NVME_CSTS_RDY) != want) {
+        if (*nvme_reg32(NVME_REG_CSTS) & NVME_CSTS_CFS) {
+            return 0;
+        }
+        if (clock_us() - t0 > timeout_us) {
+            return 0;
+        }
+        cpu_pause();
+    }
+    return 1;
+}
+
+static void nvme_init(void) {
+    const pci_dev_t *d = pci_find_class(0x01, 0x08);
+    nvme.regs = NULL;
+    if (d == NULL || d->prog_if != 0x02) {
+        return;
+    }
+    uint64_t bar = pci_bar_addr(d, 0);
+    if (bar == 0) {
+        return;
+    }
+    pci_enable(d, PCI_CMD_MEMORY | PCI_CMD_BUS_MASTER);
+    nvme.regs = (volatile uint8_t *)mmio_map(bar, 0x2000);
+    if (nvme.regs == NULL) {
+        return;
+    }
+    uint32_t cap_lo = nvme_reg32(NVME_REG_CAP)[0];
+    uint32_t cap_hi = nvme_reg32(NVME_REG_CAP)[1];
+    uint32_t mqes = (cap_lo & 0xFFFF) + 1;
+    uint64_t timeout_us = (uint64_t)((cap_lo >> 24) & 0xFF) * 500000u + NVME_TIMEOUT_US;
+    nvme.db_stride = 4u << (cap_hi & 0xF);
+    if (((cap_hi >> 16) & 0xF) != 0) {
+        return; /* MPSMIN above 4 KiB */
+    }
+
+    *nvme_reg32(NVME_REG_CC) = 0;
+    if (!nvme_wait_ready(0, timeout_us)) {
+        return;
+    }
+    uint16_t admin_depth = (uint16_t)((mqes < NVME_ADMIN_DEPTH) ? mqes : NVME_ADMIN_DEPTH);
+    nvme_queue_init(&nvme.admin, 0, admin_depth, nvme_admin_sq, nvme_admin_cq);
+    *nvme_reg32(NVME_REG_AQA) = (uint32_t)(admin_depth - 1) | ((uint32_t)(admin_depth - 1) << 16);
+    nvme_reg32(NVME_REG_ASQ)[0] = (uint32_t)(uintptr_t)nvme_admin_sq;
+    nvme_reg32(NVME_REG_ASQ)[1] = (uint32_t)((uint64_t)(uintptr_t)nvme_admin_sq >> 32);
+    nvme_reg32(NVME_REG_ACQ)[0] = (uint32_t)(uintptr_t)nvme_admin_cq;
+    nvme_reg32(NVME_REG_ACQ)[1] = (uint32_t)((uint64_t)(uintptr_t)nvme_admin_cq >> 32);
+    *nvme_reg32(NVME_REG_CC) = NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES;
+    if (!nvme_wait_ready(NVME_CSTS_RDY, timeout_us)) {
+        return;
+    }
+
+    if (!nvme_identify_cmd(1, 0)) {
+        return;
+    }
+    uint32_t max_sectors = NVME_MAX_SECTORS;
+    uint8_t mdts = nvme_identify[77];
+    if (mdts != 0 && mdts < 16 && (8u << mdts) < max_sectors) {
+        max_sectors = 8u << mdts;
+    }
+    if (!nvme_identify_cmd(0, 1)) {
+        return;
+    }
+    uint64_t nsze = *(uint64_t *)&nvme_identify[0];
+    uint8_t lbaf = nvme_identify[26] & 0xF;
+    if (nvme_identify[128 + lbaf * 4 + 2] != 9) {
+        return; /* block layer speaks 512-byte sectors only */
+    }
+
+    nvme.nqueues = NVME_MAX_CPUS;
+    volatile nvme_sqe_t *e = nvme_sqe_next(&nvme.admin, NVME_ADMIN_SET_FEATURES, nvme.admin.sq_tail);
+    e->cdw10 = NVME_FEAT_NUM_QUEUES;
+    e->cdw11 = (nvme.nqueues - 1) | ((nvme.nqueues - 1) << 16);
+    if (!nvme_admin_wait()) {
+        return;
+    }
+
+    /* Entry 0 belongs to the (polled) admin queue; I/O queue n uses entry n. */
+    irq_handler_t handlers[NVME_MAX_CPUS + 1];
+    handlers[0] = NULL;
+    for (uint32_t i = 0; i < nvme.nqueues; ++i) {
+        handlers[i + 1] = nvme_irq_handler;
+    }
+    int irq = 0;
+    nvme.msix = pci_enable_msix(d, handlers, nvme.nqueues + 1);
+    if (nvme.msix != NULL) {
+        irq = 1;
+    } else if (d->irq_line >= 2 && d->irq_line < 16) {
+        irq_install(d->irq_line, nvme_irq_handler, 1);
+        irq = 1;
+    }
+
+    uint16_t io_depth = (uint16_t)((mqes < NVME_IO_DEPTH) ? mqes : NVME_IO_DEPTH);
+    for (uint32_t i = 0; i < nvme.nqueues; ++i) {
+        nvme_queue_init(&nvme.io[i], (uint16_t)(i + 1), io_depth, nvme_io_sq[i], nvme_io_cq[i]);
+        if (!nvme_create_io_queue(&nvme.io[i], irq)) {
+            return;
+        }
+    }
+
+    nvme.dev.name = "nvme0";
+    nvme.dev.sectors = nsze;
+    nvme.dev.max_sectors = max_sectors;
+    nvme.dev.max_queue = (uint32_t)(io_depth - 1);
+    nvme.dev.irq_driven = (uint8_t)irq;
+    nvme.dev.submit = nvme_submit;
+    nvme.dev.kick = nvme_kick;
+    nvme.dev.poll = nvme_poll;
+    nvme.dev.set_polled = irq ? nvme_set_polled : NULL;
+    nvme.dev.priv = &nvme;
+    block_register(&nvme.dev);
+}
+
+/*
+ * Parks the caller until dev completes something after the snapshot seen
+ * of dev->completed: sleeps on dev->wait when completions are interrupt
+ * driven and we run in a task, otherwise polls. The one-tick timeout
+ * doubles as a lost-interrupt fallback. A polling task still yields
+ * between polls: kernel tasks are never preempted, and the task it waits
+ * on (say, one holding the queue) may need the CPU to finish.
+ */
+static void block_idle(block_dev_t *dev, uint32_t seen) {
+    if (dev->poll != NULL) {
+        dev->poll(dev);
+    }
+    if (dev->irq_driven && current_task >= 0) {
+        cpu_cli();
+        if (dev->completed == seen) {
+            wait_queue_sleep(&dev->wait, 1);
+        } else {
+            cpu_sti();
+        }
+    } else if (current_task >= 0) {
+        schedule();
+    } else {
+        cpu_pause();
+    }
+}
+
+static void blkq_carrier_done(blk_req_t *creq) {
+    blk_carrier_t *c = (blk_carrier_t *)creq->ctx;
+    const uint8_t *src = c->bounce;
+    blk_req_t *r = c->head;
+    while (r != NULL) {
+        blk_req_t *next = r->chain;
+        if (src != NULL) {
+            if (creq->status == BLK_OK && !creq->write) {
+                kmemcpy(r->buf, src, (size_t)r->count * 512);
+            }
+            src += (size_t)r->count * 512;
+        }
+        r->status = creq->status;
+        if (r->done != NULL) {
+            r->done(r);
+        }
+        r = next;
+    }
+    c->dev->queue.carrier_busy &= ~(1u << (c - c->dev->queue.carriers));
+}
+
+/* Hands one queued request (with its chain) to the driver; 0 if it has no room. */
+static int blkq_dispatch(block_dev_t *dev, blk_req_t *node) {
+    blk_queue_t *q = &dev->queue;
+    if (node->chain == NULL) {
+        return dev->submit(dev, node);
+    }
+    uint64_t flags = irq_save();
+    uint32_t slot = 0;
+    while (slot < BLKQ_CARRIERS && (q->carrier_busy & (1u << slot))) {
+        slot++;
+    }
+    if (slot == BLKQ_CARRIERS) {
+        irq_restore(flags);
+        return 0;
+    }
+    q->carrier_busy |= 1u << slot;
+    irq_restore(flags);
+
+    blk_carrier_t *c = &q->carriers[slot];
+    c->head = node;
+    c->dev = dev;
+    c->bounce = NULL;
+    for (blk_req_t *r = node; r->chain != NULL; r = r->chain) {
+        if ((uint8_t *)r->buf + (size_t)r->count * 512 != (uint8_t *)r->chain->buf) {
+            c->bounce = q->bounce + (size_t)slot * BLKQ_MERGE_MAX_SECTORS * 512;
+            break;
+        }
+    }
+    if (c->bounce != NULL && node->write) {
+        uint8_t *dst = c->bounce;
+        for (blk_req_t *r = node; r != NULL; r = r->chain) {
+            kmemcpy(dst, r->buf, (size_t)r->count * 512);
+            dst += (size_t)r->count * 512;
+        }
+    }
+    c->req.lba = node->lba;
+    c->req.count = node->span;
+    c->req.buf = (c->bounce != NULL) ? c->bounce : node->buf;
+    c->req.write = node->write;
+    c->req.status = BLK_PENDING;
+    c->req.done = blkq_carrier_done;
+    c->req.ctx = c;
+    if (!dev->submit(dev, &c->req)) {
+        flags = irq_save();
+        q->carrier_busy &= ~(1u << slot);
+        irq_restore(flags);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Feeds the driver from the elevator until it is full or the queue is
+ * empty, then rings its doorbell once. Runs in task context only: from
+ * submitters, unplug and waiters, never from completion interrupts.
+ * force dispatches through a plug without touching its count.
+ */
+static void blkq_run(block_dev_t *dev, int force) {
+    blk_queue_t *q = &dev->queue;
+    uint64_t flags = irq_save();
+    if ((q->plugged != 0 && !force) || q->running) {
+        irq_restore(flags);
+        return;
+    }
+    q->running = 1;
+    int sent = 0;
+    while (q->head != NULL) {
+        blk_req_t *node = q->elv->pick(q);
+        blk_req_t **pp = &q->head;
+        while (*pp != node) {
+            pp = &(*pp)->next;
+        }
+        *pp = node->next;
+        node->next = NULL;
+        /* Unlinked, so nothing merges into it; only this runner removes nodes, so pp stays valid. */
+        irq_restore(flags);
+        int ok = blkq_dispatch(dev, node);
+        flags = irq_save();
+        if (!ok) {
+            node->next = *pp;
+            *pp = node;
+            break;
+        }
+        q->head_pos = node->lba + node->span;
+        q->dispatched++;
+        sent = 1;
+    }
+    q->running = 0;
+    irq_restore(flags);
+    if (sent) {
+        block_kick(dev);
+    }
+}
+
+/* Chains req behind a same-direction queued request ending at req->lba when the transfer stays within limits. */
+static int blkq_merge(block_dev_t *dev, blk_req_t *req) {
+    blk_queue_t *q = &dev->queue;
+    uint32_t limit = (dev->max_sectors < BLKQ_MERGE_MAX_SECTORS) ? dev->max_sectors : BLKQ_MERGE_MAX_SECTORS;
+    for (blk_req_t *node = q->head; node != NULL; node = node->next) {
+        if (node->write != req->write || node->lba + node->span != req->lba || node->span + req->count > limit) {
+            continue;
+        }
+        blk_req_t *tail = node;
+        while (tail->chain != NULL) {
+            tail = tail->chain;
+        }
+        if (q->bounce == NULL && (uint8_t *)tail->buf + (size_t)tail->count * 512 != (uint8_t *)req->buf) {
+            continue;
+        }
+        tail->chain = req;
+        node->span += req->count;
+        q->merges++;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Queues an asynchronous transfer of at most dev->max_sectors; req->done runs
+ * on completion (possibly in interrupt context).
+ */
+static void blk_submit(block_dev_t *dev, blk_req_t *req) {
+    req->status = BLK_PENDING;
+    req->next = NULL;
+    req->chain = NULL;
+    req->span = req->count;
+    req->deadline = ticks + (req->write ? BLKQ_WRITE_EXPIRE_TICKS : BLKQ_READ_EXPIRE_TICKS);
+    uint64_t flags = irq_save();
+    if (!blkq_merge(dev, req)) {
+        dev->queue.elv->add(&dev->queue, req);
+    }
+    irq_restore(flags);
+    blkq_run(dev, 0);
+}
+
+/* Holds dispatch back so a burst of submissions can merge. */
+static void blk_plug(block_dev_t *dev) {
+    uint64_t flags = irq_save();
+    dev->queue.plugged++;
+    irq_restore(flags);
+}
+
+static void blk_unplug(block_dev_t *dev) {
+    uint64_t flags = irq_save();
+    int run = dev->queue.plugged > 0 && --dev->queue.plugged == 0;
+    irq_restore(flags);
+    if (run) {
+        blkq_run(dev, 0);
+    }
+}
+
+static int blk_wait_run(block_dev_t *dev, blk_req_t *req, int force) {
+    for (;;) {
+        blkq_run(dev, force);
+        uint32_t seen = dev->completed;
+        if (req->status != BLK_PENDING) {
+            break;
+        }
+        block_idle(dev, seen);
+    }
+    return req->status == BLK_OK;
+}
+
+static int blk_wait(block_dev_t *dev, blk_req_t *req) {
+    return blk_wait_run(dev, req, 0);
+}
+
+/* Like blk_wait, but dispatches past any plug on dev so a plugged caller cannot wait on itself. */
+static int blk_wait_forced(block_dev_t *dev, blk_req_t *req) {
+    return blk_wait_run(dev, req, 1);
+}
+
+static int block_read(block_dev_t *dev, uint64_t lba, uint32_t count, void *buf) {
+    uint8_t *dst = (uint8_t *)buf;
+    while (count > 0) {
+        uint32_t n = (count < dev->max_sectors) ? count : dev->max_sectors;
+        blk_req_t req = {lba, n, dst, BLK_PENDING, NULL, dev, 0, NULL, NULL, 0, 0};
+        blk_submit(dev, &req);
+        if (!blk_wait(dev, &req)) {
+            return 0;
+        }
+        lba += n;
+        count -= n;
+        dst += (uint64_t)n * 512;
+    }
+    return 1;
+}
+
+/*
+ * Gives the block cache about an eighth of free RAM (capped at
+ * BCACHE_MAX_BYTES); falls back to a small static pool without one.
+ */
+static void bcache_init(void) {
+    uint64_t bytes = mem_available() / 8;
+    if (bytes > BCACHE_MAX_BYTES) {
+        bytes = BCACHE_MAX_BYTES;
+    }
+    uint32_t n = (uint32_t)(bytes / (BCACHE_BLOCK_SIZE + sizeof(bcache_buf_t) + sizeof(bcache_buf_t *)));
+    uint32_t buckets = 1;
+    while (buckets < n) {
+        buckets <<= 1;
+    }
+    uint64_t meta = (uint64_t)n * sizeof(bcache_buf_t) + (uint64_t)buckets * sizeof(bcache_buf_t *);
+    uint8_t *data = NULL;
+    uint8_t *hdrs = NULL;
+    if (n > BCACHE_STATIC_BLOCKS) {
+        data = (uint8_t *)page_alloc((uint64_t)n * BCACHE_BLOCK_SIZE / PAGE_SIZE);
+        hdrs = (uint8_t *)page_alloc((meta + PAGE_SIZE - 1) / PAGE_SIZE);
+    }
+    if (data != NULL && hdrs != NULL) {
+        bcache.bufs = (bcache_buf_t *)hdrs;
+        bcache.hash = (bcache_buf_t **)(hdrs + (uint64_t)n * sizeof(bcache_buf_t));
+    } else {
+        n = BCACHE_STATIC_BLOCKS;
+        buckets = BCACHE_STATIC_BLOCKS;
+        data = &bcache_static_data[0][0];
+        bcache.bufs = bcache_static_bufs;
+        bcache.hash = bcache_static_hash;
+    }
+    bcache.nbufs = n;
+    bcache.hash_mask = buckets - 1;
+    for (uint32_t i = 0; i < buckets; ++i) {
+        bcache.hash[i] = NULL;
+    }
+    for (uint32_t i = 0; i < n; ++i) {
+        bcache_buf_t *b = &bcache.bufs[i];
+        b->dev = NULL;
+        b->block = 0;
+        b->data = data + (uint64_t)i * BCACHE_BLOCK_SIZE;
+        b->hnext = NULL;
+        /* Tail first in address order, so early readahead lands contiguously and merges copy-free. */
+        b->lru_prev = (i + 1 < n) ? &bcache.bufs[i + 1] : NULL;
+        b->lru_next = (i > 0) ? &bcache.bufs[i - 1] : NULL;
+        b->req.status = BLK_ERROR;
+    }
+    bcache.lru_head = &bcache.bufs[n - 1];
+    bcache.lru_tail = &bcache.bufs[0];
+}
+
+static uint32_t bcache_hash(const block_dev_t *dev, uint64_t block) {
+    uint64_t key = block ^ ((uint64_t)(uintptr_t)dev >> 4);
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 40) & bcache.hash_mask;
+}
+
+static bcache_buf_t *bcache_lookup(const block_dev_t *dev, uint64_t block) {
+    for (bcache_buf_t *b = bcache.hash[bcache_hash(dev, block)]; b != NULL; b = b->hnext) {
+        if (b->dev == dev && b->block == block) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static void bcache_unhash(bcache_buf_t *b) {
+    bcache_buf_t **pp = &bcache.hash[bcache_hash(b->dev, b->block)];
+    while (*pp != NULL && *pp != b) {
+        pp = &(*pp)->hnext;
+    }
+    if (*pp == b) {
+        *pp = b->hnext;
+    }
+    b->dev = NULL;
+    b->hnext = NULL;
+}
+
+/* Moves b to the most-recently-used end. */
+static void bcache_touch(bcache_buf_t *b) {
+    if (bcache.lru_head == b) {
+        return;
+    }
+    b->lru_prev->lru_next = b->lru_next;
+    if (b->lru_next != NULL) {
+        b->lru_next->lru_prev = b->lru_prev;
+    } else {
+        bcache.lru_tail = b->lru_prev;
+    }
+    b->lru_prev = NULL;
+    b->lru_next = bcache.lru_head;
+    bcache.lru_head->lru_prev = b;
+    bcache.lru_head = b;
+}
+
+/*
+ * Recycles the least recently used idle buffer for (dev, block) and queues
+ * its read. Returns NULL if every buffer is still filling.
+ */
+static bcache_buf_t *bcache_start(block_dev_t *dev, uint64_t block) {
+    bcache_buf_t *b = bcache.lru_tail;
+    while (b != NULL && b->req.status == BLK_PENDING) {
+        b = b->lru_prev;
+    }
+    if (b == NULL) {
+        return NULL;
+    }
+    uint64_t lba = block * BCACHE_BLOCK_SECTORS;
+    uint32_t count = BCACHE_BLOCK_SECTORS;
+    if (lba + count > dev->sectors) {
+        count = (uint32_t)(dev->sectors - lba);
+    }
+    if (b->dev != NULL) {
+        bcache_unhash(b);
+        bcache.evictions++;
+    }
+    b->req.lba = lba;
+    b->req.count = count;
+    b->req.buf = b->data;
+    b->req.done = NULL;
+    b->req.ctx = dev;
+    b->req.write = 0;
+    blk_submit(dev, &b->req);
+    uint32_t h = bcache_hash(dev, block);
+    b->dev = dev;
+    b->block = block;
+    b->hnext = bcache.hash[h];
+    bcache.hash[h] = b;
+    bcache_touch(b);
+    return b;
+}
+
+static bcache_stream_t *bcache_stream(block_dev_t *dev, uint64_t block) {
+    for (uint32_t i = 0; i < BCACHE_STREAMS; ++i) {
+        bcache_stream_t *s = &bcache.streams[i];
+        if (s->dev == dev && (block == s->last || block == s->last + 1)) {
+            return s;
+        }
+    }
+    bcache_stream_t *s = &bcache.streams[bcache.stream_clock++ % BCACHE_STREAMS];
+    s->dev = dev;
+    s->last = block;
+    s->next = block + 1;
+    s->window = 0;
+    return s;
+}
+
+/* Keeps up to window blocks in flight ahead of a sequential reader. */
+static void bcache_readahead(block_dev_t *dev, uint64_t block) {
+    bcache_stream_t *s = bcache_stream(dev, block);
+    if (block == s->last + 1) {
+        s->window = (s->window == 0) ? BCACHE_RA_MIN : s->window * 2;
+        if (s->window > BCACHE_RA_MAX) {
+            s->window = BCACHE_RA_MAX;
+        }
+        if (s->window > bcache.nbufs / 4) {
+            s->window = bcache.nbufs / 4;
+        }
+    }
+    s->last = block;
+    if (s->window == 0) {
+        return;
+    }
+    uint64_t end = block + 1 + s->window;
+    uint64_t blocks = (dev->sectors + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+    if (end > blocks) {
+        end = blocks;
+    }
+    uint64_t b = (s->next > block) ? s->next : block + 1;
+    for (; b < end; ++b) {
+        if (bcache_lookup(dev, b) != NULL) {
+            continue;
+        }
+        if (bcache_start(dev, b) == NULL) {
+            break;
+        }
+        bcache.readahead++;
+    }
+    s->next = b;
+}
+
+/*
+ * Returns the valid cache block for (dev, block), reading it on a miss.
+ * The miss and any readahead are queued under one plug so adjacent blocks
+ * leave as a single merged transfer.
+ */
+static bcache_buf_t *bcache_get(block_dev_t *dev, uint64_t block) {
+    bcache_buf_t *b = bcache_lookup(dev, block);
+    blk_plug(dev);
+    if (b != NULL && b->req.status != BLK_ERROR) {
+        bcache.hits++;
+        bcache_touch(b);
+    } else {
+        bcache.misses++;
+        if (b != NULL) {
+            bcache_unhash(b);
+        }
+        for (;;) {
+            uint32_t seen = dev->completed;
+            b = bcache_start(dev, block);
+            if (b != NULL) {
+                break;
+            }
+            blk_unplug(dev);
+            block_idle(dev, seen);
+            blk_plug(dev);
+        }
+    }
+    bcache_readahead(dev, block);
+    blk_unplug(dev);
+    return blk_wait(dev, &b->req) ? b : NULL;
+}
+
+/* Points at one cached sector; valid until the next cache call. */
+static const uint8_t *bcache_sector(block_dev_t *dev, uint64_t lba) {
+    bcache_buf_t *b = bcache_get(dev, lba / BCACHE_BLOCK_SECTORS);
+    if (b == NULL) {
+        return NULL;
+    }
+    return b->data + (lba % BCACHE_BLOCK_SECTORS) * 512;
+}
+
+/*
+ * Copies count sectors out of the cache. Each batch of missing blocks is
+ * queued under one plug so a contiguous range reaches the device as one
+ * merged transfer rather than a read per block.
+ */
+static int bcache_read(block_dev_t *dev, uint64_t lba, uint32_t count, void *buf) {
+    uint8_t *dst = (uint8_t *)buf;
+    uint32_t batch_max = bcache.nbufs / 4;
+    if (batch_max == 0) {
+        batch_max = 1;
+    }
+    while (count > 0) {
+        uint64_t first = lba / BCACHE_BLOCK_SECTORS;
+        uint64_t last = (lba + count - 1) / BCACHE_BLOCK_SECTORS;
+        if (last - first >= batch_max) {
+            last = first + batch_max - 1;
+        }
+        blk_plug(dev);
+        for (uint64_t blk = first; blk <= last; ++blk) {
+            bcache_buf_t *b = bcache_lookup(dev, blk);
+            if (b != NULL && b->req.status != BLK_ERROR) {
+                bcache.hits++;
+                bcache_touch(b);
+                continue;
+            }
+            if (b != NULL) {
+                bcache_unhash(b);
+            }
+            if (bcache_start(dev, blk) == NULL) {
+                break;
+            }
+            bcache.misses++;
+        }
+        bcache_readahead(dev, last);
+        blk_unplug(dev);
+        for (uint64_t blk = first; blk <= last; ++blk) {
+            uint32_t off = (uint32_t)(lba % BCACHE_BLOCK_SECTORS);
+            uint32_t n = BCACHE_BLOCK_SECTORS - off;
+            if (n > count) {
+                n = count;
+            }
+            bcache_buf_t *b = bcache_lookup(dev, blk);
+            if (b == NULL || !blk_wait(dev, &b->req)) {
+                b = bcache_get(dev, blk);
+            }
+            if (b == NULL) {
+                return 0;
+            }
+            kmemcpy(dst, b->data + off * 512, n * 512);
+            dst += n * 512;
+            lba += n;
+            count -= n;
+        }
+    }
+    return 1;
+}
+
+/* Starts reading any uncached blocks of the range and returns without waiting. */
+static void bcache_prefetch(block_dev_t *dev, uint64_t lba, uint32_t count) {
+    uint64_t first = lba / BCACHE_BLOCK_SECTORS;
+    uint64_t last = (lba + count - 1) / BCACHE_BLOCK_SECTORS;
+    if (count == 0 || bcache.nbufs < 4) {
+        return;
+    }
+    if (last - first >= bcache.nbufs / 4) {
+        last = first + bcache.nbufs / 4 - 1;
+    }
+    blk_plug(dev);
+    for (uint64_t blk = first; blk <= last; ++blk) {
+        if (bcache_lookup(dev, blk) != NULL) {
+            continue;
+        }
+        if (bcache_start(dev, blk) == NULL) {
+            break;
+        }
+        bcache.readahead++;
+    }
+    blk_unplug(dev);
+}
+
+static void bcache_write_done(blk_req_t *req) {
+    if (req->status != BLK_OK) {
+        bcache.write_failed = 1;
+    }
+}
+
+/* Waits for req past any plug on its device, so a full write ring cannot stall behind it. */
+static void bcache_write_wait(blk_req_t *req) {
+    blk_wait_forced((block_dev_t *)req->ctx, req);
+}
+
+/*
+ * Write-through: refreshes any cached copy, then queues the write from buf
+ * without waiting. buf must stay untouched until bcache_sync; writes issued
+ * under a plug merge like reads do. An empty write does nothing.
+ */
+static void bcache_write(block_dev_t *dev, uint64_t lba, uint32_t count, const void *buf) {
+    const uint8_t *src = (const uint8_t *)buf;
+    if (count == 0) {
+        return;
+    }
+    for (uint64_t blk = lba / BCACHE_BLOCK_SECTORS; blk <= (lba + count - 1) / BCACHE_BLOCK_SECTORS; ++blk) {
+        bcache_buf_t *b = bcache_lookup(dev, blk);
+        if (b == NULL) {
+            continue;
+        }
+        if (b->req.status == BLK_PENDING) {
+            bcache_write_wait(&b->req);
+        }
+        if (b->req.status != BLK_OK) {
+            continue;
+        }
+        uint64_t first = blk * BCACHE_BLOCK_SECTORS;
+        uint64_t from = (lba > first) ? lba : first;
+        uint64_t to = (lba + count < first + BCACHE_BLOCK_SECTORS) ? lba + count : first + BCACHE_BLOCK_SECTORS;
+        kmemcpy(b->data + (from - first) * 512, src + (from - lba) * 512, (size_t)(to - from) * 512);
+    }
+    while (count > 0) {
+        uint32_t n = (count < dev->max_sectors) ? count : dev->max_sectors;
+        blk_req_t *req = &bcache_wreqs[bcache.wnext++ % BCACHE_WRITE_REQS];
+        if (req->status == BLK_PENDING) {
+            bcache_write_wait(req);
+        }
+        req->lba = lba;
+        req->count = n;
+        req->buf = (void *)src;
+        req->done = bcache_write_done;
+        req->ctx = dev;
+        req->write = 1;
+        blk_submit(dev, req);
+        bcache.writes++;
+        lba += n;
+        count -= n;
+        src += (size_t)n * 512;
+    }
+}
+
+/* Waits for every queued write; 0 if any failed since the last sync. */
+static int bcache_sync(void) {
+    for (uint32_t i = 0; i < BCACHE_WRITE_REQS; ++i) {
+        if (bcache_wreqs[i].status == BLK_PENDING) {
+            bcache_write_wait(&bcache_wreqs[i]);
+        }
+    }
+    int ok = !bcache.write_failed;
+    bcache.write_failed = 0;
+    return ok;
+}
+
+static uint32_t fat_le32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void fat_put_le32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+/* Byte offset of cluster's entry within a FAT. */
+static uint32_t fat_entry_offset(uint32_t cluster) {
+    if (fat_fs.fat_type == 32) {
+        return cluster * 4;
+    }
+    return (fat_fs.fat_type == 12) ? (cluster + cluster / 2) : (cluster * 2);
+}
+
+static uint32_t fat_read_entry(uint32_t cluster) {
+    uint32_t fat_offset = fat_entry_offset(cluster);
+    uint32_t fat_sector_lba = fat_fs.fat_start_lba + (fat_offset / 512);
+    uint32_t ent_offset = fat_offset % 512;
+
+    const uint8_t *sec = bcache_sector(fat_fs.dev, fat_sector_lba);
+    if (sec == NULL) {
+        return 0xFFFFFFFF;
+    }
+    if (fat_fs.fat_type == 32) {
+        return fat_le32(sec + ent_offset) & 0x0FFFFFFF;
+    }
+    uint16_t val = sec[ent_offset];
+    if (ent_offset == 511) {
+        /* FAT12 entry straddling two sectors. */
+        sec = bcache_sector(fat_fs.dev, fat_sector_lba + 1);
+        if (sec == NULL) {
+            return 0xFFFFFFFF;
+        }
+        val |= (uint16_t)(sec[0] << 8);
+    } else {
+        val |= (uint16_t)(sec[ent_offset + 1] << 8);
+    }
+    if (fat_fs.fat_type == 12) {
+        return (cluster & 1) ? (val >> 4) : (val & 0x0FFF);
+    }
+    return val;
+}
+
+/* Table slot of cluster, allocating its page on first use; NULL when out of memory. */
+static uint32_t *fat_table_slot(uint32_t cluster) {
+    uint32_t **page = &fat_fs.table[cluster / FAT_TABLE_SPAN];
+    if (*page == NULL) {
+        *page = (uint32_t *)page_alloc(1);
+        if (*page == NULL) {
+            return NULL;
+        }
+        kmemzero(*page, PAGE_SIZE);
+    }
+    return &(*page)[cluster % FAT_TABLE_SPAN];
+}
+
+/* Decodes one FAT32 sector (128 entries) into the table on first use. */
+static int fat_load_sector(uint32_t sector) {
+    uint32_t *slot = fat_table_slot(sector * 128);
+    const uint8_t *sec = (slot != NULL) ? bcache_sector(fat_fs.dev, fat_fs.fat_start_lba + sector) : NULL;
+    if (sec == NULL) {
+        return 0;
+    }
+    uint32_t entries = fat_fs.total_clusters + 2;
+    for (uint32_t i = 0; i < 128 && sector * 128 + i < entries; ++i) {
+        slot[i] = fat_le32(sec + i * 4) & 0x0FFFFFFF;
+    }
+    fat_fs.table_loaded[sector / 8] |= (uint8_t)(1u << (sector % 8));
+    return 1;
+}
+
+/*
+ * Table lookup; FAT32 tables fill in lazily, a page at a time, so mounting
+ * a large volume reads nothing up front and only the parts of the FAT in
+ * use take memory. 0xFFFFFFFF when the sector cannot be loaded.
+ */
+static uint32_t fat_get(uint32_t cluster) {
+    if (fat_fs.fat_type == 32) {
+        uint32_t sector = cluster / 128;
+        if ((fat_fs.table_loaded[sector / 8] & (1u << (sector % 8))) == 0 && !fat_load_sector(sector)) {
+            return 0xFFFFFFFF;
+        }
+    }
+    return fat_fs.table[cluster / FAT_TABLE_SPAN][cluster % FAT_TABLE_SPAN];
+}
+
+/*
+ * FSInfo's free count and next-free hint, when its signatures check out
+ * and the values are in range; otherwise the free count comes from a full
+ * table scan.
+ */
+static void fat_load_fsinfo(void) {
+    const uint8_t *sec = (fat_fs.fsinfo_lba != 0) ? bcache_sector(fat_fs.dev, fat_fs.fsinfo_lba) : NULL;
+    fat_fs.free_clusters = 0xFFFFFFFF;
+    if (sec != NULL && fat_le32(sec) == 0x41615252 && fat_le32(sec + 484) == 0x61417272) {
+        uint32_t free_count = fat_le32(sec + 488);
+        uint32_t next = fat_le32(sec + 492);
+        if (free_count <= fat_fs.total_clusters) {
+            fat_fs.free_clusters = free_count;
+        }
+        if (next >= 2 && next < fat_fs.total_clusters + 2) {
+            fat_fs.next_free = next;
+        }
+    } else {
+        fat_fs.fsinfo_lba = 0;
+    }
+}
+
+/*
+ * Builds fat_fs.table from the first FAT so chain walks never touch the
+ * disk; the table stays the authority for cluster links afterwards.
+ * FAT12/16 decode eagerly, FAT32 one sector at a time on demand. Only the
+ * page directory is allocated here.
+ */
+static void fat_load_table(void) {
+    uint32_t entries = fat_fs.total_clusters + 2;
+    uint32_t spf = fat_fs.sectors_per_fat;
+    uint64_t dir_bytes = (uint64_t)(entries + FAT_TABLE_SPAN - 1) / FAT_TABLE_SPAN * sizeof(uint32_t *);
+    fat_fs.table = (uint32_t **)page_alloc((dir_bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    fat_fs.fat_dirty = (uint8_t *)page_alloc((spf / 8 + PAGE_SIZE) / PAGE_SIZE);
+    fat_fs.table_loaded = (uint8_t *)page_alloc((spf / 8 + PAGE_SIZE) / PAGE_SIZE);
+    if (fat_fs.table == NULL || fat_fs.fat_dirty == NULL || fat_fs.table_loaded == NULL) {
+        fat_fs.table = NULL;
+        return;
+    }
+    kmemzero(fat_fs.table, (size_t)dir_bytes);
+    for (uint32_t i = 0; i <= spf / 8; ++i) {
+        fat_fs.fat_dirty[i] = 0;
+        fat_fs.table_loaded[i] = 0;
+    }
+    fat_fs.table_dirty = 0;
+    fat_fs.read_only = 0;
+    fat_fs.reserved_clusters = 0;
+    fat_fs.next_free = 2;
+    if (fat_fs.fat_type == 32) {
+        fat_load_fsinfo();
+    } else {
+        for (uint32_t c = 0; c < entries; ++c) {
+            uint32_t v = fat_read_entry(c);
+            uint32_t *slot = (v != 0xFFFFFFFF) ? fat_table_slot(c) : NULL;
+            if (slot == NULL) {
+                fat_fs.table = NULL;
+                return;
+            }
+            *slot = v;
+        }
+        fat_fs.free_clusters = 0xFFFFFFFF;
+    }
+    if (fat_fs.free_clusters == 0xFFFFFFFF) {
+        fat_fs.free_clusters = 0;
+        for (uint32_t c = 2; c < entries; ++c) {
+            fat_fs.free_clusters += (fat_get(c) == 0);
+        }
+    }
+}
+
+static int fat_init(block_dev_t *dev) {
+    fat_fs.valid = 0;
+    fat_fs.dev = dev;
+    fat_fs.table = NULL;
+    /* Copied out: the FAT table load below goes through the cache and can evict sector 0. */
+    uint8_t raw[90];
+    const uint8_t *sec = bcache_sector(dev, 0);
+    if (sec == NULL) {
+        return 0;
+    }
+    kmemcpy(raw, sec, sizeof(raw));
+    kmemcpy(&fat_fs.bpb, raw, sizeof(fat_fs.bpb));
+    const fat_bpb_t *bpb = &fat_fs.bpb;
+    if (bpb->bytes_per_sector != 512 || bpb->sectors_per_cluster == 0 || bpb->num_fats == 0) {
+        return 0;
+    }
+
+    /* FAT32 zeroes the 16-bit FAT size and keeps its own extended BPB at offset 36. */
+    fat_fs.sectors_per_fat = bpb->sectors_per_fat16 ? bpb->sectors_per_fat16 : fat_le32(raw + 36);
+    fat_fs.total_sectors = bpb->total_sectors16 ? bpb->total_sectors16 : bpb->total_sectors32;
+    fat_fs.fat_start_lba = bpb->reserved_sectors;
+    fat_fs.fat_copies = bpb->num_fats;
+    fat_fs.root_dir_sectors = ((bpb->root_entries * 32) + 511) / 512;
+    fat_fs.root_start_lba = fat_fs.fat_start_lba + (bpb->num_fats * fat_fs.sectors_per_fat);
+    fat_fs.data_start_lba = fat_fs.root_start_lba + fat_fs.root_dir_sectors;
+    if (fat_fs.sectors_per_fat == 0 || fat_fs.data_start_lba >= fat_fs.total_sectors) {
+        return 0;
+    }
+
+    uint32_t data_sectors = fat_fs.total_sectors - fat_fs.data_start_lba;
+    fat_fs.total_clusters = data_sectors / bpb->sectors_per_cluster;
+    fat_fs.fat_type = (fat_fs.total_clusters < 4085) ? 12 : (fat_fs.total_clusters < 65525) ? 16 : 32;
+    fat_fs.root_cluster = 0;
+    fat_fs.fsinfo_lba = 0;
+    if (fat_fs.fat_type == 32) {
+        uint16_t ext_flags = (uint16_t)(raw[40] | (raw[41] << 8));
+        uint16_t fsinfo = (uint16_t)(raw[48] | (raw[49] << 8));
+        if (bpb->sectors_per_fat16 != 0 || bpb->root_entries != 0) {
+            return 0;
+        }
+        if (ext_flags & 0x80) {
+            /* Mirroring off: only the active FAT is read and written. */
+            fat_fs.fat_start_lba += (ext_flags & 0xF) * fat_fs.sectors_per_fat;
+            fat_fs.fat_copies = 1;
+        }
+        fat_fs.root_cluster = fat_le32(raw + 44) & 0x0FFFFFFF;
+        fat_fs.fsinfo_lba = (fsinfo != 0 && fsinfo != 0xFFFF && fsinfo < bpb->reserved_sectors) ? fsinfo : 0;
+        if (fat_fs.total_clusters > fat_fs.sectors_per_fat * 128 - 2) {
+            fat_fs.total_clusters = fat_fs.sectors_per_fat * 128 - 2;
+        }
+    }
+    fat_load_table();
+    fat_fs.valid = 1;
+    return 1;
+}
+
+static void fat_mount(void) {
+    for (int i = 0; i < block_dev_count; ++i) {
+        if (fat_init(block_devs[i])) {
+            return;
+        }
+    }
+}
+
+static uint32_t fat_cluster_to_lba(uint32_t cluster) {
+    return fat_fs.data_start_lba + (cluster - 2) * fat_fs.bpb.sectors_per_cluster;
+}
+
+static uint32_t fat_next_cluster(uint32_t cluster) {
+    if (fat_fs.table != NULL) {
+        return (cluster < fat_fs.total_clusters + 2) ? fat_get(cluster) : 0xFFFFFFFF;
+    }
+    return fat_read_entry(cluster);
+}
+
+static uint32_t fat_eoc(void) {
+    if (fat_fs.fat_type == 32) {
+        return 0x0FFFFFF8;
+    }
+    return (fat_fs.fat_type == 12) ? 0xFF8 : 0xFFF8;
+}
+
+/* First cluster of directory dir; 0 stays 0 only for the fixed FAT12/16 root. */
+static uint32_t fat_dir_start(uint32_t dir) {
+    return (dir == 0 && fat_fs.fat_type == 32) ? fat_fs.root_cluster : dir;
+}
+
+static char fat_upper(char c) {
+    return (c >= 'a' && c <= 'z') ? (char)(c - 32) : c;
+}
+
+/* FNV-1a over the upper-cased name: FAT lookups ignore case. */
+static uint32_t fat_name_hash(const char *name, uint32_t len) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; ++i) {
+        h = (h ^ (uint8_t)fat_upper(name[i])) * 16777619u;
+    }
+    return h;
+}
+
+static int fat_name_equal(const char *a, const char *b, uint32_t len) {
+    for (uint32_t i = 0; i < len; ++i) {
+        if (fat_upper(a[i]) != fat_upper(b[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Byte offsets of the 13 UCS-2 characters in an LFN entry. */
+static const uint8_t fat_lfn_offs[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+static uint8_t fat_lfn_checksum(const uint8_t *short_name) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; ++i) {
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    }
+    return sum;
+}
+
+/* "NAME    EXT" -> "NAME.EXT", honouring the NT lower-case flags in byte 12. */
+static uint32_t fat_short_name(const uint8_t *ent, char *out) {
+    uint32_t n = 0;
+    for (int i = 0; i < 8 && ent[i] != ' '; ++i) {
+        char c = (char)((i == 0 && ent[0] == 0x05) ? 0xE5 : ent[i]);
+        out[n++] = (ent[12] & 0x08) && c >= 'A' && c <= 'Z' ? (char)(c + 32) : c;
+    }
+    if (ent[8] != ' ') {
+        out[n++] = '.';
+        for (int i = 8; i < 11 && ent[i] != ' '; ++i) {
+            char c = (char)ent[i];
+            out[n++] = (ent[12] & 0x10) && c >= 'A' && c <= 'Z' ? (char)(c + 32) : c;
+        }
+    }
+    return n;
+}
+
+/*
+ * Calls visit for every live entry of the directory starting at cluster
+ * (0 = root), passing the long name when a valid LFN run precedes the
+ * 8.3 entry, else NULL, and the entry's slot index. visit returns nonzero
+ * to stop the walk.
+ */
+static int fat_dir_walk(uint32_t cluster,
+                        int (*visit)(void *ctx, const char *lfn, uint32_t lfn_len, const uint8_t *ent, uint32_t slot),
+                        void *ctx) {
+    char lfn[FAT_LFN_MAX + 1];
+    uint32_t lfn_len = 0;
+    uint8_t lfn_sum = 0;
+    uint8_t lfn_next = 0; /* sequence number expected next, 0 = no run */
+    uint32_t eoc = fat_eoc();
+    uint32_t spc = fat_fs.bpb.sectors_per_cluster;
+    uint32_t s = 0;
+    uint32_t slot = 0;
+
+    cluster = fat_dir_start(cluster);
+    for (;;) {
+        uint32_t lba;
+        if (cluster == 0) {
+            if (s >= fat_fs.root_dir_sectors) {
+                return 0;
+            }
+            lba = fat_fs.root_start_lba + s;
+        } else {
+            if (s == spc) {
+                cluster = fat_next_cluster(cluster);
+                s = 0;
+            }
+            if (cluster < 2 || cluster >= eoc) {
+                return 0;
+            }
+            lba = fat_cluster_to_lba(cluster) + s;
+        }
+        s++;
+        const uint8_t *sec = bcache_sector(fat_fs.dev, lba);
+        if (sec == NULL) {
+            return 0;
+        }
+        for (uint32_t i = 0; i < 16; ++i, ++slot) {
+            const uint8_t *ent = &sec[i * 32];
+            if (ent[0] == 0x00) {
+                return 0;
+            }
+            if (ent[0] == 0xE5) {
+                lfn_next = 0;
+                continue;
+            }
+            if (ent[11] == 0x0F) {
+                uint8_t seq = ent[0] & 0x1F;
+                if (ent[0] & 0x40) {
+                    lfn_next = seq;
+                    lfn_sum = ent[13];
+                    lfn_len = (seq * 13u <= FAT_LFN_MAX) ? seq * 13u : 0;
+                    if (lfn_len == 0) {
+                        lfn_next = 0;
+                    }
+                }
+                if (lfn_next == 0 || seq != lfn_next || ent[13] != lfn_sum) {
+                    lfn_next = 0;
+                    continue;
+                }
+                for (uint32_t k = 0; k < 13; ++k) {
+                    uint16_t ch = (uint16_t)(ent[fat_lfn_offs[k]] | (ent[fat_lfn_offs[k] + 1] << 8));
+                    uint32_t at = (seq - 1u) * 13u + k;
+                    if (ch == 0x0000) {
+                        lfn_len = at;
+                    } else if (ch != 0xFFFF && at < lfn_len) {
+                        lfn[at] = (ch < 0x80) ? (char)ch : '?';
+                    }
+                }
+                lfn_next = (uint8_t)(seq - 1);
+                if (lfn_next == 0) {
+                    lfn_next = 0xFF; /* complete: waiting for the 8.3 entry */
+                }
+                continue;
+            }
+            int have_lfn = (lfn_next == 0xFF && fat_lfn_checksum(ent) == lfn_sum);
+            lfn_next = 0;
+            if (ent[11] & 0x08) {
+                continue; /* volume label */
+            }
+            if (visit(ctx, have_lfn ? lfn : NULL, have_lfn ? lfn_len : 0, ent, slot)) {
+                return 1;
+            }
+        }
+    }
+}
+
+static void fat_dirent_fill(fat_dirent_t *d, const uint8_t *ent, uint32_t slot) {
+    d->slot = slot;
+    d->cluster = (uint32_t)(ent[26] | (ent[27] << 8));
+    if (fat_fs.fat_type == 32) {
+        d->cluster |= (uint32_t)(ent[20] | (ent[21] << 8)) << 16;
+    }
+    d->size = (uint32_t)(ent[28] | (ent[29] << 8) | (ent[30] << 16) | (ent[31] << 24));
+    d->attr = ent[11];
+}
+
+static void fat_index_add(fat_dir_index_t *ix, const char *name, uint32_t len, const uint8_t *ent, uint32_t slot, uint8_t alias) {
+    if (ix->count >= ix->cap || ix->names_used + len > ix->names_cap) {
+        ix->complete = 0;
+        return;
+    }
+    if (ix->ents == NULL) {
+        ix->count++;
+        ix->names_used += len;
+        return;
+    }
+    fat_dirent_t *d = &ix->ents[ix->count];
+    kmemcpy(ix->names + ix->names_used, name, len);
+    d->name_off = ix->names_used;
+    d->name_len = (uint16_t)len;
+    d->hash = fat_name_hash(name, len);
+    d->alias = alias;
+    fat_dirent_fill(d, ent, slot);
+    d->next = ix->heads[d->hash & ix->hash_mask];
+    ix->heads[d->hash & ix->hash_mask] = (uint16_t)ix->count;
+    ix->names_used += len;
+    ix->count++;
+}
+
+/* Indexes the long name and, as an alias, the 8.3 name of each entry. */
+static int fat_index_visit(void *ctx, const char *lfn, uint32_t lfn_len, const uint8_t *ent, uint32_t slot) {
+    fat_dir_index_t *ix = (fat_dir_index_t *)ctx;
+    char short_name[12];
+    uint32_t short_len = fat_short_name(ent, short_name);
+    if (lfn != NULL) {
+        fat_index_add(ix, lfn, lfn_len, ent, slot, 0);
+    }
+    if (lfn == NULL || lfn_len != short_len || !fat_name_equal(lfn, short_name, short_len)) {
+        fat_index_add(ix, short_name, short_len, ent, slot, lfn != NULL);
+    }
+    return 0;
+}
+
+/*
+ * Returns the index for dir_cluster, building it on first use (LRU over
+ * FAT_DIR_SLOTS). A first walk counts entries and name bytes so the index
+ * is sized to the directory; a slot keeps its buffer while it is big
+ * enough and hands it back to the page pool when it has to grow.
+ */
+static fat_dir_index_t *fat_dir_index(uint32_t dir_cluster) {
+    fat_dir_index_t *victim = &fat_dirs[0];
+    for (uint32_t i = 0; i < FAT_DIR_SLOTS; ++i) {
+        fat_dir_index_t *ix = &fat_dirs[i];
+        if (ix->used && ix->cluster == dir_cluster) {
+            ix->stamp = ++fat_dir_clock;
+            return ix;
+        }
+        if (!ix->used || (victim->used && ix->stamp < victim->stamp)) {
+            victim = ix;
+        }
+    }
+    fat_dir_index_t size = {0};
+    size.complete = 1;
+    size.cap = FAT_DIR_ENTRIES;
+    size.names_cap = FAT_DIR_NAMES;
+    fat_dir_walk(dir_cluster, fat_index_visit, &size);
+    uint32_t hash = 16;
+    while (hash < size.count && hash < FAT_DIR_HASH) {
+        hash *= 2;
+    }
+    uint64_t ents_bytes = (uint64_t)size.count * sizeof(fat_dirent_t);
+    uint64_t bytes = ents_bytes + hash * sizeof(uint16_t) + size.names_used;
+    uint32_t pages = (uint32_t)((bytes + PAGE_SIZE - 1) / PAGE_SIZE);
+    victim->used = 0;
+    if (victim->pages < pages) {
+        for (uint32_t i = 0; i < victim->pages; ++i) {
+            mm_page_free((uint8_t *)victim->ents + (uint64_t)i * PAGE_SIZE);
+        }
+        victim->pages = 0;
+        victim->ents = (fat_dirent_t *)page_alloc(pages);
+        if (victim->ents == NULL) {
+            return NULL;
+        }
+        victim->pages = pages;
+    }
+    victim->heads = (uint16_t *)((uint8_t *)victim->ents + ents_bytes);
+    victim->names = (char *)(victim->heads + hash);
+    victim->hash_mask = hash - 1;
+    victim->cap = size.count;
+    victim->names_cap = size.names_used;
+    victim->used = 1;
+    victim->cluster = dir_cluster;
+    victim->complete = size.complete;
+    victim->count = 0;
+    victim->names_used = 0;
+    victim->stamp = ++fat_dir_clock;
+    for (uint32_t i = 0; i < hash; ++i) {
+        victim->heads[i] = FAT_DIR_NONE;
+    }
+    fat_dir_walk(dir_cluster, fat_index_visit, victim);
+    return victim;
+}
+
+typedef struct {
+    const char *name;
+    uint32_t len;
+    fat_dirent_t *out;
+} fat_scan_t;
+
+static int fat_scan_visit(void *ctx, const char *lfn, uint32_t lfn_len, const uint8_t *ent, uint32_t slot) {
+    fat_scan_t *sc = (fat_scan_t *)ctx;
+    char short_name[12];
+    uint32_t short_len = fat_short_name(ent, short_name);
+    if ((lfn != NULL && lfn_len == sc->len && fat_name_equal(lfn, sc->name, sc->len)) ||
+        (short_len == sc->len && fat_name_equal(short_name, sc->name, sc->len))) {
+        fat_dirent_fill(sc->out, ent, slot);
+        return 1;
+    }
+    return 0;
+}
+
+/* O(1) hash probe once the directory is indexed; linear scan if the index overflowed or is unavailable. */
+static int fat_lookup(uint32_t dir_cluster, const char *name, uint32_t len, fat_dirent_t *out) {
+    fat_dir_index_t *ix = fat_dir_index(dir_cluster);
+    if (ix != NULL) {
+        uint32_t h = fat_name_hash(name, len);
+        for (uint16_t i = ix->heads[h & ix->hash_mask]; i != FAT_DIR_NONE; i = ix->ents[i].next) {
+            fat_dirent_t *d = &ix->ents[i];
+            if (d->hash == h && d->name_len == len && fat_name_equal(ix->names + d->name_off, name, len)) {
+                *out = *d;
+                return 1;
+            }
+        }
+        if (ix->complete) {
+            return 0;
+        }
+    }
+    fat_scan_t sc = {name, len, out};
+    return fat_dir_walk(dir_cluster, fat_scan_visit, &sc);
+}
+
+/* Resolves a '/'-separated path from the root; "" and "/" name the root itself. */
+static int fat_resolve(const char *path, fat_dirent_t *out) {
+    if (!fat_fs.valid) {
+        return 0;
+    }
+    out->cluster = 0;
+    out->size = 0;
+    out->attr = 0x10;
+    out->slot = 0xFFFFFFFF;
+    out->parent = 0;
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        const char *start = path;
+        while (*path != '\0' && *path != '/') {
+            path++;
+        }
+        uint32_t len = (uint32_t)(path - start);
+        if (len == 0) {
+            break;
+        }
+        uint32_t parent = out->cluster;
+        if ((out->attr & 0x10) == 0 || !fat_lookup(parent, start, len, out)) {
+            return 0;
+        }
+        out->parent = parent;
+    }
+    return 1;
+}
+
+/* Doubles f's extent array; the old one goes back to the page pool unless it was the inline one. */
+static int fat_extents_grow(fat_file_t *f) {
+    uint32_t cap = f->cap * 2;
+    if (cap > FAT_MAX_EXTENTS) {
+        return 0;
+    }
+    fat_extent_t *e = (fat_extent_t *)page_alloc(((uint64_t)cap * sizeof(fat_extent_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (e == NULL) {
+        return 0;
+    }
+    kmemcpy(e, f->extents, (size_t)f->nextents * sizeof(fat_extent_t));
+    if (f->extents != f->inline_extents) {
+        uint64_t old_pages = ((uint64_t)f->cap * sizeof(fat_extent_t) + PAGE_SIZE - 1) / PAGE_SIZE;
+        for (uint64_t i = 0; i < old_pages; ++i) {
+            mm_page_free((uint8_t *)f->extents + i * PAGE_SIZE);
+        }
+    }
+    f->extents = e;
+    f->cap = cap;
+    return 1;
+}
+
+/* Walks the chain once and collapses it into runs of consecutive clusters. */
+static void fat_map_extents(fat_file_t *f, uint32_t cluster) {
+    uint32_t eoc = fat_eoc();
+    if (f->extents == NULL) {
+        f->extents = f->inline_extents;
+        f->cap = FAT_INLINE_EXTENTS;
+    }
+    f->nextents = 0;
+    f->mapped_clusters = 0;
+    while (cluster >= 2 && cluster < eoc) {
+        fat_extent_t *last = (f->nextents > 0) ? &f->extents[f->nextents - 1] : NULL;
+        if (last != NULL && last->cluster + last->count == cluster) {
+            last->count++;
+        } else if (f->nextents < f->cap || fat_extents_grow(f)) {
+            fat_extent_t *e = &f->extents[f->nextents++];
+            e->file_cluster = f->mapped_clusters;
+            e->cluster = cluster;
+            e->count = 1;
+        } else {
+            break;
+        }
+        f->mapped_clusters++;
+        cluster = fat_next_cluster(cluster);
+    }
+}
+
+/*
+ * Resolves file cluster idx to a disk cluster and the number of
+ * consecutive clusters from there: binary search over the extents, with a
+ * chain walk only past the mapped prefix. Returns 0 past the chain's end.
+ */
+static uint32_t fat_file_cluster(const fat_file_t *f, uint32_t idx, uint32_t *run) {
+    if (idx < f->mapped_clusters) {
+        uint32_t lo = 0;
+        uint32_t hi = f->nextents;
+        while (hi - lo > 1) {
+            uint32_t mid = (lo + hi) / 2;
+            if (f->extents[mid].file_cluster <= idx) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        const fat_extent_t *e = &f->extents[lo];
+        *run = e->count - (idx - e->file_cluster);
+        return e->cluster + (idx - e->file_cluster);
+    }
+    if (f->nextents == 0) {
+        return 0;
+    }
+    const fat_extent_t *e = &f->extents[f->nextents - 1];
+    uint32_t cluster = e->cluster + e->count - 1;
+    uint32_t eoc = fat_eoc();
+    for (uint32_t i = f->mapped_clusters - 1; i < idx; ++i) {
+        cluster = fat_next_cluster(cluster);
+        if (cluster < 2 || cluster >= eoc) {
+            return 0;
+        }
+    }
+    *run = 1;
+    return cluster;
+}
+
+/* Reads up to len bytes at offset; whole sectors of each extent go out as one transfer. */
+static int fat_pread(const fat_file_t *f, uint32_t offset, uint8_t *out, uint32_t len, uint32_t *got) {
+    uint32_t cluster_bytes = (uint32_t)fat_fs.bpb.sectors_per_cluster * 512;
+    uint32_t end = (offset < f->size) ? f->size : offset;
+    if (len < end - offset) {
+        end = offset + len;
+    }
+    uint32_t pos = offset;
+    while (pos < end) {
+        uint32_t run = 0;
+        uint32_t cluster = fat_file_cluster(f, pos / cluster_bytes, &run);
+        if (cluster == 0) {
+            break;
+        }
+        uint32_t in_cluster = pos % cluster_bytes;
+        uint32_t lba = fat_cluster_to_lba(cluster) + in_cluster / 512;
+        uint32_t sec_off = in_cluster % 512;
+        uint32_t chunk = run * cluster_bytes - in_cluster;
+        if (chunk > end - pos) {
+            chunk = end - pos;
+        }
+        if (sec_off == 0 && chunk >= 512) {
+            chunk &= ~511u;
+            if (!bcache_read(fat_fs.dev, lba, chunk / 512, out + (pos - offset))) {
+                return 0;
+            }
+        } else {
+            const uint8_t *sec = bcache_sector(fat_fs.dev, lba);
+            if (sec == NULL) {
+                return 0;
+            }
+            if (chunk > 512 - sec_off) {
+                chunk = 512 - sec_off;
+            }
+            kmemcpy(out + (pos - offset), sec + sec_off, chunk);
+        }
+        pos += chunk;
+    }
+    *got = pos - offset;
+    return 1;
+}
+
+/* Serializes the FAT write path against the flusher task. */
+static void fat_lock(void) {
+    for (;;) {
+        uint64_t flags = irq_save();
+        if (!fat_busy) {
+            fat_busy = 1;
+            irq_restore(flags);
+            return;
+        }
+        irq_restore(flags);
+        task_sleep_ticks(1);
+    }
+}
+
+static void fat_unlock(void) {
+    fat_busy = 0;
+}
+
+static uint32_t fat_cluster_bytes(void) {
+    return (uint32_t)fat_fs.bpb.sectors_per_cluster * 512;
+}
+
+static uint32_t fat_eoc_mark(void) {
+    if (fat_fs.fat_type == 32) {
+        return 0x0FFFFFFF;
+    }
+    return (fat_fs.fat_type == 12) ? 0xFFF : 0xFFFF;
+}
+
+static void fat_mark_dirty(uint32_t fat_offset) {
+    uint32_t sec = fat_offset / 512;
+    fat_fs.fat_dirty[sec / 8] |= (uint8_t)(1u << (sec % 8));
+}
+
+/* Volume accepts changes: the table is in memory and every FAT sector it needed loaded. */
+static int fat_writable(void) {
+    return fat_fs.valid && fat_fs.table != NULL && !fat_fs.read_only;
+}
+
+/*
+ * Changes one link in the table; the FAT sectors holding it go out with
+ * the next flush. If the entry's sector cannot be loaded the set is
+ * refused and the volume turns read-only: encoding a sector the table
+ * never held would overwrite its other entries with zeros.
+ */
+static int fat_set(uint32_t cluster, uint32_t value) {
+    uint32_t off = fat_entry_offset(cluster);
+    uint32_t old = fat_get(cluster);
+    if (old == 0xFFFFFFFF) {
+        fat_fs.read_only = 1;
+        return 0;
+    }
+    if (old == 0 && value != 0) {
+        fat_fs.free_clusters--;
+    } else if (old != 0 && value == 0) {
+        fat_fs.free_clusters++;
+    }
+    fat_fs.table[cluster / FAT_TABLE_SPAN][cluster % FAT_TABLE_SPAN] = value;
+    fat_mark_dirty(off);
+    fat_mark_dirty(off + 1);
+    fat_fs.table_dirty = 1;
+    return 1;
+}
+
+static void fat_free_chain(uint32_t cluster) {
+    uint32_t eoc = fat_eoc();
+    for (uint32_t n = 0; cluster >= 2 && cluster < eoc && cluster < fat_fs.total_clusters + 2 && n < fat_fs.total_clusters; ++n) {
+        uint32_t next = fat_get(cluster);
+        if (!fat_set(cluster, 0)) {
+            return;
+        }
+        cluster = next;
+    }
+}
+
+static uint32_t fat_chain_length(uint32_t cluster) {
+    uint32_t eoc = fat_eoc();
+    uint32_t n = 0;
+    while (cluster >= 2 && cluster < eoc && n < fat_fs.total_clusters) {
+        n++;
+        cluster = fat_next_cluster(cluster);
+    }
+    return n;
+}
+
+/* First free run of at least want clusters from the scan hint on, else the longest; 0 when full. */
+static uint32_t fat_find_run(uint32_t want) {
+    uint32_t end = fat_fs.total_clusters + 2;
+    uint32_t best = 0;
+    uint32_t best_len = 0;
+    uint32_t start = 0;
+    uint32_t len = 0;
+    uint32_t c = fat_fs.next_free;
+    for (uint32_t i = 0; i < fat_fs.total_clusters; ++i, ++c) {
+        if (c >= end) {
+            c = 2;
+            len = 0;
+        }
+        if (fat_get(c) != 0) {
+            len = 0;
+            continue;
+        }
+        if (len++ == 0) {
+            start = c;
+        }
+        if (len >= want) {
+            return start;
+        }
+        if (len > best_len) {
+            best = start;
+            best_len = len;
+        }
+    }
+    return best;
+}
+
+/*
+ * Appends count clusters behind tail (0 starts a new chain), growing in
+ * place while the following clusters are free and otherwise taking the
+ * first free run long enough for the rest. Returns the first new cluster.
+ */
+static uint32_t fat_alloc(uint32_t tail, uint32_t count) {
+    uint32_t end = fat_fs.total_clusters + 2;
+    uint32_t first = 0;
+    while (count > 0) {
+        uint32_t c = tail + 1;
+        if (tail < 2 || c >= end || fat_get(c) != 0) {
+            c = fat_find_run(count);
+            if (c == 0) {
+                break;
+            }
+        }
+        while (count > 0 && c < end && fat_get(c) == 0) {
+            if (!fat_set(c, fat_eoc_mark()) || (tail >= 2 && !fat_set(tail, c))) {
+                return first;
+            }
+            if (first == 0) {
+                first = c;
+            }
+            tail = c++;
+            count--;
+        }
+        fat_fs.next_free = (c < end) ? c : 2;
+    }
+    return first;
+}
+
+/* Sector holding entry slot of directory dir (0 = root); 0 past the directory's end. */
+static uint32_t fat_slot_lba(uint32_t dir, uint32_t slot) {
+    uint32_t sector = slot / 16;
+    dir = fat_dir_start(dir);
+    if (dir == 0) {
+        return (sector < fat_fs.root_dir_sectors) ? fat_fs.root_start_lba + sector : 0;
+    }
+    uint32_t spc = fat_fs.bpb.sectors_per_cluster;
+    uint32_t eoc = fat_eoc();
+    for (uint32_t i = sector / spc; i > 0 && dir >= 2 && dir < eoc; --i) {
+        dir = fat_next_cluster(dir);
+    }
+    if (dir < 2 || dir >= eoc) {
+        return 0;
+    }
+    return fat_cluster_to_lba(dir) + sector % spc;
+}
+
+static int fat_entry_get(uint32_t dir, uint32_t slot, uint8_t *ent) {
+    uint32_t lba = fat_slot_lba(dir, slot);
+    const uint8_t *sec = (lba != 0) ? bcache_sector(fat_fs.dev, lba) : NULL;
+    if (sec == NULL) {
+        return 0;
+    }
+    kmemcpy(ent, sec + (slot % 16) * 32, 32);
+    return 1;
+}
+
+/* Directory entries change rarely and must follow the data, so they are written synchronously. */
+static int fat_entry_put(uint32_t dir, uint32_t slot, const uint8_t *ent) {
+    uint32_t lba = fat_slot_lba(dir, slot);
+    const uint8_t *sec = (lba != 0) ? bcache_sector(fat_fs.dev, lba) : NULL;
+    if (sec == NULL) {
+        return 0;
+    }
+    kmemcpy(fat_sec_buf, sec, 512);
+    kmemcpy(fat_sec_buf + (slot % 16) * 32, ent, 32);
+    bcache_write(fat_fs.dev, lba, 1, fat_sec_buf);
+    return bcache_sync();
+}
+
+static void fat_index_forget(uint32_t dir) {
+    for (uint32_t i = 0; i < FAT_DIR_SLOTS; ++i) {
+        if (fat_dirs[i].used && fat_dirs[i].cluster == dir) {
+            fat_dirs[i].used = 0;
+        }
+    }
+}
+
+/* Keeps an indexed directory's copy of a rewritten entry current. */
+static void fat_index_update(uint32_t dir, uint32_t slot, uint32_t cluster, uint32_t size) {
+    for (uint32_t i = 0; i < FAT_DIR_SLOTS; ++i) {
+        fat_dir_index_t *ix = &fat_dirs[i];
+        if (!ix->used || ix->cluster != dir) {
+            continue;
+        }
+        for (uint32_t j = 0; j < ix->count; ++j) {
+            if (ix->ents[j].slot == slot) {
+                ix->ents[j].cluster = cluster;
+                ix->ents[j].size = size;
+            }
+        }
+    }
+}
+
+/* Refreshes the FSInfo hints so the next mount skips the free-cluster scan. */
+static int fat_write_fsinfo(void) {
+    if (fat_fs.fsinfo_lba == 0) {
+        return 1;
+    }
+    const uint8_t *sec = bcache_sector(fat_fs.dev, fat_fs.fsinfo_lba);
+    if (sec == NULL) {
+        return 0;
+    }
+    kmemcpy(fat_sec_buf, sec, 512);
+    fat_put_le32(fat_sec_buf + 488, fat_fs.free_clusters);
+    fat_put_le32(fat_sec_buf + 492, fat_fs.next_free);
+    bcache_write(fat_fs.dev, fat_fs.fsinfo_lba, 1, fat_sec_buf);
+    return bcache_sync();
+}
+
+static void fat_put_byte(uint8_t *buf, uint32_t base, uint32_t len, uint32_t off, uint32_t val, uint8_t mask) {
+    if (off >= base && off < base + len) {
+        buf[off - base] = (uint8_t)((buf[off - base] & ~mask) | (val & mask));
+    }
+}
+
+/*
+ * Re-encodes the table entries overlapping FAT bytes [base, base + len)
+ * into buf. Only dirty sectors are encoded and fat_set loaded them, so the
+ * table is read directly. FAT32 keeps each entry's reserved top nibble.
+ */
+static void fat_encode(uint8_t *buf, uint32_t base, uint32_t len) {
+    uint32_t entries = fat_fs.total_clusters + 2;
+    uint32_t c = (fat_fs.fat_type == 32) ? base / 4 : (fat_fs.fat_type == 12) ? base * 2 / 3 : base / 2;
+    for (c = (c > 0) ? c - 1 : 0; c < entries; ++c) {
+        /* A neighbour in an unloaded page only covers bytes outside the run. */
+        const uint32_t *page = fat_fs.table[c / FAT_TABLE_SPAN];
+        uint32_t v = (page != NULL) ? page[c % FAT_TABLE_SPAN] : 0;
+        uint32_t off = fat_entry_offset(c);
+        if (off >= base + len) {
+            break;
+        }
+        if (fat_fs.fat_type == 32) {
+            fat_put_byte(buf, base, len, off, v, 0xFF);
+            fat_put_byte(buf, base, len, off + 1, v >> 8, 0xFF);
+            fat_put_byte(buf, base, len, off + 2, v >> 16, 0xFF);
+            fat_put_byte(buf, base, len, off + 3, v >> 24, 0x0F);
+        } else if (fat_fs.fat_type == 16) {
+            fat_put_byte(buf, base, len, off, v, 0xFF);
+            fat_put_byte(buf, base, len, off + 1, v >> 8, 0xFF);
+        } else if (c & 1) {
+            fat_put_byte(buf, base, len, off, v << 4, 0xF0);
+            fat_put_byte(buf, base, len, off + 1, v >> 4, 0xFF);
+        } else {
+            fat_put_byte(buf, base, len, off, v, 0xFF);
+            fat_put_byte(buf, base, len, off + 1, v >> 8, 0x0F);
+        }
+    }
+}
+
+/*
+ * Writes back changed FAT sectors: each run of dirty sectors is encoded
+ * once and goes to every FAT copy as a single multi-sector write.
+ */
+static int fat_flush_table(void) {
+    uint32_t spf = fat_fs.sectors_per_fat;
+    int ok = 1;
+    uint32_t s = 0;
+    while (s < spf) {
+        if ((fat_fs.fat_dirty[s / 8] & (1u << (s % 8))) == 0) {
+            s++;
+            continue;
+        }
+        uint32_t n = 0;
+        while (s + n < spf && n < FAT_FLUSH_RUN && (fat_fs.fat_dirty[(s + n) / 8] & (1u << ((s + n) % 8)))) {
+            n++;
+        }
+        if (!bcache_read(fat_fs.dev, fat_fs.fat_start_lba + s, n, fat_io_buf)) {
+            ok = 0; /* run stays dirty for the next flush */
+            s += n;
+            continue;
+        }
+        fat_encode(fat_io_buf, s * 512, n * 512);
+        blk_plug(fat_fs.dev);
+        for (uint32_t f = 0; f < fat_fs.fat_copies; ++f) {
+            bcache_write(fat_fs.dev, fat_fs.fat_start_lba + f * spf + s, n, fat_io_buf);
+        }
+        blk_unplug(fat_fs.dev);
+        if (bcache_sync()) {
+            for (uint32_t i = s; i < s + n; ++i) {
+                fat_fs.fat_dirty[i / 8] &= (uint8_t)~(1u << (i % 8));
+            }
+        } else {
+            ok = 0;
+        }
+        s += n;
+    }
+    fat_fs.table_dirty = !ok;
+    return fat_write_fsinfo() && ok;
+}
+
+static fat_page_t *fat_page_alloc(void) {
+    fat_page_t *p = fat_page_free;
+    if (p != NULL) {
+        fat_page_free = p->next;
+        return p;
+    }
+    if (fat_pages_made == FAT_DIRTY_PAGES) {
+        return NULL;
+    }
+    uint8_t *data = (uint8_t *)page_alloc(1);
+    if (data == NULL) {
+        return NULL;
+    }
+    p = &fat_pages[fat_pages_made++];
+    p->data = data;
+    return p;
+}
+
+static void fat_node_release_pages(fat_node_t *n) {
+    while (n->pages != NULL) {
+        fat_page_t *p = n->pages;
+        n->pages = p->next;
+        p->next = fat_page_free;
+        fat_page_free = p;
+    }
+}
+
+static void fat_node_drop(fat_node_t *n) {
+    fat_node_release_pages(n);
+    fat_fs.reserved_clusters -= n->reserved;
+    n->reserved = 0;
+    n->used = 0;
+}
+
+static fat_node_t *fat_node_find(uint32_t parent, uint32_t slot) {
+    for (uint32_t i = 0; i < FAT_NODES; ++i) {
+        fat_node_t *n = &fat_nodes[i];
+        if (n->used && n->parent == parent && n->slot == slot) {
+            return n;
+        }
+    }
+    return NULL;
+}
+
+/* Reserves clusters for n growing to size; fails without changes if the volume cannot hold it. */
+static int fat_node_reserve(fat_node_t *n, uint32_t size) {
+    uint32_t cb = fat_cluster_bytes();
+    uint32_t need = (uint32_t)(((uint64_t)size + cb - 1) / cb);
+    uint32_t want = (need > n->clusters) ? need - n->clusters : 0;
+    uint32_t others = fat_fs.reserved_clusters - n->reserved;
+    if (want > n->reserved && others + want > fat_fs.free_clusters) {
+        return 0;
+    }
+    fat_fs.reserved_clusters = others + want;
+    n->reserved = want;
+    n->reserve_to = size;
+    return 1;
+}
+
+/* Builds page idx as the disk has it: bytes below disk_valid from f, zeros after. */
+static int fat_node_fill(const fat_node_t *n, const fat_file_t *f, uint32_t idx, uint8_t *data) {
+    uint32_t got = 0;
+    kmemzero(data, PAGE_SIZE);
+    if ((uint64_t)idx * PAGE_SIZE >= n->disk_valid) {
+        return 1;
+    }
+    return fat_pread(f, idx * PAGE_SIZE, data, PAGE_SIZE, &got);
+}
+
+static void fat_node_map(const fat_node_t *n) {
+    fat_map_extents(&fat_node_file, n->cluster);
+    fat_node_file.size = n->disk_valid;
+}
+
+/*
+ * Frees the chain past n's size or appends what it lacks; delayed
+ * allocation happens here. A flush in the middle of a write keeps the
+ * clusters still promised to the rest of that write reserved.
+ */
+static void fat_node_allocate(fat_node_t *n) {
+    uint32_t cb = fat_cluster_bytes();
+    uint32_t need = (uint32_t)(((uint64_t)n->size + cb - 1) / cb);
+    if (need < n->clusters) {
+        if (need == 0) {
+            fat_free_chain(n->cluster);
+            n->cluster = 0;
+        } else {
+            uint32_t c = n->cluster;
+            for (uint32_t i = 1; i < need; ++i) {
+                c = fat_get(c);
+            }
+            uint32_t rest = fat_get(c);
+            if (fat_set(c, fat_eoc_mark())) {
+                fat_free_chain(rest);
+            }
+        }
+    } else if (need > n->clusters) {
+        uint32_t tail = n->cluster;
+        for (uint32_t i = 1; i < n->clusters; ++i) {
+            tail = fat_get(tail);
+        }
+        uint32_t first = fat_alloc(n->clusters ? tail : 0, need - n->clusters);
+        if (n->cluster == 0) {
+            n->cluster = first;
+        }
+    }
+    fat_fs.reserved_clusters -= n->reserved;
+    n->reserved = 0;
+    n->clusters = fat_chain_length(n->cluster);
+    if (n->reserve_to > n->size) {
+        uint32_t rest = (uint32_t)(((uint64_t)n->reserve_to + cb - 1) / cb);
+        n->reserved = (rest > n->clusters) ? rest - n->clusters : 0;
+        fat_fs.reserved_clusters += n->reserved;
+    }
+}
+
+/* Queues file bytes [pos, pos + len) of the mapped file; both are sector multiples. */
+static int fat_node_put(uint32_t pos, const uint8_t *data, uint32_t len) {
+    uint32_t cb = fat_cluster_bytes();
+    while (len > 0) {
+        uint32_t run = 0;
+        uint32_t cluster = fat_file_cluster(&fat_node_file, pos / cb, &run);
+        if (cluster == 0) {
+            return 0;
+        }
+        uint32_t in_cluster = pos % cb;
+        uint32_t chunk = run * cb - in_cluster;
+        if (chunk > len) {
+            chunk = len;
+        }
+        bcache_write(fat_fs.dev, fat_cluster_to_lba(cluster) + in_cluster / 512, chunk / 512, data);
+        pos += chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    return 1;
+}
+
+/*
+ * Allocates n's clusters and queues its dirty pages under one plug so
+ * neighbouring pages merge. Bytes between disk_valid and the size that no
+ * page holds are rebuilt (zero-filled) one page at a time.
+ */
+static int fat_node_write_back(fat_node_t *n) {
+    int ok = 1;
+    fat_node_allocate(n);
+    fat_node_map(n);
+    uint32_t end = (n->size + 511) & ~511u;
+    const fat_page_t *p = n->pages;
+    blk_plug(fat_fs.dev);
+    for (uint32_t idx = 0; (uint64_t)idx * PAGE_SIZE < end; ++idx) {
+        uint32_t pos = idx * PAGE_SIZE;
+        uint32_t len = (end - pos < PAGE_SIZE) ? end - pos : PAGE_SIZE;
+        while (p != NULL && p->index < idx) {
+            p = p->next;
+        }
+        if (p != NULL && p->index == idx) {
+            ok &= fat_node_put(pos, p->data, len);
+            continue;
+        }
+        if (pos + len <= n->disk_valid) {
+            continue;
+        }
+        blk_unplug(fat_fs.dev);
+        ok &= bcache_sync();
+        ok &= fat_node_fill(n, &fat_node_file, idx, fat_io_buf);
+        ok &= fat_node_put(pos, fat_io_buf, len);
+        ok &= bcache_sync();
+        blk_plug(fat_fs.dev);
+    }
+    blk_unplug(fat_fs.dev);
+    return ok;
+}
+
+/*
+ * Writes every dirty file back in crash-safe order: data first, then the
+ * FAT copies, then the directory entries that point at them. A node whose
+ * data, table or entry write failed keeps its pages and stays dirty for
+ * the next flush; only the others advance disk_valid and let go.
+ */
+static int fat_sync(void) {
+    int ok = 1;
+    uint8_t written[FAT_NODES];
+    for (uint32_t i = 0; i < FAT_NODES; ++i) {
+        written[i] = 0;
+        if (fat_nodes[i].used) {
+            int node_ok = fat_node_write_back(&fat_nodes[i]);
+            node_ok &= bcache_sync();
+            written[i] = (uint8_t)node_ok;
+            ok &= node_ok;
+        }
+    }
+    int table_ok = fat_fs.table_dirty ? fat_flush_table() : 1;
+    ok &= table_ok;
+    for (uint32_t i = 0; i < FAT_NODES; ++i) {
+        fat_node_t *n = &fat_nodes[i];
+        if (!n->used || !written[i] || !table_ok) {
+            continue;
+        }
+        uint8_t ent[32];
+        if (!fat_entry_get(n->parent, n->slot, ent)) {
+            ok = 0;
+            continue;
+        }
+        ent[20] = (uint8_t)(n->cluster >> 16);
+        ent[21] = (uint8_t)(n->cluster >> 24);
+        ent[26] = (uint8_t)n->cluster;
+        ent[27] = (uint8_t)(n->cluster >> 8);
+        fat_put_le32(ent + 28, n->size);
+        if (!fat_entry_put(n->parent, n->slot, ent)) {
+            ok = 0;
+            continue;
+        }
+        fat_index_update(n->parent, n->slot, n->cluster, n->size);
+        n->disk_valid = n->size;
+        if (n == fat_pinned) {
+            fat_node_release_pages(n);
+        } else {
+            fat_node_drop(n);
+        }
+    }
+    return ok;
+}
+
+static fat_node_t *fat_node_get(const fat_dirent_t *d) {
+    fat_node_t *n = fat_node_find(d->parent, d->slot);
+    for (int pass = 0; n == NULL && pass < 2; ++pass) {
+        for (uint32_t i = 0; i < FAT_NODES && n == NULL; ++i) {
+            if (!fat_nodes[i].used) {
+                n = &fat_nodes[i];
+            }
+        }
+        if (n == NULL) {
+            fat_sync();
+            continue;
+        }
+        n->used = 1;
+        n->parent = d->parent;
+        n->slot = d->slot;
+        n->cluster = d->cluster;
+        n->clusters = fat_chain_length(d->cluster);
+        n->reserved = 0;
+        n->reserve_to = d->size;
+        n->size = d->size;
+        n->disk_valid = d->size;
+        n->pages = NULL;
+    }
+    return n;
+}
+
+/* Page idx of n, read in on first touch; a full page pool makes the writer flush. */
+static uint8_t *fat_node_page(fat_node_t *n, uint32_t idx) {
+    fat_page_t **pp = &n->pages;
+    while (*pp != NULL && (*pp)->index < idx) {
+        pp = &(*pp)->next;
+    }
+    if (*pp != NULL && (*pp)->index == idx) {
+        return (*pp)->data;
+    }
+    fat_page_t *p = fat_page_alloc();
+    if (p == NULL) {
+        fat_sync();
+        p = fat_page_alloc();
+        if (p == NULL) {
+            return NULL;
+        }
+        pp = &n->pages;
+    }
+    fat_node_map(n);
+    if (!fat_node_fill(n, &fat_node_file, idx, p->data)) {
+        p->next = fat_page_free;
+        fat_page_free = p;
+        return NULL;
+    }
+    p->index = idx;
+    p->next = *pp;
+    *pp = p;
+    return p->data;
+}
+
+/* Copies into n's pages only; clusters are not chosen until the data is flushed. */
+static int fat_node_write(fat_node_t *n, uint32_t offset, const uint8_t *src, uint32_t len) {
+    uint32_t end = offset + len;
+    if (end < offset || (end > n->size && !fat_node_reserve(n, end))) {
+        return 0;
+    }
+    while (len > 0) {
+        uint8_t *page = fat_node_page(n, offset / PAGE_SIZE);
+        if (page == NULL) {
+            n->reserve_to = n->size;
+            return 0;
+        }
+        uint32_t in_page = offset % PAGE_SIZE;
+        uint32_t chunk = (len < PAGE_SIZE - in_page) ? len : PAGE_SIZE - in_page;
+        kmemcpy(page + in_page, src, chunk);
+        offset += chunk;
+        src += chunk;
+        len -= chunk;
+        if (offset > n->size) {
+            n->size = offset;
+        }
+    }
+    return 1;
+}
+
+static int fat_node_truncate(fat_node_t *n, uint32_t size) {
+    if (!fat_node_reserve(n, size)) {
+        return 0;
+    }
+    fat_page_t **pp = &n->pages;
+    while (*pp != NULL) {
+        fat_page_t *p = *pp;
+        uint64_t start = (uint64_t)p->index * PAGE_SIZE;
+        if (start >= size) {
+            *pp = p->next;
+            p->next = fat_page_free;
+            fat_page_free = p;
+            continue;
+        }
+        if (start + PAGE_SIZE > size) {
+            kmemzero(p->data + (size - start), (size_t)(start + PAGE_SIZE - size));
+        }
+        pp = &p->next;
+    }
+    if (n->disk_valid > size) {
+        n->disk_valid = size;
+    }
+    n->size = size;
+    return 1;
+}
+
+/* fat_pread through n: dirty pages first, the disk below disk_valid, zeros beyond. */
+static int fat_node_pread(const fat_node_t *n, uint32_t offset, uint8_t *out, uint32_t len, uint32_t *got) {
+    uint32_t end = (offset < n->size) ? n->size : offset;
+    if (len < end - offset) {
+        end = offset + len;
+    }
+    fat_node_map(n);
+    const fat_page_t *p = n->pages;
+    uint32_t pos = offset;
+    while (pos < end) {
+        uint32_t idx = pos / PAGE_SIZE;
+        uint32_t in_page = pos % PAGE_SIZE;
+        uint32_t chunk = (end - pos < PAGE_SIZE - in_page) ? end - pos : PAGE_SIZE - in_page;
+        while (p != NULL && p->index < idx) {
+            p = p->next;
+        }
+        if (p != NULL && p->index == idx) {
+            kmemcpy(out + (pos - offset), p->data + in_page, chunk);
+        } else if (pos < n->disk_valid) {
+            uint32_t read = 0;
+            if (chunk > n->disk_valid - pos) {
+                chunk = n->disk_valid - pos;
+            }
+            if (!fat_pread(&fat_node_file, pos, out + (pos - offset), chunk, &read)) {
+                return 0;
+            }
+        } else {
+            kmemzero(out + (pos - offset), chunk);
+        }
+        pos += chunk;
+    }
+    *got = pos - offset;
+    return 1;
+}
+
+/* Valid characters for long names; 8.3 names accept a subset of them. */
+static int fat_lfn_char(char c) {
+    const char *bad = "\"*/:<>?\\|";
+    if ((uint8_t)c < 0x20 || (uint8_t)c >= 0x80) {
+        return 0;
+    }
+    while (*bad != '\0') {
+        if (*bad++ == c) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int fat_short_char(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || (c != ' ' && c != '.' && c != '+' && c != ',' &&
+                                                              c != ';' && c != '=' && c != '[' && c != ']' && fat_lfn_char(c) &&
+                                                              !(c >= 'a' && c <= 'z'));
+}
+
+/*
+ * Builds the space-padded 8.3 form of name into ent[0..10] and its NT
+ * lower-case flags into ent[12]. Returns 1 when that form is exact;
+ * otherwise ent holds the upper-cased basis for a ~N alias.
+ */
+static int fat_make_short(const char *name, uint32_t len, uint8_t *ent) {
+    uint32_t dot = len;
+    for (uint32_t i = len; i > 1; --i) {
+        if (name[i - 1] == '.') {
+            dot = i - 1;
+            break;
+        }
+    }
+    int exact = (len > 0 && dot <= 8 && (dot == len || len - dot - 1 <= 3));
+    uint8_t lower[2] = {0, 0};
+    uint8_t upper[2] = {0, 0};
+    for (uint32_t i = 0; i < 11; ++i) {
+        ent[i] = ' ';
+    }
+    uint32_t n = 0;
+    uint32_t e = 8;
+    for (uint32_t i = 0; i < len; ++i) {
+        int in_ext = (i > dot);
+        char c = name[i];
+        if (i == dot) {
+            continue;
+        }
+        lower[in_ext] |= (c >= 'a' && c <= 'z');
+        upper[in_ext] |= (c >= 'A' && c <= 'Z');
+        c = fat_upper(c);
+        if (!fat_short_char(c)) {
+            exact = 0;
+            if (c == ' ' || c == '.') {
+                continue;
+            }
+            c = '_';
+        }
+        if (in_ext ? e < 11 : n < 8) {
+            ent[in_ext ? e++ : n++] = (uint8_t)c;
+        }
+    }
+    if (n == 0) {
+        ent[0] = '_';
+        exact = 0;
+    }
+    if ((lower[0] && upper[0]) || (lower[1] && upper[1])) {
+        exact = 0;
+    }
+    ent[12] = (uint8_t)((lower[0] ? 0x08 : 0) | (lower[1] ? 0x10 : 0));
+    return exact;
+}
+
+/* Turns the basis in ent into the first free BASIS~N alias in dir. */
+static int fat_make_alias(uint32_t dir, uint8_t *ent) {
+    uint32_t base = 0;
+    while (base < 8 && ent[base] != ' ') {
+        base++;
+    }
+    ent[12] = 0;
+    for (uint32_t num = 1; num < 100; ++num) {
+        uint32_t digits = (num < 10) ? 1 : 2;
+        uint32_t at = (base < 7 - digits) ? base : 7 - digits;
+        for (uint32_t i = at; i < 8; ++i) {
+            ent[i] = ' ';
+        }
+        ent[at] = '~';
+        if (digits == 2) {
+            ent[at + 1] = (uint8_t)('0' + num / 10);
+        }
+        ent[at + digits] = (uint8_t)('0' + num % 10);
+        char shown[12];
+        fat_dirent_t d;
+        if (!fat_lookup(dir, shown, fat_short_name(ent, shown), &d)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Appends a zeroed cluster to subdirectory dir so new entries fit. */
+static int fat_dir_grow(uint32_t dir) {
+    if (fat_fs.free_clusters <= fat_fs.reserved_clusters) {
+        return 0;
+    }
+    uint32_t tail = fat_dir_start(dir);
+    uint32_t eoc = fat_eoc();
+    while (fat_get(tail) >= 2 && fat_get(tail) < eoc) {
+        tail = fat_get(tail);
+    }
+    uint32_t c = fat_alloc(tail, 1);
+    if (c == 0) {
+        return 0;
+    }
+    uint32_t spc = fat_fs.bpb.sectors_per_cluster;
+    kmemzero(fat_io_buf, sizeof(fat_io_buf));
+    for (uint32_t s = 0; s < spc; s += FAT_FLUSH_RUN) {
+        bcache_write(fat_fs.dev, fat_cluster_to_lba(c) + s, (spc - s < FAT_FLUSH_RUN) ? spc - s : FAT_FLUSH_RUN, fat_io_buf);
+    }
+    return bcache_sync() && fat_flush_table();
+}
+
+/* First run of count free slots in dir; a full subdirectory grows by a cluster. */
+static uint32_t fat_dir_alloc(uint32_t dir, uint32_t count) {
+    uint32_t run = 0;
+    for (uint32_t slot = 0; slot < 65536; ++slot) {
+        uint32_t lba = fat_slot_lba(dir, slot);
+        if (lba == 0 && (fat_dir_start(dir) == 0 || !fat_dir_grow(dir) || (lba = fat_slot_lba(dir, slot)) == 0)) {
+            break;
+        }
+        const uint8_t *sec = bcache_sector(fat_fs.dev, lba);
+        if (sec == NULL) {
+            break;
+        }
+        uint8_t first = sec[(slot % 16) * 32];
+        run = (first == 0x00 || first == 0xE5) ? run + 1 : 0;
+        if (run == count) {
+            return slot + 1 - count;
+        }
+    }
+    return 0xFFFFFFFF;
+}
+
+/* Adds an empty file to dir: an 8.3 entry when the name fits, else LFN entries plus a ~N alias. */
+static int fat_create(uint32_t dir, const char *name, uint32_t len, fat_dirent_t *out) {
+    uint8_t ent[32];
+    if (len == 0 || len > FAT_LFN_MAX) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < len; ++i) {
+        if (!fat_lfn_char(name[i])) {
+            return 0;
+        }
+    }
+    kmemzero(ent, sizeof(ent));
+    uint32_t lfn_slots = 0;
+    if (!fat_make_short(name, len, ent)) {
+        lfn_slots = (len + 12) / 13;
+        if (!fat_make_alias(dir, ent)) {
+            return 0;
+        }
+    }
+    ent[11] = 0x20;
+    uint32_t slot = fat_dir_alloc(dir, lfn_slots + 1);
+    if (slot == 0xFFFFFFFF) {
+        return 0;
+    }
+    uint8_t sum = fat_lfn_checksum(ent);
+    for (uint32_t i = 0; i < lfn_slots; ++i) {
+        uint8_t lfn[32];
+        uint32_t seq = lfn_slots - i;
+        kmemzero(lfn, sizeof(lfn));
+        lfn[0] = (uint8_t)(seq | (i == 0 ? 0x40 : 0));
+        lfn[11] = 0x0F;
+        lfn[13] = sum;
+        for (uint32_t k = 0; k < 13; ++k) {
+            uint32_t at = (seq - 1) * 13 + k;
+            uint16_t ch = (at < len) ? (uint8_t)name[at] : (at == len ? 0x0000 : 0xFFFF);
+            lfn[fat_lfn_offs[k]] = (uint8_t)ch;
+            lfn[fat_lfn_offs[k] + 1] = (uint8_t)(ch >> 8);
+        }
+        if (!fat_entry_put(dir, slot + i, lfn)) {
+            return 0;
+        }
+    }
+    if (!fat_entry_put(dir, slot + lfn_slots, ent)) {
+        return 0;
+    }
+    fat_index_forget(dir);
+    out->cluster = 0;
+    out->size = 0;
+    out->attr = 0x20;
+    out->slot = slot + lfn_slots;
+    out->parent = dir;
+    return 1;
+}
+
+/* Resolves path, creating an empty file when only its last component is missing. */
+static int fat_resolve_create(const char *path, fat_dirent_t *out) {
+    static char dir_path[FAT_LFN_MAX + 1];
+    if (fat_resolve(path, out)) {
+        return 1;
+    }
+    uint32_t len = 0;
+    uint32_t cut = 0;
+    while (path[len] != '\0') {
+        if (path[len++] == '/') {
+            cut = len;
+        }
+    }
+    if (cut > FAT_LFN_MAX) {
+        return 0;
+    }
+    kmemcpy(dir_path, path, cut);
+    dir_path[cut] = '\0';
+    fat_dirent_t dir;
+    if (!fat_resolve(dir_path, &dir) || (dir.attr & 0x10) == 0) {
+        return 0;
+    }
+    return fat_create(dir.cluster, path + cut, len - cut, out);
+}
+
+static fat_node_t *fat_node_open(const char *path) {
+    fat_dirent_t d;
+    if (!fat_writable() || !fat_resolve_create(path, &d) || (d.attr & 0x10)) {
+        return NULL;
+    }
+    return fat_node_get(&d);
+}
+
+/* Appends to path (creating it); returns without touching the disk unless memory runs short. */
+static int fat_append(const char *path, const uint8_t *data, uint32_t len) {
+    fat_node_t *n = fat_node_open(path);
+    if (n == NULL) {
+        return 0;
+    }
+    fat_pinned = n;
+    int ok = fat_node_write(n, n->size, data, len);
+    fat_pinned = NULL;
+    return ok;
+}
+
+static int fat_truncate(const char *path, uint32_t size) {
+    fat_node_t *n = fat_node_open(path);
+    return n != NULL && fat_node_truncate(n, size);
+}
+
+/* Marks the 8.3 entry and its LFN run deleted, then frees the clusters. */
+static int fat_unlink(const char *path) {
+    fat_dirent_t d;
+    uint8_t ent[32];
+    if (!fat_writable() || !fat_resolve(path, &d) || (d.attr & 0x10)) {
+        return 0;
+    }
+    uint32_t cluster = d.cluster;
+    fat_node_t *n = fat_node_find(d.parent, d.slot);
+    if (n != NULL) {
+        cluster = n->cluster;
+        fat_node_drop(n);
+    }
+    if (!fat_entry_get(d.parent, d.slot, ent)) {
+        return 0;
+    }
+    uint8_t sum = fat_lfn_checksum(ent);
+    ent[0] = 0xE5;
+    if (!fat_entry_put(d.parent, d.slot, ent)) {
+        return 0;
+    }
+    for (uint32_t slot = d.slot; slot-- > 0;) {
+        if (!fat_entry_get(d.parent, slot, ent) || ent[11] != 0x0F || ent[0] == 0xE5 || ent[13] != sum) {
+            break;
+        }
+        uint8_t first = ent[0] & 0x40;
+        ent[0] = 0xE5;
+        if (!fat_entry_put(d.parent, slot, ent) || first) {
+            break;
+        }
+    }
+    fat_free_chain(cluster);
+    fat_index_forget(d.parent);
+    return 1;
+}
+
+/* Console sink for the log ring: producers wake it, and it runs whenever the others yield. */
+static void log_drain_task(void) {
+    log_task_running = 1;
+    for (;;) {
+        cpu_cli();
+        if (log_peek() == NULL) {
+            wait_queue_sleep(&log_wait, 0);
+        } else {
+            cpu_sti();
+        }
+        log_drain();
+    }
+}
+
+/* Writes dirty FAT state back every FAT_FLUSH_TICKS so writers never wait on the disk. */
+static void fat_flusher_task(void) {
+    for (;;) {
+        task_sleep_ticks(FAT_FLUSH_TICKS);
+        fat_lock();
+        fat_sync();
+        fat_unlock();
+    }
+}
+
+static int fat_cursor_open(fat_cursor_t *c, const char *path) {
+    fat_dirent_t d;
+    if (!fat_resolve(path, &d) || (d.attr & 0x10)) {
+        return 0;
+    }
+    c->node = fat_node_find(d.parent, d.slot);
+    c->pos = 0;
+    if (c->node == NULL) {
+        c->file.size = d.size;
+        fat_map_extents(&c->file, d.cluster);
+    }
+    return 1;
+}
+
+/*
+ * Copies the next piece of the file into buf: at most cap bytes, never
+ * past the end of the current extent, and only one cluster on the first
+ * call so output can start early. Before returning it queues the reads
+ * for the following piece, which then land while the caller consumes
+ * this one. got is 0 at end of file.
+ */
+static int fat_cursor_next(fat_cursor_t *c, uint8_t *buf, uint32_t cap, uint32_t *got) {
+    uint32_t size = (c->node != NULL) ? c->node->size : c->file.size;
+    uint32_t want = (size > c->pos) ? size - c->pos : 0;
+    *got = 0;
+    if (want > cap) {
+        want = cap;
+    }
+    if (want == 0) {
+        return 1;
+    }
+    if (c->node != NULL) {
+        if (!fat_node_pread(c->node, c->pos, buf, want, got)) {
+            return 0;
+        }
+        c->pos += *got;
+        return 1;
+    }
+    uint32_t cb = fat_cluster_bytes();
+    uint32_t run = 0;
+    if (fat_file_cluster(&c->file, c->pos / cb, &run) == 0) {
+        return 0;
+    }
+    uint32_t left = run * cb - c->pos % cb;
+    if (want > left) {
+        want = left;
+    }
+    if (c->pos == 0 && want > cb) {
+        want = cb;
+    }
+    if (!fat_pread(&c->file, c->pos, buf, want, got)) {
+        return 0;
+    }
+    c->pos += *got;
+    uint32_t cluster = (c->pos < size) ? fat_file_cluster(&c->file, c->pos / cb, &run) : 0;
+    if (cluster != 0) {
+        uint32_t in_cluster = c->pos % cb;
+        uint32_t next = run * cb - in_cluster;
+        if (next > size - c->pos) {
+            next = size - c->pos;
+        }
+        if (next > cap) {
+            next = cap;
+        }
+        bcache_prefetch(fat_fs.dev, fat_cluster_to_lba(cluster) + in_cluster / 512, (in_cluster % 512 + next + 511) / 512);
+    }
+    return 1;
+}
+
+static uint16_t ext2_le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/* Reads the superblock (byte 1024) and caches each group's inode table location. */
+static int ext2_init(block_dev_t *dev) {
+    const uint8_t *sb = bcache_sector(dev, 2);
+    if (sb == NULL || ext2_le16(sb + 56) != EXT2_MAGIC) {
+        return 0;
+    }
+    uint32_t log_block = fat_le32(sb + 24);
+    uint32_t incompat = fat_le32(sb + 96);
+    if (log_block > 2 || (fat_le32(sb + 76) >= 1 && (incompat & ~EXT2_INCOMPAT_FILETYPE) != 0)) {
+        return 0; /* blocks over 4 KiB, or extents/journal replay/compression we cannot read */
+    }
+    ext2_fs.dev = dev;
+    ext2_fs.block_size = 1024u << log_block;
+    ext2_fs.block_sectors = ext2_fs.block_size / 512;
+    ext2_fs.blocks_per_group = fat_le32(sb + 32);
+    ext2_fs.inodes_per_group = fat_le32(sb + 40);
+    ext2_fs.inode_size = (fat_le32(sb + 76) >= 1) ? ext2_le16(sb + 88) : 128;
+    if (ext2_fs.blocks_per_group == 0 || ext2_fs.inodes_per_group == 0 || ext2_fs.inode_size < 128 ||
+        ext2_fs.inode_size > 512 || (ext2_fs.inode_size & (ext2_fs.inode_size - 1)) != 0) {
+        return 0;
+    }
+    uint32_t blocks = fat_le32(sb + 4);
+    uint32_t first_data = fat_le32(sb + 20);
+    ext2_fs.groups = (blocks - first_data + ext2_fs.blocks_per_group - 1) / ext2_fs.blocks_per_group;
+
+    uint32_t desc_sectors = (ext2_fs.groups * 32 + 511) / 512;
+    uint8_t *desc = (uint8_t *)page_alloc(((uint64_t)desc_sectors * 512 + PAGE_SIZE - 1) / PAGE_SIZE);
+    ext2_fs.inode_tables = (uint32_t *)page_alloc(((uint64_t)ext2_fs.groups * 4 + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (desc == NULL || ext2_fs.inode_tables == NULL ||
+        !bcache_read(dev, (uint64_t)(first_data + 1) * ext2_fs.block_sectors, desc_sectors, desc)) {
+        return 0;
+    }
+    for (uint32_t g = 0; g < ext2_fs.groups; ++g) {
+        ext2_fs.inode_tables[g] = fat_le32(desc + g * 32 + 8);
+    }
+    ext2_fs.valid = 1;
+    return 1;
+}
+
+static void ext2_mount(void) {
+    for (int i = 0; i < block_dev_count; ++i) {
+        if ((!fat_fs.valid || block_devs[i] != fat_fs.dev) && ext2_init(block_devs[i])) {
+            return;
+        }
+    }
+}
+
+/* Returns the cached inode, reading it from its group's inode table on a miss (LRU). */
+static ext2_inode_t *ext2_iget(uint32_t ino) {
+    ext2_inode_t *victim = &ext2_icache[0];
+    if (ino == 0) {
+        return NULL;
+    }
+    for (uint32_t i = 0; i < EXT2_ICACHE; ++i) {
+        ext2_inode_t *ip = &ext2_icache[i];
+        if (ip->ino == ino) {
+            ip->stamp = ++ext2_fs.clock;
+            return ip;
+        }
+        if (ip->stamp < victim->stamp) {
+            victim = ip;
+        }
+    }
+    uint32_t group = (ino - 1) / ext2_fs.inodes_per_group;
+    if (group >= ext2_fs.groups) {
+        return NULL;
+    }
+    uint64_t byte = (uint64_t)((ino - 1) % ext2_fs.inodes_per_group) * ext2_fs.inode_size;
+    const uint8_t *sec = bcache_sector(ext2_fs.dev, (uint64_t)ext2_fs.inode_tables[group] * ext2_fs.block_sectors + byte / 512);
+    if (sec == NULL) {
+        return NULL;
+    }
+    const uint8_t *raw = sec + byte % 512;
+    victim->ino = ino;
+    victim->stamp = ++ext2_fs.clock;
+    victim->mode = ext2_le16(raw);
+    victim->size = fat_le32(raw + 4);
+    if ((victim->mode & EXT2_S_IFMT) == EXT2_S_IFREG && fat_le32(raw + 108) != 0) {
+        victim->size = 0xFFFFFFFF; /* clamp files past 4 GiB */
+    }
+    for (uint32_t i = 0; i < 15; ++i) {
+        victim->block[i] = fat_le32(raw + 40 + i * 4);
+    }
+    victim->ind_no = 0;
+    victim->dind_no = 0;
+    victim->dind2_no = 0;
+    victim->tind_no = 0;
+    victim->tind2_no = 0;
+    victim->tind3_no = 0;
+    return victim;
+}
+
+/* Keeps one block of pointers cached per level; a sequential reader loads each one once. */
+static uint32_t *ext2_map_block(uint32_t block, uint32_t *cached_no, uint32_t **buf) {
+    if (*cached_no == block) {
+        return *buf;
+    }
+    if (*buf == NULL) {
+        *buf = (uint32_t *)page_alloc(1);
+        if (*buf == NULL) {
+            return NULL;
+        }
+    }
+    *cached_no = 0;
+    if (!bcache_read(ext2_fs.dev, (uint64_t)block * ext2_fs.block_sectors, ext2_fs.block_sectors, *buf)) {
+        return NULL;
+    }
+    ext2_fs.map_reads++;
+    *cached_no = block;
+    return *buf;
+}
+
+/*
+ * Logical -> physical block through the direct and the single, double and
+ * triple indirect pointers, plus how many following blocks are physically
+ * contiguous within the same pointer block. 0 is a hole; EXT2_BMAP_ERROR
+ * means a pointer block could not be read.
+ */
+static uint32_t ext2_bmap(ext2_inode_t *ip, uint32_t lblk, uint32_t *run) {
+    uint32_t apb = ext2_fs.block_size / 4;
+    const uint32_t *ptrs;
+    uint32_t idx;
+    uint32_t count;
+    *run = 1;
+    if (lblk < 12) {
+        ptrs = ip->block;
+        idx = lblk;
+        count = 12;
+    } else if (lblk - 12 < apb) {
+        if (ip->block[12] == 0) {
+            return 0;
+        }
+        ptrs = ext2_map_block(ip->block[12], &ip->ind_no, &ip->ind);
+        idx = lblk - 12;
+        count = apb;
+    } else if (lblk - 12 - apb < apb * apb) {
+        uint32_t rel = lblk - 12 - apb;
+        if (ip->block[13] == 0) {
+            return 0;
+        }
+        const uint32_t *top = ext2_map_block(ip->block[13], &ip->dind_no, &ip->dind);
+        if (top == NULL) {
+            return EXT2_BMAP_ERROR;
+        }
+        if (top[rel / apb] == 0) {
+            return 0;
+        }
+        ptrs = ext2_map_block(top[rel / apb], &ip->dind2_no, &ip->dind2);
+        idx = rel % apb;
+        count = apb;
+    } else {
+        uint32_t rel = lblk - 12 - apb - apb * apb;
+        if (ip->block[14] == 0) {
+            return 0;
+        }
+        const uint32_t *top = ext2_map_block(ip->block[14], &ip->tind_no, &ip->tind);
+        if (top == NULL) {
+            return EXT2_BMAP_ERROR;
+        }
+        if (top[rel / apb / apb] == 0) {
+            return 0;
+        }
+        const uint32_t *mid = ext2_map_block(top[rel / apb / apb], &ip->tind2_no, &ip->tind2);
+        if (mid == NULL) {
+            return EXT2_BMAP_ERROR;
+        }
+        if (mid[rel / apb % apb] == 0) {
+            return 0;
+        }
+        ptrs = ext2_map_block(mid[rel / apb % apb], &ip->tind3_no, &ip->tind3);
+        idx = rel % apb;
+        count = apb;
+    }
+    if (ptrs == NULL) {
+        return EXT2_BMAP_ERROR;
+    }
+    if (ptrs[idx] == 0) {
+        return 0;
+    }
+    while (idx + *run < count && ptrs[idx + *run] == ptrs[idx] + *run) {
+        (*run)++;
+    }
+    return ptrs[idx];
+}
+
+/* Reads up to len bytes at offset; each contiguous run of blocks goes out as one transfer. */
+static int ext2_pread(ext2_inode_t *ip, uint32_t offset, uint8_t *out, uint32_t len, uint32_t *got) {
+    uint32_t bs = ext2_fs.block_size;
+    uint32_t end = (offset < ip->size) ? ip->size : offset;
+    if (len < end - offset) {
+        end = offset + len;
+    }
+    uint32_t pos = offset;
+    while (pos < end) {
+        uint32_t run = 0;
+        uint32_t phys = ext2_bmap(ip, pos / bs, &run);
+        if (phys == EXT2_BMAP_ERROR) {
+            return 0;
+        }
+        uint32_t in_block = pos % bs;
+        uint32_t chunk = run * bs - in_block;
+        if (chunk > end - pos) {
+            chunk = end - pos;
+        }
+        uint64_t lba = (uint64_t)phys * ext2_fs.block_sectors + in_block / 512;
+        uint32_t sec_off = in_block % 512;
+        if (phys == 0) {
+            kmemzero(out + (pos - offset), chunk);
+        } else if (sec_off == 0 && chunk >= 512) {
+            chunk &= ~511u;
+            if (!bcache_read(ext2_fs.dev, lba, chunk / 512, out + (pos - offset))) {
+                return 0;
+            }
+        } else {
+            const uint8_t *sec = bcache_sector(ext2_fs.dev, lba);
+            if (sec == NULL) {
+                return 0;
+            }
+            if (chunk > 512 - sec_off) {
+                chunk = 512 - sec_off;
+            }
+            kmemcpy(out + (pos - offset), sec + sec_off, chunk);
         }
-        regs->rax = 0;
-        break;
-    case SYS_YIELD:
-        if (ring3_enabled && current_user >= 0) {
-            user_need_resched = 1;
+        pos += chunk;
+    }
+    *got = pos - offset;
+    return 1;
+}
+
+/* Calls visit for each live entry of directory inode ino; visit returns nonzero to stop. */
+static int ext2_dir_walk(uint32_t ino, int (*visit)(void *ctx, const char *name, uint32_t len, uint32_t ino), void *ctx) {
+    ext2_inode_t *dir = ext2_iget(ino);
+    if (dir == NULL || (dir->mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+        return 0;
+    }
+    uint32_t size = dir->size;
+    for (uint32_t off = 0; off < size; off += ext2_fs.block_size) {
+        uint32_t got = 0;
+        dir = ext2_iget(ino);
+        if (dir == NULL || !ext2_pread(dir, off, ext2_dir_buf, ext2_fs.block_size, &got)) {
+            return 0;
         }
-        regs->rax = 0;
-        break;
-    default:
-        regs->rax = (uint64_t)-1;
-        break;
+        for (uint32_t p = 0; p + 8 <= got;) {
+            const uint8_t *de = ext2_dir_buf + p;
+            uint16_t rec_len = ext2_le16(de + 4);
+            uint32_t child = fat_le32(de);
+            if (rec_len < 8 || p + rec_len > got) {
+                break;
+            }
+            if (child != 0 && 8u + de[6] <= rec_len && visit(ctx, (const char *)de + 8, de[6], child)) {
+                return 1;
+            }
+            p += rec_len;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    uint32_t len;
+    uint32_t ino;
+} ext2_scan_t;
+
+static int ext2_lookup_visit(void *ctx, const char *name, uint32_t len, uint32_t ino) {
+    ext2_scan_t *sc = (ext2_scan_t *)ctx;
+    for (uint32_t i = 0; len == sc->len && i < len; ++i) {
+        if (name[i] != sc->name[i]) {
+            return 0;
+        }
+    }
+    if (len != sc->len) {
+        return 0;
+    }
+    sc->ino = ino;
+    return 1;
+}
+
+/* Resolves a '/'-separated path from the root inode; names are case-sensitive. */
+static uint32_t ext2_resolve(const char *path) {
+    uint32_t ino = EXT2_ROOT_INO;
+    if (!ext2_fs.valid) {
+        return 0;
+    }
+    while (*path != '\0') {
+        while (*path == '/') {
+            path++;
+        }
+        const char *start = path;
+        while (*path != '\0' && *path != '/') {
+            path++;
+        }
+        if (path == start) {
+            break;
+        }
+        ext2_scan_t sc = {start, (uint32_t)(path - start), 0};
+        if (!ext2_dir_walk(ino, ext2_lookup_visit, &sc)) {
+            return 0;
+        }
+        ino = sc.ino;
+    }
+    return ino;
+}
+
+static uint32_t initrd_number(const uint8_t *p, uint32_t n, uint32_t base) {
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        uint8_t c = p[i];
+        uint32_t d = (c >= '0' && c <= '9') ? (uint32_t)(c - '0')
+                   : (c >= 'a' && c <= 'f') ? (uint32_t)(c - 'a' + 10)
+                   : (c >= 'A' && c <= 'F') ? (uint32_t)(c - 'A' + 10) : base;
+        if (d >= base) {
+            break; /* ustar fields end in a space or NUL */
+        }
+        v = v * base + d;
+    }
+    return v;
+}
+
+static int initrd_match(const uint8_t *p, const char *s) {
+    while (*s != '\0') {
+        if (*p++ != (uint8_t)*s++) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void initrd_add(const char *name, uint32_t len, const uint8_t *data, uint32_t size) {
+    while (len > 0 && (name[0] == '/' || (name[0] == '.' && len > 1 && name[1] == '/'))) {
+        uint32_t skip = (name[0] == '/') ? 1 : 2;
+        name += skip;
+        len -= skip;
+    }
+    if (len == 0 || initrd_count >= INITRD_FILES) {
+        return;
+    }
+    initrd_entry_t *e = &initrd_entries[initrd_count];
+    uint32_t h = vfs_hash(0, name, len) % INITRD_HASH;
+    e->name = name;
+    e->name_len = len;
+    e->data = data;
+    e->size = size;
+    e->next = initrd_hash[h];
+    initrd_hash[h] = (uint16_t)++initrd_count;
+}
+
+/* newc: 110-byte ASCII-hex header, then the name and the data, each padded to 4 bytes. */
+static int initrd_parse_cpio(const uint8_t *p, uint64_t size) {
+    uint64_t off = 0;
+    while (off + 110 <= size && (initrd_match(p + off, "070701") || initrd_match(p + off, "070702"))) {
+        const uint8_t *h = p + off;
+        uint32_t mode = initrd_number(h + 14, 8, 16);
+        uint32_t file_size = initrd_number(h + 54, 8, 16);
+        uint32_t name_size = initrd_number(h + 94, 8, 16);
+        uint64_t data = (off + 110 + name_size + 3) & ~3ull;
+        if (name_size == 0 || data + file_size > size) {
+            break;
+        }
+        if (name_size == 11 && initrd_match(h + 110, "TRAILER!!!")) {
+            return 1;
+        }
+        if ((mode & 0170000) == 0100000) {
+            initrd_add((const char *)h + 110, name_size - 1, p + data, file_size);
+        }
+        off = (data + file_size + 3) & ~3ull;
+    }
+    return off > 0;
+}
+
+/* ustar: 512-byte headers with octal sizes; names that need the prefix field are skipped. */
+static int initrd_parse_tar(const uint8_t *p, uint64_t size) {
+    uint64_t off = 0;
+    while (off + 512 <= size && initrd_match(p + off + 257, "ustar")) {
+        const uint8_t *h = p + off;
+        uint32_t file_size = initrd_number(h + 124, 12, 8);
+        uint32_t name_len = 0;
+        while (name_len < 100 && h[name_len] != 0) {
+            name_len++;
+        }
+        if (off + 512 + file_size > size) {
+            break;
+        }
+        if ((h[156] == '0' || h[156] == 0) && h[345] == 0) {
+            initrd_add((const char *)h, name_len, h + 512, file_size);
+        }
+        off += 512 + (((uint64_t)file_size + 511) & ~511ull);
+    }
+    return off > 0;
+}
+
+/* Indexes the loader's archive in place, or the built-in files when there is none. */
+static void initrd_init(const barecore_boot_info_t *bi) {
+    if (bi != NULL && bi->magic == BARECORE_BOOTINFO_MAGIC && bi->initrd_base != 0 && bi->initrd_size != 0) {
+        const uint8_t *p = (const uint8_t *)paging_identity_map(bi->initrd_base, bi->initrd_size, 0);
+        if (p != NULL && initrd_parse_cpio(p, bi->initrd_size)) {
+            initrd_format = "cpio";
+        } else if (p != NULL && initrd_parse_tar(p, bi->initrd_size)) {
+            initrd_format = "ustar";
+        }
+    }
+    if (initrd_count > 0) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(initrd_files) / sizeof(initrd_files[0]); ++i) {
+        const char *data = initrd_files[i].data;
+        uint32_t len = 0;
+        uint32_t size = 0;
+        while (initrd_files[i].name[len] != '\0') {
+            len++;
+        }
+        while (data[size] != '\0') {
+            size++;
+        }
+        initrd_add(initrd_files[i].name, len, (const uint8_t *)data, size);
+    }
+}
+
+static int initrd_lookup(const char *path, int create, uint64_t *key) {
+    uint32_t len = 0;
+    (void)create;
+    while (path[len] != '\0') {
+        len++;
+    }
+    for (uint32_t i = initrd_hash[vfs_hash(0, path, len) % INITRD_HASH]; i != 0; i = initrd_entries[i - 1].next) {
+        const initrd_entry_t *e = &initrd_entries[i - 1];
+        uint32_t n = 0;
+        while (n < len && n < e->name_len && e->name[n] == path[n]) {
+            n++;
+        }
+        if (n == len && n == e->name_len) {
+            *key = i - 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint32_t initrd_size(const vfs_inode_t *ip) {
+    return initrd_entries[ip->key].size;
+}
+
+static int initrd_read(const vfs_inode_t *ip, uint32_t offset, uint8_t *out, uint32_t len, uint32_t *got) {
+    const initrd_entry_t *e = &initrd_entries[ip->key];
+    uint32_t n = (offset < e->size) ? e->size - offset : 0;
+    if (n > len) {
+        n = len;
+    }
+    kmemcpy(out, e->data + offset, n);
+    *got = n;
+    return 1;
+}
+
+/* FAT keys are parent cluster << 32 | 8.3 slot; the first cluster may change at flush, the slot does not. */
+static int vfs_fat_lookup(const char *path, int create, uint64_t *key) {
+    fat_dirent_t d;
+    fat_lock();
+    int ok = (create && fat_writable()) ? fat_resolve_create(path, &d) : fat_resolve(path, &d);
+    fat_unlock();
+    if (!ok || (d.attr & 0x10)) {
+        return 0;
+    }
+    *key = ((uint64_t)d.parent << 32) | d.slot;
+    return 1;
+}
+
+/* The on-disk entry behind ip; fails once the file has been deleted. */
+static int vfs_fat_entry(const vfs_inode_t *ip, fat_dirent_t *d) {
+    uint8_t ent[32];
+    uint32_t parent = (uint32_t)(ip->key >> 32);
+    uint32_t slot = (uint32_t)ip->key;
+    if (!fat_entry_get(parent, slot, ent) || ent[0] == 0 || ent[0] == 0xE5) {
+        return 0;
+    }
+    fat_dirent_fill(d, ent, slot);
+    d->parent = parent;
+    return 1;
+}
+
+/* Node for a write or truncate of ip; NULL once the volume has gone read-only. */
+static fat_node_t *vfs_fat_node(const vfs_inode_t *ip) {
+    fat_dirent_t d;
+    if (!fat_writable()) {
+        return NULL;
+    }
+    fat_node_t *n = fat_node_find((uint32_t)(ip->key >> 32), (uint32_t)ip->key);
+    if (n == NULL && vfs_fat_entry(ip, &d)) {
+        n = fat_node_get(&d);
+    }
+    return n;
+}
+
+static int vfs_fat_read(const vfs_inode_t *ip, uint32_t offset, uint8_t *out, uint32_t len, uint32_t *got) {
+    static fat_file_t f;
+    fat_dirent_t d;
+    int ok = 0;
+    fat_lock();
+    const fat_node_t *n = fat_node_find((uint32_t)(ip->key >> 32), (uint32_t)ip->key);
+    if (n != NULL) {
+        ok = fat_node_pread(n, offset, out, len, got);
+    } else if (vfs_fat_entry(ip, &d)) {
+        f.size = d.size;
+        fat_map_extents(&f, d.cluster);
+        ok = fat_pread(&f, offset, out, len, got);
+    }
+    fat_unlock();
+    return ok;
+}
+
+static int vfs_fat_write(const vfs_inode_t *ip, uint32_t offset, const uint8_t *src, uint32_t len) {
+    fat_lock();
+    fat_node_t *n = vfs_fat_node(ip);
+    fat_pinned = n;
+    int ok = n != NULL && fat_node_write(n, offset, src, len);
+    fat_pinned = NULL;
+    fat_unlock();
+    return ok;
+}
+
+static int vfs_fat_truncate(const vfs_inode_t *ip, uint32_t size) {
+    fat_lock();
+    fat_node_t *n = vfs_fat_node(ip);
+    int ok = n != NULL && fat_node_truncate(n, size);
+    fat_unlock();
+    return ok;
+}
+
+static uint32_t vfs_fat_size(const vfs_inode_t *ip) {
+    fat_dirent_t d;
+    uint32_t size = 0;
+    fat_lock();
+    const fat_node_t *n = fat_node_find((uint32_t)(ip->key >> 32), (uint32_t)ip->key);
+    if (n != NULL) {
+        size = n->size;
+    } else if (vfs_fat_entry(ip, &d)) {
+        size = d.size;
+    }
+    fat_unlock();
+    return size;
+}
+
+static int vfs_ext2_lookup(const char *path, int create, uint64_t *key) {
+    (void)create;
+    uint32_t ino = ext2_resolve(path);
+    const ext2_inode_t *ip = ext2_iget(ino);
+    if (ip == NULL || (ip->mode & EXT2_S_IFMT) != EXT2_S_IFREG) {
+        return 0;
+    }
+    *key = ino;
+    return 1;
+}
+
+static int vfs_ext2_read(const vfs_inode_t *ip, uint32_t offset, uint8_t *out, uint32_t len, uint32_t *got) {
+    ext2_inode_t *ep = ext2_iget((uint32_t)ip->key);
+    return ep != NULL && ext2_pread(ep, offset, out, len, got);
+}
+
+static uint32_t vfs_ext2_size(const vfs_inode_t *ip) {
+    const ext2_inode_t *ep = ext2_iget((uint32_t)ip->key);
+    return (ep != NULL) ? ep->size : 0;
+}
+
+static const vfs_ops_t initrd_vfs_ops = {"initrd", initrd_lookup, initrd_read, NULL, NULL, initrd_size};
+static const vfs_ops_t fat_vfs_ops = {"fat", vfs_fat_lookup, vfs_fat_read, vfs_fat_write, vfs_fat_truncate, vfs_fat_size};
+static const vfs_ops_t fat_ro_vfs_ops = {"fat", vfs_fat_lookup, vfs_fat_read, NULL, NULL, vfs_fat_size};
+static const vfs_ops_t ext2_vfs_ops = {"ext2", vfs_ext2_lookup, vfs_ext2_read, NULL, NULL, vfs_ext2_size};
+
+static void vfs_mount(const char *path, const vfs_ops_t *ops) {
+    if (vfs_mount_count >= VFS_MOUNTS) {
+        return;
+    }
+    vfs_mount_t *m = &vfs_mounts[vfs_mount_count++];
+    m->path = path;
+    m->len = 0;
+    while (path[m->len] != '\0') {
+        m->len++;
+    }
+    m->ops = ops;
+}
+
+/* The initrd is the root; disk volumes appear under /disk (FAT) and /ext2. */
+static void vfs_init(void) {
+    vfs_mount("/", &initrd_vfs_ops);
+    if (fat_fs.valid) {
+        vfs_mount("/disk", (fat_fs.table != NULL) ? &fat_vfs_ops : &fat_ro_vfs_ops);
+    }
+    if (ext2_fs.valid) {
+        vfs_mount("/ext2", &ext2_vfs_ops);
+    }
+}
+
+static int lsdisk_visit(void *ctx, const char *lfn, uint32_t lfn_len, const uint8_t *ent, uint32_t slot) {
+    const fat_node_t *n = fat_node_find(*(const uint32_t *)ctx, slot);
+    char name[FAT_LFN_MAX + 2];
+    uint32_t len = lfn_len;
+    if (lfn != NULL) {
+        kmemcpy(name, lfn, len);
+    } else {
+        len = fat_short_name(ent, name);
+    }
+    if (ent[11] & 0x10) {
+        name[len++] = '/';
+    }
+    name[len] = '\0';
+    userspace_write("  ");
+    userspace_write(name);
+    if ((ent[11] & 0x10) == 0) {
+        userspace_write(" ");
+        write_u64_dec((n != NULL) ? n->size : (uint32_t)(ent[28] | (ent[29] << 8) | (ent[30] << 16) | (ent[31] << 24)));
+    }
+    userspace_write("\n");
+    return 0;
+}
+
+static int lsdisk_ext2_visit(void *ctx, const char *name, uint32_t len, uint32_t ino) {
+    (void)ctx;
+    const ext2_inode_t *ip = ext2_iget(ino);
+    if (ip == NULL || (len == 1 && name[0] == '.') || (len == 2 && name[0] == '.' && name[1] == '.')) {
+        return 0;
+    }
+    userspace_write("  ");
+    write_text(name, len);
+    if ((ip->mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+        userspace_write("/");
+    } else {
+        userspace_write(" ");
+        write_u64_dec(ip->size);
+    }
+    userspace_write("\n");
+    return 0;
+}
+
+/* Lists path on every mounted disk volume. */
+static void shell_cmd_lsdisk(const char *path) {
+    int listed = 0;
+    if (!fat_fs.valid && !ext2_fs.valid) {
+        userspace_write("disk fs: not detected\n");
+        return;
+    }
+    if (fat_fs.valid) {
+        userspace_write("disk fs: FAT");
+        userspace_write((fat_fs.fat_type == 12) ? "12" : (fat_fs.fat_type == 16) ? "16" : "32");
+        userspace_write(" on ");
+        userspace_write(fat_fs.dev->name);
+        userspace_write("\n");
+        fat_dirent_t d;
+        fat_lock();
+        if (fat_resolve(path, &d) && (d.attr & 0x10) != 0) {
+            fat_dir_walk(d.cluster, lsdisk_visit, &d.cluster);
+            listed = 1;
+        }
+        fat_unlock();
+    }
+    if (ext2_fs.valid) {
+        userspace_write("disk fs: ext2 on ");
+        userspace_write(ext2_fs.dev->name);
+        userspace_write(" block=");
+        write_u64_dec(ext2_fs.block_size);
+        userspace_write(" map-reads=");
+        write_u64_dec(ext2_fs.map_reads);
+        userspace_write("\n");
+        const ext2_inode_t *ip = ext2_iget(ext2_resolve(path));
+        if (ip != NULL && (ip->mode & EXT2_S_IFMT) == EXT2_S_IFDIR) {
+            ext2_dir_walk(ip->ino, lsdisk_ext2_visit, NULL);
+            listed = 1;
+        }
+    }
+    if (!listed) {
+        userspace_write("lsdisk: not a directory\n");
+    }
+}
+
+static void diskbench_complete(blk_req_t *req) {
+    (void)req;
+    diskbench_done++;
+}
+
+/* DISKBENCH_OPS random 4 KiB reads with qd requests kept in flight. */
+static void diskbench_run(block_dev_t *dev, uint32_t qd) {
+    uint64_t blocks = dev->sectors / 8;
+    uint32_t rng = 0x9E3779B9u;
+    uint32_t issued = 0;
+    uint8_t live[32];
+
+    if (blocks == 0) {
+        return;
+    }
+    diskbench_done = 0;
+    for (uint32_t i = 0; i < qd; ++i) {
+        live[i] = 0;
+    }
+    uint64_t t0 = clock_us();
+    while (diskbench_done < DISKBENCH_OPS) {
+        uint32_t seen = dev->completed;
+        for (uint32_t i = 0; i < qd && issued < DISKBENCH_OPS; ++i) {
+            if (live[i] && diskbench_reqs[i].status == BLK_PENDING) {
+                continue;
+            }
+            rng ^= rng << 13;
+            rng ^= rng >> 17;
+            rng ^= rng << 5;
+            blk_req_t *r = &diskbench_reqs[i];
+            r->lba = (rng % blocks) * 8;
+            r->count = 8;
+            r->buf = diskbench_buf[i];
+            r->status = BLK_PENDING;
+            r->done = diskbench_complete;
+            r->ctx = dev;
+            if (!dev->submit(dev, r)) {
+                r->status = BLK_OK;
+                live[i] = 0;
+                break;
+            }
+            live[i] = 1;
+            issued++;
+        }
+        block_kick(dev);
+        if (diskbench_done < DISKBENCH_OPS) {
+            block_idle(dev, seen);
+        }
+    }
+    uint64_t us = clock_us() - t0;
+    if (us == 0) {
+        us = 1;
+    }
+    userspace_write(dev->name);
+    userspace_write(" qd=");
+    write_u64_dec(qd);
+    userspace_write(" iops=");
+    write_u64_dec((uint64_t)DISKBENCH_OPS * 1000000u / us);
+    userspace_write(" KiB/s=");
+    write_u64_dec((uint64_t)DISKBENCH_OPS * 4u * 1000000u / us);
+    userspace_write("\n");
+}
+
+/* Fills the real framebuffer FBBENCH_FRAMES times under one memory type; returns MB/s. */
+static uint64_t fbbench_run(uint32_t type) {
+    if (fb_map(type) == NULL) {
+        return 0;
+    }
+    uint32_t *vram = (uint32_t *)(uintptr_t)fb.addr;
+    uint64_t t0 = clock_us();
+    for (uint32_t f = 0; f < FBBENCH_FRAMES; ++f) {
+        uint32_t color = (f & 1) ? fb.fg_pixel : fb.bg_pixel;
+        for (uint32_t y = 0; y < fb.height; ++y) {
+            kmemset32(vram + (size_t)y * fb.pitch_pixels, color, fb.width);
+        }
+    }
+    uint64_t us = clock_us() - t0;
+    if (us == 0) {
+        us = 1;
+    }
+    return (uint64_t)FBBENCH_FRAMES * fb.width * fb.height * sizeof(uint32_t) / us;
+}
+
+static void shell_cmd_fbbench(void) {
+    if (!fb.enabled) {
+        userspace_write("fbbench: no framebuffer (VGA text console)\n");
+        return;
+    }
+    uint64_t uc = fbbench_run(CACHE_UC);
+    uint64_t wc = fbbench_run(CACHE_WC);
+    if (fb.shadowed) {
+        fb_mark_dirty(0, 0, fb.width, fb.height);
+        fb_flush();
+    } else {
+        clear_console();
+    }
+    userspace_write("fbbench: fill UC MB/s=");
+    write_u64_dec(uc);
+    userspace_write(" WC MB/s=");
+    write_u64_dec(wc);
+    userspace_write(pat_enabled ? " (PAT)\n" : " (no PAT, WC=UC)\n");
+}
+
+static void shell_cmd_logstat(void) {
+    uint64_t head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    userspace_write("log: next-seq=");
+    write_u64_dec(head);
+    userspace_write(" pending=");
+    write_u64_dec(head - log_tail);
+    userspace_write(" drained=");
+    write_u64_dec(log_records);
+    userspace_write(" batches=");
+    write_u64_dec(log_batches);
+    userspace_write(" dropped=");
+    write_u64_dec(log_dropped);
+    userspace_write(" max-lag-us=");
+    write_u64_dec(log_max_lag_us);
+    userspace_write(log_task_running ? " drain=task\n" : " drain=inline\n");
+}
+
+static void shell_cmd_inputstat(void) {
+    userspace_write("input: events=");
+    write_u64_dec(input_events);
+    userspace_write(" drops=");
+    write_u64_dec(input_drops);
+    userspace_write(" wakeups=");
+    write_u64_dec(input_wakeups);
+    userspace_write(" mods=");
+    write_u64_hex(input_mods);
+    userspace_write(" key-latency-us last=");
+    write_u64_dec(input_lat_last_us);
+    userspace_write(" max=");
+    write_u64_dec(input_lat_max_us);
+    userspace_write("\n");
+}
+
+static void irqstat_line(const char *name, const irq_time_t *t) {
+    userspace_write(name);
+    userspace_write(" count=");
+    write_u64_dec(t->count);
+    userspace_write(" avg-ns=");
+    write_u64_dec((tsc_per_us && t->count) ? t->cycles * 1000 / tsc_per_us / t->count : 0);
+    userspace_write(" max-ns=");
+    write_u64_dec(tsc_per_us ? t->max_cycles * 1000 / tsc_per_us : 0);
+    userspace_write("\n");
+}
+
+static void shell_cmd_irqstat(void) {
+    userspace_write("hardirq (handler to EOI):\n");
+    for (int v = 0; v < IDT_ENTRIES; ++v) {
+        if (hardirq_time[v].count != 0) {
+            userspace_write("  vec ");
+            write_u64_hex((uint64_t)v);
+            irqstat_line("", &hardirq_time[v]);
+        }
+    }
+    userspace_write("softirq:\n");
+    for (int i = 0; i < SOFTIRQ_COUNT; ++i) {
+        userspace_write("  ");
+        irqstat_line(softirq_time[i].name, &softirq_time[i]);
     }
+    userspace_write("tasklets and work:\n");
+    for (uint32_t i = 0; i < sizeof(defer_times) / sizeof(defer_times[0]); ++i) {
+        userspace_write("  ");
+        irqstat_line(defer_times[i]->name, defer_times[i]);
+    }
+    userspace_write("deferred-exits=");
+    write_u64_dec(softirq_deferred);
+    userspace_write(" work-queued=");
+    write_u64_dec(system_wq.queued);
+    userspace_write(" kbd-raw-drops=");
+    write_u64_dec(kbd_raw_drops);
+    userspace_write("\n");
 }
 
-static void ata_wait_bsy(void) {
-    while (inb(0x1F7) & 0x80) {
+static void shell_cmd_uartstat(void) {
+    if (!uart.present) {
+        userspace_write("uart: COM1 not present\n");
+        return;
     }
+    userspace_write(uart.irq_mode ? "uart: COM1 16550A irq4" : "uart: COM1 polled");
+    userspace_write(" irqs=");
+    write_u64_dec(uart.irqs);
+    userspace_write(" tx=");
+    write_u64_dec(uart.tx_bytes);
+    userspace_write(" bursts=");
+    write_u64_dec(uart.tx_bursts);
+    userspace_write(" stalls=");
+    write_u64_dec(uart.tx_stalls);
+    userspace_write(" rx=");
+    write_u64_dec(uart.rx_bytes);
+    userspace_write(" rx-drops=");
+    write_u64_dec(uart.rx_drops);
+    userspace_write("\n");
 }
 
-static int ata_wait_drq(void) {
-    for (int i = 0; i < 100000; ++i) {
-        uint8_t s = inb(0x1F7);
-        if (s & 0x08) {
-            return 1;
+static void shell_cmd_diskbench(void) {
+    static const uint32_t depths[] = {1, 8, 32};
+    if (block_dev_count == 0) {
+        userspace_write("diskbench: no block devices\n");
+        return;
+    }
+    for (int d = 0; d < block_dev_count; ++d) {
+        for (uint32_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+            if (depths[i] > 1 && depths[i] > block_devs[d]->max_queue) {
+                continue;
+            }
+            diskbench_run(block_devs[d], depths[i]);
         }
-        if (s & 0x01) {
-            return 0;
+    }
+}
+
+static void disklat_sort(uint32_t *v, uint32_t n) {
+    for (uint32_t gap = n / 2; gap > 0; gap /= 2) {
+        for (uint32_t i = gap; i < n; ++i) {
+            uint32_t x = v[i];
+            uint32_t j = i;
+            for (; j >= gap && v[j - gap] > x; j -= gap) {
+                v[j] = v[j - gap];
+            }
+            v[j] = x;
         }
     }
-    return 0;
 }
 
-static int ata_read_sector(uint32_t lba, uint8_t *buf) {
-    ata_wait_bsy();
-    outb(0x1F2, 1);
-    outb(0x1F3, (uint8_t)(lba & 0xFF));
-    outb(0x1F4, (uint8_t)((lba >> 8) & 0xFF));
-    outb(0x1F5, (uint8_t)((lba >> 16) & 0xFF));
-    outb(0x1F6, 0xE0 | ((lba >> 24) & 0x0F));
-    outb(0x1F7, 0x20);
-    if (!ata_wait_drq()) {
-        return 0;
+/* DISKLAT_OPS random 4 KiB reads at queue depth 1, timed one by one. */
+static void disklat_run(block_dev_t *dev, const char *mode) {
+    static const uint32_t permille[] = {500, 900, 990, 999};
+    static const char *const labels[] = {" p50=", " p90=", " p99=", " p99.9="};
+    uint64_t blocks = dev->sectors / 8;
+    uint32_t rng = 0x9E3779B9u;
+
+    if (blocks == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < DISKLAT_OPS; ++i) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        uint64_t t0 = rdtsc();
+        if (!block_read(dev, (rng % blocks) * 8, 8, diskbench_buf[0])) {
+            userspace_write(dev->name);
+            userspace_write(": read error\n");
+            return;
+        }
+        disklat_ns[i] = (uint32_t)((rdtsc() - t0) * 1000u / tsc_per_us);
     }
-    for (int i = 0; i < 256; ++i) {
-        uint16_t w = inw(0x1F0);
-        buf[i * 2] = (uint8_t)(w & 0xFF);
-        buf[i * 2 + 1] = (uint8_t)(w >> 8);
+    disklat_sort(disklat_ns, DISKLAT_OPS);
+    userspace_write(dev->name);
+    userspace_write(" ");
+    userspace_write(mode);
+    for (uint32_t i = 0; i < sizeof(permille) / sizeof(permille[0]); ++i) {
+        userspace_write(labels[i]);
+        write_u64_dec(disklat_ns[DISKLAT_OPS * permille[i] / 1000]);
     }
-    return 1;
+    userspace_write(" max=");
+    write_u64_dec(disklat_ns[DISKLAT_OPS - 1]);
+    userspace_write(" ns\n");
 }
 
-static void fat_init(void) {
-    fat_fs.valid = 0;
-    if (!ata_read_sector(0, fat_sector)) {
+/* Interrupt-driven devices are measured twice: as configured and busy-polled. */
+static void shell_cmd_disklat(void) {
+    if (block_dev_count == 0) {
+        userspace_write("disklat: no block devices\n");
         return;
     }
-    fat_bpb_t *bpb = (fat_bpb_t *)fat_sector;
-    if (bpb->bytes_per_sector != 512) {
-        return;
+    for (int d = 0; d < block_dev_count; ++d) {
+        block_dev_t *dev = block_devs[d];
+        if (!dev->irq_driven) {
+            disklat_run(dev, "poll");
+            continue;
+        }
+        disklat_run(dev, "irq");
+        dev->irq_driven = 0;
+        if (dev->set_polled != NULL) {
+            dev->set_polled(dev, 1);
+        }
+        disklat_run(dev, "poll");
+        if (dev->set_polled != NULL) {
+            dev->set_polled(dev, 0);
+        }
+        dev->irq_driven = 1;
     }
-
-    fat_fs.bpb = *bpb;
-    fat_fs.total_sectors = bpb->total_sectors16 ? bpb->total_sectors16 : bpb->total_sectors32;
-    fat_fs.fat_start_lba = bpb->reserved_sectors;
-    fat_fs.root_dir_sectors = ((bpb->root_entries * 32) + 511) / 512;
-    fat_fs.root_start_lba = fat_fs.fat_start_lba + (bpb->num_fats * bpb->sectors_per_fat16);
-    fat_fs.data_start_lba = fat_fs.root_start_lba + fat_fs.root_dir_sectors;
-
-    uint32_t data_sectors = fat_fs.total_sectors - (bpb->reserved_sectors + (bpb->num_fats * bpb->sectors_per_fat16) + fat_fs.root_dir_sectors);
-    fat_fs.total_clusters = data_sectors / bpb->sectors_per_cluster;
-    fat_fs.fat_type = (fat_fs.total_clusters < 4085) ? 12 : 16;
-    fat_fs.valid = 1;
 }
 
-static uint32_t fat_cluster_to_lba(uint32_t cluster) {
-    return fat_fs.data_start_lba + (cluster - 2) * fat_fs.bpb.sectors_per_cluster;
+static void shell_cmd_bcache(void) {
+    userspace_write("bcache: ");
+    write_u64_dec(bcache.nbufs);
+    userspace_write(" x 4 KiB hits=");
+    write_u64_dec(bcache.hits);
+    userspace_write(" misses=");
+    write_u64_dec(bcache.misses);
+    userspace_write(" readahead=");
+    write_u64_dec(bcache.readahead);
+    userspace_write(" evicted=");
+    write_u64_dec(bcache.evictions);
+    userspace_write(" writes=");
+    write_u64_dec(bcache.writes);
+    userspace_write("\n");
 }
 
-static uint32_t fat_next_cluster(uint32_t cluster) {
-    uint32_t fat_offset = (fat_fs.fat_type == 12) ? (cluster + cluster / 2) : (cluster * 2);
-    uint32_t fat_sector_lba = fat_fs.fat_start_lba + (fat_offset / 512);
-    uint32_t ent_offset = fat_offset % 512;
-
-    if (!ata_read_sector(fat_sector_lba, fat_sector)) {
-        return 0xFFFFFFFF;
+static void shell_cmd_elevator(const char *args) {
+    char name[16];
+    uint32_t n = 0;
+    while (*args == ' ') {
+        args++;
     }
-    if (fat_fs.fat_type == 12) {
-        uint16_t val = (uint16_t)fat_sector[ent_offset] | ((uint16_t)fat_sector[ent_offset + 1] << 8);
-        uint16_t next = (cluster & 1) ? (val >> 4) : (val & 0x0FFF);
-        return next;
-    }
-    return (uint16_t)fat_sector[ent_offset] | ((uint16_t)fat_sector[ent_offset + 1] << 8);
-}
-
-static int fat_read_root_entry(const char *name, uint32_t *start_cluster, uint32_t *size) {
-    if (!fat_fs.valid) {
-        return 0;
+    while (*args && *args != ' ' && n + 1 < sizeof(name)) {
+        name[n++] = *args++;
     }
-    char target[11];
-    for (int i = 0; i < 11; ++i) {
-        target[i] = ' ';
+    name[n] = '\0';
+    while (*args == ' ') {
+        args++;
     }
-    int idx = 0;
-    for (const char *p = name; *p && idx < 11; ++p) {
-        if (*p == '.') {
-            idx = 8;
+    for (int d = 0; d < block_dev_count; ++d) {
+        block_dev_t *dev = block_devs[d];
+        if (n != 0 && !str_equal(name, dev->name)) {
             continue;
         }
-        target[idx++] = (*p >= 'a' && *p <= 'z') ? (char)(*p - 32) : *p;
+        if (str_equal(args, "noop")) {
+            dev->queue.elv = &elv_noop;
+        } else if (str_equal(args, "deadline")) {
+            dev->queue.elv = &elv_deadline;
+        } else if (*args != '\0') {
+            userspace_write("elevator: noop|deadline\n");
+            return;
+        }
+        userspace_write(dev->name);
+        userspace_write(": ");
+        userspace_write(dev->queue.elv->name);
+        userspace_write(" dispatched=");
+        write_u64_dec(dev->queue.dispatched);
+        userspace_write(" merged=");
+        write_u64_dec(dev->queue.merges);
+        userspace_write("\n");
     }
+}
 
-    for (uint32_t s = 0; s < fat_fs.root_dir_sectors; ++s) {
-        if (!ata_read_sector(fat_fs.root_start_lba + s, fat_sector)) {
-            return 0;
+/* Streams the file through file_buffer; each piece prints while the next one is being read. */
+static void shell_cmd_catdisk(const char *name) {
+    static fat_cursor_t cur;
+    uint32_t got = 0;
+    int found = 0;
+    int ok = 1;
+    if (!fat_fs.valid && !ext2_fs.valid) {
+        userspace_write("disk fs: not detected\n");
+        return;
+    }
+    if (fat_fs.valid) {
+        fat_lock();
+        found = fat_cursor_open(&cur, name);
+        while (found && (ok = fat_cursor_next(&cur, file_buffer, sizeof(file_buffer), &got)) && got > 0) {
+            write_text((const char *)file_buffer, got);
         }
-        for (int i = 0; i < 16; ++i) {
-            uint8_t *ent = &fat_sector[i * 32];
-            if (ent[0] == 0x00) {
-                return 0;
-            }
-            if (ent[0] == 0xE5 || ent[11] == 0x0F) {
-                continue;
-            }
-            int match = 1;
-            for (int j = 0; j < 11; ++j) {
-                if (ent[j] != (uint8_t)target[j]) {
-                    match = 0;
-                    break;
-                }
-            }
-            if (!match) {
-                continue;
-            }
-            *start_cluster = (uint16_t)(ent[26] | (ent[27] << 8));
-            *size = (uint32_t)(ent[28] | (ent[29] << 8) | (ent[30] << 16) | (ent[31] << 24));
-            return 1;
+        fat_unlock();
+    }
+    ext2_inode_t *ip = (!found && ext2_fs.valid) ? ext2_iget(ext2_resolve(name)) : NULL;
+    if (ip != NULL && (ip->mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+        found = 1;
+        for (uint32_t pos = 0; (ok = ext2_pread(ip, pos, file_buffer, sizeof(file_buffer), &got)) && got > 0; pos += got) {
+            write_text((const char *)file_buffer, got);
         }
     }
+    if (!found) {
+        userspace_write("catdisk: not found\n");
+        return;
+    }
+    userspace_write(ok ? "\n" : "\ncatdisk: read error\n");
+}
+
+/* Splits "<path> <rest>" in place; returns rest. */
+static char *shell_split_arg(char *args) {
+    while (*args != '\0' && *args != ' ') {
+        args++;
+    }
+    if (*args == ' ') {
+        *args++ = '\0';
+    }
+    while (*args == ' ') {
+        args++;
+    }
+    return args;
+}
+
+static int shell_fat_writable(const char *cmd) {
+    if (fat_writable()) {
+        return 1;
+    }
+    userspace_write(cmd);
+    userspace_write(fat_fs.valid ? ": volume is read-only\n" : ": disk fs not detected\n");
     return 0;
 }
 
-static int fat_read_file(const char *name, uint8_t *out, uint32_t max_bytes, uint32_t *out_size) {
-    uint32_t cluster = 0;
+/* Appends text plus a newline; it reaches the disk with the next flush. */
+static void shell_cmd_writedisk(char *args) {
+    char *text = shell_split_arg(args);
+    uint32_t len = 0;
+    if (!shell_fat_writable("writedisk")) {
+        return;
+    }
+    while (text[len] != '\0') {
+        len++;
+    }
+    text[len++] = '\n';
+    fat_lock();
+    int ok = fat_append(args, (const uint8_t *)text, len);
+    fat_unlock();
+    vfs_invalidate();
+    text[len - 1] = '\0';
+    if (!ok) {
+        userspace_write("writedisk: failed\n");
+    }
+}
+
+static void shell_cmd_truncdisk(char *args) {
+    const char *num = shell_split_arg(args);
     uint32_t size = 0;
-    if (!fat_read_root_entry(name, &cluster, &size)) {
-        return 0;
+    if (!shell_fat_writable("truncdisk")) {
+        return;
     }
-    uint32_t remaining = size;
-    uint32_t offset = 0;
-    while (cluster >= 2 && cluster < 0xFFF8 && remaining > 0 && offset < max_bytes) {
-        uint32_t lba = fat_cluster_to_lba(cluster);
-        for (uint32_t s = 0; s < fat_fs.bpb.sectors_per_cluster; ++s) {
-            if (!ata_read_sector(lba + s, fat_sector)) {
-                return 0;
-            }
-            uint32_t chunk = (remaining > 512) ? 512 : remaining;
-            if (offset + chunk > max_bytes) {
-                chunk = max_bytes - offset;
-            }
-            for (uint32_t i = 0; i < chunk; ++i) {
-                out[offset + i] = fat_sector[i];
-            }
-            offset += chunk;
-            if (remaining >= chunk) {
-                remaining -= chunk;
-            } else {
-                remaining = 0;
-            }
-            if (remaining == 0 || offset >= max_bytes) {
-                break;
-            }
-        }
-        cluster = fat_next_cluster(cluster);
-        if (fat_fs.fat_type == 12 && cluster >= 0xFF8) {
-            break;
-        }
-        if (fat_fs.fat_type == 16 && cluster >= 0xFFF8) {
-            break;
-        }
+    if (*num < '0' || *num > '9') {
+        userspace_write("truncdisk: usage: truncdisk <path> <bytes>\n");
+        return;
+    }
+    while (*num >= '0' && *num <= '9') {
+        size = size * 10 + (uint32_t)(*num++ - '0');
+    }
+    fat_lock();
+    int ok = fat_truncate(args, size);
+    fat_unlock();
+    vfs_invalidate();
+    if (!ok) {
+        userspace_write("truncdisk: failed\n");
     }
-    *out_size = offset;
-    return 1;
 }
 
-static void shell_cmd_lsdisk(void) {
-    if (!fat_fs.valid) {
-        userspace_write("disk fs: not detected\n");
+static void shell_cmd_rmdisk(const char *path) {
+    if (!shell_fat_writable("rmdisk")) {
         return;
     }
-    userspace_write("disk fs: FAT");
-    userspace_write((fat_fs.fat_type == 12) ? "12\n" : "16\n");
+    fat_lock();
+    int ok = fat_unlink(path);
+    fat_unlock();
+    vfs_invalidate();
+    if (!ok) {
+        userspace_write("rmdisk: not found\n");
+    }
 }
 
-static void shell_cmd_catdisk(const char *name) {
+static void shell_cmd_sync(void) {
     if (!fat_fs.valid) {
-        userspace_write("disk fs: not detected\n");
         return;
     }
-    uint32_t out_size = 0;
-    if (!fat_read_file(name, file_buffer, sizeof(file_buffer) - 1, &out_size)) {
-        userspace_write("catdisk: not found\n");
-        return;
+    fat_lock();
+    int ok = fat_sync();
+    fat_unlock();
+    userspace_write(ok ? "sync: ok free=" : "sync: write error free=");
+    write_u64_dec(fat_fs.free_clusters);
+    userspace_write(" clusters\n");
+}
+
+static void shell_cmd_mounts(void) {
+    for (uint32_t i = 0; i < vfs_mount_count; ++i) {
+        userspace_write(vfs_mounts[i].path);
+        userspace_write(" ");
+        userspace_write(vfs_mounts[i].ops->name);
+        userspace_write((vfs_mounts[i].ops->write != NULL) ? " rw\n" : " ro\n");
     }
-    file_buffer[out_size] = 0;
-    userspace_write((char *)file_buffer);
+    userspace_write("initrd: ");
+    userspace_write(initrd_format);
+    userspace_write(", ");
+    write_u64_dec(initrd_count);
+    userspace_write(" files\ndcache: hits=");
+    write_u64_dec(vfs_dcache_hits);
+    userspace_write(" misses=");
+    write_u64_dec(vfs_dcache_misses);
+    userspace_write("\npcache: hits=");
+    write_u64_dec(pcache_hits);
+    userspace_write(" misses=");
+    write_u64_dec(pcache_misses);
+    userspace_write(" faults=");
+    write_u64_dec(mm_faults);
+    userspace_write(" cow=");
+    write_u64_dec(mm_cow_copies);
     userspace_write("\n");
 }
 
@@ -1424,14 +9504,70 @@ static void shell_exec(char *line) {
         userspace_write("\n");
         return;
     }
-    if (str_equal(line, "lsdisk")) {
-        shell_cmd_lsdisk();
+    if (str_equal(line, "lsdisk") || str_starts_with(line, "lsdisk ")) {
+        shell_cmd_lsdisk(line[6] ? line + 7 : "");
+        return;
+    }
+    if (str_equal(line, "diskbench")) {
+        shell_cmd_diskbench();
+        return;
+    }
+    if (str_equal(line, "irqstat")) {
+        shell_cmd_irqstat();
+        return;
+    }
+    if (str_equal(line, "inputstat")) {
+        shell_cmd_inputstat();
+        return;
+    }
+    if (str_equal(line, "uartstat")) {
+        shell_cmd_uartstat();
+        return;
+    }
+    if (str_equal(line, "logstat")) {
+        shell_cmd_logstat();
+        return;
+    }
+    if (str_equal(line, "fbbench")) {
+        shell_cmd_fbbench();
+        return;
+    }
+    if (str_equal(line, "elevator") || str_starts_with(line, "elevator ")) {
+        shell_cmd_elevator(line + 8);
+        return;
+    }
+    if (str_equal(line, "bcache")) {
+        shell_cmd_bcache();
+        return;
+    }
+    if (str_equal(line, "disklat")) {
+        shell_cmd_disklat();
         return;
     }
     if (str_starts_with(line, "catdisk ")) {
         shell_cmd_catdisk(line + 8);
         return;
     }
+    if (str_starts_with(line, "writedisk ")) {
+        shell_cmd_writedisk(line + 10);
+        return;
+    }
+    if (str_starts_with(line, "truncdisk ")) {
+        shell_cmd_truncdisk(line + 10);
+        return;
+    }
+    if (str_starts_with(line, "rmdisk ")) {
+        shell_cmd_rmdisk(line + 7);
+        return;
+    }
+    if (str_equal(line, "sync")) {
+        shell_cmd_sync();
+        return;
+    }
+    if (str_equal(line, "mounts")) {
+        shell_cmd_mounts();
+        return;
+    }
     if (str_starts_with(line, "sleep ")) {
         uint64_t ms = 0;
         const char *p = line + 6;
@@ -1476,6 +9612,20 @@ static void shell_exec(char *line) {
         enter_user_mode(user_demo, USER_STACK_TOP);
         return;
     }
+    if (str_starts_with(line, "usercat ") || str_starts_with(line, "usermap ")) {
+        uint32_t n = 0;
+        while (line[8 + n] != '\0' && n + 1 < sizeof(user_path)) {
+            user_path[n] = line[8 + n];
+            n++;
+        }
+        user_path[n] = '\0';
+        enter_user_mode((line[4] == 'c') ? user_cat : user_map, USER_STACK_TOP);
+        return;
+    }
+    if (str_equal(line, "userfb")) {
+        enter_user_mode(user_fb, USER_STACK_TOP);
+        return;
+    }
     if (str_equal(line, "userpreempt")) {
         userspace_write("starting ring3 preemptive demo...\n");
         for (int i = 0; i < MAX_USER_TASKS; ++i) {
@@ -1494,6 +9644,20 @@ static void shell_exec(char *line) {
     userspace_write("unknown command\n");
 }
 
+static inline long user_syscall5(long num, long a0, long a1, long a2, long a3, long a4) {
+    long ret;
+    register long r10 __asm__("r10") = a3;
+    register long r8 __asm__("r8") = a4;
+    __asm__ volatile("int $0x80" : "=a"(ret) : "a"(num), "D"(a0), "S"(a1), "d"(a2), "r"(r10), "r"(r8) : "memory");
+    return ret;
+}
+
+static inline long user_syscall3(long num, long a0, long a1, long a2) {
+    long ret;
+    __asm__ volatile("int $0x80" : "=a"(ret) : "a"(num), "D"(a0), "S"(a1), "d"(a2) : "memory");
+    return ret;
+}
+
 static inline long user_syscall2(long num, long a0, long a1) {
     long ret;
     __asm__ volatile("int $0x80" : "=a"(ret) : "a"(num), "D"(a0), "S"(a1) : "memory");
@@ -1506,63 +9670,327 @@ static inline long user_syscall1(long num, long a0) {
     return ret;
 }
 
-static void user_write(const char *s) {
-    size_t len = 0;
-    while (s[len]) {
-        len++;
+static inline long user_syscall0(long num) {
+    long ret;
+    __asm__ volatile("int $0x80" : "=a"(ret) : "a"(num) : "memory");
+    return ret;
+}
+
+/*
+ * Ring3 runtime: everything below runs in user mode and only reaches the
+ * kernel through int 0x80. Output is collected in a caller-owned uio_t and
+ * handed to SYS_WRITE when the buffer fills, on newline (line-buffered
+ * streams), on explicit flush and on exit.
+ */
+static size_t user_strlen(const char *s) {
+    const char *p = s;
+    while (*p) {
+        p++;
+    }
+    return (size_t)(p - s);
+}
+
+static void *user_memcpy(void *dst, const void *src, size_t n) {
+    void *ret = dst;
+    __asm__ volatile("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+    return ret;
+}
+
+static void uio_init(uio_t *io, uint8_t mode) {
+    io->len = 0;
+    io->mode = mode;
+}
+
+static void uio_flush(uio_t *io) {
+    if (io->len == 0) {
+        return;
+    }
+    (void)user_syscall3(SYS_WRITE, 1, (long)(uintptr_t)io->buf, (long)io->len);
+    io->len = 0;
+}
+
+static void uio_putc(uio_t *io, char c) {
+    io->buf[io->len++] = c;
+    if (io->len == UIO_BUF_SIZE || (c == '\n' && io->mode == UIO_LINEBUF)) {
+        uio_flush(io);
+    }
+}
+
+static void uio_write(uio_t *io, const char *s, size_t len) {
+    if (io->mode == UIO_LINEBUF) {
+        for (size_t i = 0; i < len; ++i) {
+            uio_putc(io, s[i]);
+        }
+        return;
+    }
+    if (len >= UIO_BUF_SIZE) {
+        uio_flush(io);
+        (void)user_syscall3(SYS_WRITE, 1, (long)(uintptr_t)s, (long)len);
+        return;
+    }
+    while (len > 0) {
+        size_t room = UIO_BUF_SIZE - io->len;
+        size_t chunk = (len < room) ? len : room;
+        user_memcpy(io->buf + io->len, s, chunk);
+        io->len += (uint32_t)chunk;
+        s += chunk;
+        len -= chunk;
+        if (io->len == UIO_BUF_SIZE) {
+            uio_flush(io);
+        }
+    }
+}
+
+static void uio_puts(uio_t *io, const char *s) {
+    uio_write(io, s, user_strlen(s));
+}
+
+static void uio_put_uint(uio_t *io, uint64_t value, uint32_t base, uint32_t width, char pad) {
+    static const char digits[] = "0123456789abcdef";
+    char tmp[24];
+    uint32_t n = 0;
+    do {
+        tmp[n++] = digits[value % base];
+        value /= base;
+    } while (value != 0);
+    while (n < width && n < sizeof(tmp)) {
+        tmp[n++] = pad;
+    }
+    while (n > 0) {
+        uio_putc(io, tmp[--n]);
+    }
+}
+
+/* Supports %s %c %d %u %x %p %% with optional '0' pad, width and 'l'. */
+static void uio_vprintf(uio_t *io, const char *fmt, va_list ap) {
+    for (const char *p = fmt; *p; ++p) {
+        if (*p != '%') {
+            const char *run = p;
+            while (p[1] && p[1] != '%') {
+                p++;
+            }
+            uio_write(io, run, (size_t)(p - run + 1));
+            continue;
+        }
+        p++;
+        char pad = ' ';
+        uint32_t width = 0;
+        uint8_t is_long = 0;
+        if (*p == '0') {
+            pad = '0';
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            width = width * 10 + (uint32_t)(*p - '0');
+            p++;
+        }
+        while (*p == 'l') {
+            is_long = 1;
+            p++;
+        }
+        switch (*p) {
+        case 's': {
+            const char *s = va_arg(ap, const char *);
+            uio_puts(io, s ? s : "(null)");
+            break;
+        }
+        case 'c':
+            uio_putc(io, (char)va_arg(ap, int));
+            break;
+        case 'd': {
+            int64_t v = is_long ? va_arg(ap, int64_t) : va_arg(ap, int);
+            uint64_t u = (uint64_t)v;
+            if (v < 0) {
+                uio_putc(io, '-');
+                u = 0 - u; /* -v overflows for INT64_MIN */
+            }
+            uio_put_uint(io, u, 10, width, pad);
+            break;
+        }
+        case 'u':
+            uio_put_uint(io, is_long ? va_arg(ap, uint64_t) : va_arg(ap, uint32_t), 10, width, pad);
+            break;
+        case 'x':
+            uio_put_uint(io, is_long ? va_arg(ap, uint64_t) : va_arg(ap, uint32_t), 16, width, pad);
+            break;
+        case 'p':
+            uio_puts(io, "0x");
+            uio_put_uint(io, (uint64_t)(uintptr_t)va_arg(ap, void *), 16, 16, '0');
+            break;
+        case '%':
+            uio_putc(io, '%');
+            break;
+        case 0:
+            return;
+        default:
+            uio_putc(io, '%');
+            uio_putc(io, *p);
+            break;
+        }
     }
-    (void)user_syscall2(SYS_WRITE, (long)(uintptr_t)s, (long)len);
+}
+
+static void uio_printf(uio_t *io, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    uio_vprintf(io, fmt, ap);
+    va_end(ap);
 }
 
 static void user_sleep(uint64_t ms) {
     (void)user_syscall1(SYS_SLEEP, (long)ms);
 }
 
+static void user_exit_loop(void) {
+    for (;;) {
+        (void)user_syscall0(SYS_YIELD);
+    }
+}
+
+static void user_exit(uio_t *io) {
+    uio_flush(io);
+    (void)user_syscall0(SYS_EXIT);
+    user_exit_loop();
+}
+
 static void user_demo(void) {
-    user_write("[ring3] user demo start\n");
+    uio_t out;
+    uio_init(&out, UIO_LINEBUF);
+    uio_puts(&out, "[ring3] user demo start\n");
     for (int i = 0; i < 10; ++i) {
-        user_write("[ring3] tick\n");
+        uio_printf(&out, "[ring3] tick %d\n", i);
         user_sleep(100);
     }
-    user_write("[ring3] demo done\n");
-    for (;;) {
-        user_sleep(500);
+    uio_puts(&out, "[ring3] demo done\n");
+    user_exit(&out);
+}
+
+/* cat in ring3: the file streams through one stack buffer straight to fd 1. */
+static void user_cat(void) {
+    uio_t out;
+    char buf[256];
+    long n;
+    uio_init(&out, UIO_LINEBUF);
+    long fd = user_syscall2(SYS_OPEN, (long)(uintptr_t)user_path, O_RDONLY);
+    if (fd < 0) {
+        uio_printf(&out, "[ring3] usercat: %s not found\n", user_path);
+        user_exit(&out);
+    }
+    while ((n = user_syscall3(SYS_READ, fd, (long)(uintptr_t)buf, sizeof(buf))) > 0) {
+        (void)user_syscall3(SYS_WRITE, 1, (long)(uintptr_t)buf, n);
     }
+    (void)user_syscall1(SYS_CLOSE, fd);
+    user_exit(&out);
 }
 
-static void user_task_a(void) {
-    for (;;) {
-        user_write("[ring3] A\n");
-        user_sleep(200);
+/*
+ * Maps a file privately and prints it straight from the mapping, then
+ * writes to the first page: that fault copies it, and a second mapping
+ * of the same file still sees the page cache's original byte.
+ */
+static void user_map(void) {
+    uio_t out;
+    uio_init(&out, UIO_LINEBUF);
+    long fd = user_syscall2(SYS_OPEN, (long)(uintptr_t)user_path, O_RDONLY);
+    long size = (fd < 0) ? -1 : user_syscall3(SYS_LSEEK, fd, 0, SEEK_END);
+    if (size <= 0) {
+        uio_printf(&out, "[ring3] usermap: %s not found or empty\n", user_path);
+        user_exit(&out);
     }
+    long priv = user_syscall5(SYS_MMAP, fd, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, 0);
+    long shared = user_syscall5(SYS_MMAP, fd, size, PROT_READ, MAP_SHARED, 0);
+    (void)user_syscall1(SYS_CLOSE, fd);
+    if (priv < 0 || shared < 0) {
+        uio_puts(&out, "[ring3] usermap: mmap failed\n");
+        user_exit(&out);
+    }
+    (void)user_syscall3(SYS_WRITE, 1, priv, size);
+    volatile char *p = (volatile char *)(uintptr_t)priv;
+    const volatile char *q = (const volatile char *)(uintptr_t)shared;
+    char orig = q[0];
+    p[0] = (char)(orig ^ 0x20);
+    uio_printf(&out, "\n[ring3] private=%c shared=%c at %p\n", p[0], q[0], (void *)(uintptr_t)priv);
+    (void)user_syscall1(SYS_MUNMAP, priv);
+    (void)user_syscall1(SYS_MUNMAP, shared);
+    user_exit(&out);
 }
 
-static void user_task_b(void) {
-    for (;;) {
-        user_write("[ring3] B\n");
-        user_sleep(250);
+/*
+ * Draws a panel into the mapped framebuffer with the gfx kernels: a solid
+ * fill, an opaque blit of a sprite and an alpha-blended copy of it, then
+ * one SYS_FBFLUSH for the whole panel.
+ */
+static void user_fb(void) {
+    uio_t out;
+    fb_info_t info;
+    uio_init(&out, UIO_LINEBUF);
+    long base = user_syscall1(SYS_FBMAP, (long)(uintptr_t)&info);
+    if (base < 0) {
+        uio_puts(&out, "[ring3] userfb: no framebuffer\n");
+        user_exit(&out);
+    }
+    gfx_surface_t screen = {(uint32_t *)(uintptr_t)base, info.width, info.height, info.pitch};
+    gfx_surface_t sprite = {user_sprite, USER_SPRITE_SIZE, USER_SPRITE_SIZE, USER_SPRITE_SIZE};
+    for (uint32_t y = 0; y < USER_SPRITE_SIZE; ++y) {
+        for (uint32_t x = 0; x < USER_SPRITE_SIZE; ++x) {
+            uint32_t alpha = (x + y) * 255 / (2 * USER_SPRITE_SIZE - 2);
+            user_sprite[y * USER_SPRITE_SIZE + x] = (alpha << 24) | ((x * 4) << 16) | ((y * 4) << 8) | 0xC0;
+        }
     }
+    gfx_convert(user_sprite, user_sprite, USER_SPRITE_SIZE * USER_SPRITE_SIZE, info.format);
+
+    uint32_t pw = USER_SPRITE_SIZE * 2 + 48;
+    uint32_t ph = USER_SPRITE_SIZE + 32;
+    uint32_t px = (info.width > pw) ? info.width - pw : 0;
+    uint32_t py = 0;
+    uint32_t panel = 0x305070;
+    gfx_convert(&panel, &panel, 1, info.format);
+    gfx_fill(&screen, px, py, pw, ph, panel);
+    gfx_blit(&screen, px + 16, py + 16, &sprite);
+    gfx_composite(&screen, px + 32 + USER_SPRITE_SIZE, py + 16, &sprite);
+    (void)user_syscall5(SYS_FBFLUSH, px, py, pw, ph, 0);
+    uio_printf(&out, "[ring3] userfb: %ux%u panel at %u,%u via %s kernels\n", pw, ph, px, py, gfx->name);
+    (void)user_syscall1(SYS_MUNMAP, base);
+    user_exit(&out);
 }
 
-static void user_task_c(void) {
-    for (;;) {
-        user_write("[ring3] C\n");
-        user_sleep(300);
+/* Chatty tasks are fully buffered: one SYS_WRITE per UIO_BUF_SIZE bytes. */
+static void user_task_loop(char tag, uint64_t ms) {
+    uio_t out;
+    uio_init(&out, UIO_FULLBUF);
+    for (uint32_t n = 0;; ++n) {
+        uio_printf(&out, "[ring3] %c %u\n", tag, n);
+        user_sleep(ms);
     }
 }
 
+static void user_task_a(void) {
+    user_task_loop('A', 200);
+}
+
+static void user_task_b(void) {
+    user_task_loop('B', 250);
+}
+
+static void user_task_c(void) {
+    user_task_loop('C', 300);
+}
+
 static void user_task_d(void) {
-    for (;;) {
-        user_write("[ring3] D\n");
-        user_sleep(350);
-    }
+    user_task_loop('D', 350);
 }
 
 void kmain(const barecore_boot_info_t *boot_info) {
     serial_put_char('M');
 
+    log_init();
+    simd_init();
     init_gdt_tss();
+    pat_init();
     init_console(boot_info);
+    if (fb.enabled) {
+        fb_map(CACHE_WC);
+    }
     clear_console();
     write_cstr("barecore kernel (production path)\n");
     write_cstr("long mode: OK\n");
@@ -1575,6 +10003,7 @@ void kmain(const barecore_boot_info_t *boot_info) {
         hpet_enable_interrupt();
         hpet_set_periodic_ms(10);
         init_pic(1);
+        irq_ioapic_routing = 1;
     } else {
         init_pic(apic_enabled ? 1 : 0);
         if (!apic_enabled) {
@@ -1582,11 +10011,32 @@ void kmain(const barecore_boot_info_t *boot_info) {
         }
     }
 
-    fat_init();
+    uart_init();
+    tsc_calibrate();
+    mem_init(boot_info);
+    fb_shadow_init();
+    mm_init();
+    pci_scan();
+    ata_init();
+    ata_dma_init();
+    ata_blk_register();
+    ahci_init();
+    virtio_blk_init();
+    nvme_init();
+    bcache_init();
+    fat_mount();
+    ext2_mount();
+    initrd_init(boot_info);
+    vfs_init();
 
     create_task(task_a, "task-a");
     create_task(task_b, "task-b");
     create_task(task_shell, "shell");
+    if (fat_fs.valid && fat_fs.table != NULL) {
+        create_task(fat_flusher_task, "fat-flush");
+    }
+    create_task(log_drain_task, "log-drain");
+    create_task(system_worker_task, "kworker");
 
     write_cstr("scheduler: round-robin\n");
     write_cstr("drivers: ");
@@ -1597,8 +10047,11 @@ void kmain(const barecore_boot_info_t *boot_info) {
     } else {
         write_cstr("PIT + PS/2 keyboard");
     }
+    if (uart.irq_mode) {
+        write_cstr(" + 16550 UART (IRQ4)");
+    }
     write_cstr("\n");
-    write_cstr("syscalls: write exit getpid sleep yield\n");
+    write_cstr("syscalls: write exit getpid sleep yield open read close lseek mmap munmap fbmap fbflush\n");
 
     cpu_sti();
     schedule();
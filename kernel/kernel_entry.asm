@@ -11,6 +11,8 @@ global isr_keyboard_stub
 global isr_syscall_stub
 global isr_divide_stub
 global isr_page_fault_stub
+global isr_irq_stubs
+global isr_msi_stubs
 
 extern kmain
 extern irq_timer_handler
@@ -18,6 +20,8 @@ extern irq_keyboard_handler
 extern syscall_dispatch
 extern exception_divide_handler
 extern exception_page_fault_handler
+extern irq_dispatch
+extern msi_dispatch
 
 section .text
 
@@ -39,6 +43,28 @@ section .text
     push rax
 %endmacro
 
+; Device IRQ lines share one C entry point: irq_dispatch(regs, line).
+%macro IRQ_STUB 1
+isr_irq%1_stub:
+    PUSH_REGS
+    mov rdi, rsp
+    mov rsi, %1
+    call irq_dispatch
+    POP_REGS
+    iretq
+%endmacro
+
+; Message-signalled interrupts: msi_dispatch(regs, slot), slot 0..7.
+%macro MSI_STUB 1
+isr_msi%1_stub:
+    PUSH_REGS
+    mov rdi, rsp
+    mov rsi, %1
+    call msi_dispatch
+    POP_REGS
+    iretq
+%endmacro
+
 %macro POP_REGS 0
     pop rax
     pop rbx
@@ -154,7 +180,46 @@ isr_page_fault_stub:
     PUSH_REGS
     mov rdi, rsp
     mov rsi, [rsp + 15 * 8]
+    lea rdx, [rsp + 16 * 8]
     call exception_page_fault_handler
     POP_REGS
     add rsp, 8
     iretq
+
+IRQ_STUB 2
+IRQ_STUB 3
+IRQ_STUB 4
+IRQ_STUB 5
+IRQ_STUB 6
+IRQ_STUB 7
+IRQ_STUB 8
+IRQ_STUB 9
+IRQ_STUB 10
+IRQ_STUB 11
+IRQ_STUB 12
+IRQ_STUB 13
+IRQ_STUB 14
+IRQ_STUB 15
+
+MSI_STUB 0
+MSI_STUB 1
+MSI_STUB 2
+MSI_STUB 3
+MSI_STUB 4
+MSI_STUB 5
+MSI_STUB 6
+MSI_STUB 7
+
+section .rodata
+align 8
+; Indexed by legacy IRQ line; 0 (timer) and 1 (keyboard) have dedicated stubs.
+isr_irq_stubs:
+    dq 0, 0
+    dq isr_irq2_stub, isr_irq3_stub, isr_irq4_stub, isr_irq5_stub
+    dq isr_irq6_stub, isr_irq7_stub, isr_irq8_stub, isr_irq9_stub
+    dq isr_irq10_stub, isr_irq11_stub, isr_irq12_stub, isr_irq13_stub
+    dq isr_irq14_stub, isr_irq15_stub
+
+isr_msi_stubs:
+    dq isr_msi0_stub, isr_msi1_stub, isr_msi2_stub, isr_msi3_stub
+    dq isr_msi4_stub, isr_msi5_stub, isr_msi6_stub, isr_msi7_stub
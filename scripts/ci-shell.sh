@@ -0,0 +1,37 @@
+#!/usr/bin/env bash
+# Boots the image, types each stdin line into the shell over COM1 once the
+# prompt is up, and leaves the serial log (CRs stripped) in <log>.
+# usage: printf 'cmd\n...' | scripts/ci-shell.sh <log> [extra qemu args...]
+set -euo pipefail
+
+log=$1
+shift
+fifo=$(mktemp -u)
+mkfifo "$fifo"
+trap 'rm -f "$fifo"' EXIT
+
+timeout 90s qemu-system-x86_64 -nographic -monitor none -no-reboot -no-shutdown \
+  -drive format=raw,file=build/os.img \
+  -serial stdio \
+  -device isa-debug-exit,iobase=0xf4,iosize=0x04 \
+  "$@" < "$fifo" > "$log.raw" 2>&1 &
+qemu=$!
+exec 3> "$fifo"
+
+for _ in $(seq 300); do
+  grep -q "\[bcore shell\]" "$log.raw" && break
+  sleep 0.1
+done
+sleep 2 # let task-a/task-b finish printing before the first command
+while IFS= read -r cmd; do
+  printf '%s\r' "$cmd" >&3
+  sleep 1
+done
+sleep 2
+
+exec 3>&-
+kill "$qemu" 2>/dev/null || true
+wait "$qemu" || true
+tr -d '\r' < "$log.raw" > "$log"
+rm -f "$log.raw"
+cat "$log"
@@ -6,17 +6,10 @@
 
 #define KERNEL_LOAD_ADDR 0x00100000ULL
 
-static EFI_STATUS load_kernel(EFI_HANDLE image, EFI_SYSTEM_TABLE *st, UINTN *kernel_size) {
+static EFI_STATUS open_root(EFI_HANDLE image, EFI_SYSTEM_TABLE *st, EFI_FILE_PROTOCOL **root) {
     EFI_STATUS status;
     EFI_LOADED_IMAGE *loaded_image = NULL;
     EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *fs = NULL;
-    EFI_FILE_PROTOCOL *root = NULL;
-    EFI_FILE_PROTOCOL *kernel = NULL;
-    EFI_FILE_INFO *info = NULL;
-    UINTN info_size = 0;
-    UINTN read_size;
-    UINTN pages;
-    EFI_PHYSICAL_ADDRESS load_addr = KERNEL_LOAD_ADDR;
 
     status = uefi_call_wrapper(st->BootServices->HandleProtocol, 3,
                                image, &LoadedImageProtocol, (void **)&loaded_image);
@@ -30,17 +23,25 @@ static EFI_STATUS load_kernel(EFI_HANDLE image, EFI_SYSTEM_TABLE *st, UINTN *ker
         return status;
     }
 
-    status = uefi_call_wrapper(fs->OpenVolume, 2, fs, &root);
-    if (EFI_ERROR(status)) {
-        return status;
-    }
+    return uefi_call_wrapper(fs->OpenVolume, 2, fs, root);
+}
+
+/* Reads a whole file into pages allocated with type (and *addr as its address or limit). */
+static EFI_STATUS load_file(EFI_SYSTEM_TABLE *st, EFI_FILE_PROTOCOL *root, CHAR16 *name,
+                            EFI_ALLOCATE_TYPE type, EFI_PHYSICAL_ADDRESS *addr, UINTN *size) {
+    EFI_STATUS status;
+    EFI_FILE_PROTOCOL *file = NULL;
+    EFI_FILE_INFO *info = NULL;
+    UINTN info_size = 0;
+    UINTN read_size;
+    UINTN pages;
 
-    status = uefi_call_wrapper(root->Open, 5, root, &kernel, L"\\kernel.bin", EFI_FILE_MODE_READ, 0);
+    status = uefi_call_wrapper(root->Open, 5, root, &file, name, EFI_FILE_MODE_READ, 0);
     if (EFI_ERROR(status)) {
         return status;
     }
 
-    status = uefi_call_wrapper(kernel->GetInfo, 4, kernel, &GenericFileInfo, &info_size, NULL);
+    status = uefi_call_wrapper(file->GetInfo, 4, file, &GenericFileInfo, &info_size, NULL);
     if (status != EFI_BUFFER_TOO_SMALL) {
         return status;
     }
@@ -50,29 +51,45 @@ static EFI_STATUS load_kernel(EFI_HANDLE image, EFI_SYSTEM_TABLE *st, UINTN *ker
         return status;
     }
 
-    status = uefi_call_wrapper(kernel->GetInfo, 4, kernel, &GenericFileInfo, &info_size, info);
+    status = uefi_call_wrapper(file->GetInfo, 4, file, &GenericFileInfo, &info_size, info);
     if (EFI_ERROR(status)) {
         return status;
     }
 
-    *kernel_size = info->FileSize;
-    pages = (*kernel_size + 0xFFF) / 0x1000;
+    *size = info->FileSize;
+    pages = (*size + 0xFFF) / 0x1000;
 
-    status = uefi_call_wrapper(st->BootServices->AllocatePages, 4,
-                               AllocateAddress, EfiLoaderData, pages, &load_addr);
+    status = uefi_call_wrapper(st->BootServices->AllocatePages, 4, type, EfiLoaderData, pages, addr);
     if (EFI_ERROR(status)) {
         return status;
     }
 
-    read_size = *kernel_size;
-    status = uefi_call_wrapper(kernel->Read, 3, kernel, &read_size, (void *)(UINTN)KERNEL_LOAD_ADDR);
-    if (EFI_ERROR(status) || read_size != *kernel_size) {
+    read_size = *size;
+    status = uefi_call_wrapper(file->Read, 3, file, &read_size, (void *)(UINTN)*addr);
+    if (EFI_ERROR(status) || read_size != *size) {
         return EFI_LOAD_ERROR;
     }
 
     return EFI_SUCCESS;
 }
 
+static EFI_STATUS load_kernel(EFI_SYSTEM_TABLE *st, EFI_FILE_PROTOCOL *root, UINTN *kernel_size) {
+    EFI_PHYSICAL_ADDRESS load_addr = KERNEL_LOAD_ADDR;
+    return load_file(st, root, L"\\kernel.bin", AllocateAddress, &load_addr, kernel_size);
+}
+
+/* Hands the kernel the largest conventional range; boot services data (page tables included) stays untouched. */
+static void fill_memory_info(EFI_MEMORY_DESCRIPTOR *mmap, UINTN mmap_size, UINTN desc_size, barecore_boot_info_t *bi) {
+    for (UINTN off = 0; off + desc_size <= mmap_size; off += desc_size) {
+        EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)((UINT8 *)mmap + off);
+        UINT64 size = d->NumberOfPages * 4096;
+        if (d->Type == EfiConventionalMemory && d->PhysicalStart >= 0x100000 && size > bi->mem_size) {
+            bi->mem_base = d->PhysicalStart;
+            bi->mem_size = size;
+        }
+    }
+}
+
 static void fill_boot_info(EFI_SYSTEM_TABLE *st, barecore_boot_info_t *bi) {
     EFI_GRAPHICS_OUTPUT_PROTOCOL *gop = NULL;
     EFI_STATUS status;
@@ -85,6 +102,10 @@ static void fill_boot_info(EFI_SYSTEM_TABLE *st, barecore_boot_info_t *bi) {
     bi->framebuffer_bpp = 0;
     bi->framebuffer_format = 0;
     bi->reserved = 0;
+    bi->mem_base = 0;
+    bi->mem_size = 0;
+    bi->initrd_base = 0;
+    bi->initrd_size = 0;
 
     status = uefi_call_wrapper(st->BootServices->LocateProtocol, 3,
                                &GraphicsOutputProtocol, NULL, (void **)&gop);
@@ -108,6 +129,9 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
     UINTN desc_size = 0;
     UINT32 desc_version = 0;
     EFI_MEMORY_DESCRIPTOR *mmap = NULL;
+    EFI_FILE_PROTOCOL *root = NULL;
+    EFI_PHYSICAL_ADDRESS initrd_addr = 0xFFFFFFFFULL;
+    UINTN initrd_size = 0;
     barecore_boot_info_t boot_info;
     void (*kernel_entry)(barecore_boot_info_t *) =
         (void (*)(barecore_boot_info_t *))(UINTN)KERNEL_LOAD_ADDR;
@@ -115,7 +139,10 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
     InitializeLib(image, st);
     Print(L"barecore UEFI loader\r\n");
 
-    status = load_kernel(image, st, &kernel_size);
+    status = open_root(image, st, &root);
+    if (!EFI_ERROR(status)) {
+        status = load_kernel(st, root, &kernel_size);
+    }
     if (EFI_ERROR(status)) {
         Print(L"kernel load failed: %r\r\n", status);
         return status;
@@ -123,6 +150,15 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
 
     fill_boot_info(st, &boot_info);
 
+    /* Optional: without it the kernel falls back to its built-in files. */
+    status = load_file(st, root, L"\\initrd.cpio", AllocateMaxAddress, &initrd_addr, &initrd_size);
+    if (!EFI_ERROR(status)) {
+        boot_info.initrd_base = initrd_addr;
+        boot_info.initrd_size = initrd_size;
+    } else {
+        Print(L"no initrd.cpio: %r\r\n", status);
+    }
+
     status = uefi_call_wrapper(st->BootServices->GetMemoryMap, 5,
                                &mmap_size, mmap, &map_key, &desc_size, &desc_version);
     if (status != EFI_BUFFER_TOO_SMALL) {
@@ -143,6 +179,7 @@ EFI_STATUS efi_main(EFI_HANDLE image, EFI_SYSTEM_TABLE *st) {
         Print(L"GetMemoryMap failed: %r\r\n", status);
         return status;
     }
+    fill_memory_info(mmap, mmap_size, desc_size, &boot_info);
 
     status = uefi_call_wrapper(st->BootServices->ExitBootServices, 2, image, map_key);
     if (EFI_ERROR(status)) {